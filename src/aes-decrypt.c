@@ -28,6 +28,11 @@
 #include <libgen.h>
 #include <string.h>
 #include <getopt.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "aes.h"
 
@@ -36,8 +41,22 @@ struct Options {
   //bool force; /* -f flag: chmod files if necessary */
   //bool burn_file; /* -b flag: shred file after encrypting */
   bool verbose; /* -v flag: print progress */
-  bool use_stdout;
+  bool recursive; /* -r flag: decrypt the cipher files under directories */
+  bool use_stdout; /* -t flag, or -o -: write the plaintext to stdout */
+  bool list; /* -l flag: list the files in archives */
+  char * member; /* -x flag: the one file to extract from an archive */
   char * out_directory;
+  char * out_file; /* -o flag: name of the plaintext file */
+  char * engine_name; /* --engine: cipher engine to use */
+  bool mode_given; /* --mode was given; otherwise it is read from the file */
+  aes_mode_t mode; /* --mode: cipher mode */
+  int jobs; /* -j flag: number of threads, 0 for one per processor */
+  bool range; /* --offset or --length was given */
+  long int offset; /* --offset: first byte of plaintext to decrypt */
+  long int length; /* --length: bytes of plaintext to decrypt, -1 for all */
+  aes_io_t io; /* --io: how to read and write files */
+  bool in_place; /* --in_place: decrypt files where they lie */
+  bool resume; /* --resume: carry on from checkpoints */
 };
 
 /* Program options */
@@ -46,10 +65,22 @@ const struct option long_opts[] = {
   //{"burn-after-read", no_argument, NULL, 'b'},
   {"out_dir", required_argument, NULL, 'd'},
   {"terminal", no_argument, NULL, 't'},
+  {"output", required_argument, NULL, 'o'},
   {"verbose", no_argument, NULL, 'v'},
+  {"recursive", no_argument, NULL, 'r'},
+  {"list", no_argument, NULL, 'l'},
+  {"extract", required_argument, NULL, 'x'},
+  {"engine", required_argument, NULL, 'e'},
+  {"mode", required_argument, NULL, 'm'},
+  {"jobs", required_argument, NULL, 'j'},
+  {"offset", required_argument, NULL, 'O'},
+  {"length", required_argument, NULL, 'L'},
+  {"io", required_argument, NULL, 'I'},
+  {"in_place", no_argument, NULL, 'P'},
+  {"resume", no_argument, NULL, 'R'},
   {0, 0, 0, 0}
 };
-const char opts_str[] = "vtd:";
+const char opts_str[] = "vrltd:o:e:m:j:x:";
 
 
 /* Static variables: */
@@ -58,232 +89,1779 @@ static struct Options flags; /* User Selected Options */
 
 static aes_key_t ekey; /* Contains the decryption key */
 
+static aes_key_t xts_keys[2]; /* The key file split into XTS data/tweak keys */
+
+static const aes_engine_t *engine; /* Cipher engine used to decrypt */
+
+static pool_t *pool; /* Worker threads */
+
+/* Where status and error messages go. Each thread has its own, because the
+   files of a batch keep theirs until it is their turn to be printed. */
+static __thread FILE *messages;
+static __thread FILE *errors;
+
+static bool batch; /* Several files are being decrypted at once */
+
+/* Checkpoints of the file being decrypted, for --resume, or NULL */
+static __thread checkpoint_t *checkpoint;
+
 /* Program Functions: */
 
 /**
- * Loads the key from the specified file and expands it.
+ * Checks whether a number of bytes is a valid AES key size.
+ */
+static bool valid_key_size(size_t size) {
+  return size == key_16_bytes || size == key_24_bytes || size == key_32_bytes;
+}
+
+/**
+ * Loads the key from the specified file and expands it.
+ *
+ * An XTS key file holds two keys back to back. A 32-byte key could be either
+ * one AES-256 key or two AES-128 keys, so we don't guess: the key is set up
+ * both ways where it can be, and the mode of each cipher file picks which to
+ * use. Whichever way doesn't fit gets a size of 0.
+ */
+void load_key(FILE *keyfd) {
+  size_t enc_len, data_len;
+  char * b64_str;
+  uint8_t * data_str;
+
+  b64_str = (char *)malloc((size_t)128);
+  if (fgets(b64_str, 128, keyfd) != b64_str) {
+	exit_error(PROGRAM_NAME ": Failed to read key from file.");
+  }
+  enc_len = strlen(b64_str);
+  data_str = base64_decode(b64_str, enc_len, &data_len);
+  if (data_str == NULL || (!valid_key_size(data_len)
+						   && !valid_key_size(data_len / 2))) {
+	exit_error(PROGRAM_NAME ": Error: Key file does not hold a valid key.\n");
+  }
+
+  if (valid_key_size(data_len)) {
+	ekey.size = data_len;
+	memmove(ekey.block, data_str, ekey.size);
+	key_expansion(&ekey);
+  }
+
+  if (data_len % 2 == 0 && valid_key_size(data_len / 2)) {
+	xts_keys[0].size = xts_keys[1].size = data_len / 2;
+	memmove(xts_keys[0].block, data_str, data_len / 2);
+	memmove(xts_keys[1].block, data_str + data_len / 2, data_len / 2);
+	key_expansion(&xts_keys[0]);
+	key_expansion(&xts_keys[1]);
+  }
+
+  free(b64_str);
+  free(data_str);
+}
+
+/**
+ * Prints how much of the current file has been decrypted, for -v.
+ *
+ * @param total - Number of bytes to decrypt, or -1 if it isn't known.
+ */
+static void show_progress(long int done, long int total) {
+  if (!flags.verbose || batch)
+	return;
+  if (total < 0)
+	fprintf(messages, "Decrypted %ld bytes.\r", done);
+  else
+	fprintf(messages, "Decrypted %ld of %ld bytes.\r", done, total);
+  fflush(messages);
+}
+
+/**
+ * Saves a checkpoint between buffers, for --resume, if one is due.
+ */
+static bool save_checkpoint(aes_output_t *out) {
+  if (checkpoint == NULL || checkpoint_update(checkpoint, out))
+	return true;
+  fprintf(errors, PROGRAM_NAME ": Error: Could not save a checkpoint.\n");
+  return false;
+}
+
+/**
+ * Decrypts an ECB cipher file. The cipher file is taken AES_BUFFER_SIZE bytes
+ * at a time, and each buffer is decrypted into the output by the cipher
+ * engine.
+ */
+static bool decrypt_ecb(aes_input_t *in, aes_output_t *out, aes_key_t *key) {
+  uint8_t block[AES_BLOCK_SIZE];
+  const uint8_t *src;
+  uint8_t *dst;
+  size_t bytes_read, full, len;
+
+  if (in->size >= 0)
+	VERBOSE("Size of file: %ld bytes (%ld blocks)\n", in->size,
+			(in->size + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+  
+  /* Decrypt the blocks one buffer at a time */
+  
+  while ((src = input_read(in, AES_BUFFER_SIZE, &bytes_read)) != NULL
+		 && bytes_read > 0) {
+	full = bytes_read / AES_BLOCK_SIZE;
+	len = (bytes_read + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+
+	dst = output_reserve(out, len);
+	if (dst == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  return false;
+	}
+
+	/* Run decryption */
+	engine->decrypt(key, src, dst, full);
+
+	/* A truncated cipher file leaves a partial block; pad it with 0's */
+	if (len > bytes_read) {
+	  memset(block, 0, sizeof(block));
+	  memcpy(block, src + AES_BLOCK_SIZE * full, bytes_read % AES_BLOCK_SIZE);
+	  engine->decrypt(key, block, dst + AES_BLOCK_SIZE * full, 1);
+	}
+
+	if (!output_commit(out, len)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  return false;
+	}
+	show_progress(in->pos, in->size);
+  }
+  VERBOSE("\n");
+
+  if (src == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	return false;
+  }
+  return true;
+}
+
+/**
+ * Reports why a context failed to decrypt a file. All that can go wrong once
+ * it has started is in the file: a tag or padding that doesn't check out, or
+ * a file cut short, and a wrong key looks just the same.
+ */
+static void ctx_failed(const aes_ctx_t *ctx) {
+  fprintf(errors, PROGRAM_NAME ": Error: %s. The cipher file has been" \
+		  " modified, or the key is wrong.\n", aes_ctx_error(ctx));
+}
+
+/**
+ * Runs the rest of a cipher file through a context that has been started.
+ * The context holds back the end of the file until it knows it is the end:
+ * the GCM tag, the CBC padding, an XTS scrap or the last chunk. So we don't
+ * need to know how long the file is, and this works on a pipe too. The GCM
+ * tag is checked once everything has been decrypted; if it doesn't match we
+ * return false, and the caller throws the plaintext away. Each chunk is
+ * checked before it is written.
+ *
+ * @param data_size - Length of the ciphertext, or -1 if not known.
+ */
+static bool decrypt_ctx(aes_input_t *in, aes_output_t *out, aes_ctx_t *ctx,
+						long int data_size) {
+  size_t piece_size, bytes_read, len;
+  long int done;
+  const uint8_t *src;
+  uint8_t *dst;
+
+  piece_size = ctx_piece_size(ctx, (size_t)pool_size(pool) * AES_CHUNK_SIZE);
+
+  if (data_size >= 0)
+	VERBOSE("Size of ciphertext: %ld bytes\n", data_size);
+
+  /* A resumed run starts part way through */
+  done = in->pos - AES_HEADER_SIZE;
+  while ((src = input_read(in, piece_size, &bytes_read)) != NULL
+		 && bytes_read > 0) {
+	dst = output_reserve(out, ctx_update_size(ctx, bytes_read));
+	if (dst == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  return false;
+	}
+	if (!aes_ctx_update(ctx, src, dst, bytes_read, &len)) {
+	  ctx_failed(ctx);
+	  return false;
+	}
+	if (!output_commit(out, len)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  return false;
+	}
+
+	done += bytes_read;
+	show_progress(done, data_size);
+	if (!save_checkpoint(out))
+	  return false;
+  }
+  VERBOSE("\n");
+
+  if (src == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	return false;
+  }
+
+  /* The end of the file, with the padding taken off and the tag checked */
+  dst = output_reserve(out, ctx_final_size(ctx));
+  if (dst == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	return false;
+  }
+  if (!aes_ctx_final(ctx, dst, &len)) {
+	ctx_failed(ctx);
+	return false;
+  }
+  if (!output_commit(out, len)) {
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	return false;
+  }
+  return true;
+}
+
+/**
+ * Decrypts a whole cipher file in any of the modes with a header, by running
+ * it through a library context (see libaes.c), as encrypt_stream() does. The
+ * header has already been read, so 'in' is positioned at the start of the
+ * ciphertext, or where a checkpoint says to pick up from.
+ *
+ * @param data_size - Length of the ciphertext, or -1 if not known.
+ */
+static bool decrypt_stream(aes_input_t *in, aes_output_t *out, aes_key_t *key,
+						   const aes_header_t *header, long int data_size) {
+  aes_ctx_t *ctx;
+  bool ok;
+
+  if (header->mode == mode_xts) {
+	if (xts_keys[0].size == 0) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Key file does not hold an XTS" \
+			  " key pair.\n");
+	  return false;
+	}
+	ctx = ctx_new(engine, pool, mode_xts, true, &xts_keys[0], &xts_keys[1]);
+  }
+  else {
+	ctx = ctx_new(engine, pool, header->mode, true, key, NULL);
+  }
+  if (ctx == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return false;
+  }
+
+  ok = ctx_start(ctx, header, in->pos - AES_HEADER_SIZE);
+  if (!ok)
+	fprintf(errors, PROGRAM_NAME ": Error: %s.\n", aes_ctx_error(ctx));
+  else
+	ok = decrypt_ctx(in, out, ctx, data_size);
+  if (ok && header->mode == mode_gcm)
+	VERBOSE("Authentication tag verified.\n");
+
+  aes_ctx_free(ctx);
+  return ok;
+}
+
+/**
+ * Works out the range of plaintext to decrypt from an XTS or chunked file:
+ * the whole file, unless --offset or --length say otherwise.
+ *
+ * @return false if it runs past the end of the file.
+ */
+static bool plain_range(long int data_size, long int *offset,
+							long int *length) {
+  *offset = flags.offset;
+  *length = flags.length < 0 ? data_size - *offset : flags.length;
+  return *offset <= data_size && *length <= data_size - *offset;
+}
+
+/**
+ * Decrypts the part of an XTS cipher file from flags.offset to flags.offset +
+ * flags.length. The header has already been read. A whole file goes through
+ * decrypt_stream() instead, as a context runs a file from start to end.
+ *
+ * Every data unit decrypts on its own, so we seek straight to the first unit
+ * that covers the range, and stop after the last. The rest of the file is
+ * never read. The units at either end of the range stick out past it, so they
+ * are decrypted on the side and only the part inside the range is copied out.
+ *
+ * @param data_size - Length of the ciphertext, or -1 if not known.
+ */
+static bool decrypt_xts(aes_input_t *in, aes_output_t *out,
+						const aes_header_t *header, long int data_size) {
+  xts_t xts = { engine, &xts_keys[0], &xts_keys[1], header->param };
+  uint64_t start, end, pos, want;
+  long int offset, length;
+  size_t buffer_size, bytes_read, skip, out_len;
+  const uint8_t *src;
+  uint8_t *dst, *edge;
+
+  if (xts_keys[0].size == 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: Key file does not hold an XTS" \
+			" key pair.\n");
+	return false;
+  }
+  if (!xts_valid_unit_size(xts.unit_size)
+	  || (data_size >= 0 && data_size < AES_BLOCK_SIZE)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Cipher file is damaged.\n");
+	return false;
+  }
+
+  if (data_size < 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: --offset and --length need a" \
+			" cipher file that can be seeked.\n");
+	return false;
+  }
+
+  /* Work out the range of plaintext wanted, and the units that cover it */
+  if (!plain_range(data_size, &offset, &length)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Range is past the end of the" \
+			" file (%ld bytes).\n", data_size);
+	return false;
+  }
+  if (length == 0)
+	return true;
+  xts_range(&xts, data_size, offset, length, &start, &end);
+
+  VERBOSE("Decrypting bytes %ld to %ld of %ld, in %zu byte data units\n",
+		  offset, offset + length, data_size, xts.unit_size);
+
+  if (!input_seek(in, AES_HEADER_SIZE + start)) {
+	fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	return false;
+  }
+
+  /* Leave room for a scrap at the end of the file */
+  buffer_size = (size_t)pool_size(pool) * AES_CHUNK_SIZE;
+  edge = (uint8_t*)malloc(buffer_size + AES_BLOCK_SIZE);
+  if (edge == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return false;
+  }
+
+  for (pos = start; pos < end; pos += want) {
+	want = end - pos;
+	if (want >= buffer_size + AES_BLOCK_SIZE)
+	  want = buffer_size;
+
+	src = input_read(in, want, &bytes_read);
+	if (src == NULL || bytes_read != want) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	  free(edge);
+	  return false;
+	}
+
+	/* The part of the buffer inside the range */
+	skip = pos < (uint64_t)offset ? offset - pos : 0;
+	out_len = want - skip;
+	if (pos + want > (uint64_t)(offset + length))
+	  out_len -= pos + want - (offset + length);
+
+	dst = output_reserve(out, out_len);
+	if (dst == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  free(edge);
+	  return false;
+	}
+
+	if (out_len == want) {
+	  xts_crypt_parallel(pool, &xts, true, pos / xts.unit_size,
+						 src, dst, want);
+	}
+	else {
+	  xts_crypt_parallel(pool, &xts, true, pos / xts.unit_size,
+						 src, edge, want);
+	  memcpy(dst, edge + skip, out_len);
+	}
+
+	if (!output_commit(out, out_len)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  free(edge);
+	  return false;
+	}
+	show_progress(pos + want - start, end - start);
+  }
+  VERBOSE("\n");
+
+  free(edge);
+  return true;
+}
+
+/**
+ * Decrypts the part of a chunked cipher file from flags.offset to
+ * flags.offset + flags.length. The header has already been read. A whole file
+ * goes through decrypt_stream() instead.
+ *
+ * Chunks are all the same size, so we seek straight to the first chunk that
+ * covers the range, and stop after the last; only the tags of those chunks
+ * are checked, and the rest of the file is never read. The chunks at either
+ * end of the range stick out past it, so they are decrypted on the side and
+ * only the part inside the range is copied out.
+ *
+ * @param data_size - Length of the chunks and their tags, or -1 if not known.
+ */
+static bool decrypt_chunked(aes_input_t *in, aes_output_t *out,
+							aes_key_t *key, const aes_header_t *header,
+							long int data_size) {
+  chunked_t chunked;
+  uint64_t first, end, chunk, count, num_chunks;
+  long int total, offset, length, pos;
+  size_t unit, per_buffer, want, bytes_read, skip, out_len, plain_len;
+  const uint8_t *src;
+  uint8_t *dst, *edge;
+
+  if (!chunked_valid_size(header->param)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Cipher file is damaged.\n");
+	return false;
+  }
+  chunked_init(&chunked, engine, key, header);
+  unit = chunked.chunk_size + GCM_TAG_SIZE;
+  per_buffer = chunked_per_buffer((size_t)pool_size(pool) * AES_CHUNK_SIZE,
+								  chunked.chunk_size);
+
+  if (data_size < 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: --offset and --length need a" \
+			" cipher file that can be seeked.\n");
+	return false;
+  }
+
+  total = chunked_plain_size(data_size, chunked.chunk_size);
+  if (total < 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: Cipher file is truncated.\n");
+	return false;
+  }
+  num_chunks = (data_size + unit - 1) / unit;
+
+  /* Work out the range of plaintext wanted, and the chunks that cover it */
+  if (!plain_range(total, &offset, &length)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Range is past the end of the" \
+			" file (%ld bytes).\n", total);
+	return false;
+  }
+  first = offset / chunked.chunk_size;
+  end = (offset + length + chunked.chunk_size - 1) / chunked.chunk_size;
+
+  /* An empty file is one empty chunk, which is still checked */
+  if (total == 0)
+	end = 1;
+  else if (length == 0)
+	return true;
+
+  VERBOSE("Decrypting bytes %ld to %ld of %ld, in %zu byte chunks\n",
+		  offset, offset + length, total, chunked.chunk_size);
+
+  if (!input_seek(in, AES_HEADER_SIZE + first * unit)) {
+	fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	return false;
+  }
+
+  edge = (uint8_t*)malloc(per_buffer * chunked.chunk_size);
+  if (edge == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return false;
+  }
+
+  for (chunk = first; chunk < end; chunk += count) {
+	count = end - chunk < per_buffer ? end - chunk : per_buffer;
+
+	/* The last chunk of the file may be short */
+	want = count * unit;
+	if (chunk + count == num_chunks)
+	  want = data_size - chunk * unit;
+	src = input_read(in, want, &bytes_read);
+	if (src == NULL || bytes_read != want) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	  free(edge);
+	  return false;
+	}
+
+	/* The part of the chunks inside the range */
+	plain_len = want - count * GCM_TAG_SIZE;
+	pos = chunk * chunked.chunk_size;
+	skip = pos < offset ? offset - pos : 0;
+	out_len = plain_len - skip;
+	if (pos + (long int)plain_len > offset + length)
+	  out_len = offset + length - pos - skip;
+
+	dst = output_reserve(out, out_len);
+	if (dst == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  free(edge);
+	  return false;
+	}
+
+	if (!chunked_decrypt(pool, &chunked, chunk, chunk + count == num_chunks,
+						 src, out_len == plain_len ? dst : edge, want)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Authentication failed. The" \
+			  " cipher file has been modified, or the key is wrong.\n");
+	  free(edge);
+	  return false;
+	}
+	if (out_len != plain_len)
+	  memcpy(dst, edge + skip, out_len);
+
+	if (!output_commit(out, out_len)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  free(edge);
+	  return false;
+	}
+	show_progress(pos + skip + out_len - offset, length);
+  }
+  VERBOSE("\n");
+
+  free(edge);
+  return true;
+}
+
+/**
+ * Works out how long the plaintext will be, so the output can be sized up
+ * front. For CBC this is before the padding comes off, and the output is cut
+ * down once it has.
+ *
+ * @return The size of the plaintext, or -1 if it isn't known.
+ */
+static long int plain_size(const aes_input_t *in,
+						   const aes_header_t *header) {
+  long int data_size = in->size - AES_HEADER_SIZE;
+  long int offset, length;
+
+  if (in->size < 0)
+	return -1;
+
+  switch (header->mode) {
+  case mode_ctr:
+  case mode_cbc:
+	return data_size;
+  case mode_gcm:
+	return data_size - GCM_TAG_SIZE;
+  case mode_xts:
+	return plain_range(data_size, &offset, &length) ? length : -1;
+  case mode_chunked:
+	data_size = chunked_plain_size(data_size, header->param);
+	return data_size >= 0 && plain_range(data_size, &offset, &length)
+	  ? length : -1;
+  default:
+	return (in->size + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+  }
+}
+
+/**
+ * Decrypts a cipher file once we know its mode.
+ */
+static bool decrypt_mode(aes_input_t *in, aes_output_t *out, aes_key_t *key,
+						 const aes_header_t *header) {
+  long int data_size = in->size < 0 ? -1 : in->size - AES_HEADER_SIZE;
+
+  switch (header->mode) {
+  case mode_ecb:
+	return decrypt_ecb(in, out, key);
+  case mode_xts:
+	if (flags.range)
+	  return decrypt_xts(in, out, header, data_size);
+	break;
+  case mode_chunked:
+	if (flags.range)
+	  return decrypt_chunked(in, out, key, header, data_size);
+	break;
+  default:
+	break;
+  }
+  return decrypt_stream(in, out, key, header, data_size);
+}
+
+static bool decrypt_sparse(FILE *fdin, FILE *fdout,
+						   const aes_header_t *header);
+
+/**
+ * Works out the key check of a checkpoint (see inplace_key_check()) from the
+ * key that a file in 'mode' is decrypted with.
+ *
+ * @return false if the key file doesn't hold a key for that mode.
+ */
+static bool checkpoint_key(aes_mode_t mode, uint8_t *check) {
+  if (mode == mode_xts) {
+	if (xts_keys[0].size == 0)
+	  return false;
+	inplace_key_check(engine, &xts_keys[0], &xts_keys[1], check);
+  }
+  else {
+	if (ekey.size == 0)
+	  return false;
+	inplace_key_check(engine, &ekey, NULL, check);
+  }
+  return true;
+}
+
+/**
+ * Gets the checkpoint of a file being decrypted with --resume ready. A new
+ * one takes the header and the key check; one that was loaded must be for
+ * this cipher file, and the input and output are moved on to where it got to.
+ */
+static bool start_checkpoint(aes_input_t *in, FILE *fdout,
+							 const aes_header_t *header) {
+  uint8_t buf[AES_HEADER_SIZE], saved[AES_HEADER_SIZE];
+
+  if (!checkpoint_mode(header->mode) || header->sparse) {
+	fprintf(errors, PROGRAM_NAME ": Error: --resume only works with ctr, xts" \
+			" and chunked cipher files that aren't sparse.\n");
+	return false;
+  }
+  if (in->size < 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: --resume needs a regular" \
+			" file.\n");
+	return false;
+  }
+
+  if (!checkpoint->resumed) {
+	if (!checkpoint_key(header->mode, checkpoint->key_check)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Key file does not hold a %s" \
+			  " key.\n", mode_name(header->mode));
+	  return false;
+	}
+	checkpoint->header = *header;
+	checkpoint->in_size = in->size;
+	return true;
+  }
+
+  header_encode(header, buf);
+  header_encode(&checkpoint->header, saved);
+  if (memcmp(buf, saved, AES_HEADER_SIZE) != 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: Checkpoint is from a different" \
+			" cipher file.\n");
+	return false;
+  }
+  if (!input_seek(in, checkpoint->in_pos)
+	  || fseek(fdout, checkpoint->out_pos, SEEK_SET) != 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	return false;
+  }
+  VERBOSE("Resuming from byte %ld.\n", in->pos);
+  return true;
+}
+
+/**
+ * Main Decryption algorithm. Files in the newer modes start with a header
+ * that says how they were encrypted; anything else is taken to be an ECB file
+ * in the original format, unless --mode says otherwise.
+ *
+ * Like encryption, regular files are mapped into memory and decrypted
+ * straight from one mapping into the other (see fileio.c). Nothing needs the
+ * size of the file, so a cipher file can come from a pipe as well.
+ *
+ * With --resume, checkpoints are saved as it goes, and a file whose
+ * checkpoint was loaded is picked up part way (see checkpoint.c). A sparse
+ * cipher file is decrypted around its holes instead (see decrypt_sparse()).
+ *
+ * A GCM file isn't decrypted to standard output: its plaintext would be out
+ * of our hands before the tag at the end of the file is checked. A chunked
+ * file can be, as each chunk is checked before it is written.
+ */
+bool decrypt_file(FILE *fdin, FILE *fdout, aes_key_t *key) {
+  aes_input_t in;
+  aes_output_t out;
+  aes_header_t header;
+  const uint8_t *buf;
+  size_t buffer_size, bytes_read;
+  bool ok;
+
+  /* Room for a buffer per thread, plus an XTS scrap */
+  buffer_size = (size_t)pool_size(pool) * AES_CHUNK_SIZE + AES_BLOCK_SIZE;
+  if (!input_open(&in, fdin, buffer_size, flags.io)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return false;
+  }
+
+  /* With --mode=ecb we don't look for a header at all, in case the first
+	 block of an ECB file happens to look like one. */
+  memset(&header, 0, sizeof(header));
+  if (flags.mode_given && flags.mode == mode_ecb) {
+	header.mode = mode_ecb;
+  }
+  else {
+	buf = input_read(&in, AES_HEADER_SIZE, &bytes_read);
+	if (buf == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	  input_close(&in);
+	  return false;
+	}
+	if (bytes_read < AES_HEADER_SIZE || !header_decode(buf, &header)) {
+	  if (header_is_old(buf, bytes_read)) {
+		fprintf(errors, PROGRAM_NAME ": Error: Cipher file is from an older" \
+				" version, whose cipher wasn't standard AES; decrypt it with" \
+				" that version.\n");
+		input_close(&in);
+		return false;
+	  }
+	  if (header_has_magic(buf, bytes_read)) {
+		fprintf(errors, PROGRAM_NAME ": Error: Cipher file header is" \
+				" damaged, or from a newer version.\n");
+		input_close(&in);
+		return false;
+	  }
+	  input_unread(&in, bytes_read);
+	  header.mode = mode_ecb;
+	}
+  }
+
+  ok = false;
+  if (flags.mode_given && flags.mode != header.mode) {
+	if (header.mode == mode_ecb)
+	  fprintf(errors, PROGRAM_NAME ": Error: Not a %s mode cipher file.\n",
+			  mode_name(flags.mode));
+	else
+	  fprintf(errors, PROGRAM_NAME ": Error: Cipher file uses %s mode, not" \
+			  " %s.\n", mode_name(header.mode), mode_name(flags.mode));
+  }
+  else if (header.mode == mode_archive) {
+	fprintf(errors, PROGRAM_NAME ": Error: An archive can only be read from" \
+			" a file that can be seeked.\n");
+  }
+  else if (header.mode == mode_gcm && fdout == stdout) {
+	fprintf(errors, PROGRAM_NAME ": Error: GCM files can't be decrypted to" \
+			" standard output, which would get the plaintext before the tag" \
+			" is checked. Use -o, or encrypt in chunked mode, whose chunks" \
+			" are each checked before they are written.\n");
+  }
+  else if (flags.range && header.mode != mode_xts
+		   && header.mode != mode_chunked) {
+	fprintf(errors, PROGRAM_NAME ": Error: --offset and --length only work" \
+			" with XTS and chunked cipher files.\n");
+  }
+  else if (header.mode != mode_xts && key->size == 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: Key file holds an XTS key pair," \
+			" which only works with XTS cipher files.\n");
+  }
+  else if (header.sparse && flags.range) {
+	fprintf(errors, PROGRAM_NAME ": Error: --offset and --length don't work" \
+			" with sparse cipher files.\n");
+  }
+  else if (checkpoint != NULL && !start_checkpoint(&in, fdout, &header)) {
+	/* Already reported */
+  }
+  else if (header.sparse) {
+	VERBOSE("Cipher file uses %s mode, and is sparse.\n",
+			mode_name(header.mode));
+	ok = decrypt_sparse(fdin, fdout, &header);
+  }
+  else {
+	VERBOSE("Cipher file uses %s mode.\n", mode_name(header.mode));
+
+	if (!output_open(&out, fdout, plain_size(&in, &header), buffer_size,
+					 flags.io)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	  input_close(&in);
+	  return false;
+	}
+	VERBOSE("Reading: %s. Writing: %s.\n", input_kind(&in),
+			output_kind(&out));
+
+	ok = decrypt_mode(&in, &out, key, &header);
+	if (!output_close(&out) && ok) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  ok = false;
+	}
+  }
+
+  input_close(&in);
+  return ok;
+}
+
+/**
+ * As with the encryption program, we generate an output file name based on the
+ * input file. Usually a cipher will have the extension ".aes", and so the 
+ * original file name will just be the cipher file minus the .aes extension.
+ *
+ * If the cipher file does not have the .aes extension, we will still try to
+ * decode it, but instead, the output file will have a .txt extension appended
+ * to the name.
+ *
+ * A cipher file found by walking a directory with -r keeps its place in the
+ * tree: 'skip' is how much of its path is left off (the part above the
+ * directory named on the command line), and the rest goes under the output
+ * directory. For any other file, 'skip' is -1 and just the file name is kept.
+ */
+char * create_out_file_name(char *in_path, int skip) {
+  char *out_path, *out_name, *out_dir;
+  char *in_path_cp;
+  char *ext_loc;
+
+  out_path = (char*)malloc(FILENAME_MAX);
+
+  in_path_cp = strdup(in_path);
+  out_name = skip < 0 ? basename(in_path_cp) : in_path_cp + skip;
+
+  out_dir = flags.out_directory == NULL ? "./" : flags.out_directory;
+
+  strncpy(out_path, out_dir, FILENAME_MAX);
+
+  /* Only look for the extension in the file's own name */
+  ext_loc = strrchr(out_name, '/');
+  ext_loc = strstr(ext_loc == NULL ? out_name : ext_loc, CIPHER_EXTENSION);
+  if (ext_loc == NULL) {
+	strncat(out_path, out_name, FILENAME_MAX - strlen(out_path));
+	strncat(out_path, ".txt", FILENAME_MAX - strlen(out_path));
+  }
+  else {
+	*ext_loc = '\0';
+	strncat(out_path, out_name, FILENAME_MAX - strlen(out_path));
+  }
+
+  free(in_path_cp);
+  return out_path;
+}
+
+/**
+ * Makes the directory in the output tree that goes with a directory being
+ * walked with -r. (See create_out_file_name() for 'skip'.)
+ *
+ * @return false if it isn't there and couldn't be made.
+ */
+static bool create_out_dir(const char *in_path, int skip) {
+  char out_path[FILENAME_MAX];
+
+  snprintf(out_path, sizeof(out_path), "%s%s",
+		   flags.out_directory == NULL ? "./" : flags.out_directory,
+		   in_path + skip);
+  if (mkdir(out_path, 0777) != 0 && errno != EEXIST) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to create directory" \
+			" '%s'.\n", out_path);
+	return false;
+  }
+  return true;
+}
+
+/**
+ * Checks whether a cipher file is an archive. Only a file we are at the start
+ * of and can seek in is looked at, since an archive can't be read any other
+ * way; its header is read and the file put back where it was.
+ */
+static bool is_archive(FILE *fd) {
+  uint8_t buf[AES_HEADER_SIZE];
+  aes_header_t header;
+  bool found;
+
+  if ((flags.mode_given && flags.mode != mode_archive) || ftell(fd) != 0)
+	return false;
+
+  found = fread(buf, sizeof(uint8_t), sizeof(buf), fd) == sizeof(buf)
+	&& header_decode(buf, &header) && header.mode == mode_archive;
+  return fseek(fd, 0, SEEK_SET) == 0 && found;
+}
+
+/**
+ * Reads 'len' bytes from 'pos' in a file into 'buf', a buffer at a time.
+ *
+ * @return false if they aren't all there.
+ */
+static bool read_at(aes_input_t *in, long int pos, uint8_t *buf, size_t len) {
+  const uint8_t *src;
+  size_t buffer_size, want, bytes_read;
+
+  if (!input_seek(in, pos))
+	return false;
+  buffer_size = (size_t)pool_size(pool) * AES_CHUNK_SIZE;
+  while (len > 0) {
+	want = len < buffer_size ? len : buffer_size;
+	src = input_read(in, want, &bytes_read);
+	if (src == NULL || bytes_read != want)
+	  return false;
+	memcpy(buf, src, want);
+	buf += want;
+	len -= want;
+  }
+  return true;
+}
+
+/**
+ * Reads and checks the index of an archive (see archive.c). It is found from
+ * the trailer at the end of the file, and is authenticated along with the
+ * header and the trailer before anything in it is believed.
+ *
+ * @param gcm - Set up with the archive's key, ready for the members.
+ * @param key - The archive's own key (see header_file_key()), which 'gcm'
+ *              goes on using.
+ * @param count - Set to the number of members.
+ * @return The members, to be freed with archive_free(), or NULL.
+ */
+static aes_member_t * read_index(aes_input_t *in, gcm_t *gcm,
+								 const uint8_t *header_buf, aes_key_t *key,
+								 size_t *count) {
+  uint8_t aad[AES_HEADER_SIZE + ARCHIVE_TRAILER_SIZE];
+  uint8_t iv[AES_BLOCK_SIZE], tag[GCM_TAG_SIZE];
+  uint64_t index_offset, index_len;
+  aes_member_t *members;
+  uint8_t *index;
+
+  memcpy(aad, header_buf, AES_HEADER_SIZE);
+  if (!read_at(in, in->size - ARCHIVE_TRAILER_SIZE, aad + AES_HEADER_SIZE,
+			   ARCHIVE_TRAILER_SIZE)
+	  || !archive_trailer_decode(aad + AES_HEADER_SIZE, in->size,
+								 &index_offset, &index_len)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Archive is damaged.\n");
+	return NULL;
+  }
+
+  index = (uint8_t*)malloc(index_len + GCM_TAG_SIZE);
+  if (index == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return NULL;
+  }
+  if (!read_at(in, index_offset, index, index_len + GCM_TAG_SIZE)) {
+	fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	free(index);
+	return NULL;
+  }
+
+  archive_nonce(ARCHIVE_INDEX_NUMBER, iv);
+  gcm_init(gcm, engine, key, iv);
+  gcm_aad(gcm, aad, sizeof(aad));
+  gcm_decrypt(gcm, pool, index, index, index_len);
+  gcm_tag(gcm, tag);
+  if (!gcm_tag_equal(tag, index + index_len)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Authentication failed. The" \
+			" archive has been modified, or the key is wrong.\n");
+	free(index);
+	return NULL;
+  }
+
+  members = archive_index_decode(index, index_len, index_offset, count);
+  if (members == NULL)
+	fprintf(errors, PROGRAM_NAME ": Error: Archive index is damaged.\n");
+  free(index);
+  return members;
+}
+
+/**
+ * Decrypts one member of an archive into 'fdout'. We seek straight to it, so
+ * nothing else in the archive is read. Its tag is checked at the end, and if
+ * it doesn't match we return false, and the caller throws the plaintext
+ * away.
+ */
+static bool extract_member(aes_input_t *in, gcm_t *gcm,
+						   const uint8_t *header_buf,
+						   const aes_member_t *member, FILE *fdout) {
+  aes_output_t out;
+  uint8_t iv[AES_BLOCK_SIZE], tag[GCM_TAG_SIZE];
+  size_t buffer_size, want, bytes_read;
+  uint64_t done;
+  const uint8_t *src;
+  uint8_t *dst;
+  bool ok;
+
+  archive_nonce(member->number, iv);
+  gcm_restart(gcm, iv);
+  gcm_aad(gcm, header_buf, AES_HEADER_SIZE);
+
+  buffer_size = (size_t)pool_size(pool) * AES_CHUNK_SIZE;
+  if (!output_open(&out, fdout, member->size, buffer_size, flags.io)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return false;
+  }
+
+  ok = input_seek(in, member->offset);
+  for (done = 0; ok && done < member->size; done += want) {
+	want = member->size - done < buffer_size ? member->size - done
+	  : buffer_size;
+	src = input_read(in, want, &bytes_read);
+	if (src == NULL || bytes_read != want) {
+	  ok = false;
+	  break;
+	}
+
+	dst = output_reserve(&out, want);
+	if (dst == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  output_close(&out);
+	  return false;
+	}
+	gcm_decrypt(gcm, pool, src, dst, want);
+	if (!output_commit(&out, want)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  output_close(&out);
+	  return false;
+	}
+	show_progress(done + want, member->size);
+  }
+  VERBOSE("\n");
+
+  if (ok) {
+	src = input_read(in, GCM_TAG_SIZE, &bytes_read);
+	ok = src != NULL && bytes_read == GCM_TAG_SIZE;
+  }
+  if (!ok) {
+	fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	output_close(&out);
+	return false;
+  }
+
+  gcm_tag(gcm, tag);
+  if (!gcm_tag_equal(tag, src)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Authentication failed. Member" \
+			" '%s' has been modified.\n", member->name);
+	output_close(&out);
+	return false;
+  }
+  VERBOSE("Authentication tag verified.\n");
+
+  if (!output_close(&out)) {
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	return false;
+  }
+  return true;
+}
+
+/**
+ * Makes the directories above a member of an archive being extracted to
+ * 'out_path', from the output directory down. (The member's name has been
+ * checked not to climb out of it.)
+ *
+ * @param start - Where the member's name starts in 'out_path'.
  */
-void load_key(FILE *keyfd) {
-  size_t enc_len, data_len;
-  char * b64_str;
-  uint8_t * data_str;
+static bool create_member_dirs(char *out_path, size_t start) {
+  char *slash;
 
-  b64_str = (char *)malloc((size_t)80);
-  if (fgets(b64_str, 80, keyfd) != b64_str) {
-	exit_error(PROGRAM_NAME ": Failed to read key from file.");
+  for (slash = strchr(out_path + start, '/'); slash != NULL;
+	   slash = strchr(slash + 1, '/')) {
+	*slash = '\0';
+	if (mkdir(out_path, 0777) != 0 && errno != EEXIST) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Failed to create directory" \
+			  " '%s'.\n", out_path);
+	  *slash = '/';
+	  return false;
+	}
+	*slash = '/';
   }
-  enc_len = strlen(b64_str);
-  data_str = base64_decode(b64_str, enc_len, &data_len);
+  return true;
+}
 
-  ekey.size = data_len;
-  memmove(ekey.block, data_str, ekey.size);
+/**
+ * Lists the members of an archive with -l, or extracts them: all of them, or
+ * with -x, just the one named. Each goes to its own path under the output
+ * directory, or to the file named with -o, or standard output.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any member failed.
+ */
+static int decrypt_archive(FILE *fdin, const char *in_path, aes_key_t *key) {
+  aes_input_t in;
+  aes_header_t header;
+  uint8_t header_buf[AES_HEADER_SIZE];
+  char out_path[FILENAME_MAX];
+  aes_member_t *members;
+  const char *out_dir;
+  size_t i, count;
+  aes_key_t file_key;
+  gcm_t gcm;
+  FILE *outfd;
+  bool found, ok;
+  int status;
 
-  key_expansion(&ekey);
-  free(b64_str);
-  free(data_str);
+  if (key->size == 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: Key file holds an XTS key pair," \
+			" which only works with XTS cipher files.\n");
+	return EXIT_FAILURE;
+  }
+  if (!flags.list && flags.member == NULL && flags.out_file != NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: -o needs --extract to pick one" \
+			" member of an archive.\n");
+	return EXIT_FAILURE;
+  }
+
+  if (!input_open(&in, fdin, (size_t)pool_size(pool) * AES_CHUNK_SIZE
+				  + GCM_TAG_SIZE, flags.io)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return EXIT_FAILURE;
+  }
+  if (!read_at(&in, 0, header_buf, AES_HEADER_SIZE)
+	  || !header_decode(header_buf, &header)) {
+	fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	input_close(&in);
+	return EXIT_FAILURE;
+  }
+  VERBOSE("Reading: %s.\n", input_kind(&in));
+
+  header_file_key(engine, key, &header, &file_key);
+  members = read_index(&in, &gcm, header_buf, &file_key, &count);
+  if (members == NULL) {
+	input_close(&in);
+	return EXIT_FAILURE;
+  }
+  VERBOSE("Archive '%s' holds %zu file(s).\n", in_path, count);
+
+  out_dir = flags.out_directory == NULL ? "./" : flags.out_directory;
+  status = EXIT_SUCCESS;
+  found = false;
+  for (i = 0; i < count; i++) {
+	if (flags.member != NULL && strcmp(members[i].name, flags.member) != 0)
+	  continue;
+	found = true;
+
+	if (flags.list) {
+	  fprintf(messages, "%12ld  %s\n", (long int)members[i].size,
+			  members[i].name);
+	  continue;
+	}
+
+	if (flags.use_stdout) {
+	  snprintf(out_path, sizeof(out_path), "(standard output)");
+	  outfd = stdout;
+	}
+	else {
+	  if (flags.out_file != NULL)
+		snprintf(out_path, sizeof(out_path), "%s", flags.out_file);
+	  else
+		snprintf(out_path, sizeof(out_path), "%s%s", out_dir,
+				 members[i].name);
+	  outfd = flags.out_file != NULL
+		|| create_member_dirs(out_path, strlen(out_dir))
+		? fopen(out_path, "w+b") : NULL;
+	}
+
+	if (outfd == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Failed to create file '%s'.\n",
+			  out_path);
+	  status = EXIT_FAILURE;
+	}
+	else {
+	  VERBOSE("Extracting '%s'...\n", members[i].name);
+	  ok = extract_member(&in, &gcm, header_buf, &members[i], outfd);
+	  if (ok) {
+		fprintf(messages, PROGRAM_NAME ": Plaintext file '%s' created from" \
+				" '%s' in archive '%s'.\n", out_path, members[i].name,
+				in_path);
+	  }
+	  if (!flags.use_stdout) {
+		fclose(outfd);
+		if (!ok)
+		  remove(out_path);
+	  }
+	  else if (fflush(stdout) != 0) {
+		ok = false;
+	  }
+	  if (!ok)
+		status = EXIT_FAILURE;
+	}
+
+	/* Names needn't be unique; -x takes the first */
+	if (flags.member != NULL)
+	  break;
+  }
+
+  if (flags.member != NULL && !found) {
+	fprintf(errors, PROGRAM_NAME ": Error: Archive '%s' has no file '%s'.\n",
+			in_path, flags.member);
+	status = EXIT_FAILURE;
+  }
+
+  archive_free(members, count);
+  input_close(&in);
+  return status;
 }
 
+/* A file being decrypted in place */
+struct in_place
+{
+  aes_header_t header;
+  xts_t xts;
+};
+
+/**
+ * Decrypts a window of a file being decrypted in place, or of the data of a
+ * sparse file.
+ */
+static void in_place_window(void *arg, uint64_t pos, uint8_t *buf,
+							size_t len) {
+  struct in_place *job = arg;
 
-void sub_bytes_inv(uint8_t **state) {
-  int i;
-  for (i = 0; i < 4; i++)
-	bytesub_decrypt(state[i], 4);
+  if (job->header.mode == mode_xts)
+	xts_crypt_parallel(pool, &job->xts, true, pos / job->xts.unit_size,
+					   buf, buf, len);
+  else
+	ctr_crypt_parallel(pool, engine, &ekey, job->header.iv,
+					   pos / AES_BLOCK_SIZE, buf, buf, len);
 }
 
 /**
- * ShiftRows function of AES algorithm
- * Rotates the bytes in each row of the state block a certain 
- * number of times.
+ * Gets a cipher file ready to be decrypted in place: picks up the journal of
+ * a run that stopped part way, or reads the header and starts a new one. The
+ * header is kept in the journal, as the first window writes over it.
+ *
+ * @return false if it can't be decrypted.
  */
-void shift_rows_inv(uint8_t **state) {
-  uint8_t temp;
-  int r, i, c;
-  /* First row is not changed.  */
-  /* Rows 2, 3, 4 are rotated 1, 2, and 3 spaces to the left, respectively.  */
-  for (r = 1; r < 4; r++) {
-	for (i = 0; i < r; i++) {
-	  for (c = 3; c >= 1; c--) {
-		temp = state[r][c];
-		state[r][c] = state[r][c-1];
-		state[r][c-1] = temp;
-	  }
+static bool in_place_open(inplace_t *ip, struct in_place *job,
+						  const char *in_path, const char *journal_name) {
+  uint8_t check[16];
+  struct stat st;
+  bool resume;
+
+  ip->journal_fd = open(journal_name, O_RDWR);
+  resume = ip->journal_fd >= 0;
+  if (resume) {
+	if (!inplace_resume(ip) || !ip->decrypt
+		|| !header_decode(ip->header, &job->header)) {
+	  if (ip->error != NULL)
+		fprintf(errors, PROGRAM_NAME ": Error: '%s': %s.\n", journal_name,
+				ip->error);
+	  else
+		fprintf(errors, PROGRAM_NAME ": Error: '%s' is not a decryption" \
+				" journal.\n", journal_name);
+	  return false;
+	}
+  }
+  else if (fstat(ip->fd, &st) != 0 || !S_ISREG(st.st_mode)
+		   || st.st_size < AES_HEADER_SIZE
+		   || pread(ip->fd, ip->header, AES_HEADER_SIZE, 0) != AES_HEADER_SIZE
+		   || !header_decode(ip->header, &job->header)) {
+	if (header_is_old(ip->header, AES_HEADER_SIZE))
+	  fprintf(errors, PROGRAM_NAME ": Error: '%s' is from an older version," \
+			  " whose cipher wasn't standard AES; decrypt it with that" \
+			  " version.\n", in_path);
+	else
+	  fprintf(errors, PROGRAM_NAME ": Error: '%s' is not a cipher file.\n",
+			  in_path);
+	return false;
+  }
+
+  if (job->header.sparse) {
+	fprintf(errors, PROGRAM_NAME ": Error: Sparse cipher files can't be" \
+			" decrypted in place.\n");
+	return false;
+  }
+  if (job->header.mode != mode_ctr && job->header.mode != mode_xts) {
+	fprintf(errors, PROGRAM_NAME ": Error: Only ctr and xts files can be" \
+			" decrypted in place; '%s' is %s.\n", in_path,
+			mode_name(job->header.mode));
+	return false;
+  }
+  if ((job->header.mode == mode_ctr && ekey.size == 0)
+	  || (job->header.mode == mode_xts && xts_keys[0].size == 0)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Key file does not hold a %s" \
+			" key.\n", mode_name(job->header.mode));
+	return false;
+  }
+  if (job->header.mode == mode_xts) {
+	inplace_key_check(engine, &xts_keys[0], &xts_keys[1], check);
+	job->xts.unit_size = job->header.param;
+	if (!xts_valid_unit_size(job->xts.unit_size)
+		|| (!resume && st.st_size - AES_HEADER_SIZE < AES_BLOCK_SIZE)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Cipher file is damaged.\n");
+	  return false;
+	}
+  }
+  else {
+	inplace_key_check(engine, &ekey, NULL, check);
+  }
+
+  if (resume) {
+	if (memcmp(ip->key_check, check, sizeof(check)) != 0) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Journal '%s' was made with a" \
+			  " different key.\n", journal_name);
+	  return false;
 	}
+	VERBOSE("Resuming from byte %llu of '%s'.\n",
+			(unsigned long long)ip->pos, in_path);
+	return true;
+  }
+
+  ip->decrypt = true;
+  memcpy(ip->key_check, check, sizeof(check));
+  ip->plain_size = st.st_size - AES_HEADER_SIZE;
+  ip->window_size = (uint64_t)pool_size(pool) * AES_CHUNK_SIZE;
+
+  ip->journal_fd = open(journal_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (ip->journal_fd < 0 || !inplace_start(ip)) {
+	if (ip->journal_fd >= 0)
+	  unlink(journal_name);
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to create journal" \
+			" '%s'.\n", journal_name);
+	return false;
   }
+  return true;
 }
 
 /**
- * MixColumns function of AES algorithm
+ * Decrypts a cipher file in place, for --in_place: the opposite of
+ * aes-encrypt --in_place, and so also the way to roll one of its runs back.
+ * The plaintext moves down over the header, the file is cut short, and it
+ * loses its CIPHER_EXTENSION. Only CTR and XTS files can be done this way;
+ * as they carry no tag, a wrong key gives garbage, just as it would with a
+ * copy.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE.
  */
-void mix_columns_inv(uint8_t **state) {
-  int c;
-  uint8_t temp[4];
-  for (c = 0; c < 4; c++) {
-	temp[0] = ff_multiply(0x0e, state[0][c])
-	  ^ ff_multiply(0x0b, state[1][c])
-	  ^ ff_multiply(0x0d, state[2][c])
-	  ^ ff_multiply(0x09, state[3][c]);
-	temp[1] = ff_multiply(0x09, state[0][c])
-	  ^ ff_multiply(0x0e, state[1][c])
-	  ^ ff_multiply(0x0b, state[2][c])
-	  ^ ff_multiply(0x0d, state[3][c]);
-	temp[2] = ff_multiply(0x0d, state[0][c])
-	  ^ ff_multiply(0x09, state[1][c])
-	  ^ ff_multiply(0x0e, state[2][c])
-	  ^ ff_multiply(0x0b, state[3][c]);
-	temp[3] = ff_multiply(0x0b, state[0][c])
-	  ^ ff_multiply(0x0d, state[1][c])
-	  ^ ff_multiply(0x09, state[2][c])
-	  ^ ff_multiply(0x0e, state[3][c]);
+static int decrypt_in_place(const char *in_path) {
+  char journal_name[FILENAME_MAX], out_name[FILENAME_MAX];
+  struct in_place job;
+  inplace_t ip;
+  size_t len;
+  bool ok;
 
-	state[0][c] = temp[0];
-	state[1][c] = temp[1];
-	state[2][c] = temp[2];
-	state[3][c] = temp[3];
+  len = strlen(in_path);
+  if (len <= strlen(CIPHER_EXTENSION)
+	  || len + strlen(JOURNAL_EXTENSION) >= sizeof(journal_name)
+	  || strcmp(in_path + len - strlen(CIPHER_EXTENSION),
+				CIPHER_EXTENSION) != 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: '%s' doesn't end in '" \
+			CIPHER_EXTENSION "'.\n", in_path);
+	return EXIT_FAILURE;
   }
+  snprintf(journal_name, sizeof(journal_name), "%s" JOURNAL_EXTENSION,
+		   in_path);
+  memcpy(out_name, in_path, len - strlen(CIPHER_EXTENSION));
+  out_name[len - strlen(CIPHER_EXTENSION)] = '\0';
+
+  memset(&ip, 0, sizeof(ip));
+  ip.fd = open(in_path, O_RDWR);
+  if (ip.fd < 0) {
+	/* The last run stopped after renaming the file, but before removing the
+	   journal */
+	if (errno == ENOENT && access(out_name, F_OK) == 0
+		&& unlink(journal_name) == 0) {
+	  fprintf(messages, PROGRAM_NAME ": Plaintext file '%s' created from" \
+			  " file '%s'.\n", out_name, in_path);
+	  return EXIT_SUCCESS;
+	}
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to open file '%s'.\n",
+			in_path);
+	return EXIT_FAILURE;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.xts.engine = engine;
+  job.xts.data_key = &xts_keys[0];
+  job.xts.tweak_key = &xts_keys[1];
+
+  VERBOSE("Decrypting file '%s' in place...\n", in_path);
+  ok = in_place_open(&ip, &job, in_path, journal_name);
+  if (ok && !inplace_run(&ip, in_place_window, &job, show_progress)) {
+	fprintf(errors, PROGRAM_NAME ": Error: %s.\n", ip.error);
+	ok = false;
+  }
+  VERBOSE("\n");
+
+  /* The journal is only removed once the file has its new name, so a run
+	 that stops in between still knows the file is decrypted */
+  if (ok && rename(in_path, out_name) != 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to rename '%s' to" \
+			" '%s'.\n", in_path, out_name);
+	ok = false;
+  }
+  if (ok) {
+	unlink(journal_name);
+	fprintf(messages, PROGRAM_NAME ": Plaintext file '%s' created from" \
+			" file '%s'.\n", out_name, in_path);
+  }
+
+  if (ip.journal_fd >= 0)
+	close(ip.journal_fd);
+  close(ip.fd);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 /**
- * AddRoundKey function of AES algorithm
- * XOR's the block state against 
+ * Decrypts a sparse cipher file (see sparse.c). Only the data between the
+ * holes in its list is read and deciphered, and the plaintext file gets the
+ * same holes; a pipe gets zeros for them.
+ *
+ * @param fdin - The cipher file, which must be a regular file.
  */
-void add_round_key_inv(uint8_t **state, int round) {
-  int r, c;
-  int keyind = 16 * (round + 1);
+static bool decrypt_sparse(FILE *fdin, FILE *fdout,
+						   const aes_header_t *header) {
+  struct in_place job;
+  sparse_t sp;
+  struct stat st;
+  bool ok;
 
-  for (c = 3; c >= 0; c--) {
-	for (r = 3; r >= 0; r--) {
-	  state[r][c] = state[r][c] ^ ekey.exp_block[--keyind];
+  if (fstat(fileno(fdin), &st) != 0 || !S_ISREG(st.st_mode)) {
+	fprintf(errors, PROGRAM_NAME ": Error: A sparse cipher file can only be" \
+			" read from a file that can be seeked.\n");
+	return false;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.header = *header;
+  job.xts.engine = engine;
+  job.xts.data_key = &xts_keys[0];
+  job.xts.tweak_key = &xts_keys[1];
+  job.xts.unit_size = header->param;
+  if (header->mode == mode_xts) {
+	if (xts_keys[0].size == 0) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Key file does not hold an XTS" \
+			  " key pair.\n");
+	  return false;
+	}
+	if (!xts_valid_unit_size(job.xts.unit_size)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Cipher file is damaged.\n");
+	  return false;
 	}
   }
-}
 
-void aes_cipher_inv(uint8_t **state) {
-  int round, num_rounds;
+  memset(&sp, 0, sizeof(sp));
+  sp.in_fd = fileno(fdin);
+  sp.out_fd = fileno(fdout);
+  sp.decrypt = true;
+  sp.step = header->mode == mode_xts ? job.xts.unit_size : AES_BLOCK_SIZE;
+  sp.tail = header->mode == mode_xts ? AES_BLOCK_SIZE : 0;
+  sp.window_size = (uint64_t)pool_size(pool) * AES_CHUNK_SIZE;
 
-  num_rounds = (ekey.size / 4) + (AES_BLOCK_SIZE / 4) + 2;
-  
-  add_round_key_inv(state, num_rounds);
+  ok = sparse_load(&sp, st.st_size);
+  if (ok && sp.size < sp.tail) {
+	sp.error = "Cipher file is damaged";
+	ok = false;
+  }
+  if (ok && fflush(fdout) != 0) {
+	sp.error = "File write error";
+	ok = false;
+  }
+  if (ok) {
+	VERBOSE("Cipher file has %zu holes.\n", sp.count);
+	ok = sparse_run(&sp, in_place_window, &job, show_progress);
+  }
+  if (!ok)
+	fprintf(errors, PROGRAM_NAME ": Error: %s.\n", sp.error);
+  VERBOSE("\n");
+
+  sparse_free(&sp);
+  return ok;
+}
+
+/**
+ * Opens the checkpoint file of a plaintext file, for --resume, and loads it
+ * if an earlier run left one behind to carry on from. What is left of it is
+ * checked once the header has been read (see start_checkpoint()).
+ *
+ * @return false if it can't be opened, or was left by a run that this one
+ *         can't carry on.
+ */
+static bool open_checkpoint(checkpoint_t *cp, const char *cp_name,
+							FILE *infd) {
+  uint8_t check[16];
+  struct stat st;
 
-  for (round = (num_rounds-1); round >= 1; round--) {
-	shift_rows_inv(state);
-	sub_bytes_inv(state);
-	add_round_key_inv(state, round);
-	mix_columns_inv(state);
+  memset(cp, 0, sizeof(*cp));
+  cp->fd = open(cp_name, O_RDWR | O_CREAT, 0600);
+  if (cp->fd < 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to create checkpoint" \
+			" '%s'.\n", cp_name);
+	return false;
   }
+  cp->decrypt = true;
+  if (!checkpoint_load(cp))
+	return true;
 
-  shift_rows_inv(state);
-  sub_bytes_inv(state);
-  add_round_key_inv(state, 0);
+  if (!cp->decrypt || fstat(fileno(infd), &st) != 0
+	  || (uint64_t)st.st_size != cp->in_size) {
+	fprintf(errors, PROGRAM_NAME ": Error: Checkpoint '%s' is from a" \
+			" different run.\n", cp_name);
+	close(cp->fd);
+	return false;
+  }
+  if (!checkpoint_key(cp->header.mode, check)
+	  || memcmp(cp->key_check, check, sizeof(check)) != 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: Checkpoint '%s' was made with" \
+			" a different key.\n", cp_name);
+	close(cp->fd);
+	return false;
+  }
+  cp->resumed = checkpoint_resume(cp);
+  if (!cp->resumed)
+	cp->in_pos = cp->out_pos = cp->done = 0;
+  return true;
 }
 
 /**
- * Main Decryption algorithm.
+ * Decrypts one cipher file, named on the command line. "-" is standard input,
+ * which is decrypted to standard output unless -o names a file.
+ *
+ * A plaintext file is removed again if anything goes wrong, so a partial or
+ * unauthenticated plaintext is never left behind. What has gone to standard
+ * output can't be taken back, so GCM files, whose tag is only checked at the
+ * end, aren't decrypted to it (see decrypt_file()).
+ *
+ * An archive is listed or unpacked instead (see decrypt_archive()), and with
+ * --in_place the file is decrypted where it lies (see decrypt_in_place()).
+ *
+ * With --resume, a checkpoint file is kept next to the plaintext file until
+ * it is done, and a run that was stopped part way carries on from it. It goes
+ * with the plaintext file if that is removed.
+ *
+ * @param skip - See create_out_file_name().
+ * @return EXIT_SUCCESS or EXIT_FAILURE.
  */
-bool decrypt_file(FILE *fdin, FILE *fdout, aes_key_t *key) {
-  int i, b, num_blocks;
-  long int file_size;
-  uint8_t buffer[18];
-  uint8_t **state;
-  
-  /* Initialize state block */
-  state = (uint8_t**)malloc(4 * sizeof(uint8_t*));
-  for (i = 0; i < 4; i++)
-	state[i] = (uint8_t*)malloc(4);
+static int decrypt_named(char *in_path, int skip) {
+  char *out_name, cp_name[FILENAME_MAX];
+  FILE *infd, *outfd;
+  checkpoint_t cp;
+  bool from_stdin, to_stdout, ok;
+  int status;
 
-  /* Get size of the file. */
-  fseek(fdin, 0L, SEEK_END);
-  file_size = ftell(fdin);
-  rewind(fdin);
+  if (flags.in_place)
+	return decrypt_in_place(in_path);
 
-  /* Determine the number of blocks to encrypt */
-  num_blocks = file_size / AES_BLOCK_SIZE;
-  if (file_size % AES_BLOCK_SIZE) num_blocks++;
+  from_stdin = strcmp(in_path, "-") == 0;
+  to_stdout = flags.use_stdout || (from_stdin && flags.out_file == NULL);
 
-  VERBOSE("Size of file: %ld bytes (%d blocks)\n", file_size, num_blocks);
-  
-  /* Decrypt each block */
-  
-  for (b = 0; b < num_blocks; b++) {
-	if (flags.verbose) {
-	  printf("Decrypting block %d of %d.\r", b+1, num_blocks);
-	  fflush(stdin);
+  if (from_stdin) {
+	in_path = "(standard input)";
+	infd = stdin;
+  }
+  else {
+	infd = fopen(in_path, "rb"); /* Open file for reading */
+	if (infd == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Failed to open file '%s'.\n",
+			  in_path);
+	  return EXIT_FAILURE;
 	}
+  }
 
-	/* Read in next 16 bytes. */
-	fread(buffer, sizeof(uint8_t), 16, fdin);
-	if (ferror(fdin) != 0) {
-	  fprintf(stderr, PROGRAM_NAME ": Error: File read error.\n");
-	  return false;
+  /* An archive holds files of its own, which go where it says */
+  if (is_archive(infd)) {
+	status = decrypt_archive(infd, in_path, &ekey);
+	if (!from_stdin)
+	  fclose(infd);
+	return status;
+  }
+  if (flags.list || flags.member != NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: '%s' is not an archive.\n",
+			in_path);
+	if (!from_stdin)
+	  fclose(infd);
+	return EXIT_FAILURE;
+  }
+
+  if (to_stdout) {
+	out_name = strdup("(standard output)");
+	outfd = stdout;
+  }
+  else {
+	out_name = flags.out_file != NULL ? strdup(flags.out_file)
+	  : create_out_file_name(in_path, skip);
+
+	/* Carrying on from a checkpoint mustn't truncate what is already done */
+	if (flags.resume && !from_stdin) {
+	  snprintf(cp_name, sizeof(cp_name), "%s" CHECKPOINT_EXTENSION, out_name);
+	  if (!open_checkpoint(&cp, cp_name, infd)) {
+		fclose(infd);
+		free(out_name);
+		return EXIT_FAILURE;
+	  }
+	  checkpoint = &cp;
 	}
+	outfd = fopen(out_name, checkpoint != NULL && cp.resumed ? "r+b" : "w+b");
+  }
 
-	/* Fill state block */
-	for (i = 0; i < AES_BLOCK_SIZE; i++)
-	  state[i%4][i/4] = buffer[i];
-	
-	aes_cipher_inv(state); /* Run decryption */
-	
-    /* Get the newly decrypted byte sequence */
-	for (i = 0; i < AES_BLOCK_SIZE; i++)
-	  buffer[i] = state[i%4][i/4];
-	
-	/* Write result to the output file */
-	if (fwrite(buffer, sizeof(uint8_t), 16, fdout) != 16) {
-	  fprintf(stderr, PROGRAM_NAME ": Error: File write error.\n");
-	  return false;
+  if (outfd == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to create file '%s'.\n",
+			out_name);
+	ok = false;
+  }
+  else {
+	VERBOSE("Decrypting file '%s'...\n", in_path);
+	ok = decrypt_file(infd, outfd, &ekey);
+	if (ok) {
+	  fprintf(messages, PROGRAM_NAME ": Plaintext file '%s' created from" \
+			  " file '%s'.\n", out_name, in_path);
+	}
+	if (!to_stdout) {
+	  fclose(outfd);
+	  if (!ok)
+		remove(out_name);
+	}
+	else if (fflush(stdout) != 0) {
+	  ok = false;
 	}
   }
-  VERBOSE("\n");
 
-  for (i = 0; i < 4; i++)
-	free(state[i]);
-  free(state);
-  
-  return true;
+  if (checkpoint != NULL) {
+	close(cp.fd);
+	unlink(cp_name);
+	checkpoint = NULL;
+  }
+
+  if (!from_stdin)
+	fclose(infd);
+  free(out_name);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+/* A cipher file, or a directory to walk with -r */
+struct unit
+{
+  char *path;
+  bool dir;
+  int skip; /* Part of the path left out of the output (see
+			   create_out_file_name()), or -1 */
+};
+
+static int decrypt_tree(const char *path, int skip);
+
 /**
- * As with the encryption program, we generate an output file name based on the
- * input file. Usually a cipher will have the extension ".aes", and so the 
- * original file name will just be the cipher file minus the .aes extension.
+ * Decrypts one unit.
  *
- * If the cipher file does not have the .aes extension, we will still try to
- * decode it, but instead, the output file will have a .txt extension appended
- * to the name.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed.
  */
-char * create_out_file_name(char *in_path) {
-  char *out_path, *out_name, *out_dir;
-  char *in_path_cp;
-  char *ext_loc;
+static int decrypt_unit(const struct unit *unit) {
+  if (unit->dir)
+	return decrypt_tree(unit->path, unit->skip);
+  return decrypt_named(unit->path, unit->skip);
+}
 
-  out_path = (char*)malloc(FILENAME_MAX);
+/**
+ * Batch function: decrypts the i-th of the units in 'arg', with its messages
+ * going to 'out' and 'err'.
+ */
+static bool decrypt_batch(void *arg, size_t i, FILE *out, FILE *err) {
+  const struct unit *list = arg;
+  FILE *old_out = messages, *old_err = errors;
+  bool ok;
 
-  in_path_cp = strdup(in_path);
-  out_name = basename(in_path_cp);
+  messages = out;
+  errors = err;
+  ok = decrypt_unit(&list[i]) == EXIT_SUCCESS;
+  messages = old_out;
+  errors = old_err;
+  return ok;
+}
 
-  out_dir = flags.out_directory == NULL ? "./" : flags.out_directory;
+/**
+ * Decrypts a list of cipher files and directories. Given more than one and
+ * more than one thread, they are run as a batch, unless the plaintexts all go
+ * to standard output or one of them is standard input. Directories are
+ * started first, so the walk spreads over the threads as early as it can.
+ *
+ * @param skip - For the files of a directory being walked, the part of their
+ *               path left out of the output. -1 for the files named on the
+ *               command line.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed.
+ */
+static int decrypt_entries(const aes_entry_t *entries, int count, int skip) {
+  struct unit *list;
+  long int *sizes;
+  int i, status;
+  bool parallel;
 
-  strncpy(out_path, out_dir, FILENAME_MAX);
+  sizes = (long int*)malloc(count * sizeof(long int));
+  list = (struct unit*)malloc(count * sizeof(struct unit));
+  if (sizes == NULL || list == NULL) {
+	free(sizes);
+	free(list);
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return EXIT_FAILURE;
+  }
 
-  ext_loc = strstr(out_name, CIPHER_EXTENSION);
-  if (ext_loc == NULL) {
-	strncat(out_path, out_name, FILENAME_MAX - strlen(out_path));
-	strncat(out_path, ".txt", FILENAME_MAX - strlen(out_path));
+  parallel = count > 1 && pool_size(pool) > 1 && !flags.use_stdout;
+  for (i = 0; i < count; i++) {
+	list[i].path = entries[i].path;
+	list[i].dir = entries[i].dir;
+	list[i].skip = skip >= 0 || !entries[i].dir ? skip
+	  : walk_skip(entries[i].path);
+	sizes[i] = entries[i].dir ? LONG_MAX : entries[i].size;
+	if (strcmp(entries[i].path, "-") == 0)
+	  parallel = false;
+  }
+
+  if (parallel) {
+	status = batch_run(pool, count, sizes, decrypt_batch, list, messages,
+					   errors) ? EXIT_SUCCESS : EXIT_FAILURE;
   }
   else {
-	*ext_loc = '\0';
-	strncat(out_path, out_name, FILENAME_MAX - strlen(out_path));
+	status = EXIT_SUCCESS;
+	for (i = 0; i < count; i++) {
+	  if (decrypt_unit(&list[i]) != EXIT_SUCCESS)
+		status = EXIT_FAILURE;
+	}
   }
 
-  free(in_path_cp);
-  return out_path;
+  free(sizes);
+  free(list);
+  return status;
+}
+
+/**
+ * Decrypts every cipher file (every file ending in .aes) under a directory,
+ * for -r. The plaintexts go into the same tree of directories under the
+ * output directory.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed.
+ */
+static int decrypt_tree(const char *path, int skip) {
+  aes_entry_t *entries;
+  size_t count, i, n, len;
+  int status;
+
+  entries = walk_dir(path, &count);
+  if (entries == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to read directory '%s'.\n",
+			path);
+	return EXIT_FAILURE;
+  }
+  if (!create_out_dir(path, skip)) {
+	walk_free(entries, count);
+	return EXIT_FAILURE;
+  }
+
+  /* Leave out the files that aren't cipher files */
+  n = 0;
+  for (i = 0; i < count; i++) {
+	len = strlen(entries[i].path);
+	if (entries[i].dir || (len > strlen(CIPHER_EXTENSION)
+						   && strcmp(entries[i].path + len
+									 - strlen(CIPHER_EXTENSION),
+									 CIPHER_EXTENSION) == 0))
+	  entries[n++] = entries[i];
+	else
+	  free(entries[i].path);
+  }
+
+  VERBOSE("Decrypting directory '%s'...\n", path);
+  status = n > 0 ? decrypt_entries(entries, n, skip) : EXIT_SUCCESS;
+  walk_free(entries, n);
+  return status;
+}
+
+/**
+ * Decrypts every cipher file named on the command line, and with -r, every
+ * cipher file under the directories named there.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed.
+ */
+static int decrypt_all(char **names, int count) {
+  struct stat st;
+  aes_entry_t *entries;
+  int i, status;
+
+  if (count == 0)
+	return EXIT_SUCCESS;
+
+  entries = (aes_entry_t*)malloc(count * sizeof(aes_entry_t));
+  if (entries == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < count; i++) {
+	entries[i].path = names[i];
+	entries[i].dir = false;
+	entries[i].size = -1;
+	if (stat(names[i], &st) == 0) {
+	  entries[i].dir = flags.recursive && S_ISDIR(st.st_mode);
+	  if (S_ISREG(st.st_mode))
+		entries[i].size = (long int)st.st_size;
+	}
+  }
+
+  /* With files being done side by side, there is no one file to show the
+	 progress of */
+  batch = pool_size(pool) > 1 && !flags.use_stdout
+	&& (count > 1 || flags.recursive);
+  if (batch)
+	VERBOSE("Decrypting files on %d threads at once.\n", pool_size(pool));
+
+  status = decrypt_entries(entries, count, -1);
+  free(entries);
+  return status;
 }
 
 int
 main(int argc, char *argv[])
 {
-  int opt;
-  char *out_name;
-  FILE *keyfd, *infd, *outfd;
+  int opt, i, status = EXIT_SUCCESS;
+  FILE *keyfd;
+
+  errors = stderr;
+  flags.length = -1; /* Decrypt to the end of the file by default */
   
   /* Parse command options */
   while ((opt = getopt_long(argc, argv, opts_str, long_opts, NULL)) != -1) {
@@ -295,8 +1873,57 @@ main(int argc, char *argv[])
 	case 't': flags.use_stdout = true; break;
 
 	case 'd': flags.out_directory = optarg; break;
+
+	case 'o': flags.out_file = optarg; break;
 		  
 	case 'v': flags.verbose = true; break;
+
+	  /* Decrypt the cipher files under directories */
+	case 'r': flags.recursive = true; break;
+
+	  /* List or extract from archives */
+	case 'l': flags.list = true; break;
+
+	case 'x': flags.member = optarg; break;
+
+	case 'e': flags.engine_name = optarg; break;
+
+	case 'm':
+	  if (!mode_find(optarg, &flags.mode)) {
+		exit_error(PROGRAM_NAME ": Error: Unknown cipher mode '%s'.\n", optarg);
+	  }
+	  flags.mode_given = true;
+	  break;
+
+	case 'j': flags.jobs = atoi(optarg);
+	  if (flags.jobs < 1) {
+		exit_error(PROGRAM_NAME ": Error: Invalid number of jobs.\n");
+	  }
+	  break;
+
+	case 'O': flags.offset = atol(optarg);
+	  if (flags.offset < 0) {
+		exit_error(PROGRAM_NAME ": Error: Invalid offset.\n");
+	  }
+	  flags.range = true;
+	  break;
+
+	case 'L': flags.length = atol(optarg);
+	  if (flags.length < 0) {
+		exit_error(PROGRAM_NAME ": Error: Invalid length.\n");
+	  }
+	  flags.range = true;
+	  break;
+
+	case 'I':
+	  if (!io_find(optarg, &flags.io)) {
+		exit_error(PROGRAM_NAME ": Error: Unknown I/O method '%s'.\n", optarg);
+	  }
+	  break;
+
+	case 'P': flags.in_place = true; break;
+
+	case 'R': flags.resume = true; break;
 		
 	default:
 	  exit_error(PROGRAM_NAME ": Error: Invalid option indicated.\n");
@@ -304,6 +1931,31 @@ main(int argc, char *argv[])
 	}
   }
 
+  if (flags.in_place && (flags.out_file != NULL || flags.out_directory != NULL
+						 || flags.use_stdout || flags.recursive || flags.range
+						 || flags.list || flags.member != NULL
+						 || optind + 1 >= argc)) {
+	exit_error(PROGRAM_NAME ": Error: --in_place needs the cipher files to" \
+			   " be named, and doesn't take -o, -d, -t, -r, -l, -x," \
+			   " --offset or --length.\n");
+  }
+  if (flags.resume && (flags.in_place || flags.use_stdout || flags.range
+					   || flags.list || flags.member != NULL
+					   || optind + 1 >= argc
+					   || (flags.out_file != NULL
+						   && strcmp(flags.out_file, "-") == 0))) {
+	exit_error(PROGRAM_NAME ": Error: --resume needs the cipher files to be" \
+			   " named, and doesn't take -t, -o -, -l, -x, --offset," \
+			   " --length or --in_place.\n");
+  }
+
+  /* Keep status messages out of the plaintext */
+  if (flags.out_file != NULL && strcmp(flags.out_file, "-") == 0) {
+	flags.use_stdout = true;
+	flags.out_file = NULL;
+  }
+  messages = flags.use_stdout ? stderr : stdout;
+
   /* Load decryption key from provided file. 
 	 (First argument must be the key file)
   */
@@ -317,6 +1969,36 @@ main(int argc, char *argv[])
 	}
   }
 
+  /* Standard input is decrypted to standard output, unless -o says not to */
+  if (flags.out_file == NULL) {
+	if (optind + 1 == argc)
+	  messages = stderr;
+	for (i = optind + 1; i < argc; i++) {
+	  if (strcmp(argv[i], "-") == 0)
+		messages = stderr;
+	}
+  }
+
+  /* Build the cipher lookup tables and pick the cipher engine */
+  ttable_init();
+
+  engine = engine_find(flags.engine_name);
+  if (engine == NULL) {
+	exit_error(PROGRAM_NAME ": Error: Unknown cipher engine '%s'.\n",
+			   flags.engine_name);
+  }
+  if (!engine_supported(engine)) {
+	exit_error(PROGRAM_NAME ": Error: Cipher engine '%s' is not supported" \
+			   " on this machine.\n", engine->name);
+  }
+  VERBOSE("Using the '%s' cipher engine.\n", engine->name);
+
+  pool = pool_create(flags.jobs);
+  if (pool == NULL) {
+	exit_error(PROGRAM_NAME ": Error: Could not start worker threads.\n");
+  }
+  VERBOSE("Using %d thread(s).\n", pool_size(pool));
+
   VERBOSE("Reading symmetric key from file '%s'\n", argv[optind]);
   keyfd = fopen(argv[optind], "r"); // Open File
   
@@ -328,41 +2010,18 @@ main(int argc, char *argv[])
   fclose(keyfd); // Close key file
   optind++;
 
-  /* Decrypt Cipher Files */
-  for (; optind < argc; optind++) {
-	infd = fopen(argv[optind], "rb"); /* Open file for reading */
-
-	if (infd == NULL) {
-	  fprintf(stderr, PROGRAM_NAME ": Error: Failed to open file '%s'.\n",
-			  argv[optind]);
-	}
-	else {
-	  if (flags.use_stdout) {
-		outfd = stdout;
-	  }
-	  else {
-		out_name = create_out_file_name(argv[optind]);
-		outfd = fopen(out_name, "wb");
-	  }
-
-	  if (outfd == NULL) {
-		fprintf(stderr, PROGRAM_NAME ": Error: Failed to create file '%s'.\n",
-				out_name);
-		fclose(infd);
-	  }
-	  else {
-		VERBOSE("Decrypting file '%s'...\n", argv[optind]);
-		if (decrypt_file(infd, outfd, &ekey)) {
-		  printf(PROGRAM_NAME ": Plaintext file '%s' created from file '%s'.\n",
-				 out_name, argv[optind]);
-		}
-		fclose(infd);
-		if (!flags.use_stdout) fclose(outfd);
-	  }
-	  if (!flags.use_stdout) free(out_name);
-	}
+  /* Decrypt Cipher Files. With none given, decrypt standard input. */
+  if (flags.out_file != NULL && (argc - optind > 1 || flags.recursive)) {
+	exit_error(PROGRAM_NAME ": Error: -o only works with one cipher file.\n");
+  }
+  if (optind == argc) {
+	status = decrypt_named("-", -1);
+  }
+  else {
+	status = decrypt_all(argv + optind, argc - optind);
   }
 
-  printf(PROGRAM_NAME ": Decryption complete.\n");
-  exit(EXIT_SUCCESS);
+  fprintf(messages, PROGRAM_NAME ": Decryption complete.\n");
+  pool_destroy(pool);
+  exit(status);
 }
@@ -28,11 +28,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
-#include <time.h>
 #include <stdbool.h>
 #include <getopt.h>
 #include <stdint.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "aes.h"
 
@@ -40,8 +43,13 @@
 
 #define DEFAULT_OUT_FILE "cipher"
 
+#define DEFAULT_ARCHIVE_FILE "archive"
+
 #define OUTPUT_EXTENSION ".aes"
 
+/* Largest file that is encrypted in a group with other small files */
+#define SMALL_FILE_SIZE (16 * 1024)
+
 //#define DEFAULT_OUTPUT "cipher.aes"
 
 /*
@@ -62,9 +70,19 @@ struct Options {
   //bool force; /* -f flag: chmod files if necessary */
   //bool burn_file; /* -b flag: shred file after encrypting */
   bool verbose; /* -v flag: print progress */
+  bool recursive; /* -r flag: encrypt the files under directories */
   char * out_directory;
+  char * out_file; /* -o flag: name of the cipher file, "-" for stdout */
   char * key_file_name;
   key_size_t key_size;
+  char * engine_name; /* --engine: cipher engine to use */
+  aes_mode_t mode; /* --mode: cipher mode, ECB by default */
+  int jobs; /* -j flag: number of threads, 0 for one per processor */
+  size_t unit_size; /* -u flag: XTS data unit size, or chunk size */
+  aes_io_t io; /* --io: how to read and write files */
+  bool in_place; /* --in_place: encrypt files where they lie */
+  bool resume; /* --resume: carry on from checkpoints */
+  bool sparse; /* --sparse: leave the holes of sparse files out */
 };
 
 /* Program options */
@@ -72,20 +90,33 @@ const struct option long_opts[] = {
   //{"force", no_argument, NULL, 'f'},
   //{"burn-after-read", no_argument, NULL, 'b'},
   {"verbose", no_argument, NULL, 'v'},
+  {"recursive", no_argument, NULL, 'r'},
   {"out_dir", required_argument, NULL, 'd'},
+  {"output", required_argument, NULL, 'o'},
   {"key_file_name", required_argument, NULL, 'k'},
   {"key_size", required_argument, NULL, 's'},
+  {"engine", required_argument, NULL, 'e'},
+  {"mode", required_argument, NULL, 'm'},
+  {"jobs", required_argument, NULL, 'j'},
+  {"unit_size", required_argument, NULL, 'u'},
+  {"io", required_argument, NULL, 'I'},
+  {"in_place", no_argument, NULL, 'P'},
+  {"resume", no_argument, NULL, 'R'},
+  {"sparse", no_argument, NULL, 'S'},
   {0, 0, 0, 0}
 };
-const char opts_str[] = "vd:k:s:";
+const char opts_str[] = "vrd:o:k:s:e:m:j:u:";
 
 
 /* 
   --GLOBAL VARIABLES--
   
-  There are just 2 global variables in both the encrypt and decrypt programs.
-  'flags' is the global flags structure that contains the options that the user
-  selected.
+  There are just a few global variables in both the encrypt and decrypt
+  programs. 'flags' is the global flags structure that contains the options
+  that the user selected, 'engine' is the cipher engine picked from those
+  options, and 'pool' holds the worker threads that the parallel modes and
+  batches of files run on.
+  XTS mode needs a second key, which is kept next to the first.
   
   I tried to keep the key struct non-global, but I ran into issues with running 
   the key expansion algorithm when it was heap-allocated. My best guess is that
@@ -96,6 +127,22 @@ static struct Options flags; /* User Selected Options */
 
 static aes_key_t encrypt_key; /* Contains the encryption key */
 
+static aes_key_t tweak_key; /* XTS tweak key */
+
+static const aes_engine_t *engine; /* Cipher engine used to encrypt */
+
+static pool_t *pool; /* Worker threads */
+
+/* Where status and error messages go. Each thread has its own, because the
+   files of a batch keep theirs until it is their turn to be printed. */
+static __thread FILE *messages;
+static __thread FILE *errors;
+
+static bool batch; /* Several files are being encrypted at once */
+
+/* Checkpoints of the file being encrypted, for --resume, or NULL */
+static __thread checkpoint_t *checkpoint;
+
 /*
   --FUNCTIONS--
  */
@@ -113,8 +160,6 @@ static aes_key_t encrypt_key; /* Contains the encryption key */
  *                   the default key size (256 bits).
  */
 void key_init(aes_key_t *key, int key_size) {
-  int i;
-
   /* 
    We default to using a 256-bit key. Otherwise we use whatever strength 
    the user specified
@@ -132,21 +177,16 @@ void key_init(aes_key_t *key, int key_size) {
    When creating aes-decrypt, I wanted to be able to control the key used, so I 
    wrote in this little segment
   */
-  for (i=0; i < key->size; i++) {
-	key->block[i] = 'a';
-  }
+  memset(key->block, 'a', key->size);
 #else
-  
-  uint8_t rand_byte;
-  
   /* 
-   Here, we generate the encryption key using random numbers using the current
-   UNIX time as the generating seed.
+   Here, we generate the encryption key from the kernel's random number
+   generator. There is nothing safe to fall back to if that isn't available,
+   so we give up rather than make a key that could be guessed.
    */
-  srand(time(NULL));
-  for (i = 0; i < key->size; i++) {
-	rand_byte = rand() & 0xFF; 
-	key->block[i] = rand_byte;
+  if (!random_bytes(key->block, key->size)) {
+	exit_error(PROGRAM_NAME ": Error: Could not generate a key: no random" \
+			   " bytes from the kernel.\n");
   }
   
 #endif
@@ -159,256 +199,413 @@ void key_init(aes_key_t *key, int key_size) {
  * This function saves the key to a plain-text file using base-64 encoding.
  * We will need this file when we later use this key to decrypt the file.
  *
+ * For XTS mode, the tweak key is stored right after the data key, so the key
+ * file holds twice as many bytes.
+ *
  * @param key - Pointer to the encryption key
+ * @param key2 - Pointer to the XTS tweak key, or NULL.
  * @param keyfd - File descriptor of a file that has been opened for writing. 
  */
-void save_key(aes_key_t *key, FILE *keyfd) {
-  size_t enc_len;
+void save_key(aes_key_t *key, aes_key_t *key2, FILE *keyfd) {
+  uint8_t block[64];
+  size_t len, enc_len;
   char *b64_str;
 
-  b64_str = base64_encode(key->block, (size_t)key->size, &enc_len);
+  memcpy(block, key->block, key->size);
+  len = key->size;
+  if (key2 != NULL) {
+	memcpy(block + len, key2->block, key2->size);
+	len += key2->size;
+  }
+
+  b64_str = base64_encode(block, len, &enc_len);
   if (fputs(b64_str, keyfd) == EOF) {
 	exit_error(PROGRAM_NAME ": Failed to write key to file.\n");
   }
+  free(b64_str);
 }
 
 /**
- * Performs the Sub Bytes function of the AES cipher, in which we replace each 
- * byte of the state with its corresponding S-Box value. For AES, the S-Box is 
- * a simple bijection, the pseudo-code for which is such:
+ * Reads back a key saved by save_key(), for --in_place to finish a run that
+ * stopped part way with the key it started with.
  *
- * b[i] => The i'th bit of byte b
+ * @param key2 - Pointer to the XTS tweak key, or NULL.
+ * @return false if the file doesn't hold a key of the right kind.
+ */
+static bool load_key(aes_key_t *key, aes_key_t *key2, FILE *keyfd) {
+  char b64_str[128];
+  uint8_t *data;
+  size_t len;
+  bool ok;
+
+  if (fgets(b64_str, sizeof(b64_str), keyfd) == NULL)
+	return false;
+  data = base64_decode(b64_str, strlen(b64_str), &len);
+  if (data == NULL)
+	return false;
+
+  if (key2 != NULL && len % 2 == 0)
+	len /= 2;
+  ok = len == key_16_bytes || len == key_24_bytes || len == key_32_bytes;
+  if (ok) {
+	key->size = len;
+	memcpy(key->block, data, len);
+	key_expansion(key);
+	if (key2 != NULL) {
+	  key2->size = len;
+	  memcpy(key2->block, data + len, len);
+	  key_expansion(key2);
+	}
+  }
+  free(data);
+  return ok;
+}
+
+/**
+ * Saves a new key for --in_place, where losing it would lose the only copy of
+ * the files it encrypts. The key file must not exist yet, so that the key of
+ * an earlier run is never replaced, and the file and its directory are synced
+ * before the first file is overwritten.
  *
- * byte f(byte b):
- *   unsigned char c = 0x63;
- *   if (b != 0):
- *     b = multiplicativeInverse(b);
- *   for (i = 0; i < 8; i++):
- *     b[i] = b[i] XOR b[(i+4) MOD 8] XOR b[(i+5) MOD 8] XOR
- *            b[(i+6) MOD 8] XOR b[(i+7) MOD 8] XOR c[i];
- *    return b;
+ * @param key2 - Pointer to the XTS tweak key, or NULL.
+ * @return false if the file couldn't be created or synced.
+ */
+static bool save_key_synced(aes_key_t *key, aes_key_t *key2,
+							const char *name) {
+  char dir[PATH_MAX];
+  FILE *keyfd;
+  int fd, dir_fd;
+  bool ok;
+
+  fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+	return false;
+  keyfd = fdopen(fd, "w");
+  if (keyfd == NULL) {
+	close(fd);
+	return false;
+  }
+  save_key(key, key2, keyfd);
+  ok = fflush(keyfd) == 0 && fsync(fd) == 0;
+  ok = fclose(keyfd) == 0 && ok;
+
+  /* The file's name has to reach the disk too */
+  strncpy(dir, name, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = '\0';
+  dir_fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0)
+	return false;
+  ok = fsync(dir_fd) == 0 && ok;
+  close(dir_fd);
+  return ok;
+}
+
+/**
+ * Prints how much of the current file has been encrypted, for -v.
  *
- * To increase computation speed, however, we simply put every S-Box value in
- * a table and simply perform a lookup. This table can be found in "bytesub.c".
+ * @param total - Size of the file, or -1 if it isn't known.
  */
-void sub_bytes(uint8_t **state) {
-  int i;
-  for (i = 0; i < 4; i++)
-	bytesub_encrypt(state[i], 4);
+static void show_progress(long int done, long int total) {
+  if (!flags.verbose || batch)
+	return;
+  if (total < 0)
+	fprintf(messages, "Encrypted %ld bytes.\r", done);
+  else
+	fprintf(messages, "Encrypted %ld of %ld bytes.\r", done, total);
+  fflush(messages);
 }
 
+/**
+ * Saves a checkpoint between buffers, for --resume, if one is due.
+ */
+static bool save_checkpoint(aes_output_t *out) {
+  if (checkpoint == NULL || checkpoint_update(checkpoint, out))
+	return true;
+  fprintf(errors, PROGRAM_NAME ": Error: Could not save a checkpoint.\n");
+  return false;
+}
 
 /**
- * Shift Rows function of AES cipher.
- * This function simply performs a byte-wise rotation of the rows in the
- * state matrix. Each row is rotated a certian number of times.
+ * Encrypts a file in ECB mode. This function takes the plaintext file
+ * AES_BUFFER_SIZE bytes at a time, and hands each buffer to the cipher engine
+ * to encrypt into the output. The bytes of a block fill the state matrix
+ * vertically, so for bytes b0, b1, b2,..., b15, the state matrix looks like
+ * this:
  *
- * Row 0 is not affected.
- * Row 1 is rotated 1 time.
- * Row 2 is rotated 2 times.
- * Row 3 is rotated 3 times. 
+ * [b0, b4, b8 , b12]
+ * [b1, b5, b9 , b13]
+ * [b2, b6, b10, b14]
+ * [b3, b7, b11, b15]
+ * 
+ * Every engine works on the columns of the state directly, so the buffer can
+ * be handed over as-is, without copying each block into a state matrix first.
  *
- * For encryption, we rotate right. When we decrypt, we rotate to the left.
+ * The last block is padded with 0's, and nothing else is written to the cipher
+ * file. This is the original file format.
  */
-void shift_rows(uint8_t **state) {
-  uint8_t temp;
-  int r, i, c;
+static bool encrypt_ecb(aes_input_t *in, aes_output_t *out, aes_key_t *key) {
+  uint8_t block[AES_BLOCK_SIZE];
+  const uint8_t *src;
+  uint8_t *dst;
+  size_t bytes_read, full, len;
+
+  if (in->size >= 0)
+	VERBOSE("Size of file: %ld bytes (%ld blocks)\n", in->size,
+			(in->size + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE);
+
+  /* Encrypt the blocks one buffer at a time */
   
-  for (r = 1; r < 4; r++) {
-	for (i = 0; i < r; i++) {
-	  for (c = 1; c < 4; c++) {
-		temp = state[r][c-1];
-		state[r][c-1] = state[r][c];
-		state[r][c] = temp;
-	  }
+  while ((src = input_read(in, AES_BUFFER_SIZE, &bytes_read)) != NULL
+		 && bytes_read > 0) {
+	full = bytes_read / AES_BLOCK_SIZE;
+	len = (bytes_read + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+
+	dst = output_reserve(out, len);
+	if (dst == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  return false;
 	}
+
+	/* Run cipher on the buffer */
+	engine->encrypt(key, src, dst, full);
+
+	/* If we did not read a full block, pad with 0's */
+	if (len > bytes_read) {
+	  memset(block, 0, sizeof(block));
+	  memcpy(block, src + AES_BLOCK_SIZE * full, bytes_read % AES_BLOCK_SIZE);
+	  engine->encrypt(key, block, dst + AES_BLOCK_SIZE * full, 1);
+	}
+
+	if (!output_commit(out, len)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  return false;
+	}
+	show_progress(in->pos, in->size);
   }
-}
+  VERBOSE("\n");
 
+  if (src == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	return false;
+  }
+  return true;
+}
 
 /**
- * Mix Columns function of AES algorithm
- *
- * Programmically, this function is fairly simple, however the math behind it
- * is rather complex. 
- *
- * At its core, we perform a matrix multiplication of the state matrix with the
- * following byte matrix:
- * [0x02 0x03 0x01 0x01]
- * [0x01 0x02 0x03 0x01]
- * [0x01 0x01 0x02 0x03]
- * [0x03 0x01 0x01 0x02]
- *
- * This multiplication is performed over a Finite Field, specifically a Galois
- * Field of order 256. A description of this Galois Field can be found in "The
- * Laws of Cryptology", page 119. Again, however, when implementing this 
- * multiplication we can use lookup tables to make the calculations much faster.
- * The actual implementation of this finite field multiplication can be found 
- * in "gf.c".
+ * Starts the cipher file: has the context make up its header, with a fresh
+ * nonce, and writes it out. A file that --resume is carrying on with already
+ * has one, and the context picks up from it where the checkpoint says.
  */
-void mix_columns(uint8_t **state) {
-  int c;
-  uint8_t temp[4];
-  for (c = 0; c < 4; c++) {
-	temp[0] = ff_multiply(0x02, state[0][c])
-	  ^ ff_multiply(0x03, state[1][c])
-	  ^ state[2][c]
-	  ^ state[3][c];
-	temp[1] = state[0][c]
-	  ^ ff_multiply(0x02, state[1][c])
-	  ^ ff_multiply(0x03, state[2][c])
-	  ^ state[3][c];
-	temp[2] = state[0][c]
-	  ^ state[1][c]
-	  ^ ff_multiply(0x02, state[2][c])
-	  ^ ff_multiply(0x03, state[3][c]);
-	temp[3] = ff_multiply(0x03, state[0][c])
-	  ^ state[1][c]
-	  ^ state[2][c]
-	  ^ ff_multiply(0x02, state[3][c]);
+static bool start_cipher(aes_ctx_t *ctx, aes_input_t *in, aes_output_t *out) {
+  size_t len;
+  uint8_t *dst;
+
+  if (checkpoint != NULL && checkpoint->resumed) {
+	if (ctx_start(ctx, &checkpoint->header, in->pos))
+	  return true;
+	fprintf(errors, PROGRAM_NAME ": Error: %s.\n", aes_ctx_error(ctx));
+	return false;
+  }
 
-	state[0][c] = temp[0];
-	state[1][c] = temp[1];
-	state[2][c] = temp[2];
-	state[3][c] = temp[3];
+  dst = output_reserve(out, AES_HEADER_SIZE);
+  if (dst == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	return false;
+  }
+  if (!aes_ctx_update(ctx, NULL, dst, 0, &len)) {
+	fprintf(errors, PROGRAM_NAME ": Error: %s.\n", aes_ctx_error(ctx));
+	return false;
   }
+  if (!output_commit(out, len)) {
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	return false;
+  }
+  if (checkpoint != NULL)
+	checkpoint->header = *ctx_header(ctx);
+  return true;
 }
 
 /**
- * Add Round Key function of the AES cipher.
- * 
- * Here is where we acutally apply the key in the cipher algorithm. During
- * each round of encryption, we XOR each byte of the 16-byte block against
- * the next 16 bytes of the expanded key. Once we've used that set of bytes,
- * we XOR the current state against the next 16 bytes, and never touch those
- * bytes again for this state. 
- * 
+ * Encrypts a file in any of the modes with a header, by running it through a
+ * library context (see libaes.c), which does the mode's work: the nonce or
+ * IV, the counter, CBC padding, the XTS data units and ciphertext stealing at
+ * the end, or the chunks and their tags. The cipher file is laid out just as
+ * the library lays out a message (see mode.c).
+ *
+ * We hand the context as much of the file at a time as there are threads in
+ * the pool to take it, and it splits the work between them in the modes that
+ * can be split; CBC encryption runs on one thread. Every piece is a whole
+ * number of steps, and the context writes its output straight into the
+ * output mapping, so nothing is copied but the few bytes it holds back.
  */
-void add_round_key(uint8_t **state, int round, uint8_t *exp_key) {
-  int r, c;
-  uint8_t keyind = 16 * round;
+static bool encrypt_stream(aes_input_t *in, aes_output_t *out,
+						   aes_ctx_t *ctx) {
+  size_t piece_size, bytes_read, len;
+  const uint8_t *src;
+  uint8_t *dst;
+
+  if (!start_cipher(ctx, in, out))
+	return false;
+
+  piece_size = ctx_piece_size(ctx, (size_t)pool_size(pool) * AES_CHUNK_SIZE);
+
+  if (in->size >= 0)
+	VERBOSE("Size of file: %ld bytes\n", in->size);
 
-  for (c = 0; c < 4; c++) {
-	for (r = 0; r < 4; r++) {
-	  state[r][c] ^= exp_key[keyind++];
+  while ((src = input_read(in, piece_size, &bytes_read)) != NULL
+		 && bytes_read > 0) {
+	dst = output_reserve(out, ctx_update_size(ctx, bytes_read));
+	if (dst == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  return false;
+	}
+	if (!aes_ctx_update(ctx, src, dst, bytes_read, &len)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: %s.\n", aes_ctx_error(ctx));
+	  return false;
 	}
+	if (!output_commit(out, len)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	  return false;
+	}
+
+	show_progress(in->pos, in->size);
+	if (!save_checkpoint(out))
+	  return false;
   }
+  VERBOSE("\n");
+
+  if (src == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	return false;
+  }
+
+  /* The end of the file, the padding, and the tag */
+  dst = output_reserve(out, ctx_final_size(ctx));
+  if (dst == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	return false;
+  }
+  if (!aes_ctx_final(ctx, dst, &len)) {
+	fprintf(errors, PROGRAM_NAME ": Error: %s.\n", aes_ctx_error(ctx));
+	return false;
+  }
+  if (!output_commit(out, len)) {
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	return false;
+  }
+  return true;
 }
 
 /**
- * This function is the overall application of the AES cipher in the context of
- * a single state block matrix.
+ * Works out how long the cipher file will be, so the output can be sized up
+ * front.
  *
- * For each state, we perform the four AES functions several times, in what are
- * referred to as "rounds". The number of rounds we do depends on the size of 
- * the encryption key. 
+ * @param size - Size of the plaintext, or -1 if it isn't known.
+ * @return The size of the cipher file, or -1 if it isn't known.
  */
-void aes_cipher(uint8_t **state, aes_key_t *key) {
-  int round, num_rounds;
-
-  num_rounds = (key->size / 4) + 6;
-  
-  add_round_key(state, 0, key->exp_block);
-
-  for (round = 1; round < num_rounds; round++) {
-	sub_bytes(state);
-	shift_rows(state);
-	mix_columns(state);
-	add_round_key(state, round, key->exp_block);
+static long int cipher_size(long int size) {
+  if (size < 0)
+	return -1;
+
+  switch (flags.mode) {
+  case mode_ctr:
+  case mode_xts:
+	return AES_HEADER_SIZE + size;
+  case mode_gcm:
+	return AES_HEADER_SIZE + size + GCM_TAG_SIZE;
+  case mode_cbc:
+	return AES_HEADER_SIZE + (size / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+  case mode_chunked:
+	return chunked_cipher_size(size, flags.unit_size);
+  default:
+	return (size + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
   }
-
-  /* Don't mix columns on the last round */
-  sub_bytes(state);
-  shift_rows(state);
-  add_round_key(state, num_rounds, key->exp_block);
 }
 
 /**
- * This function reads the plaintext file in blocks of 16-bytes, and loads the
- * bytes into the state block. This state block is a 4x4 matrix, however, while
- * the array is row-major order, the bytes are arranged vertically. So for bytes
- * b0, b1, b2,..., b15, the state matrix will look like this:
+ * Encrypts a file in the mode the user selected. Every mode but ECB, whose
+ * files are in the original format, is run through a library context (see
+ * encrypt_stream()).
  *
- * [b0, b4, b8 , b12]
- * [b1, b5, b9 , b13]
- * [b2, b6, b10, b14]
- * [b3, b7, b11, b15]
- * 
- * As such, we read/write the bytes from/to the files sequentially into a 
- * separate buffer, and fill in the state block from there. The cipher then
- * assumes that the state is arranged as above. 
+ * Regular files are mapped into memory, and the cipher reads the plaintext
+ * straight from the input mapping and writes straight into the output one
+ * (see fileio.c). Pipes and the like are read and written through buffers.
+ *
+ * With --resume, checkpoints are saved as it goes, and a file whose
+ * checkpoint was loaded is picked up part way (see checkpoint.c). The rest of
+ * the cipher file is then written through a buffer, as it isn't a new file.
  *
  * @param fdin - File descriptor for the plaintext file. Should be a binary file
  *               that has already been opened for reading.
  * @param fdout - File descriptor for the cipher file, which should be a new 
- *                binary file opened for writing.
+ *                binary file opened for writing (and reading, to be mapped).
  * @param key - Pointer to the encryption key.
  */
 bool encrypt_file(FILE *fdin, FILE *fdout, aes_key_t *key) {
-  int i, b, num_blocks;
-  size_t bytes_read;
-  long int file_size;
-  uint8_t buffer[18]; /* A little bit of extra, just in case */
-  uint8_t **state;
-  
-  /* Initialize state block on the heap */
-  state = (uint8_t**)malloc(4 * sizeof(uint8_t*)); 
-  for (i = 0; i < 4; i++)
-	state[i] = (uint8_t*)malloc(4); /* Allocate each row */
-
-  /* Determine the size of the file. */
-  fseek(fdin, 0L, SEEK_END);
-  file_size = ftell(fdin);
-  rewind(fdin);
-
-  /* Determine the number of blocks to encrypt */
-  num_blocks = file_size / AES_BLOCK_SIZE;
-  if (file_size % AES_BLOCK_SIZE) num_blocks++;
-
-  VERBOSE("Size of file: %ld bytes (%d blocks)\n", file_size, num_blocks);
-
-  /* Encrypt each block */
-  
-  for (b = 0; b < num_blocks; b++) {
-	if (flags.verbose) {
-	  printf("Encrypting block %d of %d.\r", b+1, num_blocks);
-	  fflush(stdin);
+  aes_input_t in;
+  aes_output_t out;
+  aes_ctx_t *ctx;
+  size_t buffer_size;
+  bool ok;
+
+  /* Room for a buffer per thread */
+  buffer_size = (size_t)pool_size(pool) * AES_CHUNK_SIZE;
+  if (!input_open(&in, fdin, buffer_size, flags.io)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return false;
+  }
+  /* A resumed run picks up where the last checkpoint says */
+  if (checkpoint != NULL) {
+	if (in.size < 0) {
+	  fprintf(errors, PROGRAM_NAME ": Error: --resume needs a regular" \
+			  " file.\n");
+	  input_close(&in);
+	  return false;
 	}
-
-	/* Read in next 16 bytes. */
-	bytes_read = fread(buffer, sizeof(uint8_t), 16, fdin);
-	if (ferror(fdin) != 0) {
-	  fprintf(stderr, PROGRAM_NAME ": Error: File read error.\n");
+	if (checkpoint->resumed
+		&& (!input_seek(&in, checkpoint->in_pos)
+			|| fseek(fdout, checkpoint->out_pos, SEEK_SET) != 0)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	  input_close(&in);
 	  return false;
 	}
+	if (checkpoint->resumed)
+	  VERBOSE("Resuming from byte %ld.\n", in.pos);
+	checkpoint->in_size = in.size;
+  }
 
-	/* If we did not read a full block, pad with 0's */
-	while (bytes_read < 16)
-	  buffer[bytes_read++] = 0;
-	
-	/* Fill state block */
-	for (i = 0; i < AES_BLOCK_SIZE; i++)
-	  state[i%4][i/4] = buffer[i];
-	
-	aes_cipher(state, key); /* Run cipher on the current state matrix*/
-
-	/* Get the newly encrypted byte sequence */
-	for (i = 0; i < AES_BLOCK_SIZE; i++)
-	  buffer[i] = state[i%4][i/4];
-	
-	/* Write result to the output file */
-	if (fwrite(buffer, sizeof(uint8_t), 16, fdout) != 16) {
-	  fprintf(stderr, PROGRAM_NAME ": Error: File write error.\n");
-	  return false;
+  if (!output_open(&out, fdout, cipher_size(in.size), buffer_size,
+				   flags.io)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	input_close(&in);
+	return false;
+  }
+  VERBOSE("Reading: %s. Writing: %s.\n", input_kind(&in), output_kind(&out));
+
+  if (flags.mode == mode_ecb) {
+	ok = encrypt_ecb(&in, &out, key);
+  }
+  else {
+	ctx = ctx_new(engine, pool, flags.mode, false, key,
+				  flags.mode == mode_xts ? &tweak_key : NULL);
+	if (ctx == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	  ok = false;
+	}
+	else {
+	  if (flags.mode == mode_xts || flags.mode == mode_chunked)
+		aes_ctx_set_unit_size(ctx, flags.unit_size);
+	  ok = encrypt_stream(&in, &out, ctx);
+	  aes_ctx_free(ctx);
 	}
   }
-  VERBOSE("\n");
 
-  for (i = 0; i < 4; i++)
-	free(state[i]);
-  free(state);
-  
-  return true;
+  input_close(&in);
+  if (!output_close(&out) && ok) {
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	ok = false;
+  }
+  return ok;
 }
 
 /**
@@ -417,15 +614,20 @@ bool encrypt_file(FILE *fdin, FILE *fdout, aes_key_t *key) {
  * file path that indicates either the current directory or
  * the directory selected with -d option, and appends the
  * .aes extension. 
+ *
+ * A file found by walking a directory with -r keeps its place in the tree:
+ * 'skip' is how much of its path is left off (the part above the directory
+ * named on the command line), and the rest goes under the output directory.
+ * For any other file, 'skip' is -1 and just the file name is kept.
  */
-char * create_out_file_name(char *in_path) {
+char * create_out_file_name(char *in_path, int skip) {
   char *in_path_cp;
   char *out_name, *out_dir, *out_path;
 
   out_path = (char*)malloc(FILENAME_MAX);
 
   in_path_cp = strdup(in_path);
-  out_name = basename(in_path_cp);
+  out_name = skip < 0 ? basename(in_path_cp) : in_path_cp + skip;
 
   if (flags.out_directory == NULL) {
 	out_dir = "./";
@@ -444,6 +646,1135 @@ char * create_out_file_name(char *in_path) {
   return out_path;
 }
 
+/**
+ * Makes the directory in the output tree that goes with a directory being
+ * walked with -r. (See create_out_file_name() for 'skip'.)
+ *
+ * @return false if it isn't there and couldn't be made.
+ */
+static bool create_out_dir(const char *in_path, int skip) {
+  char out_path[FILENAME_MAX];
+
+  snprintf(out_path, sizeof(out_path), "%s%s",
+		   flags.out_directory == NULL ? "./" : flags.out_directory,
+		   in_path + skip);
+  if (mkdir(out_path, 0777) != 0 && errno != EEXIST) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to create directory" \
+			" '%s'.\n", out_path);
+	return false;
+  }
+  return true;
+}
+
+/* A file being encrypted in place */
+struct in_place
+{
+  aes_header_t header;
+  xts_t xts;
+};
+
+/**
+ * Encrypts a window of a file being encrypted in place, or of the data of a
+ * sparse file. Windows start on a data unit, so each one is ciphered as it
+ * would be in a whole file.
+ */
+static void in_place_window(void *arg, uint64_t pos, uint8_t *buf,
+							size_t len) {
+  struct in_place *job = arg;
+
+  if (job->header.mode == mode_xts)
+	xts_crypt_parallel(pool, &job->xts, false, pos / job->xts.unit_size,
+					   buf, buf, len);
+  else
+	ctr_crypt_parallel(pool, engine, &encrypt_key, job->header.iv,
+					   pos / AES_BLOCK_SIZE, buf, buf, len);
+}
+
+/**
+ * Gets a file ready to be encrypted in place: picks up the journal of a run
+ * that stopped part way, or starts a new one.
+ *
+ * @return false if it can't be encrypted.
+ */
+static bool in_place_open(inplace_t *ip, struct in_place *job,
+						  const char *in_path, const char *journal_name) {
+  uint8_t check[16];
+  struct stat st;
+
+  inplace_key_check(engine, &encrypt_key,
+					flags.mode == mode_xts ? &tweak_key : NULL, check);
+
+  ip->journal_fd = open(journal_name, O_RDWR);
+  if (ip->journal_fd >= 0) {
+	if (!inplace_resume(ip) || ip->decrypt
+		|| !header_decode(ip->header, &job->header)) {
+	  if (ip->error != NULL)
+		fprintf(errors, PROGRAM_NAME ": Error: '%s': %s.\n", journal_name,
+				ip->error);
+	  else
+		fprintf(errors, PROGRAM_NAME ": Error: '%s' is not an encryption" \
+				" journal.\n", journal_name);
+	  return false;
+	}
+	if (job->header.mode != flags.mode) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Journal '%s' is for %s mode.\n",
+			  journal_name, mode_name(job->header.mode));
+	  return false;
+	}
+	if (memcmp(ip->key_check, check, sizeof(check)) != 0) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Journal '%s' was made with a" \
+			  " different key.\n", journal_name);
+	  return false;
+	}
+	VERBOSE("Resuming from byte %llu of '%s'.\n",
+			(unsigned long long)ip->pos, in_path);
+	job->xts.unit_size = job->header.param;
+	return true;
+  }
+
+  if (fstat(ip->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+	fprintf(errors, PROGRAM_NAME ": Error: '%s' is not a regular file.\n",
+			in_path);
+	return false;
+  }
+  if (flags.mode == mode_xts && st.st_size < AES_BLOCK_SIZE) {
+	fprintf(errors, PROGRAM_NAME ": Error: XTS mode needs at least %d" \
+			" bytes of input.\n", AES_BLOCK_SIZE);
+	return false;
+  }
+
+  /* XTS has no IV; the data unit numbers take its place */
+  if (flags.mode == mode_xts) {
+	memset(&job->header, 0, sizeof(job->header));
+	job->header.mode = mode_xts;
+	job->header.param = flags.unit_size;
+  }
+  else if (!header_init(&job->header, flags.mode)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Could not generate a nonce.\n");
+	return false;
+  }
+  job->xts.unit_size = job->header.param;
+
+  header_encode(&job->header, ip->header);
+  memcpy(ip->key_check, check, sizeof(check));
+  ip->plain_size = st.st_size;
+  ip->window_size = (uint64_t)pool_size(pool) * AES_CHUNK_SIZE;
+
+  ip->journal_fd = open(journal_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (ip->journal_fd < 0 || !inplace_start(ip)) {
+	if (ip->journal_fd >= 0)
+	  unlink(journal_name);
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to create journal" \
+			" '%s'.\n", journal_name);
+	return false;
+  }
+  return true;
+}
+
+/**
+ * Encrypts a file in place, for --in_place, so that the cipher file takes the
+ * room of the plaintext rather than as much again (see inplace.c). The file
+ * is renamed with OUTPUT_EXTENSION once it is done, and its journal removed.
+ * If a journal is already there, an earlier run stopped part way, and this
+ * one carries on from where it stopped.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int encrypt_in_place(const char *in_path) {
+  char journal_name[FILENAME_MAX], out_name[FILENAME_MAX];
+  struct in_place job;
+  inplace_t ip;
+  bool ok;
+
+  snprintf(journal_name, sizeof(journal_name), "%s" JOURNAL_EXTENSION,
+		   in_path);
+  snprintf(out_name, sizeof(out_name), "%s" OUTPUT_EXTENSION, in_path);
+
+  memset(&ip, 0, sizeof(ip));
+  ip.fd = open(in_path, O_RDWR);
+  if (ip.fd < 0) {
+	/* The last run stopped after renaming the file, but before removing the
+	   journal */
+	if (errno == ENOENT && access(out_name, F_OK) == 0
+		&& unlink(journal_name) == 0) {
+	  fprintf(messages, PROGRAM_NAME ": Cipher '%s' created from file" \
+			  " '%s'.\n", out_name, in_path);
+	  return EXIT_SUCCESS;
+	}
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to open file '%s'.\n",
+			in_path);
+	return EXIT_FAILURE;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.xts.engine = engine;
+  job.xts.data_key = &encrypt_key;
+  job.xts.tweak_key = &tweak_key;
+
+  VERBOSE("Encrypting file '%s' in place...\n", in_path);
+  ok = in_place_open(&ip, &job, in_path, journal_name);
+  if (ok && !inplace_run(&ip, in_place_window, &job, show_progress)) {
+	fprintf(errors, PROGRAM_NAME ": Error: %s.\n", ip.error);
+	ok = false;
+  }
+  VERBOSE("\n");
+
+  /* The journal is only removed once the file has its new name, so a run
+	 that stops in between still knows the file is encrypted */
+  if (ok && rename(in_path, out_name) != 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to rename '%s' to" \
+			" '%s'.\n", in_path, out_name);
+	ok = false;
+  }
+  if (ok) {
+	unlink(journal_name);
+	fprintf(messages, PROGRAM_NAME ": Cipher '%s' created from file" \
+			" '%s'.\n", out_name, in_path);
+  }
+
+  if (ip.journal_fd >= 0)
+	close(ip.journal_fd);
+  close(ip.fd);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Encrypts a file with --sparse: only the data between its holes is read and
+ * ciphered, and the cipher file gets the same holes, and a list of them at
+ * the end (see sparse.c). The windows are ciphered as they would be in place.
+ *
+ * @param fdin - The plaintext, which must be a regular file.
+ * @param fdout - The cipher file. A pipe gets zeros for the holes.
+ */
+static bool encrypt_sparse(FILE *fdin, FILE *fdout) {
+  struct in_place job;
+  sparse_t sp;
+  struct stat st;
+  uint64_t skipped;
+  size_t i;
+  bool ok;
+
+  if (fstat(fileno(fdin), &st) != 0 || !S_ISREG(st.st_mode)) {
+	fprintf(errors, PROGRAM_NAME ": Error: --sparse needs a regular" \
+			" file.\n");
+	return false;
+  }
+  if (flags.mode == mode_xts && st.st_size < AES_BLOCK_SIZE) {
+	fprintf(errors, PROGRAM_NAME ": Error: XTS mode needs at least %d" \
+			" bytes of input.\n", AES_BLOCK_SIZE);
+	return false;
+  }
+  if (fflush(fdout) != 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	return false;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.xts.engine = engine;
+  job.xts.data_key = &encrypt_key;
+  job.xts.tweak_key = &tweak_key;
+
+  /* XTS has no IV; the data unit numbers take its place */
+  if (flags.mode == mode_xts) {
+	job.header.mode = mode_xts;
+	job.header.param = flags.unit_size;
+  }
+  else if (!header_init(&job.header, flags.mode)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Could not generate a nonce.\n");
+	return false;
+  }
+  job.header.sparse = true;
+  job.xts.unit_size = job.header.param;
+
+  memset(&sp, 0, sizeof(sp));
+  sp.in_fd = fileno(fdin);
+  sp.out_fd = fileno(fdout);
+  header_encode(&job.header, sp.header);
+  sp.size = st.st_size;
+  sp.step = flags.mode == mode_xts ? flags.unit_size : AES_BLOCK_SIZE;
+  sp.tail = flags.mode == mode_xts ? AES_BLOCK_SIZE : 0;
+  sp.window_size = (uint64_t)pool_size(pool) * AES_CHUNK_SIZE;
+
+  ok = sparse_find(&sp);
+  if (ok) {
+	skipped = 0;
+	for (i = 0; i < sp.count; i++)
+	  skipped += sp.holes[i].length;
+	VERBOSE("Leaving out %zu holes, %llu bytes.\n", sp.count,
+			(unsigned long long)skipped);
+	ok = sparse_run(&sp, in_place_window, &job, show_progress);
+  }
+  if (!ok)
+	fprintf(errors, PROGRAM_NAME ": Error: %s.\n", sp.error);
+  VERBOSE("\n");
+
+  sparse_free(&sp);
+  return ok;
+}
+
+/**
+ * Checks whether any of the named files has a journal left by --in_place.
+ */
+static bool in_place_pending(char **names, int count) {
+  char journal_name[FILENAME_MAX];
+  int i;
+
+  for (i = 0; i < count; i++) {
+	snprintf(journal_name, sizeof(journal_name), "%s" JOURNAL_EXTENSION,
+			 names[i]);
+	if (access(journal_name, F_OK) == 0)
+	  return true;
+  }
+  return false;
+}
+
+/**
+ * Opens the checkpoint file of a cipher file, for --resume, and loads it if
+ * an earlier run left one behind to carry on from.
+ *
+ * @return false if it can't be opened, or was left by a run that this one
+ *         can't carry on.
+ */
+static bool open_checkpoint(checkpoint_t *cp, const char *cp_name,
+							FILE *infd) {
+  uint8_t check[16];
+  struct stat st;
+
+  memset(cp, 0, sizeof(*cp));
+  cp->fd = open(cp_name, O_RDWR | O_CREAT, 0600);
+  if (cp->fd < 0) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to create checkpoint" \
+			" '%s'.\n", cp_name);
+	return false;
+  }
+
+  inplace_key_check(engine, &encrypt_key,
+					flags.mode == mode_xts ? &tweak_key : NULL, check);
+  if (checkpoint_load(cp)) {
+	if (cp->decrypt || cp->header.mode != flags.mode
+		|| (flags.mode != mode_ctr && cp->header.param != flags.unit_size)
+		|| fstat(fileno(infd), &st) != 0
+		|| (uint64_t)st.st_size != cp->in_size) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Checkpoint '%s' is from a" \
+			  " different run.\n", cp_name);
+	  close(cp->fd);
+	  return false;
+	}
+	if (memcmp(cp->key_check, check, sizeof(check)) != 0) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Checkpoint '%s' was made with" \
+			  " a different key.\n", cp_name);
+	  close(cp->fd);
+	  return false;
+	}
+	cp->resumed = checkpoint_resume(cp);
+  }
+  if (!cp->resumed)
+	cp->done = 0;
+  memcpy(cp->key_check, check, sizeof(check));
+  return true;
+}
+
+/**
+ * Encrypts one file, by name. "-" is standard input, which is encrypted to
+ * 'cipher.aes' unless -o names a file. -o - writes the cipher to standard
+ * output.
+ *
+ * @param skip - See create_out_file_name().
+ * @return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int encrypt_named(char *in_path, int skip) {
+  char *out_name, cp_name[FILENAME_MAX];
+  FILE *infd, *outfd;
+  checkpoint_t cp;
+  bool from_stdin, to_stdout, ok;
+
+  if (flags.in_place)
+	return encrypt_in_place(in_path);
+
+  from_stdin = strcmp(in_path, "-") == 0;
+  to_stdout = flags.out_file != NULL && strcmp(flags.out_file, "-") == 0;
+
+  if (from_stdin) {
+	VERBOSE("Reading from Standard Input.\n");
+	in_path = "(standard input)";
+	infd = stdin;
+  }
+  else {
+	infd = fopen(in_path, "rb"); /* Open file for reading */
+	if (infd == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Failed to open file '%s'.\n",
+			  in_path);
+	  return EXIT_FAILURE;
+	}
+  }
+
+  if (to_stdout) {
+	out_name = strdup("(standard output)");
+	outfd = stdout;
+  }
+  else {
+	if (flags.out_file != NULL)
+	  out_name = strdup(flags.out_file);
+	else if (from_stdin)
+	  out_name = strdup(DEFAULT_OUT_FILE OUTPUT_EXTENSION);
+	else
+	  out_name = create_out_file_name(in_path, skip);
+
+	/* Carrying on from a checkpoint mustn't truncate what is already done */
+	if (flags.resume && !from_stdin) {
+	  snprintf(cp_name, sizeof(cp_name), "%s" CHECKPOINT_EXTENSION, out_name);
+	  if (!open_checkpoint(&cp, cp_name, infd)) {
+		fclose(infd);
+		free(out_name);
+		return EXIT_FAILURE;
+	  }
+	  checkpoint = &cp;
+	}
+	outfd = fopen(out_name, checkpoint != NULL && cp.resumed ? "r+b" : "w+b");
+  }
+
+  if (outfd == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to create file '%s'.\n",
+			out_name);
+	ok = false;
+  }
+  else {
+	VERBOSE("Encrypting file '%s'...\n", in_path);
+	if (flags.sparse)
+	  ok = encrypt_sparse(infd, outfd);
+	else
+	  ok = encrypt_file(infd, outfd, &encrypt_key);
+	if (ok) {
+	  fprintf(messages, PROGRAM_NAME ": Cipher '%s' created from file '%s'.\n",
+			  out_name, in_path);
+	}
+	if (!to_stdout)
+	  fclose(outfd);
+	else if (fflush(stdout) != 0)
+	  ok = false;
+  }
+
+  /* A run that fails keeps its checkpoint, to be carried on later */
+  if (checkpoint != NULL) {
+	close(cp.fd);
+	if (ok)
+	  unlink(cp_name);
+	checkpoint = NULL;
+  }
+
+  if (!from_stdin)
+	fclose(infd);
+  free(out_name);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Reads the whole of a small file into 'buf'.
+ *
+ * @return false if it couldn't be read, or is no longer 'size' bytes long.
+ */
+static bool read_small(int fd, uint8_t *buf, long int size) {
+  ssize_t got;
+  long int done;
+  uint8_t extra;
+
+  for (done = 0; done < size; done += got) {
+	got = read(fd, buf + done, size - done);
+	if (got < 0 && errno == EINTR)
+	  got = 0;
+	else if (got <= 0)
+	  return false;
+  }
+  return read(fd, &extra, 1) == 0;
+}
+
+/**
+ * Writes a whole cipher file in one go.
+ */
+static bool write_small(const char *path, const uint8_t *buf, size_t len) {
+  ssize_t put;
+  size_t done;
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+	return false;
+  for (done = 0; done < len; done += put) {
+	put = write(fd, buf + done, len - done);
+	if (put < 0 && errno == EINTR)
+	  put = 0;
+	else if (put <= 0)
+	  break;
+  }
+  return close(fd) == 0 && done == len;
+}
+
+/**
+ * Encrypts a group of up to AES_LANES small files together. Each file is read
+ * and written whole, with one call each and no mapping or buffers of its own,
+ * and the data of all of them is ciphered in one go by the multi-buffer
+ * functions. That keeps the engine busy when no single file has enough blocks
+ * to do so.
+ *
+ * A file that turns out not to be a small regular file after all goes through
+ * encrypt_named() in its turn, so the messages still come out in order.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed.
+ */
+static int encrypt_group(const aes_entry_t *entries, int count, int skip) {
+  aes_lane_t lanes[AES_LANES];
+  aes_header_t headers[AES_LANES];
+  uint8_t j0[AES_LANES][AES_BLOCK_SIZE];
+  long int sizes[AES_LANES];
+  size_t offsets[AES_LANES + 1]; /* Where each cipher file goes in 'buf' */
+  bool grouped[AES_LANES];
+  int fds[AES_LANES];
+  struct stat st;
+  size_t header_size;
+  uint8_t *buf, *data;
+  gcm_t gcm;
+  char *out_name;
+  int i, n, status;
+
+  header_size = flags.mode == mode_ecb ? 0 : AES_HEADER_SIZE;
+
+  /* Find out which files are still small enough, and how much room they
+	 need */
+  offsets[0] = 0;
+  for (i = 0; i < count; i++) {
+	fds[i] = open(entries[i].path, O_RDONLY);
+	grouped[i] = fds[i] >= 0 && fstat(fds[i], &st) == 0
+	  && S_ISREG(st.st_mode) && st.st_size <= SMALL_FILE_SIZE;
+	sizes[i] = grouped[i] ? st.st_size : 0;
+	if (!grouped[i] && fds[i] >= 0)
+	  close(fds[i]);
+
+	/* Round up to whole blocks, with room for CBC padding or the GCM tag */
+	offsets[i + 1] = offsets[i] + header_size
+	  + ((sizes[i] + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+  }
+
+  /* Zeroed, so ECB padding is already there */
+  buf = (uint8_t*)calloc(1, offsets[count]);
+
+  n = 0;
+  for (i = 0; i < count; i++) {
+	if (!grouped[i])
+	  continue;
+	data = buf + offsets[i] + header_size;
+	grouped[i] = buf != NULL && read_small(fds[i], data, sizes[i]);
+	close(fds[i]);
+
+	if (grouped[i] && header_size > 0) {
+	  grouped[i] = header_init(&headers[i], flags.mode);
+	  header_encode(&headers[i], buf + offsets[i]);
+	}
+	if (!grouped[i])
+	  continue;
+
+	lanes[n].iv = headers[i].iv;
+	lanes[n].in = data;
+	lanes[n].out = data;
+	lanes[n].len = flags.mode == mode_cbc ? cbc_pad(data, sizes[i])
+	  : (size_t)sizes[i];
+	n++;
+  }
+  if (n > 0) {
+	VERBOSE("Encrypting %d small files together.\n", n);
+
+	switch (flags.mode) {
+	case mode_ctr:
+	  ctr_crypt_multi(engine, &encrypt_key, lanes, n, 0);
+	  break;
+	case mode_gcm:
+	  /* The hash key is the same for every lane, so it is only set up once */
+	  for (i = 0; i < n; i++) {
+		if (i == 0)
+		  gcm_init(&gcm, engine, &encrypt_key, lanes[i].iv);
+		else
+		  gcm_restart(&gcm, lanes[i].iv);
+		memcpy(j0[i], gcm.j0, AES_BLOCK_SIZE);
+		lanes[i].iv = j0[i];
+	  }
+	  ctr_crypt_multi(engine, &encrypt_key, lanes, n, 1);
+
+	  /* Each lane is hashed on its own, with its header as the AAD */
+	  for (i = 0; i < n; i++) {
+		gcm_restart(&gcm, lanes[i].iv);
+		gcm_aad(&gcm, lanes[i].out - AES_HEADER_SIZE, AES_HEADER_SIZE);
+		gcm_hash(&gcm, lanes[i].out, lanes[i].len);
+		gcm_tag(&gcm, lanes[i].out + lanes[i].len);
+	  }
+	  break;
+	case mode_cbc:
+	  cbc_encrypt_multi(engine, &encrypt_key, lanes, n);
+	  break;
+	default:
+	  /* ECB blocks don't depend on anything, so the files are done as one */
+	  engine->encrypt(&encrypt_key, buf, buf, offsets[count] / AES_BLOCK_SIZE);
+	  break;
+	}
+  }
+
+  /* Write the cipher files out, in order */
+  status = EXIT_SUCCESS;
+  for (i = 0; i < count; i++) {
+	if (!grouped[i]) {
+	  if (encrypt_named(entries[i].path, skip) != EXIT_SUCCESS)
+		status = EXIT_FAILURE;
+	  continue;
+	}
+
+	out_name = create_out_file_name(entries[i].path, skip);
+	if (write_small(out_name, buf + offsets[i], cipher_size(sizes[i]))) {
+	  fprintf(messages, PROGRAM_NAME ": Cipher '%s' created from file '%s'.\n",
+			  out_name, entries[i].path);
+	}
+	else {
+	  fprintf(errors, PROGRAM_NAME ": Error: Failed to write file '%s'.\n",
+			  out_name);
+	  remove(out_name);
+	  status = EXIT_FAILURE;
+	}
+	free(out_name);
+  }
+
+  free(buf);
+  return status;
+}
+
+/* One file on its own, a run of small files encrypted as a group, or a
+   directory to walk with -r */
+struct unit
+{
+  int first, count;
+  bool small;
+  bool dir;
+  int skip; /* Part of the path left out of the output (see
+			   create_out_file_name()), or -1 */
+};
+
+/* The files of a batch, and the units they make up */
+struct units
+{
+  const aes_entry_t *entries;
+  const struct unit *list;
+};
+
+static int encrypt_tree(const char *path, int skip);
+
+/**
+ * Encrypts the files of one unit.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed.
+ */
+static int encrypt_unit(const aes_entry_t *entries, const struct unit *unit) {
+  if (unit->dir)
+	return encrypt_tree(entries[unit->first].path, unit->skip);
+  if (unit->count == 1)
+	return encrypt_named(entries[unit->first].path, unit->skip);
+  return encrypt_group(entries + unit->first, unit->count, unit->skip);
+}
+
+/**
+ * Batch function: encrypts the i-th unit of the files in 'arg', with its
+ * messages going to 'out' and 'err'.
+ */
+static bool encrypt_batch(void *arg, size_t i, FILE *out, FILE *err) {
+  const struct units *units = arg;
+  FILE *old_out = messages, *old_err = errors;
+  bool ok;
+
+  messages = out;
+  errors = err;
+  ok = encrypt_unit(units->entries, &units->list[i]) == EXIT_SUCCESS;
+  messages = old_out;
+  errors = old_err;
+  return ok;
+}
+
+/**
+ * Encrypts a list of files and directories. Runs of small files are put into
+ * groups of up to AES_LANES, which are encrypted together (see
+ * encrypt_group()). Given more than one unit and more than one thread, the
+ * units are run as a batch. Directories are started first, so the walk
+ * spreads over the threads as early as it can.
+ *
+ * @param skip - For the files of a directory being walked, the part of their
+ *               path left out of the output. -1 for the files named on the
+ *               command line.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed.
+ */
+static int encrypt_entries(const aes_entry_t *entries, int count, int skip) {
+  struct units units;
+  struct unit *list;
+  long int *sizes;
+  int i, n, status;
+  bool small;
+
+  sizes = (long int*)malloc(count * sizeof(long int));
+  list = (struct unit*)malloc(count * sizeof(struct unit));
+  if (sizes == NULL || list == NULL) {
+	free(sizes);
+	free(list);
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return EXIT_FAILURE;
+  }
+
+  /* XTS works on whole data units, and chunked mode on whole chunks, so
+	 they aren't grouped */
+  n = 0;
+  for (i = 0; i < count; i++) {
+	small = !entries[i].dir && entries[i].size >= 0
+	  && entries[i].size <= SMALL_FILE_SIZE && flags.mode != mode_xts
+	  && flags.mode != mode_chunked && flags.out_file == NULL
+	  && !flags.in_place && !flags.sparse;
+
+	if (small && n > 0 && list[n - 1].small && list[n - 1].count < AES_LANES) {
+	  list[n - 1].count++;
+	  sizes[n - 1] += entries[i].size;
+	  continue;
+	}
+	list[n].first = i;
+	list[n].count = 1;
+	list[n].small = small;
+	list[n].dir = entries[i].dir;
+	list[n].skip = skip >= 0 || !entries[i].dir ? skip
+	  : walk_skip(entries[i].path);
+	sizes[n] = entries[i].dir ? LONG_MAX : entries[i].size;
+	n++;
+  }
+
+  if (n > 1 && pool_size(pool) > 1) {
+	units.entries = entries;
+	units.list = list;
+	status = batch_run(pool, n, sizes, encrypt_batch, &units, messages,
+					   errors) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  else {
+	status = EXIT_SUCCESS;
+	for (i = 0; i < n; i++) {
+	  if (encrypt_unit(entries, &list[i]) != EXIT_SUCCESS)
+		status = EXIT_FAILURE;
+	}
+  }
+
+  free(sizes);
+  free(list);
+  return status;
+}
+
+/**
+ * Encrypts every file under a directory, for -r. The cipher files go into the
+ * same tree of directories under the output directory.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed.
+ */
+static int encrypt_tree(const char *path, int skip) {
+  aes_entry_t *entries;
+  size_t count;
+  int status;
+
+  entries = walk_dir(path, &count);
+  if (entries == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to read directory '%s'.\n",
+			path);
+	return EXIT_FAILURE;
+  }
+  if (!create_out_dir(path, skip)) {
+	walk_free(entries, count);
+	return EXIT_FAILURE;
+  }
+
+  VERBOSE("Encrypting directory '%s'...\n", path);
+  status = count > 0 ? encrypt_entries(entries, count, skip) : EXIT_SUCCESS;
+  walk_free(entries, count);
+  return status;
+}
+
+/**
+ * Encrypts every file named on the command line, and with -r, every file
+ * under the directories named there.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed.
+ */
+static int encrypt_all(char **names, int count) {
+  struct stat st;
+  aes_entry_t *entries;
+  int i, status;
+
+  if (count == 0)
+	return EXIT_SUCCESS;
+
+  entries = (aes_entry_t*)malloc(count * sizeof(aes_entry_t));
+  if (entries == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < count; i++) {
+	entries[i].path = names[i];
+	entries[i].dir = false;
+	entries[i].size = -1;
+	if (stat(names[i], &st) == 0) {
+	  entries[i].dir = flags.recursive && S_ISDIR(st.st_mode);
+	  if (S_ISREG(st.st_mode))
+		entries[i].size = (long int)st.st_size;
+	}
+  }
+
+  /* With files being done side by side, there is no one file to show the
+	 progress of */
+  batch = pool_size(pool) > 1 && (count > 1 || flags.recursive);
+  if (batch)
+	VERBOSE("Encrypting files on %d threads at once.\n", pool_size(pool));
+
+  status = encrypt_entries(entries, count, -1);
+  free(entries);
+  return status;
+}
+
+/* An archive being written (see archive.c) */
+struct archive
+{
+  aes_output_t out;
+  aes_header_t header;
+  uint8_t header_buf[AES_HEADER_SIZE];
+  aes_key_t key; /* The archive's own key (see header_file_key()) */
+  gcm_t gcm;
+  aes_member_t *members;
+  size_t count, room;
+  uint32_t next; /* Number for the next member's nonce */
+  struct stat st; /* The archive file, so it isn't added to itself */
+  bool failed; /* Writing the archive failed */
+};
+
+/**
+ * Encrypts a file into an archive as its next member. A small file is read
+ * whole, straight into the output, and encrypted where it lies; anything
+ * bigger is taken a buffer at a time, like encrypt_stream().
+ *
+ * If the file can't be read, it is left out of the index, but the archive
+ * carries on. Only if the archive can't be written is ar->failed set.
+ *
+ * @param name - Name the file is stored under.
+ * @return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int archive_add(struct archive *ar, const char *path,
+					   const char *name) {
+  aes_member_t *member, *grown;
+  aes_input_t in;
+  uint8_t iv[AES_BLOCK_SIZE], tag[GCM_TAG_SIZE];
+  struct stat st;
+  size_t buffer_size, bytes_read;
+  const uint8_t *src;
+  uint8_t *dst;
+  FILE *infd;
+  bool ok;
+
+  if (!archive_name_safe(name)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Can't add '%s' to an archive as" \
+			" '%s'.\n", path, name);
+	return EXIT_FAILURE;
+  }
+  if (ar->next == ARCHIVE_INDEX_NUMBER) {
+	fprintf(errors, PROGRAM_NAME ": Error: Too many files for one" \
+			" archive.\n");
+	return EXIT_FAILURE;
+  }
+
+  if (ar->count == ar->room) {
+	ar->room = ar->room == 0 ? 64 : 2 * ar->room;
+	grown = (aes_member_t*)realloc(ar->members,
+								   ar->room * sizeof(aes_member_t));
+	if (grown == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	  ar->failed = true;
+	  return EXIT_FAILURE;
+	}
+	ar->members = grown;
+  }
+  member = &ar->members[ar->count];
+
+  infd = fopen(path, "rb");
+  if (infd == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to open file '%s'.\n",
+			path);
+	return EXIT_FAILURE;
+  }
+  if (fstat(fileno(infd), &st) != 0) {
+	memset(&st, 0, sizeof(st));
+  }
+  else if (st.st_dev == ar->st.st_dev && st.st_ino == ar->st.st_ino) {
+	VERBOSE("Leaving the archive itself out.\n");
+	fclose(infd);
+	return EXIT_SUCCESS;
+  }
+  VERBOSE("Adding file '%s' as '%s'...\n", path, name);
+
+  /* Every member gets a nonce of its own, even one that fails part way */
+  member->number = ar->next++;
+  member->offset = ar->out.pos;
+  member->size = 0;
+  archive_nonce(member->number, iv);
+  gcm_restart(&ar->gcm, iv);
+  gcm_aad(&ar->gcm, ar->header_buf, sizeof(ar->header_buf));
+
+  ok = true;
+  if (S_ISREG(st.st_mode) && st.st_size <= SMALL_FILE_SIZE) {
+	dst = output_reserve(&ar->out, st.st_size);
+	if (dst == NULL) {
+	  ar->failed = true;
+	}
+	else if (!read_small(fileno(infd), dst, st.st_size)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	  ok = false;
+	}
+	else {
+	  gcm_encrypt(&ar->gcm, pool, dst, dst, st.st_size);
+	  ar->failed = !output_commit(&ar->out, st.st_size);
+	  member->size = st.st_size;
+	}
+  }
+  else {
+	buffer_size = (size_t)pool_size(pool) * AES_CHUNK_SIZE;
+	if (!input_open(&in, infd, buffer_size, flags.io)) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	  fclose(infd);
+	  return EXIT_FAILURE;
+	}
+	while ((src = input_read(&in, buffer_size, &bytes_read)) != NULL
+		   && bytes_read > 0) {
+	  dst = output_reserve(&ar->out, bytes_read);
+	  if (dst == NULL) {
+		ar->failed = true;
+		break;
+	  }
+	  if (!gcm_encrypt(&ar->gcm, pool, src, dst, bytes_read)) {
+		fprintf(errors, PROGRAM_NAME ": Error: File is too large for GCM" \
+				" mode.\n");
+		ok = false;
+		break;
+	  }
+	  if (!output_commit(&ar->out, bytes_read)) {
+		ar->failed = true;
+		break;
+	  }
+	  member->size += bytes_read;
+	  show_progress(in.pos, in.size);
+	}
+	VERBOSE("\n");
+	if (src == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: File read error.\n");
+	  ok = false;
+	}
+	input_close(&in);
+  }
+  fclose(infd);
+
+  if (ok && !ar->failed) {
+	gcm_tag(&ar->gcm, tag);
+	ar->failed = !output_write(&ar->out, tag, sizeof(tag));
+  }
+  if (ar->failed) {
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	return EXIT_FAILURE;
+  }
+  if (!ok)
+	return EXIT_FAILURE;
+
+  member->name = strdup(name);
+  if (member->name == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	ar->failed = true;
+	return EXIT_FAILURE;
+  }
+  ar->count++;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Adds every file under a directory to an archive, for -r. Each is stored
+ * under its path from the directory named on the command line down.
+ *
+ * @param skip - Part of the path left out of the names (see walk_skip()).
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed.
+ */
+static int archive_tree(struct archive *ar, const char *path, int skip) {
+  aes_entry_t *entries;
+  size_t count, i;
+  int status;
+
+  entries = walk_dir(path, &count);
+  if (entries == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Failed to read directory '%s'.\n",
+			path);
+	return EXIT_FAILURE;
+  }
+
+  status = EXIT_SUCCESS;
+  for (i = 0; i < count && !ar->failed; i++) {
+	if (entries[i].dir) {
+	  if (archive_tree(ar, entries[i].path, skip) != EXIT_SUCCESS)
+		status = EXIT_FAILURE;
+	}
+	else if (archive_add(ar, entries[i].path, entries[i].path + skip)
+			 != EXIT_SUCCESS) {
+	  status = EXIT_FAILURE;
+	}
+  }
+
+  walk_free(entries, count);
+  return status;
+}
+
+/**
+ * Finishes an archive: encrypts the index and writes it after the members,
+ * followed by the trailer that says where to find it.
+ *
+ * @return false if it couldn't be written.
+ */
+static bool archive_finish(struct archive *ar) {
+  uint8_t aad[AES_HEADER_SIZE + ARCHIVE_TRAILER_SIZE];
+  uint8_t iv[AES_BLOCK_SIZE], tag[GCM_TAG_SIZE];
+  uint8_t *index;
+  size_t len;
+  bool ok;
+
+  index = archive_index_encode(ar->members, ar->count, &len);
+  if (index == NULL) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	return false;
+  }
+
+  /* The index covers the trailer too, so it can't be pointed elsewhere */
+  memcpy(aad, ar->header_buf, AES_HEADER_SIZE);
+  archive_trailer_encode(ar->out.pos, len, aad + AES_HEADER_SIZE);
+
+  archive_nonce(ARCHIVE_INDEX_NUMBER, iv);
+  gcm_restart(&ar->gcm, iv);
+  gcm_aad(&ar->gcm, aad, sizeof(aad));
+  gcm_encrypt(&ar->gcm, pool, index, index, len);
+  gcm_tag(&ar->gcm, tag);
+
+  ok = output_write(&ar->out, index, len)
+	&& output_write(&ar->out, tag, sizeof(tag))
+	&& output_write(&ar->out, aad + AES_HEADER_SIZE, ARCHIVE_TRAILER_SIZE);
+  if (!ok)
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+  free(index);
+  return ok;
+}
+
+/**
+ * Packs every file named on the command line, and with -r, every file under
+ * the directories named there, into one archive (see archive.c). It is
+ * written to the file named with -o, or 'archive.aes'. The files are stored
+ * under their own names, or for files found with -r, their paths from the
+ * directory named on the command line down.
+ *
+ * The members are written one after another. A big one is still encrypted on
+ * all the threads.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed.
+ */
+static int encrypt_archive(char **names, int count) {
+  struct archive ar;
+  struct stat st;
+  char *out_name, *name_cp;
+  FILE *outfd;
+  bool to_stdout;
+  int i, status;
+
+  memset(&ar, 0, sizeof(ar));
+  if (!header_init(&ar.header, mode_archive)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Could not generate a nonce.\n");
+	return EXIT_FAILURE;
+  }
+  header_encode(&ar.header, ar.header_buf);
+
+  to_stdout = flags.out_file != NULL && strcmp(flags.out_file, "-") == 0;
+  if (to_stdout) {
+	out_name = "(standard output)";
+	outfd = stdout;
+  }
+  else {
+	out_name = flags.out_file != NULL ? flags.out_file
+	  : DEFAULT_ARCHIVE_FILE OUTPUT_EXTENSION;
+	outfd = fopen(out_name, "w+b");
+	if (outfd == NULL) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Failed to create file '%s'.\n",
+			  out_name);
+	  return EXIT_FAILURE;
+	}
+  }
+
+  if (fstat(fileno(outfd), &ar.st) != 0)
+	memset(&ar.st, 0, sizeof(ar.st));
+  if (!output_open(&ar.out, outfd, -1, (size_t)pool_size(pool)
+				   * AES_CHUNK_SIZE, flags.io)) {
+	fprintf(errors, PROGRAM_NAME ": Error: Out of memory.\n");
+	if (!to_stdout) {
+	  fclose(outfd);
+	  remove(out_name);
+	}
+	return EXIT_FAILURE;
+  }
+  VERBOSE("Writing: %s.\n", output_kind(&ar.out));
+
+  /* Set up the keys once; each member then only restarts the GCM state */
+  header_file_key(engine, &encrypt_key, &ar.header, &ar.key);
+  gcm_init(&ar.gcm, engine, &ar.key, ar.header.iv);
+  status = EXIT_SUCCESS;
+  ar.failed = !output_write(&ar.out, ar.header_buf, sizeof(ar.header_buf));
+
+  for (i = 0; i < count && !ar.failed; i++) {
+	if (strcmp(names[i], "-") == 0) {
+	  fprintf(errors, PROGRAM_NAME ": Error: Standard input can't be added" \
+			  " to an archive.\n");
+	  status = EXIT_FAILURE;
+	}
+	else if (flags.recursive && stat(names[i], &st) == 0
+			 && S_ISDIR(st.st_mode)) {
+	  if (archive_tree(&ar, names[i], walk_skip(names[i])) != EXIT_SUCCESS)
+		status = EXIT_FAILURE;
+	}
+	else {
+	  name_cp = strdup(names[i]);
+	  if (name_cp == NULL
+		  || archive_add(&ar, names[i], basename(name_cp)) != EXIT_SUCCESS)
+		status = EXIT_FAILURE;
+	  free(name_cp);
+	}
+  }
+
+  if (!ar.failed)
+	ar.failed = !archive_finish(&ar);
+  if (!output_close(&ar.out) && !ar.failed) {
+	fprintf(errors, PROGRAM_NAME ": Error: File write error.\n");
+	ar.failed = true;
+  }
+
+  if (ar.failed) {
+	status = EXIT_FAILURE;
+  }
+  else {
+	fprintf(messages, PROGRAM_NAME ": Archive '%s' created from %zu" \
+			" file(s).\n", out_name, ar.count);
+  }
+  if (!to_stdout) {
+	fclose(outfd);
+	if (ar.failed)
+	  remove(out_name);
+  }
+  else if (fflush(stdout) != 0) {
+	status = EXIT_FAILURE;
+  }
+
+  archive_free(ar.members, ar.count);
+  return status;
+}
+
 /**
  * Program main function.
  *
@@ -454,9 +1785,10 @@ int
 main(int argc, char *argv[])
 {
   int opt;
-  char *out_name;
-  FILE *keyfd, *infd, *outfd;
-  
+  int status = EXIT_SUCCESS;
+  FILE *keyfd;
+
+  errors = stderr;
   /* Parse command options */
   while ((opt = getopt_long(argc, argv, opts_str, long_opts, NULL)) != -1) {
 	switch (opt) { 
@@ -467,6 +1799,9 @@ main(int argc, char *argv[])
 	  /* Verbose option */
 	case 'v': flags.verbose = true; break;
 
+	  /* Encrypt the files under directories */
+	case 'r': flags.recursive = true; break;
+
 	  /* Key size option */
 	case 's': flags.key_size = atoi(optarg);
 	  if (flags.key_size != key_16_bytes
@@ -481,6 +1816,45 @@ main(int argc, char *argv[])
 
 	  /* Specified output directory */
 	case 'd': flags.out_directory = optarg; break;
+
+	  /* Cipher file name */
+	case 'o': flags.out_file = optarg; break;
+
+	  /* Cipher engine option */
+	case 'e': flags.engine_name = optarg; break;
+
+	  /* Cipher mode option */
+	case 'm':
+	  if (!mode_find(optarg, &flags.mode)) {
+		exit_error(PROGRAM_NAME ": Error: Unknown cipher mode '%s'.\n", optarg);
+	  }
+	  break;
+
+	  /* Number of threads */
+	case 'j': flags.jobs = atoi(optarg);
+	  if (flags.jobs < 1) {
+		exit_error(PROGRAM_NAME ": Error: Invalid number of jobs.\n");
+	  }
+	  break;
+
+	  /* XTS data unit size, or chunk size (checked once the mode is known) */
+	case 'u': flags.unit_size = strtoul(optarg, NULL, 0); break;
+
+	  /* File I/O method */
+	case 'I':
+	  if (!io_find(optarg, &flags.io)) {
+		exit_error(PROGRAM_NAME ": Error: Unknown I/O method '%s'.\n", optarg);
+	  }
+	  break;
+
+	  /* Encrypt files where they lie */
+	case 'P': flags.in_place = true; break;
+
+	  /* Keep checkpoints, and carry on from them */
+	case 'R': flags.resume = true; break;
+
+	  /* Leave holes out */
+	case 'S': flags.sparse = true; break;
 		
 	default:
 	  exit_error(PROGRAM_NAME ": Error: Invalid option indicated.\n");
@@ -488,9 +1862,74 @@ main(int argc, char *argv[])
 	}
   }
 
-  /* Generate Encryption Key */
-  VERBOSE("Generating encryption key.\n");
-  key_init(&encrypt_key, flags.key_size);
+  if (flags.unit_size != 0 && flags.mode == mode_chunked
+	  && !chunked_valid_size(flags.unit_size)) {
+	exit_error(PROGRAM_NAME ": Error: The chunk size must be a power of 2" \
+			   " from %d to %d.\n", CHUNKED_MIN_SIZE, AES_CHUNK_SIZE);
+  }
+  if (flags.unit_size != 0 && flags.mode != mode_chunked
+	  && !xts_valid_unit_size(flags.unit_size)) {
+	exit_error(PROGRAM_NAME ": Error: The data unit size must be a power" \
+			   " of 2 from %d to %d.\n", AES_BLOCK_SIZE, AES_CHUNK_SIZE);
+  }
+
+  if (flags.in_place && flags.mode != mode_ctr && flags.mode != mode_xts) {
+	exit_error(PROGRAM_NAME ": Error: --in_place only works in the modes" \
+			   " that keep the length of the file, ctr and xts.\n");
+  }
+  if (flags.sparse && flags.mode != mode_ctr && flags.mode != mode_xts) {
+	exit_error(PROGRAM_NAME ": Error: --sparse only works in the modes" \
+			   " that keep the length of the file, ctr and xts.\n");
+  }
+  if (flags.sparse && (flags.in_place || flags.resume)) {
+	exit_error(PROGRAM_NAME ": Error: --sparse doesn't take --in_place or" \
+			   " --resume.\n");
+  }
+  if (flags.resume && !checkpoint_mode(flags.mode)) {
+	exit_error(PROGRAM_NAME ": Error: --resume only works in ctr, xts and" \
+			   " chunked modes.\n");
+  }
+  if (flags.resume && (flags.in_place || optind == argc
+					   || (flags.out_file != NULL
+						   && strcmp(flags.out_file, "-") == 0))) {
+	exit_error(PROGRAM_NAME ": Error: --resume needs the files to be named," \
+			   " and doesn't take -o - or --in_place.\n");
+  }
+  if (flags.in_place && (flags.out_file != NULL || flags.out_directory != NULL
+						 || flags.recursive || optind == argc)) {
+	exit_error(PROGRAM_NAME ": Error: --in_place needs the files to be" \
+			   " named, and doesn't take -o, -d or -r.\n");
+  }
+
+  /* Keep status messages out of the cipher */
+  messages = flags.out_file != NULL && strcmp(flags.out_file, "-") == 0
+	? stderr : stdout;
+
+  /* Build the cipher lookup tables and pick the cipher engine */
+  ttable_init();
+
+  engine = engine_find(flags.engine_name);
+  if (engine == NULL) {
+	exit_error(PROGRAM_NAME ": Error: Unknown cipher engine '%s'.\n",
+			   flags.engine_name);
+  }
+  if (!engine_supported(engine)) {
+	exit_error(PROGRAM_NAME ": Error: Cipher engine '%s' is not supported" \
+			   " on this machine.\n", engine->name);
+  }
+  VERBOSE("Using the '%s' cipher engine.\n", engine->name);
+  VERBOSE("Using %s mode.\n", mode_name(flags.mode));
+
+  pool = pool_create(flags.jobs);
+  if (pool == NULL) {
+	exit_error(PROGRAM_NAME ": Error: Could not start worker threads.\n");
+  }
+  VERBOSE("Using %d thread(s).\n", pool_size(pool));
+
+  if (flags.mode == mode_xts && flags.unit_size == 0)
+	flags.unit_size = XTS_DEFAULT_UNIT_SIZE;
+  if (flags.mode == mode_chunked && flags.unit_size == 0)
+	flags.unit_size = CHUNKED_DEFAULT_SIZE;
 
   /* Open file to save key */
   /* Use default file name if not specified by user */
@@ -499,61 +1938,81 @@ main(int argc, char *argv[])
 	flags.key_file_name = DEFAULT_KEY_FILE;
   }
 
-  /* Save key to file */
-  VERBOSE("Saving encryption key to file '%s'.\n", flags.key_file_name);
-  keyfd = fopen(flags.key_file_name, "w");
-  if (keyfd == NULL) {
-	exit_error(PROGRAM_NAME ": Error: Could not create encryption key" \
-			   " file '%s'.\n",\
-			   flags.key_file_name);
+  if ((flags.in_place && in_place_pending(argv + optind, argc - optind))
+	  || ((flags.in_place || flags.resume)
+		  && access(flags.key_file_name, F_OK) == 0)) {
+	/*
+	 A run that stopped part way has to be finished with the same key, and the
+	 files an earlier --in_place run encrypted have no other copy, so their key
+	 is never replaced
+	 */
+	VERBOSE("Reading encryption key from file '%s'.\n", flags.key_file_name);
+	keyfd = fopen(flags.key_file_name, "r");
+	if (keyfd == NULL) {
+	  exit_error(PROGRAM_NAME ": Error: Could not open encryption key" \
+				 " file '%s'.\n", flags.key_file_name);
+	}
+	if (!load_key(&encrypt_key, flags.mode == mode_xts ? &tweak_key : NULL,
+				  keyfd)) {
+	  exit_error(PROGRAM_NAME ": Error: Key file '%s' does not hold a" \
+				 " valid %s key.\n", flags.key_file_name,
+				 mode_name(flags.mode));
+	}
+	fclose(keyfd);
+  }
+  else {
+	/* Generate Encryption Key */
+	VERBOSE("Generating encryption key.\n");
+	key_init(&encrypt_key, flags.key_size);
+	if (flags.mode == mode_xts)
+	  key_init(&tweak_key, flags.key_size);
+
+	/* Save key to file */
+	VERBOSE("Saving encryption key to file '%s'.\n", flags.key_file_name);
+	if (flags.in_place) {
+	  if (!save_key_synced(&encrypt_key,
+						   flags.mode == mode_xts ? &tweak_key : NULL,
+						   flags.key_file_name)) {
+		exit_error(PROGRAM_NAME ": Error: Could not create encryption key" \
+				   " file '%s': %s.\n", flags.key_file_name, strerror(errno));
+	  }
+	}
+	else {
+	  keyfd = fopen(flags.key_file_name, "w");
+	  if (keyfd == NULL) {
+		exit_error(PROGRAM_NAME ": Error: Could not create encryption key" \
+				   " file '%s'.\n",\
+				   flags.key_file_name);
+	  }
+	  save_key(&encrypt_key, flags.mode == mode_xts ? &tweak_key : NULL,
+			   keyfd);
+	  fclose(keyfd); /* Close file */
+	}
   }
-  save_key(&encrypt_key, keyfd);
-  fclose(keyfd); /* Close file */
 
   /* Encrypt specified files using newly generated key */
 
-  if ((optind == argc) || (argv[optind][0] == '-')) {
-	/* Encrypt standard input if no file specified. */
-    VERBOSE("Reading from Standard Input.\n");
-	infd = stdin;
-
-	outfd = fopen(DEFAULT_OUT_FILE OUTPUT_EXTENSION, "wb"); 
-
-	encrypt_file(infd, outfd, &encrypt_key);
-	optind++;
+  if (flags.mode == mode_archive) {
+	/* Everything goes into the one archive */
+	status = encrypt_archive(argv + optind, argc - optind);
   }
-
-  for (; optind < argc; optind++) {
-	infd = fopen(argv[optind], "rb"); /* Open file for reading */
-	
-	if (infd == NULL) {
-	  fprintf(stderr, PROGRAM_NAME ": Error: Failed to open file '%s'.\n",
-			  argv[optind]);
+  else {
+	if (flags.out_file != NULL && (argc - optind > 1 || flags.recursive)) {
+	  exit_error(PROGRAM_NAME ": Error: -o only works with one file.\n");
 	}
-	else {
-	  out_name = create_out_file_name(argv[optind]);
-	  outfd = fopen(out_name, "wb"); 
-
-	  if (outfd == NULL) {
-		fprintf(stderr, PROGRAM_NAME ": Error: Failed to create file '%s'.\n",
-				out_name);
-		fclose(infd);
-	  }
-	  else {
-		VERBOSE("Encrypting file '%s'...\n", argv[optind]);
-		if (encrypt_file(infd, outfd, &encrypt_key)) {
-		  printf(PROGRAM_NAME ": Cipher '%s' created from file '%s'.\n",
-				 out_name, argv[optind]);
-		}
-		fclose(infd);
-		fclose(outfd);
-	  }
-	  free(out_name);
+	if ((optind == argc) || (strcmp(argv[optind], "-") == 0)) {
+	  /* Encrypt standard input if no file specified. */
+	  status = encrypt_named("-", -1);
+	  if (optind < argc)
+		optind++;
 	}
+	if (encrypt_all(argv + optind, argc - optind) != EXIT_SUCCESS)
+	  status = EXIT_FAILURE;
   }
 
-  printf(PROGRAM_NAME ": Encryption complete. Key stored at file '%s'.\n",
-		 flags.key_file_name);
-  
-  exit(EXIT_SUCCESS);
+  fprintf(messages, PROGRAM_NAME ": Encryption complete. Key stored at" \
+		  " file '%s'.\n", flags.key_file_name);
+
+  pool_destroy(pool);
+  exit(status);
 }
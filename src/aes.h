@@ -9,19 +9,50 @@
 #ifndef _AES_H_
 #define _AES_H_
 
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "libaes.h"
+
 /* Number of bytes in an encryption block */
 #define AES_BLOCK_SIZE 16
 
+/* Number of bytes read from a file and ciphered at a time */
+#define AES_BUFFER_SIZE (64 * 1024)
+
+/* Number of bytes one thread ciphers at a time in the parallel modes */
+#define AES_CHUNK_SIZE (1024 * 1024)
+
+/* Most buffers the multi-buffer functions cipher at once */
+#define AES_LANES 8
+
+/* Number of bytes in the header of a non-ECB cipher file (see mode.c) */
+#define AES_HEADER_SIZE 32
+
 #define CIPHER_EXTENSION ".aes"
 
+/* Added to the name of a file being ciphered in place, for its journal */
+#define JOURNAL_EXTENSION ".journal"
+
+/* Added to the name of an output file, for its checkpoints (see
+   checkpoint.c) */
+#define CHECKPOINT_EXTENSION ".checkpoint"
+
+/* Bytes of output between checkpoints */
+#define CHECKPOINT_INTERVAL (256L * 1024 * 1024)
+
 
 /*
 --MACROS--
 
 I made these macros to assist in making terminal output look a little cleaner.
 */
-/* This macro allows me to put verbose messages on one line. */
-#define VERBOSE(...) if (flags.verbose) printf( __VA_ARGS__ )
+/* This macro allows me to put verbose messages on one line. They go to
+   'messages', which is stderr when the data itself is going to stdout. */
+#define VERBOSE(...) if (flags.verbose) fprintf(messages, __VA_ARGS__ )
 
 /* This macro prints an error message and quits */
 #define exit_error(...) fprintf(stderr, __VA_ARGS__ ); exit(EXIT_FAILURE)
@@ -43,13 +74,301 @@ typedef struct
   key_size_t size; /* Size of the key */
   unsigned char block[32]; /* Normal key block */
   unsigned char exp_block[240]; /* Expanded key block */
+  unsigned char dec_block[240]; /* Decryption key block, for the equivalent
+								   inverse cipher (see keyexpand.c) */
 } aes_key_t;
 
+/* Keys a key schedule cache holds if not told otherwise (see keycache.c) */
+#define KEY_CACHE_DEFAULT_SIZE 256
+
+/* Most keys a key schedule cache can be made to hold */
+#define KEY_CACHE_MAX_SIZE (1 << 20)
+
+/* Longest key ID a cache keeps, with its terminating zero */
+#define KEY_CACHE_ID_SIZE 256
+
+/**
+ * Cipher file header, as read or written by mode.c
+ */
+typedef struct
+{
+  aes_mode_t mode;
+  uint32_t param; /* Mode parameter, 0 if unused */
+  bool sparse; /* Holes are left out, and listed at the end (see sparse.c) */
+  uint8_t iv[16]; /* Nonce / initial counter block */
+} aes_header_t;
+
+/* Number of bytes in the GCM authentication tag at the end of a file */
+#define GCM_TAG_SIZE 16
+
+/* Powers of the hash key kept for GHASH with carry-less multiply */
+#define GHASH_POWERS 8
+
+/**
+ * GHASH key: the hash key H, plus tables built from it (see gcm.c)
+ */
+typedef struct
+{
+  uint8_t h[16]; /* H = E(K, 0) */
+  bool clmul; /* Use PCLMULQDQ */
+  uint8_t h_pow[GHASH_POWERS][16]; /* H^1 ... H^8, byte-swapped (PCLMULQDQ) */
+  uint64_t hh[16], hl[16]; /* 4-bit multiplication tables (no PCLMULQDQ) */
+} ghash_key_t;
+
+/* Default XTS data unit size */
+#define XTS_DEFAULT_UNIT_SIZE 4096
+
+/* Default size of the chunks of a chunked cipher file */
+#define CHUNKED_DEFAULT_SIZE (64 * 1024)
+
+/* Smallest chunk size; below this the tags take up too much of the file */
+#define CHUNKED_MIN_SIZE 4096
+
+/**
+ * XTS keys and settings (see xts.c)
+ */
+typedef struct
+{
+  const struct aes_engine *engine;
+  const aes_key_t *data_key; /* Encrypts the data */
+  const aes_key_t *tweak_key; /* Encrypts the data unit numbers */
+  size_t unit_size; /* Bytes per data unit */
+} xts_t;
+
+/**
+ * Ways of reading and writing files (see fileio.c). Files that can't be
+ * handled the way asked for, such as pipes, fall back to io_stdio.
+ */
+typedef enum
+{
+  io_mmap = 0, /* Map the files into memory */
+  io_uring = 1, /* Read ahead and write behind with io_uring */
+  io_direct = 2, /* io_uring, bypassing the page cache with O_DIRECT */
+  io_stdio = 3 /* Read and write through stdio buffers */
+} aes_io_t;
+
+/* Asynchronous I/O ring (see uring.c) */
+typedef struct uring uring_t;
+
+/* Alignment of ring buffers and transfers, enough for O_DIRECT */
+#define URING_ALIGN 4096
+
+/* Buffers in a ring: one being ciphered, and the rest in flight */
+#define URING_DEPTH 3
+
+/**
+ * A file being read (see fileio.c). Regular files are mapped into memory or
+ * read ahead into a ring of buffers; anything else is read through 'buffer'.
+ */
+typedef struct
+{
+  FILE *fd;
+  const uint8_t *map; /* The whole file, or NULL if it isn't mapped */
+  long int size; /* Bytes from the start position to the end, -1 if unknown */
+  long int pos; /* Bytes read so far */
+  uint8_t *buffer;
+  size_t buffer_size; /* Most that can be read at once */
+  size_t len; /* Bytes in the buffer */
+  size_t unread; /* Bytes at the end of the buffer to be read again */
+  uring_t *ring; /* Reads in flight, or NULL */
+  int fd_flags; /* File status flags to restore, or -1 */
+  size_t stride; /* File bytes between the starts of two ring windows */
+  size_t window_size; /* Bytes read into each ring buffer */
+  long int base; /* File offset of window 0 */
+  long int window; /* Oldest window held in the ring */
+  long int filled[URING_DEPTH]; /* Bytes read into each buffer, or one of
+								   the WINDOW_ states in fileio.c */
+} aes_input_t;
+
+/**
+ * A file being written (see fileio.c). New regular files are sized up front
+ * and mapped into memory, or written behind from a ring of buffers; anything
+ * else is written from 'buffer'.
+ */
+typedef struct
+{
+  FILE *fd;
+  uint8_t *map; /* The whole file, or NULL if it isn't mapped */
+  long int map_size; /* Bytes reserved in the file */
+  long int pos; /* Bytes written so far */
+  uint8_t *buffer;
+  size_t buffer_size;
+  uring_t *ring; /* Writes in flight, or NULL */
+  int fd_flags; /* File status flags to restore, or -1 */
+  size_t stride; /* Bytes gathered in a ring buffer before it is written */
+  unsigned slot; /* Ring buffer being filled */
+  size_t fill; /* Bytes in it */
+  long int file_pos; /* File offset it will be written at */
+  bool failed; /* A write has failed */
+} aes_output_t;
+
+/* Worker thread pool (see pool.c) */
+typedef struct pool pool_t;
+
+/* A function run by the pool for each chunk of a job */
+typedef void (*pool_fn_t)(void *arg, size_t index);
+
+/* A file or directory found by walking a directory (see walk.c) */
+typedef struct
+{
+  char *path;
+  long int size;
+  bool dir;
+} aes_entry_t;
+
+/* Number in the nonce of an archive's index (see archive.c) */
+#define ARCHIVE_INDEX_NUMBER 0xFFFFFFFF
+
+/* Number of bytes in the trailer at the end of an archive */
+#define ARCHIVE_TRAILER_SIZE 16
+
+/* Number of bytes in the trailer at the end of a sparse cipher file */
+#define SPARSE_TRAILER_SIZE 16
+
+/* A file packed into an archive (see archive.c) */
+typedef struct
+{
+  char *name; /* Path it is extracted to, under the output directory */
+  uint64_t offset; /* Where its ciphertext starts in the archive */
+  uint64_t size; /* Length of the file, and of the ciphertext before the tag */
+  uint32_t number; /* Number its nonce was made with */
+} aes_member_t;
+
+/**
+ * A file being ciphered where it lies, and the journal that makes it safe to
+ * stop part way (see inplace.c)
+ */
+typedef struct
+{
+  int fd; /* The file, open for reading and writing */
+  int journal_fd;
+  bool decrypt;
+  uint8_t header[AES_HEADER_SIZE]; /* Header of the cipher file, encoded */
+  uint8_t key_check[16]; /* Set by the caller, to match the key on resume */
+  uint64_t plain_size; /* Bytes of plaintext */
+  uint64_t window_size; /* Bytes ciphered at a time */
+  uint64_t pos, len, slot; /* Window in the journal, if len isn't 0 */
+  const char *error; /* Why inplace_run() failed */
+} inplace_t;
+
+/**
+ * Where a long run of aes-encrypt or aes-decrypt has got to, for --resume
+ * (see checkpoint.c)
+ */
+typedef struct
+{
+  int fd; /* The checkpoint file */
+  bool decrypt;
+  bool resumed; /* The run is carrying on from an earlier one */
+  aes_header_t header;
+  uint8_t key_check[16]; /* See inplace_key_check() */
+  uint64_t in_size; /* Size of the input file */
+  uint64_t done; /* Bytes of output on disk, as last saved */
+  uint64_t in_pos, out_pos; /* Where this run started in each file */
+} checkpoint_t;
+
+/* Block encrypted for the key check of journals and checkpoints (see
+   inplace_key_check()) */
+#define KEY_CHECK_BLOCK { 'A', 'E', 'S', 'C', 'K', 'E', 'Y', 'C', 'H', 'E', \
+	  'C', 'K', 0, 0, 0, 0 }
+
+/* A function that ciphers a window of a file in place (see inplace.c) */
+typedef void (*inplace_fn_t)(void *arg, uint64_t pos, uint8_t *buf,
+							 size_t len);
+
+/* A hole in a sparse file: a range of zeros that takes no room on disk */
+typedef struct
+{
+  uint64_t offset;
+  uint64_t length;
+} aes_hole_t;
+
+/**
+ * A sparse file being ciphered, and its holes (see sparse.c)
+ */
+typedef struct
+{
+  int in_fd; /* The input, which must be a regular file */
+  int out_fd; /* The output, written from its file position */
+  bool decrypt;
+  uint8_t header[AES_HEADER_SIZE]; /* Header of the cipher file, encoded */
+  uint64_t size; /* Bytes of plaintext */
+  uint64_t step; /* Holes start and end on a multiple of this */
+  uint64_t tail; /* Bytes at the end that can't be in a hole */
+  uint64_t window_size; /* Bytes ciphered at a time */
+  aes_hole_t *holes;
+  size_t count; /* Number of holes */
+  const char *error; /* Why a function failed */
+} sparse_t;
+
+/* A function run for each file of a batch (see batch.c) */
+typedef bool (*batch_fn_t)(void *arg, size_t index, FILE *out, FILE *err);
+
+/**
+ * One of several buffers ciphered together, each with its own IV (see
+ * ctr_crypt_multi() and cbc_encrypt_multi())
+ */
+typedef struct
+{
+  const uint8_t *iv; /* Initial counter block, or CBC IV */
+  const uint8_t *in;
+  uint8_t *out;
+  size_t len;
+} aes_lane_t;
+
+/**
+ * State of a GCM encryption or decryption (see gcm.c)
+ */
+typedef struct
+{
+  const struct aes_engine *engine;
+  const aes_key_t *key;
+  ghash_key_t hkey;
+  uint8_t j0[16]; /* First counter block; encrypts the tag */
+  uint8_t x[16]; /* Running hash */
+  uint64_t aad_len, data_len; /* Bytes hashed so far */
+  uint8_t h_n[16]; /* H^pow_blocks, for chaining chunk hashes */
+  uint64_t pow_blocks;
+} gcm_t;
+
+/**
+ * Settings of a chunked cipher file, shared by all of its chunks (see chunk.c)
+ */
+typedef struct
+{
+  aes_key_t key; /* The file's own key (see header_file_key()) */
+  gcm_t gcm; /* Set up with the hash key; each chunk starts from a copy */
+  uint8_t header_buf[AES_HEADER_SIZE]; /* The header, as stored */
+  size_t chunk_size; /* Bytes of plaintext per chunk */
+} chunked_t;
+
+/**
+ * Cipher engine. Each engine provides the same pair of functions for running
+ * the cipher over a run of whole blocks; see engine.c.
+ */
+typedef struct aes_engine
+{
+  const char *name; /* Name used to select the engine */
+  bool (*supported)(void); /* Checks the CPU, or NULL if it runs anywhere */
+  void (*encrypt)(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+				  size_t num_blocks);
+  void (*decrypt)(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+				  size_t num_blocks);
+} aes_engine_t;
+
 /* External functions */
 
 /* Key Expansion Function. (imported from keyexpand.c) */
 extern void key_expansion(aes_key_t *);
 
+/* Key schedule cache. (imported from keycache.c) */
+extern aes_key_cache_t * key_cache_create(size_t);
+extern bool key_cache_find(aes_key_cache_t *, const char *, uint64_t, int,
+						   aes_key_t *);
+extern bool key_cache_add(aes_key_cache_t *, const char *, uint64_t, int,
+						  const aes_key_t *);
+extern void key_cache_destroy(aes_key_cache_t *);
+
 /* Imported from base64.c */
 extern char * base64_encode(const uint8_t *,size_t,size_t*);
 extern uint8_t * base64_decode(const char *,size_t,size_t*);
@@ -60,8 +379,206 @@ extern void bytesub_encrypt(uint8_t *, size_t);
 /* Imported from bytesub.c  */
 extern void bytesub_decrypt(uint8_t *, size_t);
 
-/* Imported from gf.c */
+/* GF(2^8) arithmetic. (imported from gf.c) */
 extern uint8_t ff_multiply(uint8_t, uint8_t);
+extern uint8_t gf_xtime(uint8_t);
+extern uint8_t gf_mul2(uint8_t);
+extern uint8_t gf_mul3(uint8_t);
+extern uint8_t gf_mul9(uint8_t);
+extern uint8_t gf_mul11(uint8_t);
+extern uint8_t gf_mul13(uint8_t);
+extern uint8_t gf_mul14(uint8_t);
+extern uint32_t gf_mix_column(uint32_t);
+extern uint32_t gf_mix_column_inv(uint32_t);
+extern void gf_mix_columns(uint8_t *);
+extern void gf_mix_columns_inv(uint8_t *);
+
+/* Table-driven cipher engine. (imported from ttable.c) */
+extern void ttable_init(void);
+extern void ttable_encrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+						   size_t);
+extern void ttable_decrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+						   size_t);
+
+/* Byte-wise reference cipher engine. (imported from cipher.c) */
+extern void reference_encrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+							  size_t);
+extern void reference_decrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+							  size_t);
+
+/* AES-NI cipher engine. (imported from aesni.c) */
+extern void aesni_encrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+						  size_t);
+extern void aesni_decrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+						  size_t);
+
+/* VAES cipher engines. (imported from vaes.c) */
+extern void vaes256_encrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+							size_t);
+extern void vaes256_decrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+							size_t);
+extern void vaes512_encrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+							size_t);
+extern void vaes512_decrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+							size_t);
+
+/* Constant-time bitsliced cipher engine. (imported from bitslice.c) */
+extern void bitslice_encrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+							 size_t);
+extern void bitslice_decrypt(const aes_key_t *, const uint8_t *, uint8_t *,
+							 size_t);
+
+/* Engine selection. (imported from engine.c) */
+extern bool engine_supported(const aes_engine_t *);
+extern const aes_engine_t * engine_find(const char *);
+
+/* Cipher modes and file header. (imported from mode.c) */
+extern bool mode_find(const char *, aes_mode_t *);
+extern const char * mode_name(aes_mode_t);
+extern bool random_bytes(uint8_t *, size_t);
+extern bool header_init(aes_header_t *, aes_mode_t);
+extern bool header_init_many(aes_header_t *, size_t, aes_mode_t);
+extern void header_encode(const aes_header_t *, uint8_t *);
+extern void header_file_key(const aes_engine_t *, const aes_key_t *,
+							const aes_header_t *, aes_key_t *);
+extern bool header_has_magic(const uint8_t *, size_t);
+extern bool header_is_old(const uint8_t *, size_t);
+extern bool header_decode(const uint8_t *, aes_header_t *);
+
+/* Counter mode. (imported from ctr.c) */
+extern void ctr_crypt(const aes_engine_t *, const aes_key_t *,
+					  const uint8_t *, uint64_t, const uint8_t *, uint8_t *,
+					  size_t);
+extern void ctr_crypt_parallel(pool_t *, const aes_engine_t *,
+							   const aes_key_t *, const uint8_t *, uint64_t,
+							   const uint8_t *, uint8_t *, size_t);
+extern void ctr_crypt_multi(const aes_engine_t *, const aes_key_t *,
+							const aes_lane_t *, size_t, uint64_t);
+
+/* Galois/Counter mode. (imported from gcm.c) */
+extern void gcm_init(gcm_t *, const aes_engine_t *, const aes_key_t *,
+					 const uint8_t *);
+extern void gcm_restart(gcm_t *, const uint8_t *);
+extern void gcm_aad(gcm_t *, const uint8_t *, size_t);
+extern bool gcm_encrypt(gcm_t *, pool_t *, const uint8_t *, uint8_t *, size_t);
+extern bool gcm_decrypt(gcm_t *, pool_t *, const uint8_t *, uint8_t *, size_t);
+extern bool gcm_hash(gcm_t *, const uint8_t *, size_t);
+extern void gcm_tag(gcm_t *, uint8_t *);
+extern bool gcm_tag_equal(const uint8_t *, const uint8_t *);
+
+/* Chunked mode. (imported from chunk.c) */
+extern bool chunked_valid_size(size_t);
+extern void chunked_init(chunked_t *, const aes_engine_t *, const aes_key_t *,
+						 const aes_header_t *);
+extern size_t chunked_per_buffer(size_t, size_t);
+extern long int chunked_cipher_size(long int, size_t);
+extern long int chunked_plain_size(long int, size_t);
+extern bool chunked_encrypt(pool_t *, const chunked_t *, uint64_t, bool,
+							const uint8_t *, uint8_t *, size_t);
+extern bool chunked_decrypt(pool_t *, const chunked_t *, uint64_t, bool,
+							const uint8_t *, uint8_t *, size_t);
+
+/* Cipher block chaining mode. (imported from cbc.c) */
+extern void cbc_encrypt(const aes_engine_t *, const aes_key_t *, uint8_t *,
+						const uint8_t *, uint8_t *, size_t);
+extern void cbc_encrypt_multi(const aes_engine_t *, const aes_key_t *,
+							  const aes_lane_t *, size_t);
+extern void cbc_decrypt_parallel(pool_t *, const aes_engine_t *,
+								 const aes_key_t *, const uint8_t *,
+								 const uint8_t *, uint8_t *, size_t);
+extern size_t cbc_pad(uint8_t *, size_t);
+extern bool cbc_unpad(const uint8_t *, size_t, size_t *);
+
+/* XTS mode. (imported from xts.c) */
+extern void xts_crypt(const xts_t *, bool, uint64_t, const uint8_t *,
+					  uint8_t *, size_t);
+extern void xts_crypt_parallel(pool_t *, const xts_t *, bool, uint64_t,
+							   const uint8_t *, uint8_t *, size_t);
+extern bool xts_valid_unit_size(size_t);
+extern void xts_range(const xts_t *, uint64_t, uint64_t, uint64_t,
+					  uint64_t *, uint64_t *);
+
+/* File input and output. (imported from fileio.c) */
+extern bool io_find(const char *, aes_io_t *);
+extern bool input_open(aes_input_t *, FILE *, size_t, aes_io_t);
+extern const uint8_t * input_read(aes_input_t *, size_t, size_t *);
+extern void input_unread(aes_input_t *, size_t);
+extern bool input_seek(aes_input_t *, long int);
+extern void input_close(aes_input_t *);
+extern const char * input_kind(const aes_input_t *);
+extern bool output_open(aes_output_t *, FILE *, long int, size_t, aes_io_t);
+extern uint8_t * output_reserve(aes_output_t *, size_t);
+extern bool output_commit(aes_output_t *, size_t);
+extern bool output_write(aes_output_t *, const void *, size_t);
+extern long int output_sync(aes_output_t *);
+extern bool output_close(aes_output_t *);
+extern const char * output_kind(const aes_output_t *);
+
+/* Asynchronous I/O ring. (imported from uring.c) */
+extern uring_t * uring_create(int, unsigned, size_t);
+extern bool uring_async(const uring_t *);
+extern uint8_t * uring_buffer(uring_t *, unsigned);
+extern bool uring_start(uring_t *, unsigned, bool, uint64_t, size_t);
+extern ssize_t uring_wait(uring_t *, unsigned);
+extern void uring_destroy(uring_t *);
+
+/* Worker thread pool. (imported from pool.c) */
+extern int pool_default_size(void);
+extern pool_t * pool_create(int);
+extern int pool_size(const pool_t *);
+extern void pool_run(pool_t *, size_t, pool_fn_t, void *);
+extern void pool_destroy(pool_t *);
+
+/* Batches of files. (imported from batch.c) */
+extern bool batch_run(pool_t *, size_t, const long int *, batch_fn_t, void *,
+					  FILE *, FILE *);
+
+/* Directory walking. (imported from walk.c) */
+extern aes_entry_t * walk_dir(const char *, size_t *);
+extern int walk_skip(const char *);
+extern void walk_free(aes_entry_t *, size_t);
+
+/* Archives. (imported from archive.c) */
+extern void archive_nonce(uint32_t, uint8_t *);
+extern bool archive_name_safe(const char *);
+extern uint8_t * archive_index_encode(const aes_member_t *, size_t, size_t *);
+extern aes_member_t * archive_index_decode(const uint8_t *, size_t, uint64_t,
+										   size_t *);
+extern void archive_free(aes_member_t *, size_t);
+extern void archive_trailer_encode(uint64_t, uint64_t, uint8_t *);
+extern bool archive_trailer_decode(const uint8_t *, uint64_t, uint64_t *,
+								   uint64_t *);
+
+/* Checkpoints. (imported from checkpoint.c) */
+extern bool checkpoint_mode(aes_mode_t);
+extern bool checkpoint_load(checkpoint_t *);
+extern bool checkpoint_save(checkpoint_t *);
+extern bool checkpoint_update(checkpoint_t *, aes_output_t *);
+extern bool checkpoint_resume(checkpoint_t *);
+
+/* Library contexts, as the programs use them. (imported from libaes.c) */
+extern aes_ctx_t * ctx_new(const aes_engine_t *, pool_t *, aes_mode_t, bool,
+						   const aes_key_t *, const aes_key_t *);
+extern bool ctx_start(aes_ctx_t *, const aes_header_t *, uint64_t);
+extern const aes_header_t * ctx_header(const aes_ctx_t *);
+extern size_t ctx_piece_size(const aes_ctx_t *, size_t);
+extern size_t ctx_update_size(const aes_ctx_t *, size_t);
+extern size_t ctx_final_size(const aes_ctx_t *);
+
+/* In-place ciphering. (imported from inplace.c) */
+extern void inplace_key_check(const aes_engine_t *, const aes_key_t *,
+							  const aes_key_t *, uint8_t *);
+extern bool inplace_start(inplace_t *);
+extern bool inplace_resume(inplace_t *);
+extern bool inplace_run(inplace_t *, inplace_fn_t, void *,
+						void (*)(long int, long int));
+
+/* Sparse files. (imported from sparse.c) */
+extern bool sparse_find(sparse_t *);
+extern bool sparse_load(sparse_t *, uint64_t);
+extern void sparse_free(sparse_t *);
+extern bool sparse_run(sparse_t *, inplace_fn_t, void *,
+					   void (*)(long int, long int));
 
 
 #endif /* _AES_H_ */
@@ -0,0 +1,120 @@
+/**
+ * AES-NI cipher engine
+ *
+ * Intel and AMD processors since around 2010 can run a whole AES round in one
+ * instruction. AESENC does ShiftRows, SubBytes, MixColumns and AddRoundKey on
+ * a 128-bit register, and AESENCLAST does the same minus MixColumns. The
+ * decryption instructions (AESDEC/AESDECLAST) implement the equivalent inverse
+ * cipher, so they use the decryption key block that key_expansion() builds
+ * next to the encryption one.
+ *
+ * The instructions treat the register as the 16 bytes of the state in memory
+ * order, which is the same order as the blocks in the file and the round keys
+ * in the expanded key, so nothing needs to be rearranged.
+ *
+ * The functions here are compiled for AES-NI regardless of the compiler flags,
+ * so they must only be called after engine.c has checked that the CPU has it.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+/**
+ * Loads 'num_rounds'+1 round keys into registers.
+ */
+static inline AESNI_TARGET
+void load_round_keys(__m128i *rk, const uint8_t *key_block, int num_rounds) {
+  int r;
+  for (r = 0; r <= num_rounds; r++)
+	rk[r] = _mm_loadu_si128((const __m128i *)(key_block + 16 * r));
+}
+
+/*
+  AESENC takes several cycles to produce its result, but the CPU can start a
+  new one every cycle or so. A single block has to wait out the full latency of
+  every round, so we run AESNI_LANES independent blocks through each round
+  together to keep the AES unit busy.
+ */
+#define AESNI_LANES 8
+
+/* Applies one round instruction to all eight lanes. */
+#define ROUND8(op, b, k) do { \
+	b[0] = op(b[0], k); b[1] = op(b[1], k); \
+	b[2] = op(b[2], k); b[3] = op(b[3], k); \
+	b[4] = op(b[4], k); b[5] = op(b[5], k); \
+	b[6] = op(b[6], k); b[7] = op(b[7], k); } while (0)
+
+/**
+ * Runs 'num_blocks' blocks through the cipher, eight at a time where we can.
+ * The encrypt and decrypt directions only differ in the round instructions
+ * and the key block, so they share this body.
+ */
+#define AESNI_CIPHER(round_op, last_op, rk, num_rounds, in, out, num_blocks) \
+  do { \
+	__m128i b[AESNI_LANES]; \
+	int r, l; \
+	for (; num_blocks >= AESNI_LANES; num_blocks -= AESNI_LANES) { \
+	  for (l = 0; l < AESNI_LANES; l++) \
+		b[l] = _mm_loadu_si128((const __m128i *)(in + 16 * l)); \
+	  ROUND8(_mm_xor_si128, b, rk[0]); \
+	  for (r = 1; r < num_rounds; r++) \
+		ROUND8(round_op, b, rk[r]); \
+	  ROUND8(last_op, b, rk[num_rounds]); \
+	  for (l = 0; l < AESNI_LANES; l++) \
+		_mm_storeu_si128((__m128i *)(out + 16 * l), b[l]); \
+	  in += 16 * AESNI_LANES; \
+	  out += 16 * AESNI_LANES; \
+	} \
+	for (; num_blocks > 0; num_blocks--) { \
+	  b[0] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), rk[0]); \
+	  for (r = 1; r < num_rounds; r++) \
+		b[0] = round_op(b[0], rk[r]); \
+	  b[0] = last_op(b[0], rk[num_rounds]); \
+	  _mm_storeu_si128((__m128i *)out, b[0]); \
+	  in += AES_BLOCK_SIZE; \
+	  out += AES_BLOCK_SIZE; \
+	} \
+  } while (0)
+
+/**
+ * Encrypts a run of 16-byte blocks.
+ */
+AESNI_TARGET
+void aesni_encrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+				   size_t num_blocks) {
+  __m128i rk[15];
+  int num_rounds;
+
+  num_rounds = (key->size / 4) + 6;
+  load_round_keys(rk, key->exp_block, num_rounds);
+
+  AESNI_CIPHER(_mm_aesenc_si128, _mm_aesenclast_si128,
+			   rk, num_rounds, in, out, num_blocks);
+}
+
+/**
+ * Decrypts a run of 16-byte blocks.
+ */
+AESNI_TARGET
+void aesni_decrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+				   size_t num_blocks) {
+  __m128i rk[15];
+  int num_rounds;
+
+  num_rounds = (key->size / 4) + 6;
+  load_round_keys(rk, key->dec_block, num_rounds);
+
+  AESNI_CIPHER(_mm_aesdec_si128, _mm_aesdeclast_si128,
+			   rk, num_rounds, in, out, num_blocks);
+}
+
+#endif /* __x86_64__ || __i386__ */
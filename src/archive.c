@@ -0,0 +1,232 @@
+/**
+ * Archives
+ *
+ * Encrypting a tree of small files one cipher file each leaves just as many
+ * small files behind. With --mode=archive, aes-encrypt packs them all into one
+ * cipher file instead:
+ *
+ *  header      AES_HEADER_SIZE bytes, mode "archive" (see mode.c)
+ *  member 0    ciphertext, then a GCM_TAG_SIZE byte tag
+ *  member 1    ...
+ *  index       ciphertext, then a tag
+ *  trailer     ARCHIVE_TRAILER_SIZE bytes: where the index starts and how
+ *              long it is, as two big-endian 64-bit numbers, in the clear
+ *
+ * Each member and the index are encrypted in GCM mode on their own, so any one
+ * of them can be decrypted and checked without touching the rest. The
+ * archive has a key of its own, made from the header's nonce (see
+ * header_file_key()), so two archives only share nonces if their headers
+ * share all 96 bits of theirs. Within the archive, a nonce is 8 zero bytes
+ * and a big-endian 32-bit number: the member's number, or
+ * ARCHIVE_INDEX_NUMBER for the index. The header is the additional
+ * authenticated data of every member; the index also covers the trailer.
+ *
+ * The index lists the members in the order they were added:
+ *
+ *  count       8 bytes, the number of members
+ *  then for each member:
+ *  offset      8 bytes, where its ciphertext starts in the archive
+ *  size        8 bytes, its length (the ciphertext is as long, plus the tag)
+ *  number      4 bytes, the number its nonce was made with
+ *  name length 2 bytes
+ *  name        that many bytes, with no terminating 0
+ *
+ * aes-decrypt reads the trailer and then the index, and can go straight from
+ * there to any one member. Numbers are stored rather than taken from the
+ * order, because a file that fails part way through being added still used
+ * up its nonce, even though it is left out of the index.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "aes.h"
+
+/* Bytes in the index before the first member */
+#define INDEX_COUNT_SIZE 8
+
+/* Bytes of a member's index entry before its name */
+#define INDEX_ENTRY_SIZE 22
+
+/* Reads a big-endian number of 'len' bytes */
+static uint64_t get_be(const uint8_t *p, int len) {
+  uint64_t v = 0;
+
+  while (len-- > 0)
+	v = (v << 8) | *p++;
+  return v;
+}
+
+/* Writes a big-endian number of 'len' bytes */
+static void put_be(uint8_t *p, uint64_t v, int len) {
+  while (len-- > 0) {
+	p[len] = v & 0xFF;
+	v >>= 8;
+  }
+}
+
+/**
+ * Makes the nonce of a member, or of the index, under the archive's key.
+ *
+ * @param number - The member's number, or ARCHIVE_INDEX_NUMBER.
+ * @param iv - 16 bytes to fill, in the form gcm_init() takes.
+ */
+void archive_nonce(uint32_t number, uint8_t *iv) {
+  memset(iv, 0, 8);
+  put_be(iv + 8, number, 4);
+  memset(iv + 12, 0, 4);
+}
+
+/**
+ * Checks that a member name stays inside the directory it is extracted to:
+ * it must not be empty, absolute, or have a ".." in it.
+ */
+bool archive_name_safe(const char *name) {
+  const char *p;
+  size_t len;
+
+  if (name[0] == '\0' || name[0] == '/')
+	return false;
+
+  for (p = name; *p != '\0'; p += len + (p[len] == '/')) {
+	len = strcspn(p, "/");
+	if (len == 2 && p[0] == '.' && p[1] == '.')
+	  return false;
+  }
+  return true;
+}
+
+/**
+ * Lays out the index of an archive.
+ *
+ * @param len - Set to the length of the index.
+ * @return The index, to be freed by the caller, or NULL if we ran out of
+ *         memory.
+ */
+uint8_t * archive_index_encode(const aes_member_t *members, size_t count,
+							   size_t *len) {
+  uint8_t *buf, *p;
+  size_t i, name_len;
+
+  *len = INDEX_COUNT_SIZE;
+  for (i = 0; i < count; i++)
+	*len += INDEX_ENTRY_SIZE + strlen(members[i].name);
+
+  buf = (uint8_t*)malloc(*len);
+  if (buf == NULL)
+	return NULL;
+
+  put_be(buf, count, 8);
+  p = buf + INDEX_COUNT_SIZE;
+  for (i = 0; i < count; i++) {
+	name_len = strlen(members[i].name);
+	put_be(p, members[i].offset, 8);
+	put_be(p + 8, members[i].size, 8);
+	put_be(p + 16, members[i].number, 4);
+	put_be(p + 20, name_len, 2);
+	memcpy(p + INDEX_ENTRY_SIZE, members[i].name, name_len);
+	p += INDEX_ENTRY_SIZE + name_len;
+  }
+  return buf;
+}
+
+/**
+ * Reads the index of an archive, once it has been decrypted and checked.
+ * Every member must lie between the header and the index, and have a name
+ * that is safe to extract (see archive_name_safe()).
+ *
+ * @param end - Where the index starts in the archive.
+ * @param count - Set to the number of members.
+ * @return The members, to be freed with archive_free(), or NULL if the index
+ *         is damaged or we ran out of memory.
+ */
+aes_member_t * archive_index_decode(const uint8_t *buf, size_t len,
+									uint64_t end, size_t *count) {
+  aes_member_t *members;
+  const uint8_t *p;
+  size_t i, left, name_len;
+
+  if (len < INDEX_COUNT_SIZE)
+	return NULL;
+  *count = get_be(buf, 8);
+  left = len - INDEX_COUNT_SIZE;
+  if (*count > left / INDEX_ENTRY_SIZE)
+	return NULL;
+
+  members = (aes_member_t*)calloc(*count + 1, sizeof(aes_member_t));
+  if (members == NULL)
+	return NULL;
+
+  p = buf + INDEX_COUNT_SIZE;
+  for (i = 0; i < *count; i++) {
+	if (left < INDEX_ENTRY_SIZE)
+	  break;
+	members[i].offset = get_be(p, 8);
+	members[i].size = get_be(p + 8, 8);
+	members[i].number = get_be(p + 16, 4);
+	name_len = get_be(p + 20, 2);
+	if (members[i].offset < AES_HEADER_SIZE || members[i].offset > end
+		|| end - members[i].offset < GCM_TAG_SIZE
+		|| members[i].size > end - members[i].offset - GCM_TAG_SIZE
+		|| name_len > left - INDEX_ENTRY_SIZE
+		|| memchr(p + INDEX_ENTRY_SIZE, '\0', name_len) != NULL)
+	  break;
+
+	members[i].name = strndup((const char*)p + INDEX_ENTRY_SIZE, name_len);
+	if (members[i].name == NULL || !archive_name_safe(members[i].name))
+	  break;
+
+	p += INDEX_ENTRY_SIZE + name_len;
+	left -= INDEX_ENTRY_SIZE + name_len;
+  }
+
+  if (i < *count || left != 0) {
+	archive_free(members, i + 1);
+	return NULL;
+  }
+  return members;
+}
+
+/**
+ * Frees a list of members.
+ */
+void archive_free(aes_member_t *members, size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++)
+	free(members[i].name);
+  free(members);
+}
+
+/**
+ * Lays out the trailer at the end of an archive.
+ *
+ * @param buf - ARCHIVE_TRAILER_SIZE bytes to fill.
+ */
+void archive_trailer_encode(uint64_t index_offset, uint64_t index_len,
+							uint8_t *buf) {
+  put_be(buf, index_offset, 8);
+  put_be(buf + 8, index_len, 8);
+}
+
+/**
+ * Reads the trailer at the end of an archive, and checks that the index it
+ * points to fits between the header and the trailer.
+ *
+ * @param size - Length of the whole archive.
+ * @return false if the archive is damaged.
+ */
+bool archive_trailer_decode(const uint8_t *buf, uint64_t size,
+							uint64_t *index_offset, uint64_t *index_len) {
+  *index_offset = get_be(buf, 8);
+  *index_len = get_be(buf + 8, 8);
+
+  if (size < AES_HEADER_SIZE + GCM_TAG_SIZE + ARCHIVE_TRAILER_SIZE)
+	return false;
+  return *index_offset >= AES_HEADER_SIZE
+	&& *index_offset <= size - GCM_TAG_SIZE - ARCHIVE_TRAILER_SIZE
+	&& *index_len == size - GCM_TAG_SIZE - ARCHIVE_TRAILER_SIZE
+	   - *index_offset;
+}
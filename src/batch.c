@@ -0,0 +1,169 @@
+/**
+ * Batches of files
+ *
+ * When we're given a lot of files, each one becomes a chunk of a single pool
+ * job, so several files are ciphered at once. A file still splits its own
+ * buffers into chunks as it goes, and threads that run out of files help with
+ * those (see pool.c). The biggest files are started first, so one big file
+ * at the end of the list doesn't leave the other threads idle.
+ *
+ * What a file has to say, on either stream, is kept in memory while it runs.
+ * It is printed once every file before it on the command line has been
+ * printed, so the output reads as if the files had been done one at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "aes.h"
+
+/* What one file of the batch said */
+typedef struct
+{
+  char *out_text, *err_text;
+  size_t out_len, err_len;
+  bool done; /* Finished, and waiting to be printed */
+  bool ok;
+} report_t;
+
+typedef struct
+{
+  batch_fn_t fn;
+  void *arg;
+  size_t count;
+  size_t *order; /* Files in the order they are started */
+  report_t *reports;
+  size_t printed; /* Files printed so far, in command line order */
+  FILE *out, *err;
+  pthread_mutex_t lock; /* Guards the reports and 'printed' */
+} batch_t;
+
+/* A file and its size, for sorting */
+typedef struct
+{
+  long int size;
+  size_t index;
+} batch_file_t;
+
+/**
+ * Sorts files biggest first, and otherwise in command line order.
+ */
+static int compare_files(const void *a, const void *b) {
+  const batch_file_t *x = a, *y = b;
+
+  if (x->size != y->size)
+	return x->size > y->size ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * Pool job function: runs one file, then prints every report that is now
+ * next in line.
+ */
+static void batch_chunk(void *arg, size_t i) {
+  batch_t *batch = arg;
+  report_t *report;
+  FILE *out, *err;
+  size_t file = batch->order[i];
+  bool ok;
+
+  report = &batch->reports[file];
+  out = open_memstream(&report->out_text, &report->out_len);
+  err = open_memstream(&report->err_text, &report->err_len);
+
+  /* Without memory for the messages, say them straight away */
+  if (out == NULL || err == NULL) {
+	if (out != NULL)
+	  fclose(out);
+	if (err != NULL)
+	  fclose(err);
+	free(report->out_text);
+	free(report->err_text);
+	report->out_text = report->err_text = NULL;
+	report->out_len = report->err_len = 0;
+	ok = batch->fn(batch->arg, file, batch->out, batch->err);
+  }
+  else {
+	ok = batch->fn(batch->arg, file, out, err);
+	fclose(out);
+	fclose(err);
+  }
+
+  pthread_mutex_lock(&batch->lock);
+  report->ok = ok;
+  report->done = true;
+  while (batch->printed < batch->count
+		 && batch->reports[batch->printed].done) {
+	report = &batch->reports[batch->printed++];
+	fwrite(report->out_text, 1, report->out_len, batch->out);
+	fflush(batch->out);
+	fwrite(report->err_text, 1, report->err_len, batch->err);
+	free(report->out_text);
+	free(report->err_text);
+  }
+  pthread_mutex_unlock(&batch->lock);
+}
+
+/**
+ * Runs fn(arg, i, out, err) for every file i from 0 to count - 1, several at
+ * a time on the pool. fn must write its messages to 'out' and 'err' rather
+ * than to the standard streams, and returns whether the file went well.
+ *
+ * @param sizes - Size of each file, to decide which to start first. Files
+ *                whose size isn't known (-1) are started last.
+ * @param out - Where the status messages end up, in the order of the files.
+ * @param err - Where the error messages end up, likewise.
+ * @return true if every file went well.
+ */
+bool batch_run(pool_t *pool, size_t count, const long int *sizes,
+			   batch_fn_t fn, void *arg, FILE *out, FILE *err) {
+  batch_t batch;
+  batch_file_t *files;
+  size_t i;
+  bool ok;
+
+  batch.fn = fn;
+  batch.arg = arg;
+  batch.count = count;
+  batch.printed = 0;
+  batch.out = out;
+  batch.err = err;
+  batch.order = (size_t*)malloc(count * sizeof(size_t));
+  batch.reports = (report_t*)calloc(count, sizeof(report_t));
+  files = (batch_file_t*)malloc(count * sizeof(batch_file_t));
+
+  /* Without memory to keep track, just do them one at a time */
+  if (batch.order == NULL || batch.reports == NULL || files == NULL) {
+	free(batch.order);
+	free(batch.reports);
+	free(files);
+	ok = true;
+	for (i = 0; i < count; i++)
+	  ok = fn(arg, i, out, err) && ok;
+	return ok;
+  }
+
+  for (i = 0; i < count; i++) {
+	files[i].size = sizes[i];
+	files[i].index = i;
+  }
+  qsort(files, count, sizeof(batch_file_t), compare_files);
+  for (i = 0; i < count; i++)
+	batch.order[i] = files[i].index;
+  free(files);
+
+  pthread_mutex_init(&batch.lock, NULL);
+  pool_run(pool, count, batch_chunk, &batch);
+  pthread_mutex_destroy(&batch.lock);
+
+  ok = true;
+  for (i = 0; i < count; i++)
+	ok = batch.reports[i].ok && ok;
+
+  free(batch.order);
+  free(batch.reports);
+  return ok;
+}
@@ -0,0 +1,554 @@
+/**
+ * Bitsliced, constant-time AES engine
+ *
+ * The T-table and byte-wise engines look up table entries indexed by secret
+ * data, so an attacker who can watch the cache can learn something about the
+ * key. This engine never does that. Instead of storing one byte per byte, it
+ * stores the state "bitsliced": eight words, where word i holds bit i of every
+ * byte of several blocks at once. SubBytes then becomes a fixed circuit of
+ * AND/XOR gates over those eight words (the 113-gate circuit by Boyar and
+ * Peralta), and ShiftRows and MixColumns become masks, shifts and rotates.
+ * Every block takes exactly the same instructions no matter what it holds.
+ *
+ * Each 64-bit lane of a word carries 4 blocks, and a word has BS_LANES lanes,
+ * so BS_BLOCKS blocks go through the cipher together. Within a lane, the byte
+ * in row r and column c of block k sits at bit 16 * r + 4 * c + k. A row of
+ * the state is then a 16-bit field (handy for ShiftRows), and moving from one
+ * row to the next is a 16-bit rotate (handy for MixColumns).
+ *
+ * The words use GCC vector types, so the compiler emits SSE2 code for them by
+ * default, and we also build an AVX2 version of the entry points that runs
+ * when the CPU supports it.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aes.h"
+
+#define BS_LANES 4
+#define BS_BLOCKS (4 * BS_LANES)
+
+typedef uint64_t bs_word __attribute__((vector_size(8 * BS_LANES)));
+
+#define BS_INLINE static inline __attribute__((always_inline))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BS_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define BS_CLONES
+#endif
+
+/*
+  --PACKING--
+ */
+
+/**
+ * Swaps the bits selected by 'mask' in 'b' with the bits 'shift' places above
+ * them in 'a'.
+ */
+#define SWAPMOVE(a, b, mask, shift) do { \
+	bs_word t_ = (((a) >> (shift)) ^ (b)) & (mask); \
+	(b) ^= t_; \
+	(a) ^= t_ << (shift); } while (0)
+
+/**
+ * Transposes each 8x8 bit matrix formed by the same byte of the eight words.
+ * After this, bit j of byte m of word i is what bit i of byte m of word j was.
+ * Doing it twice gets the original words back.
+ */
+BS_INLINE void ortho(bs_word *q) {
+  SWAPMOVE(q[0], q[1], 0x5555555555555555ULL, 1);
+  SWAPMOVE(q[2], q[3], 0x5555555555555555ULL, 1);
+  SWAPMOVE(q[4], q[5], 0x5555555555555555ULL, 1);
+  SWAPMOVE(q[6], q[7], 0x5555555555555555ULL, 1);
+
+  SWAPMOVE(q[0], q[2], 0x3333333333333333ULL, 2);
+  SWAPMOVE(q[1], q[3], 0x3333333333333333ULL, 2);
+  SWAPMOVE(q[4], q[6], 0x3333333333333333ULL, 2);
+  SWAPMOVE(q[5], q[7], 0x3333333333333333ULL, 2);
+
+  SWAPMOVE(q[0], q[4], 0x0F0F0F0F0F0F0F0FULL, 4);
+  SWAPMOVE(q[1], q[5], 0x0F0F0F0F0F0F0F0FULL, 4);
+  SWAPMOVE(q[2], q[6], 0x0F0F0F0F0F0F0F0FULL, 4);
+  SWAPMOVE(q[3], q[7], 0x0F0F0F0F0F0F0F0FULL, 4);
+}
+
+/* Loads/stores a little-endian 64-bit word */
+BS_INLINE uint64_t load_le64(const uint8_t *p) {
+  return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16)
+	| ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40)
+	| ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+BS_INLINE void store_le64(uint8_t *p, uint64_t x) {
+  int i;
+  for (i = 0; i < 8; i++)
+	p[i] = (uint8_t)(x >> (8 * i));
+}
+
+/* Moves byte j of a 32-bit value to byte 2j of a 64-bit one */
+BS_INLINE uint64_t spread_bytes(uint64_t x) {
+  x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+  return x;
+}
+
+/* Undoes spread_bytes(), ignoring the odd bytes */
+BS_INLINE uint64_t gather_bytes(uint64_t x) {
+  x &= 0x00FF00FF00FF00FFULL;
+  x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+  return x;
+}
+
+/**
+ * Loads BS_BLOCKS blocks into bitsliced form.
+ *
+ * Bit position p = 16 * r + 4 * c + k of a lane lands in byte p / 8 of word
+ * p % 8 before the transpose, so word k (k < 4) of a lane must hold, byte by
+ * byte, block k's bytes 0, 8, 1, 9, 2, 10, 3, 11 (columns 0 and 2), and word
+ * k + 4 its bytes 4, 12, 5, 13, ... (columns 1 and 3). That's an interleave of
+ * the two halves of the block. ortho() then swaps the word number with the
+ * bit number within each byte.
+ */
+BS_INLINE void load_blocks(bs_word *q, const uint8_t *in) {
+  int l, k;
+  uint64_t x, y;
+
+  for (l = 0; l < BS_LANES; l++) {
+	for (k = 0; k < 4; k++) {
+	  x = load_le64(in);
+	  y = load_le64(in + 8);
+	  q[k][l] = spread_bytes(x & 0xFFFFFFFF)
+		| (spread_bytes(y & 0xFFFFFFFF) << 8);
+	  q[k + 4][l] = spread_bytes(x >> 32) | (spread_bytes(y >> 32) << 8);
+	  in += AES_BLOCK_SIZE;
+	}
+  }
+  ortho(q);
+}
+
+/**
+ * Stores the bitsliced state back out as BS_BLOCKS blocks.
+ */
+BS_INLINE void store_blocks(bs_word *q, uint8_t *out) {
+  int l, k;
+  uint64_t a, b;
+
+  ortho(q);
+  for (l = 0; l < BS_LANES; l++) {
+	for (k = 0; k < 4; k++) {
+	  a = q[k][l];
+	  b = q[k + 4][l];
+	  store_le64(out, gather_bytes(a) | (gather_bytes(b) << 32));
+	  store_le64(out + 8, gather_bytes(a >> 8) | (gather_bytes(b >> 8) << 32));
+	  out += AES_BLOCK_SIZE;
+	}
+  }
+}
+
+/**
+ * Bitslices every round key of a key block. The key is the same for all the
+ * blocks, so we just load it into all of them.
+ */
+static void load_round_keys(bs_word (*sk)[8], const uint8_t *key_block,
+							int num_rounds) {
+  uint8_t copies[BS_BLOCKS * AES_BLOCK_SIZE];
+  int r, b;
+
+  for (r = 0; r <= num_rounds; r++) {
+	for (b = 0; b < BS_BLOCKS; b++)
+	  memcpy(copies + b * AES_BLOCK_SIZE, key_block + 16 * r, AES_BLOCK_SIZE);
+	load_blocks(sk[r], copies);
+  }
+}
+
+/*
+  --ROUND FUNCTIONS--
+ */
+
+/**
+ * SubBytes as a boolean circuit (Boyar and Peralta, "A depth-16 circuit for
+ * the AES S-box"). q[i] holds bit i of every byte.
+ */
+BS_INLINE void sbox(bs_word *q) {
+  bs_word x0, x1, x2, x3, x4, x5, x6, x7;
+  bs_word y1, y2, y3, y4, y5, y6, y7, y8, y9;
+  bs_word y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+  bs_word y20, y21;
+  bs_word z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+  bs_word z10, z11, z12, z13, z14, z15, z16, z17;
+  bs_word t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+  bs_word t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+  bs_word t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+  bs_word t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+  bs_word t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+  bs_word t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+  bs_word t60, t61, t62, t63, t64, t65, t66, t67;
+  bs_word s0, s1, s2, s3, s4, s5, s6, s7;
+
+  x0 = q[7]; x1 = q[6]; x2 = q[5]; x3 = q[4];
+  x4 = q[3]; x5 = q[2]; x6 = q[1]; x7 = q[0];
+
+  /* Top linear transformation */
+  y14 = x3 ^ x5;
+  y13 = x0 ^ x6;
+  y9 = x0 ^ x3;
+  y8 = x0 ^ x5;
+  t0 = x1 ^ x2;
+  y1 = t0 ^ x7;
+  y4 = y1 ^ x3;
+  y12 = y13 ^ y14;
+  y2 = y1 ^ x0;
+  y5 = y1 ^ x6;
+  y3 = y5 ^ y8;
+  t1 = x4 ^ y12;
+  y15 = t1 ^ x5;
+  y20 = t1 ^ x1;
+  y6 = y15 ^ x7;
+  y10 = y15 ^ t0;
+  y11 = y20 ^ y9;
+  y7 = x7 ^ y11;
+  y17 = y10 ^ y11;
+  y19 = y10 ^ y8;
+  y16 = t0 ^ y11;
+  y21 = y13 ^ y16;
+  y18 = x0 ^ y16;
+
+  /* Non-linear section */
+  t2 = y12 & y15;
+  t3 = y3 & y6;
+  t4 = t3 ^ t2;
+  t5 = y4 & x7;
+  t6 = t5 ^ t2;
+  t7 = y13 & y16;
+  t8 = y5 & y1;
+  t9 = t8 ^ t7;
+  t10 = y2 & y7;
+  t11 = t10 ^ t7;
+  t12 = y9 & y11;
+  t13 = y14 & y17;
+  t14 = t13 ^ t12;
+  t15 = y8 & y10;
+  t16 = t15 ^ t12;
+  t17 = t4 ^ t14;
+  t18 = t6 ^ t16;
+  t19 = t9 ^ t14;
+  t20 = t11 ^ t16;
+  t21 = t17 ^ y20;
+  t22 = t18 ^ y19;
+  t23 = t19 ^ y21;
+  t24 = t20 ^ y18;
+
+  t25 = t21 ^ t22;
+  t26 = t21 & t23;
+  t27 = t24 ^ t26;
+  t28 = t25 & t27;
+  t29 = t28 ^ t22;
+  t30 = t23 ^ t24;
+  t31 = t22 ^ t26;
+  t32 = t31 & t30;
+  t33 = t32 ^ t24;
+  t34 = t23 ^ t33;
+  t35 = t27 ^ t33;
+  t36 = t24 & t35;
+  t37 = t36 ^ t34;
+  t38 = t27 ^ t36;
+  t39 = t29 & t38;
+  t40 = t25 ^ t39;
+
+  t41 = t40 ^ t37;
+  t42 = t29 ^ t33;
+  t43 = t29 ^ t40;
+  t44 = t33 ^ t37;
+  t45 = t42 ^ t41;
+  z0 = t44 & y15;
+  z1 = t37 & y6;
+  z2 = t33 & x7;
+  z3 = t43 & y16;
+  z4 = t40 & y1;
+  z5 = t29 & y7;
+  z6 = t42 & y11;
+  z7 = t45 & y17;
+  z8 = t41 & y10;
+  z9 = t44 & y12;
+  z10 = t37 & y3;
+  z11 = t33 & y4;
+  z12 = t43 & y13;
+  z13 = t40 & y5;
+  z14 = t29 & y2;
+  z15 = t42 & y9;
+  z16 = t45 & y14;
+  z17 = t41 & y8;
+
+  /* Bottom linear transformation */
+  t46 = z15 ^ z16;
+  t47 = z10 ^ z11;
+  t48 = z5 ^ z13;
+  t49 = z9 ^ z10;
+  t50 = z2 ^ z12;
+  t51 = z2 ^ z5;
+  t52 = z7 ^ z8;
+  t53 = z0 ^ z3;
+  t54 = z6 ^ z7;
+  t55 = z16 ^ z17;
+  t56 = z12 ^ t48;
+  t57 = t50 ^ t53;
+  t58 = z4 ^ t46;
+  t59 = z3 ^ t54;
+  t60 = t46 ^ t57;
+  t61 = z14 ^ t57;
+  t62 = t52 ^ t58;
+  t63 = t49 ^ t58;
+  t64 = z4 ^ t59;
+  t65 = t61 ^ t62;
+  t66 = z1 ^ t63;
+  s0 = t59 ^ t63;
+  s6 = t56 ^ ~t62;
+  s7 = t48 ^ ~t60;
+  t67 = t64 ^ t65;
+  s3 = t53 ^ t66;
+  s4 = t51 ^ t66;
+  s5 = t47 ^ t65;
+  s1 = t64 ^ ~s3;
+  s2 = t55 ^ ~t67;
+
+  q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+  q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+/**
+ * The inverse of the affine transform inside the S-box (including the 0x63
+ * constant). InvSubBytes is this, then SubBytes, then this again: the first
+ * application undoes the affine transform, SubBytes inverts the field element
+ * and re-applies it, and the second undoes it once more.
+ */
+BS_INLINE void inv_affine(bs_word *q) {
+  bs_word q0, q1, q2, q3, q4, q5, q6, q7;
+
+  q0 = ~q[0]; q1 = ~q[1]; q2 = q[2]; q3 = q[3];
+  q4 = q[4]; q5 = ~q[5]; q6 = ~q[6]; q7 = q[7];
+
+  q[7] = q1 ^ q4 ^ q6;
+  q[6] = q0 ^ q3 ^ q5;
+  q[5] = q7 ^ q2 ^ q4;
+  q[4] = q6 ^ q1 ^ q3;
+  q[3] = q5 ^ q0 ^ q2;
+  q[2] = q4 ^ q7 ^ q1;
+  q[1] = q3 ^ q6 ^ q0;
+  q[0] = q2 ^ q5 ^ q7;
+}
+
+BS_INLINE void inv_sbox(bs_word *q) {
+  inv_affine(q);
+  sbox(q);
+  inv_affine(q);
+}
+
+/**
+ * ShiftRows. Row r is the 16-bit field at bit 16 * r of each lane, holding
+ * four blocks per column, so rotating row r left by r columns is a rotate of
+ * that field by 4 * r bits.
+ */
+BS_INLINE void shift_rows(bs_word *q) {
+  int i;
+  bs_word x;
+
+  for (i = 0; i < 8; i++) {
+	x = q[i];
+	q[i] = (x & 0x000000000000FFFFULL)
+	  | ((x & 0x00000000FFF00000ULL) >> 4)
+	  | ((x & 0x00000000000F0000ULL) << 12)
+	  | ((x & 0x0000FF0000000000ULL) >> 8)
+	  | ((x & 0x000000FF00000000ULL) << 8)
+	  | ((x & 0xF000000000000000ULL) >> 12)
+	  | ((x & 0x0FFF000000000000ULL) << 4);
+  }
+}
+
+BS_INLINE void shift_rows_inv(bs_word *q) {
+  int i;
+  bs_word x;
+
+  for (i = 0; i < 8; i++) {
+	x = q[i];
+	q[i] = (x & 0x000000000000FFFFULL)
+	  | ((x & 0x000000000FFF0000ULL) << 4)
+	  | ((x & 0x00000000F0000000ULL) >> 12)
+	  | ((x & 0x0000FF0000000000ULL) >> 8)
+	  | ((x & 0x000000FF00000000ULL) << 8)
+	  | ((x & 0x000F000000000000ULL) << 12)
+	  | ((x & 0xFFF0000000000000ULL) >> 4);
+  }
+}
+
+/* Moves every row of a lane up by one (row r + 1 lands in row r) */
+#define ROW_UP(x) (((x) >> 16) | ((x) << 48))
+
+/* Swaps rows 0/2 and 1/3 */
+#define ROW_SWAP(x) (((x) >> 32) | ((x) << 32))
+
+/**
+ * MixColumns. With a' = the state moved up one row, each column becomes
+ *
+ *   2*a ^ 3*a' ^ a'' ^ a''' = 2*(a ^ a') ^ a' ^ (a ^ a')''
+ *
+ * and multiplying by 2 (xtime) on bit planes is a shift of the planes with
+ * the reduction polynomial (0x1B: bits 0, 1, 3, 4) folded back in.
+ */
+BS_INLINE void mix_columns(bs_word *q) {
+  bs_word r[8], t[8];
+  int i;
+
+  for (i = 0; i < 8; i++) {
+	r[i] = ROW_UP(q[i]);
+	t[i] = q[i] ^ r[i];
+  }
+
+  q[0] = t[7] ^ r[0] ^ ROW_SWAP(t[0]);
+  q[1] = t[0] ^ t[7] ^ r[1] ^ ROW_SWAP(t[1]);
+  q[2] = t[1] ^ r[2] ^ ROW_SWAP(t[2]);
+  q[3] = t[2] ^ t[7] ^ r[3] ^ ROW_SWAP(t[3]);
+  q[4] = t[3] ^ t[7] ^ r[4] ^ ROW_SWAP(t[4]);
+  q[5] = t[4] ^ r[5] ^ ROW_SWAP(t[5]);
+  q[6] = t[5] ^ r[6] ^ ROW_SWAP(t[6]);
+  q[7] = t[6] ^ r[7] ^ ROW_SWAP(t[7]);
+}
+
+/**
+ * InvMixColumns. The InvMixColumns polynomial factors into the MixColumns
+ * polynomial times (4x^2 + 5), so we first replace each column with
+ * a ^ 4*(a ^ a'') and then run the normal MixColumns.
+ */
+BS_INLINE void mix_columns_inv(bs_word *q) {
+  bs_word u[8];
+  int i;
+
+  for (i = 0; i < 8; i++)
+	u[i] = q[i] ^ ROW_SWAP(q[i]);
+
+  /* 4*u: xtime twice, with the 0x1B reduction applied for bits 7 and 6 */
+  q[0] ^= u[6];
+  q[1] ^= u[6] ^ u[7];
+  q[2] ^= u[0] ^ u[7];
+  q[3] ^= u[1] ^ u[6];
+  q[4] ^= u[2] ^ u[6] ^ u[7];
+  q[5] ^= u[3] ^ u[7];
+  q[6] ^= u[4];
+  q[7] ^= u[5];
+
+  mix_columns(q);
+}
+
+BS_INLINE void add_round_key(bs_word *q, const bs_word *sk) {
+  int i;
+  for (i = 0; i < 8; i++)
+	q[i] ^= sk[i];
+}
+
+/*
+  --ENGINE ENTRY POINTS--
+ */
+
+/**
+ * Encrypts a run of 16-byte blocks. Blocks are processed BS_BLOCKS at a time;
+ * a short final group is padded out with zeros in a scratch buffer.
+ */
+BS_CLONES
+void bitslice_encrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+					  size_t num_blocks) {
+  bs_word sk[15][8], q[8];
+  uint8_t scratch[BS_BLOCKS * AES_BLOCK_SIZE];
+  size_t n;
+  int r, num_rounds;
+
+  num_rounds = (key->size / 4) + 6;
+  load_round_keys(sk, key->exp_block, num_rounds);
+
+  while (num_blocks > 0) {
+	n = num_blocks < BS_BLOCKS ? num_blocks : BS_BLOCKS;
+	if (n < BS_BLOCKS) {
+	  memset(scratch, 0, sizeof(scratch));
+	  memcpy(scratch, in, n * AES_BLOCK_SIZE);
+	  load_blocks(q, scratch);
+	}
+	else {
+	  load_blocks(q, in);
+	}
+
+	add_round_key(q, sk[0]);
+	for (r = 1; r < num_rounds; r++) {
+	  sbox(q);
+	  shift_rows(q);
+	  mix_columns(q);
+	  add_round_key(q, sk[r]);
+	}
+	sbox(q);
+	shift_rows(q);
+	add_round_key(q, sk[num_rounds]);
+
+	if (n < BS_BLOCKS) {
+	  store_blocks(q, scratch);
+	  memcpy(out, scratch, n * AES_BLOCK_SIZE);
+	}
+	else {
+	  store_blocks(q, out);
+	}
+
+	in += n * AES_BLOCK_SIZE;
+	out += n * AES_BLOCK_SIZE;
+	num_blocks -= n;
+  }
+}
+
+/**
+ * Decrypts a run of 16-byte blocks with the equivalent inverse cipher.
+ */
+BS_CLONES
+void bitslice_decrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+					  size_t num_blocks) {
+  bs_word sk[15][8], q[8];
+  uint8_t scratch[BS_BLOCKS * AES_BLOCK_SIZE];
+  size_t n;
+  int r, num_rounds;
+
+  num_rounds = (key->size / 4) + 6;
+  load_round_keys(sk, key->dec_block, num_rounds);
+
+  while (num_blocks > 0) {
+	n = num_blocks < BS_BLOCKS ? num_blocks : BS_BLOCKS;
+	if (n < BS_BLOCKS) {
+	  memset(scratch, 0, sizeof(scratch));
+	  memcpy(scratch, in, n * AES_BLOCK_SIZE);
+	  load_blocks(q, scratch);
+	}
+	else {
+	  load_blocks(q, in);
+	}
+
+	add_round_key(q, sk[0]);
+	for (r = 1; r < num_rounds; r++) {
+	  inv_sbox(q);
+	  shift_rows_inv(q);
+	  mix_columns_inv(q);
+	  add_round_key(q, sk[r]);
+	}
+	inv_sbox(q);
+	shift_rows_inv(q);
+	add_round_key(q, sk[num_rounds]);
+
+	if (n < BS_BLOCKS) {
+	  store_blocks(q, scratch);
+	  memcpy(out, scratch, n * AES_BLOCK_SIZE);
+	}
+	else {
+	  store_blocks(q, out);
+	}
+
+	in += n * AES_BLOCK_SIZE;
+	out += n * AES_BLOCK_SIZE;
+	num_blocks -= n;
+  }
+}
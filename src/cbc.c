@@ -0,0 +1,182 @@
+/**
+ * Cipher Block Chaining (CBC) mode
+ *
+ * In CBC mode each plaintext block is XOR'ed with the previous ciphertext
+ * block (or the IV from the file header, for the first one) before it is
+ * encrypted. The plaintext is padded to a whole number of blocks PKCS#7 style:
+ * with n bytes of value n, where n is 1 to 16, so there is always at least one
+ * byte of padding and the decryptor knows how much to strip.
+ *
+ * Encryption is serial, since every block needs the ciphertext of the one
+ * before it. Decryption isn't: plaintext block i is D(C[i]) XOR C[i-1], and all
+ * of the ciphertext is right there in the buffer. So we decrypt whole runs of
+ * blocks with the engine (which keeps eight or more blocks in flight) and XOR
+ * in the previous ciphertext afterwards, and chunks of the buffer can be
+ * decrypted on different threads.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "aes.h"
+
+/**
+ * XORs one block into another.
+ */
+static inline void xor_block(uint8_t *out, const uint8_t *a, const uint8_t *b) {
+  uint64_t x[2], y[2];
+
+  memcpy(x, a, AES_BLOCK_SIZE);
+  memcpy(y, b, AES_BLOCK_SIZE);
+  x[0] ^= y[0];
+  x[1] ^= y[1];
+  memcpy(out, x, AES_BLOCK_SIZE);
+}
+
+/**
+ * Encrypts whole blocks in CBC mode. 'in' and 'out' may be the same buffer.
+ *
+ * @param iv - The previous ciphertext block. Updated to the last block of
+ *             'out', so the next call carries on the chain.
+ */
+void cbc_encrypt(const aes_engine_t *engine, const aes_key_t *key,
+				 uint8_t *iv, const uint8_t *in, uint8_t *out,
+				 size_t num_blocks) {
+  uint8_t block[AES_BLOCK_SIZE];
+  size_t i;
+
+  memcpy(block, iv, AES_BLOCK_SIZE);
+  for (i = 0; i < num_blocks; i++) {
+	xor_block(block, block, in + AES_BLOCK_SIZE * i);
+	engine->encrypt(key, block, block, 1);
+	memcpy(out + AES_BLOCK_SIZE * i, block, AES_BLOCK_SIZE);
+  }
+  memcpy(iv, block, AES_BLOCK_SIZE);
+}
+
+/**
+ * Encrypts several buffers in CBC mode at once, each with its own IV. Each
+ * chain has to be done one block after another, but the chains don't depend on
+ * each other, so we step through them together and give the engine one block
+ * from every lane per call. The engine can then work on the blocks side by
+ * side rather than wait for each one to come out before starting the next.
+ *
+ * @param lanes - Up to AES_LANES buffers, each a whole number of blocks.
+ */
+void cbc_encrypt_multi(const aes_engine_t *engine, const aes_key_t *key,
+					   const aes_lane_t *lanes, size_t num_lanes) {
+  uint8_t blocks[AES_LANES * AES_BLOCK_SIZE] __attribute__((aligned(16)));
+  size_t active[AES_LANES];
+  const uint8_t *prev;
+  size_t l, n, i, offset;
+
+  for (offset = 0; ; offset += AES_BLOCK_SIZE) {
+	/* Chain the next block of every lane that has one */
+	n = 0;
+	for (l = 0; l < num_lanes; l++) {
+	  if (offset >= lanes[l].len)
+		continue;
+	  prev = offset == 0 ? lanes[l].iv : lanes[l].out + offset - AES_BLOCK_SIZE;
+	  xor_block(blocks + AES_BLOCK_SIZE * n, prev, lanes[l].in + offset);
+	  active[n++] = l;
+	}
+	if (n == 0)
+	  break;
+
+	engine->encrypt(key, blocks, blocks, n);
+	for (i = 0; i < n; i++)
+	  memcpy(lanes[active[i]].out + offset, blocks + AES_BLOCK_SIZE * i,
+			 AES_BLOCK_SIZE);
+  }
+}
+
+/* One buffer being decrypted by the pool */
+struct cbc_job
+{
+  const aes_engine_t *engine;
+  const aes_key_t *key;
+  const uint8_t *iv;
+  const uint8_t *in;
+  uint8_t *out;
+  size_t num_blocks;
+};
+
+/* Decrypts chunk i of a job. */
+static void cbc_chunk(void *arg, size_t i) {
+  const struct cbc_job *job = arg;
+  const uint8_t *in, *prev;
+  uint8_t *out;
+  size_t first, n, b;
+
+  first = i * (AES_CHUNK_SIZE / AES_BLOCK_SIZE);
+  n = job->num_blocks - first;
+  if (n > AES_CHUNK_SIZE / AES_BLOCK_SIZE)
+	n = AES_CHUNK_SIZE / AES_BLOCK_SIZE;
+
+  in = job->in + AES_BLOCK_SIZE * first;
+  out = job->out + AES_BLOCK_SIZE * first;
+  prev = first == 0 ? job->iv : in - AES_BLOCK_SIZE;
+
+  job->engine->decrypt(job->key, in, out, n);
+
+  xor_block(out, out, prev);
+  for (b = 1; b < n; b++)
+	xor_block(out + AES_BLOCK_SIZE * b, out + AES_BLOCK_SIZE * b,
+			  in + AES_BLOCK_SIZE * (b - 1));
+}
+
+/**
+ * Decrypts whole blocks in CBC mode, one chunk per thread of 'pool'. 'in' and
+ * 'out' must not overlap, since the ciphertext is still needed after it has
+ * been decrypted.
+ *
+ * @param iv - The ciphertext block before 'in' (or the IV).
+ */
+void cbc_decrypt_parallel(pool_t *pool, const aes_engine_t *engine,
+						  const aes_key_t *key, const uint8_t *iv,
+						  const uint8_t *in, uint8_t *out, size_t num_blocks) {
+  struct cbc_job job = { engine, key, iv, in, out, num_blocks };
+
+  pool_run(pool, (num_blocks + AES_CHUNK_SIZE / AES_BLOCK_SIZE - 1)
+		   / (AES_CHUNK_SIZE / AES_BLOCK_SIZE), cbc_chunk, &job);
+}
+
+/**
+ * Pads the end of the plaintext out to a whole block.
+ *
+ * @param buf - The plaintext, with room for AES_BLOCK_SIZE more bytes.
+ * @param len - Number of bytes of plaintext.
+ * @return The padded length.
+ */
+size_t cbc_pad(uint8_t *buf, size_t len) {
+  size_t n = AES_BLOCK_SIZE - len % AES_BLOCK_SIZE;
+
+  memset(buf + len, (int)n, n);
+  return len + n;
+}
+
+/**
+ * Works out how much padding to strip from the end of the plaintext.
+ *
+ * @param buf - The decrypted data, ending with the last block of the file.
+ * @param len - Number of bytes in 'buf'; at least one block.
+ * @param out_len - Set to the length without the padding.
+ * @return false if the padding is not valid, which means the key is wrong or
+ *         the file has been damaged.
+ */
+bool cbc_unpad(const uint8_t *buf, size_t len, size_t *out_len) {
+  uint8_t n = buf[len - 1];
+  size_t i;
+
+  if (n == 0 || n > AES_BLOCK_SIZE)
+	return false;
+  for (i = 1; i <= n; i++) {
+	if (buf[len - i] != n)
+	  return false;
+  }
+
+  *out_len = len - n;
+  return true;
+}
@@ -0,0 +1,199 @@
+/**
+ * Checkpoints
+ *
+ * Encrypting or decrypting a very large file can take hours, and with
+ * --resume a run that dies part way doesn't have to start again from the
+ * beginning. Every CHECKPOINT_INTERVAL bytes of output, the output is synced
+ * to disk (see output_sync()) and a checkpoint file next to it is rewritten
+ * with how much of it is there:
+ *
+ *  offset  size  field
+ *       0     4  magic, "AESC"
+ *       4     1  version (3)
+ *       5     1  1 if decrypting, 0 if encrypting
+ *       8    32  the cipher file header
+ *      40    16  key check (see inplace_key_check())
+ *      56     8  size of the input file
+ *      64     8  bytes of output on disk
+ *
+ * Only the modes in which every block, data unit or chunk is ciphered on its
+ * own can be picked up part way: CTR, XTS and chunked mode. All they need to
+ * start again is the header and a position, as the counter, data unit number
+ * or chunk number follows from where in the file they are. GCM would also
+ * need its running hash, and that can't be written out in the clear without
+ * giving away the hash key.
+ *
+ * A resumed run goes back to the last whole step (block, data unit or chunk)
+ * that is on disk and carries on from there. The header and the key check are
+ * compared with the ones the run started with. All numbers are big-endian.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "aes.h"
+
+#define CHECKPOINT_MAGIC "AESC"
+#define CHECKPOINT_VERSION 3
+
+/* Bytes in a checkpoint file */
+#define CHECKPOINT_SIZE 72
+
+/* Reads a big-endian 64-bit number */
+static uint64_t get_be64(const uint8_t *p) {
+  uint64_t v = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+	v = (v << 8) | p[i];
+  return v;
+}
+
+/* Writes a big-endian 64-bit number */
+static void put_be64(uint8_t *p, uint64_t v) {
+  int i;
+
+  for (i = 7; i >= 0; i--) {
+	p[i] = v & 0xFF;
+	v >>= 8;
+  }
+}
+
+/**
+ * Checks whether files in a mode can be picked up part way.
+ */
+bool checkpoint_mode(aes_mode_t mode) {
+  return mode == mode_ctr || mode == mode_xts || mode == mode_chunked;
+}
+
+/**
+ * Reads the checkpoint a run left behind. Whether it belongs to this run is
+ * up to the caller.
+ *
+ * @return false if there isn't one, or it is damaged, in which case nothing
+ *         of the output can be trusted to be there.
+ */
+bool checkpoint_load(checkpoint_t *cp) {
+  uint8_t buf[CHECKPOINT_SIZE];
+  ssize_t got;
+
+  do {
+	got = pread(cp->fd, buf, sizeof(buf), 0);
+  } while (got < 0 && errno == EINTR);
+  if (got != sizeof(buf) || memcmp(buf, CHECKPOINT_MAGIC, 4) != 0
+	  || buf[4] != CHECKPOINT_VERSION || !header_decode(buf + 8, &cp->header)
+	  || !checkpoint_mode(cp->header.mode))
+	return false;
+
+  cp->decrypt = buf[5] != 0;
+  memcpy(cp->key_check, buf + 40, sizeof(cp->key_check));
+  cp->in_size = get_be64(buf + 56);
+  cp->done = get_be64(buf + 64);
+  return true;
+}
+
+/**
+ * Writes the checkpoint, and syncs it. The output must already be on disk as
+ * far as cp->done.
+ *
+ * @return false if it couldn't be written.
+ */
+bool checkpoint_save(checkpoint_t *cp) {
+  uint8_t buf[CHECKPOINT_SIZE];
+  ssize_t put;
+
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, CHECKPOINT_MAGIC, 4);
+  buf[4] = CHECKPOINT_VERSION;
+  buf[5] = cp->decrypt;
+  header_encode(&cp->header, buf + 8);
+  memcpy(buf + 40, cp->key_check, sizeof(cp->key_check));
+  put_be64(buf + 56, cp->in_size);
+  put_be64(buf + 64, cp->done);
+
+  do {
+	put = pwrite(cp->fd, buf, sizeof(buf), 0);
+  } while (put < 0 && errno == EINTR);
+  return put == sizeof(buf) && fdatasync(cp->fd) == 0;
+}
+
+/**
+ * Saves a checkpoint if another CHECKPOINT_INTERVAL bytes of output have been
+ * written since the last one. Called between buffers, when the output holds
+ * only whole steps.
+ *
+ * @return false if the output or the checkpoint couldn't be synced.
+ */
+bool checkpoint_update(checkpoint_t *cp, aes_output_t *out) {
+  long int synced;
+
+  if (cp->out_pos + out->pos < cp->done + CHECKPOINT_INTERVAL)
+	return true;
+
+  synced = output_sync(out);
+  if (synced < 0)
+	return false;
+  cp->done = cp->out_pos + synced;
+  return checkpoint_save(cp);
+}
+
+/**
+ * Works out where to pick up a run from its checkpoint: the start of the last
+ * whole step of the output that is on disk. A step that the end of the file
+ * depends on is done again, as XTS mode steals from the unit before a scrap,
+ * and the last chunk is marked as the last.
+ *
+ * Sets cp->in_pos and cp->out_pos to where to start reading and writing.
+ *
+ * @return false if nothing can be kept, and the run should start afresh.
+ */
+bool checkpoint_resume(checkpoint_t *cp) {
+  uint64_t plain_step, cipher_step, plain_size, n;
+  long int size;
+
+  plain_step = cipher_step = AES_BLOCK_SIZE;
+  if (cp->header.mode == mode_xts) {
+	plain_step = cipher_step = cp->header.param;
+  }
+  else if (cp->header.mode == mode_chunked) {
+	plain_step = cp->header.param;
+	cipher_step = plain_step + GCM_TAG_SIZE;
+  }
+  if (plain_step == 0 || cp->in_size < (cp->decrypt ? AES_HEADER_SIZE : 0))
+	return false;
+
+  if (cp->decrypt) {
+	size = cp->in_size - AES_HEADER_SIZE;
+	if (cp->header.mode == mode_chunked)
+	  size = chunked_plain_size(size, plain_step);
+	if (size < 0)
+	  return false;
+	plain_size = size;
+	n = cp->done / plain_step;
+  }
+  else {
+	if (cp->done < AES_HEADER_SIZE)
+	  return false;
+	n = (cp->done - AES_HEADER_SIZE) / cipher_step;
+	plain_size = cp->in_size;
+  }
+
+  if (n > plain_size / plain_step)
+	n = plain_size / plain_step;
+  if (n > 0 && plain_size - n * plain_step < (cp->header.mode == mode_xts
+											  ? AES_BLOCK_SIZE : 1))
+	n--;
+  if (n == 0)
+	return false;
+
+  cp->in_pos = cp->decrypt ? AES_HEADER_SIZE + n * cipher_step
+	: n * plain_step;
+  cp->out_pos = cp->decrypt ? n * plain_step
+	: AES_HEADER_SIZE + n * cipher_step;
+  cp->done = cp->out_pos;
+  return true;
+}
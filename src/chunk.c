@@ -0,0 +1,217 @@
+/**
+ * Chunked mode
+ *
+ * A GCM file has to be read from the start to check its tag, so even a few
+ * bytes from the middle of it cost a pass over the whole file. A chunked file
+ * is cut into chunks of a fixed size (the mode parameter in the header), and
+ * each chunk is encrypted in GCM mode on its own, with its tag right after it:
+ *
+ *  header | chunk 0 | tag 0 | chunk 1 | tag 1 | ... | last chunk | last tag
+ *
+ * Every chunk but the last is full, so chunk i always starts at
+ * AES_HEADER_SIZE + i * (chunk size + GCM_TAG_SIZE), and the length of the
+ * file is all the chunk index there needs to be. A range of plaintext is
+ * decrypted by seeking straight to the chunks that cover it, and only their
+ * tags are checked, so the cost depends on the size of the range, not of the
+ * file.
+ *
+ * Every file is encrypted with a key of its own, made from the header's nonce
+ * (see header_file_key()), so its chunks can't share a nonce with the chunks
+ * of another file unless the two headers share all 96 bits of theirs. A
+ * chunk's nonce is then 7 zero bytes, a byte that is 1 for the last chunk and
+ * 0 for the others, and the chunk number as a big-endian 32-bit number. The
+ * header is the additional authenticated data of every chunk. So chunks can't
+ * be moved, swapped in from another file, or cut off the end without a tag
+ * failing. An empty file still has one, empty, chunk.
+ *
+ * Chunks don't depend on each other, so the pool ciphers a chunk per thread.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "aes.h"
+
+/* Most chunks in one file, as the chunk number is 32 bits */
+#define CHUNKED_MAX_CHUNKS 0xFFFFFFFFULL
+
+/* A run of chunks being ciphered by the pool */
+struct chunked_job
+{
+  const chunked_t *chunked;
+  bool decrypt;
+  uint64_t first; /* Number of the first chunk */
+  size_t count; /* Number of chunks */
+  bool last; /* The run ends with the last chunk of the file */
+  const uint8_t *in;
+  uint8_t *out;
+  size_t len; /* Bytes of plaintext */
+  bool failed; /* A tag didn't match */
+};
+
+/**
+ * Checks that a chunk size is usable: a power of two, from CHUNKED_MIN_SIZE
+ * up to AES_CHUNK_SIZE.
+ */
+bool chunked_valid_size(size_t chunk_size) {
+  return chunk_size >= CHUNKED_MIN_SIZE && chunk_size <= AES_CHUNK_SIZE
+	&& (chunk_size & (chunk_size - 1)) == 0;
+}
+
+/**
+ * Sets up for ciphering the chunks of a file. The file's key and hash key are
+ * worked out once here, and the hash key copied for every chunk. The chunks
+ * refer to chunked->key, so 'chunked' must stay where it is while they are
+ * ciphered.
+ */
+void chunked_init(chunked_t *chunked, const aes_engine_t *engine,
+				  const aes_key_t *key, const aes_header_t *header) {
+  header_file_key(engine, key, header, &chunked->key);
+  gcm_init(&chunked->gcm, engine, &chunked->key, header->iv);
+  header_encode(header, chunked->header_buf);
+  chunked->chunk_size = header->param;
+}
+
+/**
+ * Works out how many chunks fit in a buffer of 'buffer_size' bytes, counting
+ * their tags. Always at least one; a buffer one block bigger than
+ * AES_CHUNK_SIZE has room for that.
+ */
+size_t chunked_per_buffer(size_t buffer_size, size_t chunk_size) {
+  size_t n = buffer_size / (chunk_size + GCM_TAG_SIZE);
+  return n > 0 ? n : 1;
+}
+
+/**
+ * Works out how long a chunked cipher file is.
+ *
+ * @param size - Size of the plaintext, or -1 if it isn't known.
+ * @return The size of the cipher file, or -1 if it isn't known.
+ */
+long int chunked_cipher_size(long int size, size_t chunk_size) {
+  long int chunks;
+
+  if (size < 0)
+	return -1;
+  chunks = size == 0 ? 1 : (size + chunk_size - 1) / chunk_size;
+  return AES_HEADER_SIZE + size + chunks * GCM_TAG_SIZE;
+}
+
+/**
+ * Works out how much plaintext a chunked cipher file holds.
+ *
+ * @param data_size - Size of the file after the header.
+ * @return The size of the plaintext, or -1 if no chunked file is that long.
+ */
+long int chunked_plain_size(long int data_size, size_t chunk_size) {
+  long int unit = chunk_size + GCM_TAG_SIZE;
+  long int chunks;
+
+  if (data_size < GCM_TAG_SIZE)
+	return -1;
+  chunks = (data_size + unit - 1) / unit;
+  if ((uint64_t)chunks > CHUNKED_MAX_CHUNKS
+	  || data_size - (chunks - 1) * unit < GCM_TAG_SIZE)
+	return -1;
+  return data_size - chunks * GCM_TAG_SIZE;
+}
+
+/**
+ * Ciphers and hashes chunk i of a job, starting a GCM message for it with its
+ * own nonce from a copy of the shared state.
+ */
+static void chunked_run(void *arg, size_t i) {
+  struct chunked_job *job = arg;
+  const chunked_t *chunked = job->chunked;
+  size_t size = chunked->chunk_size;
+  uint8_t iv[AES_BLOCK_SIZE], tag[GCM_TAG_SIZE];
+  const uint8_t *in;
+  uint8_t *out;
+  uint64_t number;
+  size_t len;
+  gcm_t gcm;
+
+  number = job->first + i;
+  len = job->len - i * size < size ? job->len - i * size : size;
+
+  memset(iv, 0, 7);
+  iv[7] = job->last && i == job->count - 1;
+  iv[8] = (number >> 24) & 0xFF;
+  iv[9] = (number >> 16) & 0xFF;
+  iv[10] = (number >> 8) & 0xFF;
+  iv[11] = number & 0xFF;
+
+  memcpy(&gcm, &chunked->gcm, sizeof(gcm));
+  gcm_restart(&gcm, iv);
+  gcm_aad(&gcm, chunked->header_buf, AES_HEADER_SIZE);
+
+  /* Ciphertext and tags are interleaved; plaintext is not */
+  if (job->decrypt) {
+	in = job->in + i * (size + GCM_TAG_SIZE);
+	out = job->out + i * size;
+	gcm_hash(&gcm, in, len);
+	ctr_crypt(gcm.engine, gcm.key, gcm.j0, 1, in, out, len);
+	gcm_tag(&gcm, tag);
+	if (!gcm_tag_equal(tag, in + len))
+	  __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+  }
+  else {
+	in = job->in + i * size;
+	out = job->out + i * (size + GCM_TAG_SIZE);
+	ctr_crypt(gcm.engine, gcm.key, gcm.j0, 1, in, out, len);
+	gcm_hash(&gcm, out, len);
+	gcm_tag(&gcm, out + len);
+  }
+}
+
+/**
+ * Encrypts a run of whole chunks, ending with a part chunk if it is the last.
+ * Each chunk's tag is written right after it, so the output is
+ * chunked_cipher_size() bytes longer than the input, less the header.
+ *
+ * @param first - Number of the first chunk in the run.
+ * @param last - The run ends with the last chunk of the file. An empty last
+ *               run is one empty chunk.
+ * @return false if the file has too many chunks.
+ */
+bool chunked_encrypt(pool_t *pool, const chunked_t *chunked, uint64_t first,
+					 bool last, const uint8_t *in, uint8_t *out, size_t len) {
+  struct chunked_job job = { chunked, false, first, 0, last, in, out, len,
+							 false };
+
+  job.count = (len + chunked->chunk_size - 1) / chunked->chunk_size;
+  if (job.count == 0 && last)
+	job.count = 1;
+  if (first + job.count > CHUNKED_MAX_CHUNKS)
+	return false;
+
+  pool_run(pool, job.count, chunked_run, &job);
+  return true;
+}
+
+/**
+ * Decrypts a run of chunks, each followed by its tag, into the plaintext. The
+ * plaintext must not be trusted unless this returns true.
+ *
+ * @param first - Number of the first chunk in the run.
+ * @param last - The run ends with the last chunk of the file.
+ * @param len - Bytes of ciphertext, counting the tags.
+ * @return false if a tag doesn't match, or the run is cut short.
+ */
+bool chunked_decrypt(pool_t *pool, const chunked_t *chunked, uint64_t first,
+					 bool last, const uint8_t *in, uint8_t *out, size_t len) {
+  struct chunked_job job = { chunked, true, first, 0, last, in, out, 0,
+							 false };
+  size_t unit = chunked->chunk_size + GCM_TAG_SIZE;
+
+  job.count = (len + unit - 1) / unit;
+  if (job.count == 0 || len - (job.count - 1) * unit < GCM_TAG_SIZE
+	  || first + job.count > CHUNKED_MAX_CHUNKS)
+	return false;
+  job.len = len - job.count * GCM_TAG_SIZE;
+
+  pool_run(pool, job.count, chunked_run, &job);
+  return !job.failed;
+}
@@ -0,0 +1,266 @@
+/**
+ * Byte-wise reference implementation of the AES cipher
+ *
+ * These are the round functions exactly as FIPS-197 describes them, working on
+ * a 4x4 state matrix one byte at a time. They are much slower than the other
+ * engines, but they are easy to check against the standard, and so they are
+ * kept around as the "reference" engine to verify the faster ones against.
+ *
+ * The bytes of a block fill the state matrix vertically. So for bytes b0, b1,
+ * b2,..., b15, the state matrix will look like this:
+ *
+ * [b0, b4, b8 , b12]
+ * [b1, b5, b9 , b13]
+ * [b2, b6, b10, b14]
+ * [b3, b7, b11, b15]
+ *
+ * That is just the block itself read column by column, so we keep the state
+ * as one flat 16-byte array in the same order as the block (row r, column c
+ * is byte 4 * c + r). A block is loaded with a single copy and no transpose,
+ * and the whole state fits in a register.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aes.h"
+
+/* Cipher state: one block, column by column. */
+typedef union
+{
+  uint8_t b[AES_BLOCK_SIZE]; /* b[4 * c + r] is row r, column c */
+  uint32_t w[4]; /* w[c] is column c */
+} __attribute__((aligned(16))) aes_state_t;
+
+/* Byte in row r, column c of the state */
+#define S(state, r, c) ((state)->b[4 * (c) + (r)])
+
+/*
+  --ENCRYPTION--
+ */
+
+/**
+ * Performs the Sub Bytes function of the AES cipher, in which we replace each 
+ * byte of the state with its corresponding S-Box value. For AES, the S-Box is 
+ * a simple bijection, the pseudo-code for which is such:
+ *
+ * b[i] => The i'th bit of byte b
+ *
+ * byte f(byte b):
+ *   unsigned char c = 0x63;
+ *   if (b != 0):
+ *     b = multiplicativeInverse(b);
+ *   for (i = 0; i < 8; i++):
+ *     b[i] = b[i] XOR b[(i+4) MOD 8] XOR b[(i+5) MOD 8] XOR
+ *            b[(i+6) MOD 8] XOR b[(i+7) MOD 8] XOR c[i];
+ *    return b;
+ *
+ * To increase computation speed, however, we simply put every S-Box value in
+ * a table and simply perform a lookup. This table can be found in "bytesub.c".
+ */
+static void sub_bytes(aes_state_t *state) {
+  bytesub_encrypt(state->b, AES_BLOCK_SIZE);
+}
+
+
+/**
+ * Shift Rows function of AES cipher.
+ * This function simply performs a byte-wise rotation of the rows in the
+ * state matrix. Each row is rotated a certian number of times.
+ *
+ * Row 0 is not affected.
+ * Row 1 is rotated 1 time.
+ * Row 2 is rotated 2 times.
+ * Row 3 is rotated 3 times. 
+ *
+ * For encryption, we rotate right. When we decrypt, we rotate to the left.
+ */
+static void shift_rows(aes_state_t *state) {
+  uint8_t temp[4];
+  int r, c;
+  
+  for (r = 1; r < 4; r++) {
+	for (c = 0; c < 4; c++)
+	  temp[c] = S(state, r, (c + r) % 4);
+	for (c = 0; c < 4; c++)
+	  S(state, r, c) = temp[c];
+  }
+}
+
+
+/**
+ * Mix Columns function of AES algorithm
+ *
+ * Programmically, this function is fairly simple, however the math behind it
+ * is rather complex. 
+ *
+ * At its core, we perform a matrix multiplication of the state matrix with the
+ * following byte matrix:
+ * [0x02 0x03 0x01 0x01]
+ * [0x01 0x02 0x03 0x01]
+ * [0x01 0x01 0x02 0x03]
+ * [0x03 0x01 0x01 0x02]
+ *
+ * This multiplication is performed over a Finite Field, specifically a Galois
+ * Field of order 256. A description of this Galois Field can be found in "The
+ * Laws of Cryptology", page 119. Only multiplication by 2 and 3 is needed,
+ * which is a shift and a few XORs (see "gf.c"), so the whole state is mixed
+ * at once.
+ */
+static void mix_columns(aes_state_t *state) {
+  gf_mix_columns(state->b);
+}
+
+/**
+ * Add Round Key function of the AES cipher.
+ * 
+ * Here is where we acutally apply the key in the cipher algorithm. During
+ * each round of encryption, we XOR each byte of the 16-byte block against
+ * the next 16 bytes of the expanded key. Once we've used that set of bytes,
+ * we XOR the current state against the next 16 bytes, and never touch those
+ * bytes again for this state. 
+ * 
+ * The round key is laid out column by column just like the state, so this
+ * is four word-sized XORs. Decryption uses the same function.
+ */
+static void add_round_key(aes_state_t *state, int round,
+						  const uint8_t *exp_key) {
+  uint32_t k[4];
+  int c;
+
+  memcpy(k, exp_key + 16 * round, sizeof(k));
+  for (c = 0; c < 4; c++)
+	state->w[c] ^= k[c];
+}
+
+/**
+ * This function is the overall application of the AES cipher in the context of
+ * a single state block matrix.
+ *
+ * For each state, we perform the four AES functions several times, in what are
+ * referred to as "rounds". The number of rounds we do depends on the size of 
+ * the encryption key. 
+ */
+static void aes_cipher(aes_state_t *state, const aes_key_t *key) {
+  int round, num_rounds;
+
+  num_rounds = (key->size / 4) + 6;
+  
+  add_round_key(state, 0, key->exp_block);
+
+  for (round = 1; round < num_rounds; round++) {
+	sub_bytes(state);
+	shift_rows(state);
+	mix_columns(state);
+	add_round_key(state, round, key->exp_block);
+  }
+
+  /* Don't mix columns on the last round */
+  sub_bytes(state);
+  shift_rows(state);
+  add_round_key(state, num_rounds, key->exp_block);
+}
+
+/*
+  --DECRYPTION--
+ */
+
+static void sub_bytes_inv(aes_state_t *state) {
+  bytesub_decrypt(state->b, AES_BLOCK_SIZE);
+}
+
+/**
+ * ShiftRows function of AES algorithm
+ * Rotates the bytes in each row of the state block a certain 
+ * number of times.
+ */
+static void shift_rows_inv(aes_state_t *state) {
+  uint8_t temp[4];
+  int r, c;
+  /* First row is not changed.  */
+  /* Rows 2, 3, 4 are rotated 1, 2, and 3 spaces to the right, respectively.  */
+  for (r = 1; r < 4; r++) {
+	for (c = 0; c < 4; c++)
+	  temp[(c + r) % 4] = S(state, r, c);
+	for (c = 0; c < 4; c++)
+	  S(state, r, c) = temp[c];
+  }
+}
+
+/**
+ * MixColumns function of AES algorithm
+ * The inverse matrix has the coefficients 0x0e, 0x0b, 0x0d and 0x09, which
+ * gf.c reduces to the forward MixColumns and two more xtimes.
+ */
+static void mix_columns_inv(aes_state_t *state) {
+  gf_mix_columns_inv(state->b);
+}
+
+/**
+ * The inverse cipher, in the "equivalent" form of FIPS-197 section 5.3.5: the
+ * same sequence of steps as aes_cipher(), with the inverse functions, run
+ * over the decryption key block (see keyexpand.c). That block already has
+ * the round keys in the order they are needed, with InvMixColumns applied, so
+ * InvMixColumns can come before the round key just as MixColumns does.
+ */
+static void aes_cipher_inv(aes_state_t *state, const aes_key_t *key) {
+  int round, num_rounds;
+
+  num_rounds = (key->size / 4) + 6;
+
+  add_round_key(state, 0, key->dec_block);
+
+  for (round = 1; round < num_rounds; round++) {
+	sub_bytes_inv(state);
+	shift_rows_inv(state);
+	mix_columns_inv(state);
+	add_round_key(state, round, key->dec_block);
+  }
+
+  /* Don't mix columns on the last round */
+  sub_bytes_inv(state);
+  shift_rows_inv(state);
+  add_round_key(state, num_rounds, key->dec_block);
+}
+
+/*
+  --ENGINE ENTRY POINTS--
+ */
+
+/**
+ * Encrypts a run of 16-byte blocks with the reference cipher. Each block is
+ * copied into the state as-is, enciphered, and copied back out.
+ */
+void reference_encrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+					   size_t num_blocks) {
+  aes_state_t state;
+  size_t b;
+
+  for (b = 0; b < num_blocks; b++) {
+	memcpy(state.b, in, AES_BLOCK_SIZE);
+	aes_cipher(&state, key);
+	memcpy(out, state.b, AES_BLOCK_SIZE);
+
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+  }
+}
+
+/**
+ * Decrypts a run of 16-byte blocks with the reference cipher.
+ */
+void reference_decrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+					   size_t num_blocks) {
+  aes_state_t state;
+  size_t b;
+
+  for (b = 0; b < num_blocks; b++) {
+	memcpy(state.b, in, AES_BLOCK_SIZE);
+	aes_cipher_inv(&state, key);
+	memcpy(out, state.b, AES_BLOCK_SIZE);
+
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+  }
+}
@@ -0,0 +1,208 @@
+/**
+ * Counter (CTR) mode
+ *
+ * CTR turns the block cipher into a stream cipher. Block i of the file is
+ * XOR'ed with the encryption of the counter block (nonce + i), where the
+ * 16-byte nonce from the file header is treated as one big-endian number.
+ * Encryption and decryption are the same operation, the file does not need
+ * padding, and since every keystream block only depends on its own index, any
+ * part of the file can be ciphered without looking at the rest. That is what
+ * lets us split a file into chunks and cipher them on several threads.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aes.h"
+
+/* Counter blocks built and enciphered per engine call */
+#define CTR_BLOCKS 256
+
+/* Reads a big-endian 64-bit number */
+static inline uint64_t get_be64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return __builtin_bswap64(v);
+}
+
+/* Writes a big-endian 64-bit number */
+static inline void put_be64(uint8_t *p, uint64_t v) {
+  v = __builtin_bswap64(v);
+  memcpy(p, &v, 8);
+}
+
+/**
+ * XORs 'len' bytes of 'in' with the keystream into 'out'.
+ */
+static inline void xor_stream(uint8_t *out, const uint8_t *in,
+							  const uint8_t *stream, size_t len) {
+  uint64_t a, b;
+  size_t i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+	memcpy(&a, in + i, 8);
+	memcpy(&b, stream + i, 8);
+	a ^= b;
+	memcpy(out + i, &a, 8);
+  }
+  for (; i < len; i++)
+	out[i] = in[i] ^ stream[i];
+}
+
+/**
+ * Encrypts or decrypts 'len' bytes in CTR mode. 'in' and 'out' may be the same
+ * buffer.
+ *
+ * @param iv - The 16-byte initial counter block from the file header.
+ * @param block - Index of the first block of 'in' within the file.
+ */
+void ctr_crypt(const aes_engine_t *engine, const aes_key_t *key,
+			   const uint8_t *iv, uint64_t block,
+			   const uint8_t *in, uint8_t *out, size_t len) {
+  uint8_t stream[CTR_BLOCKS * AES_BLOCK_SIZE] __attribute__((aligned(16)));
+  uint64_t hi, lo;
+  size_t i, n, num_blocks;
+
+  /* Counter for the first block */
+  hi = get_be64(iv);
+  lo = get_be64(iv + 8) + block;
+  if (lo < block)
+	hi++;
+
+  while (len > 0) {
+	n = len < sizeof(stream) ? len : sizeof(stream);
+	num_blocks = (n + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+
+	for (i = 0; i < num_blocks; i++) {
+	  put_be64(stream + AES_BLOCK_SIZE * i, hi);
+	  put_be64(stream + AES_BLOCK_SIZE * i + 8, lo);
+	  if (++lo == 0)
+		hi++;
+	}
+	engine->encrypt(key, stream, stream, num_blocks);
+	xor_stream(out, in, stream, n);
+
+	in += n;
+	out += n;
+	len -= n;
+  }
+}
+
+/* One buffer being ciphered by the pool */
+struct ctr_job
+{
+  const aes_engine_t *engine;
+  const aes_key_t *key;
+  const uint8_t *iv;
+  uint64_t block; /* Index of the first block of the buffer */
+  const uint8_t *in;
+  uint8_t *out;
+  size_t len;
+};
+
+/* Ciphers chunk i of a job. */
+static void ctr_chunk(void *arg, size_t i) {
+  const struct ctr_job *job = arg;
+  size_t offset, len;
+
+  offset = i * AES_CHUNK_SIZE;
+  len = job->len - offset;
+  if (len > AES_CHUNK_SIZE)
+	len = AES_CHUNK_SIZE;
+
+  ctr_crypt(job->engine, job->key, job->iv,
+			job->block + offset / AES_BLOCK_SIZE,
+			job->in + offset, job->out + offset, len);
+}
+
+/**
+ * Same as ctr_crypt(), but splits the buffer into AES_CHUNK_SIZE chunks and
+ * ciphers them on the threads of 'pool'.
+ */
+void ctr_crypt_parallel(pool_t *pool, const aes_engine_t *engine,
+						const aes_key_t *key, const uint8_t *iv,
+						uint64_t block, const uint8_t *in, uint8_t *out,
+						size_t len) {
+  struct ctr_job job = { engine, key, iv, block, in, out, len };
+
+  pool_run(pool, (len + AES_CHUNK_SIZE - 1) / AES_CHUNK_SIZE, ctr_chunk, &job);
+}
+
+/* Part of a lane whose keystream is waiting in the stream buffer */
+struct ctr_piece
+{
+  const aes_lane_t *lane;
+  size_t offset, len;
+};
+
+/**
+ * Enciphers the counter blocks gathered so far, and XORs each piece of
+ * keystream into the lane it came from.
+ */
+static void ctr_flush(const aes_engine_t *engine, const aes_key_t *key,
+					  uint8_t *stream, size_t num_blocks,
+					  const struct ctr_piece *pieces, size_t num_pieces) {
+  size_t i;
+
+  engine->encrypt(key, stream, stream, num_blocks);
+  for (i = 0; i < num_pieces; i++) {
+	xor_stream(pieces[i].lane->out + pieces[i].offset,
+			   pieces[i].lane->in + pieces[i].offset, stream, pieces[i].len);
+	stream += (pieces[i].len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE
+	  * AES_BLOCK_SIZE;
+  }
+}
+
+/**
+ * Same as ctr_crypt(), for several buffers at once, each with its own counter.
+ * The counter blocks of all the lanes are enciphered together, so a handful
+ * of small files fill the engine's pipeline between them when none of them
+ * could on its own.
+ *
+ * @param block - Index of the first block of every lane within its file.
+ */
+void ctr_crypt_multi(const aes_engine_t *engine, const aes_key_t *key,
+					 const aes_lane_t *lanes, size_t num_lanes,
+					 uint64_t block) {
+  uint8_t stream[CTR_BLOCKS * AES_BLOCK_SIZE] __attribute__((aligned(16)));
+  struct ctr_piece pieces[CTR_BLOCKS];
+  uint64_t hi, lo;
+  size_t l, i, offset, n, num_blocks, used, num_pieces;
+
+  used = 0;
+  num_pieces = 0;
+  for (l = 0; l < num_lanes; l++) {
+	hi = get_be64(lanes[l].iv);
+	lo = get_be64(lanes[l].iv + 8) + block;
+	if (lo < block)
+	  hi++;
+
+	for (offset = 0; offset < lanes[l].len; offset += n) {
+	  n = lanes[l].len - offset;
+	  if (n > sizeof(stream) - AES_BLOCK_SIZE * used)
+		n = sizeof(stream) - AES_BLOCK_SIZE * used;
+	  num_blocks = (n + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+
+	  for (i = used; i < used + num_blocks; i++) {
+		put_be64(stream + AES_BLOCK_SIZE * i, hi);
+		put_be64(stream + AES_BLOCK_SIZE * i + 8, lo);
+		if (++lo == 0)
+		  hi++;
+	  }
+	  pieces[num_pieces].lane = &lanes[l];
+	  pieces[num_pieces].offset = offset;
+	  pieces[num_pieces].len = n;
+	  num_pieces++;
+	  used += num_blocks;
+
+	  if (used == CTR_BLOCKS) {
+		ctr_flush(engine, key, stream, used, pieces, num_pieces);
+		used = 0;
+		num_pieces = 0;
+	  }
+	}
+  }
+  if (used > 0)
+	ctr_flush(engine, key, stream, used, pieces, num_pieces);
+}
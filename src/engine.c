@@ -0,0 +1,129 @@
+/**
+ * Cipher engine selection
+ *
+ * There is more than one way to run the AES cipher over a buffer, and which
+ * one is fastest depends on the processor. Each way is wrapped up as an
+ * "engine" with the same encrypt/decrypt interface, and both programs pick one
+ * when they start. By default we take the first engine in the list below that
+ * the CPU supports, but the user can also ask for one by name, which is handy
+ * for checking that two engines produce the same output.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+
+/**
+ * Checks CPUID for the AES instructions (and SSE2, which they operate on).
+ */
+static bool cpu_has_aesni(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+	return false;
+
+  return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+
+/**
+ * Reads the extended control register that tells us which register files the
+ * operating system saves on a context switch.
+ */
+static uint64_t read_xcr0(void) {
+  uint32_t lo, hi;
+
+  __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+/* XCR0 bits for the SSE/AVX state, and for the AVX-512 state on top of it. */
+#define XCR0_YMM_STATE 0x06
+#define XCR0_ZMM_STATE 0xe6
+
+/**
+ * Checks for the vector AES instructions on 256-bit registers. Having the
+ * instructions isn't enough; the OS also has to save the YMM registers.
+ */
+static bool cpu_has_vaes256(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!cpu_has_aesni())
+	return false;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+	return false;
+  if ((read_xcr0() & XCR0_YMM_STATE) != XCR0_YMM_STATE)
+	return false;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+	return false;
+
+  return (ebx & bit_AVX2) && (ecx & bit_VAES);
+}
+
+/**
+ * Checks for the vector AES instructions on 512-bit registers.
+ */
+static bool cpu_has_vaes512(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!cpu_has_vaes256())
+	return false;
+  if ((read_xcr0() & XCR0_ZMM_STATE) != XCR0_ZMM_STATE)
+	return false;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+	return false;
+
+  return (ebx & bit_AVX512F) != 0;
+}
+#endif
+
+/* Available engines, from most to least preferred. */
+static const aes_engine_t engines[] = {
+#if defined(__x86_64__) || defined(__i386__)
+  { "vaes512", cpu_has_vaes512, vaes512_encrypt, vaes512_decrypt },
+  { "vaes256", cpu_has_vaes256, vaes256_encrypt, vaes256_decrypt },
+  { "aesni", cpu_has_aesni, aesni_encrypt, aesni_decrypt },
+#endif
+  { "bitslice", NULL, bitslice_encrypt, bitslice_decrypt },
+  { "portable", NULL, ttable_encrypt, ttable_decrypt },
+  { "reference", NULL, reference_encrypt, reference_decrypt }
+};
+
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+/**
+ * Checks whether the engine can run on this machine.
+ */
+bool engine_supported(const aes_engine_t *engine) {
+  return engine->supported == NULL || engine->supported();
+}
+
+/**
+ * Looks up a cipher engine by name.
+ *
+ * @param name - Name of the engine. NULL or "auto" selects the fastest engine
+ *               that this machine supports.
+ * @return The engine, or NULL if there is no engine with that name.
+ */
+const aes_engine_t * engine_find(const char *name) {
+  size_t i;
+
+  if (name == NULL || strcmp(name, "auto") == 0) {
+	for (i = 0; i < NUM_ENGINES; i++) {
+	  if (engine_supported(&engines[i]))
+		return &engines[i];
+	}
+	return NULL;
+  }
+
+  for (i = 0; i < NUM_ENGINES; i++) {
+	if (strcmp(name, engines[i].name) == 0)
+	  return &engines[i];
+  }
+  return NULL;
+}
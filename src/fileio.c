@@ -0,0 +1,632 @@
+/**
+ * File input and output
+ *
+ * The cipher loops don't read into a buffer and write it back out themselves.
+ * They ask for a pointer to the next run of input, and for a pointer to where
+ * the output goes, and cipher straight from one to the other. Behind that
+ * there are three ways of getting at a file (see aes_io_t):
+ *
+ * Mapped (the default): the input is mapped read-only, and the output is
+ * sized up front (we always know how long it will be, give or take the CBC
+ * padding) and mapped read-write, so the data is never copied at all.
+ *
+ * io_uring: the input is read ahead into a small ring of buffers, and the
+ * output written behind from another, so that while the cipher works on one
+ * buffer the disk is busy with the next (see uring.c). Optionally the files
+ * are opened O_DIRECT, so a bulk job streams past the page cache instead of
+ * flushing everything else out of it.
+ *
+ * Buffered: plain stdio. Pipes, terminals and anything else that can't be
+ * handled the other ways fall back to this.
+ *
+ * The mapped output is reserved with posix_fallocate(), not just ftruncate().
+ * A store into a mapping of a sparse file that the filesystem then has no room
+ * for kills the program with SIGBUS, where a buffered write would have
+ * returned an error; reserving the space first means running out of it is
+ * reported before anything is written.
+ */
+
+/* For O_DIRECT */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aes.h"
+
+/* States of a ring window, besides the number of bytes read into it */
+#define WINDOW_PENDING (-2) /* Being read */
+#define WINDOW_FAILED (-1) /* The read failed */
+
+/* Names of the I/O methods, indexed by aes_io_t */
+static const char *io_names[] = {
+  "mmap",
+  "uring",
+  "direct",
+  "stdio"
+};
+
+#define NUM_IO (sizeof(io_names) / sizeof(io_names[0]))
+
+/**
+ * Looks up an I/O method by name.
+ *
+ * @param name - Name of the method, as given to --io.
+ * @param io - Set to the method if it was found.
+ * @return false if there is no method with that name.
+ */
+bool io_find(const char *name, aes_io_t *io) {
+  size_t i;
+
+  for (i = 0; i < NUM_IO; i++) {
+	if (strcmp(name, io_names[i]) == 0) {
+	  *io = (aes_io_t)i;
+	  return true;
+	}
+  }
+  return false;
+}
+
+/**
+ * Asks the kernel to read ahead through a mapping, and to back it with huge
+ * pages if it can. Both are only hints, so failures are ignored.
+ */
+static void map_advise(void *map, size_t len) {
+  madvise(map, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise(map, len, MADV_HUGEPAGE);
+#endif
+}
+
+/**
+ * Works out the size of the ring buffers for transfers of up to 'max' bytes.
+ * Windows start every 'stride' bytes, and overlap so that a transfer starting
+ * anywhere in the first URING_ALIGN bytes of one fits in it whole.
+ */
+static void ring_sizes(size_t max, size_t *stride, size_t *window_size) {
+  *stride = max - max % URING_ALIGN;
+  if (*stride == 0)
+	*stride = URING_ALIGN;
+  *window_size = *stride + 2 * URING_ALIGN;
+}
+
+/**
+ * Turns on O_DIRECT for a file, if the filesystem allows it.
+ *
+ * @return The old file status flags to put back, or -1 if nothing changed.
+ */
+static int set_direct(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) != 0)
+	return -1;
+  return flags;
+}
+
+/*
+  --INPUT--
+ */
+
+/**
+ * Starts reading ring window 'w' into its buffer.
+ */
+static void window_start(aes_input_t *in, long int w) {
+  unsigned slot = w % URING_DEPTH;
+  long int offset = in->base + w * (long int)in->stride;
+
+  if (offset >= in->size)
+	in->filled[slot] = 0;
+  else if (uring_start(in->ring, slot, false, offset, in->window_size))
+	in->filled[slot] = WINDOW_PENDING;
+  else
+	in->filled[slot] = WINDOW_FAILED;
+}
+
+/**
+ * Waits for the read into a ring buffer, if one is going on.
+ */
+static void window_wait(aes_input_t *in, unsigned slot) {
+  ssize_t n;
+
+  if (in->filled[slot] == WINDOW_PENDING) {
+	n = uring_wait(in->ring, slot);
+	in->filled[slot] = n < 0 ? WINDOW_FAILED : n;
+  }
+}
+
+/**
+ * Starts the ring over with window 0 holding 'pos', after a seek or a read
+ * that doesn't fit the windows we have.
+ */
+static void ring_restart(aes_input_t *in, long int pos) {
+  unsigned i;
+
+  for (i = 0; i < URING_DEPTH; i++)
+	window_wait(in, i);
+
+  in->base = pos - pos % URING_ALIGN;
+  in->window = 0;
+  for (i = 0; i < URING_DEPTH; i++)
+	window_start(in, i);
+}
+
+/**
+ * Reads from the ring. Reads go through the file in order, so once one moves
+ * on to a new window, the buffers of the windows before it are free for the
+ * windows after the ones in flight.
+ */
+static const uint8_t * ring_read(aes_input_t *in, size_t want, size_t *got) {
+  long int w, start, offset, avail;
+  unsigned slot;
+
+  w = in->pos >= in->base ? (in->pos - in->base) / (long int)in->stride : -1;
+  start = in->base + w * (long int)in->stride;
+
+  if (w < in->window || w >= in->window + URING_DEPTH
+	  || in->pos + (long int)want > start + (long int)in->window_size) {
+	ring_restart(in, in->pos);
+	w = 0;
+	start = in->base;
+  }
+
+  for (; in->window < w; in->window++) {
+	window_wait(in, in->window % URING_DEPTH);
+	window_start(in, in->window + URING_DEPTH);
+  }
+
+  slot = w % URING_DEPTH;
+  window_wait(in, slot);
+  if (in->filled[slot] == WINDOW_FAILED)
+	return NULL;
+
+  offset = in->pos - start;
+  avail = in->filled[slot] > offset ? in->filled[slot] - offset : 0;
+  *got = want < (size_t)avail ? want : (size_t)avail;
+  in->pos += *got;
+  return uring_buffer(in->ring, slot) + offset;
+}
+
+/**
+ * Sets up reading a file through a ring.
+ *
+ * @return false if the ring could not be made.
+ */
+static bool ring_open_input(aes_input_t *in, size_t buffer_size, bool direct) {
+  if (direct)
+	in->fd_flags = set_direct(fileno(in->fd));
+
+  ring_sizes(buffer_size, &in->stride, &in->window_size);
+  in->ring = uring_create(fileno(in->fd), URING_DEPTH, in->window_size);
+  if (in->ring == NULL)
+	return false;
+
+  /* Nothing is read until the first input_read() says where */
+  in->window = -URING_DEPTH;
+  return true;
+}
+
+/**
+ * Gets ready to read a file.
+ *
+ * @param fd - The file, positioned where reading should start.
+ * @param buffer_size - The most that will be asked for in one input_read().
+ * @param io - How to read the file, if it can be read that way.
+ * @return false if we ran out of memory.
+ */
+bool input_open(aes_input_t *in, FILE *fd, size_t buffer_size, aes_io_t io) {
+  struct stat st;
+  off_t start;
+  void *map;
+
+  memset(in, 0, sizeof(aes_input_t));
+  in->fd = fd;
+  in->size = -1;
+  in->fd_flags = -1;
+
+  /* Only a regular file has a size we can trust */
+  start = lseek(fileno(fd), 0, SEEK_CUR);
+  if (fstat(fileno(fd), &st) == 0 && S_ISREG(st.st_mode) && start >= 0)
+	in->size = st.st_size - start;
+
+  /* Mappings and ring windows start on a page, so only use them for a file
+	 we are at the start of */
+  if (in->size > 0 && start == 0) {
+	if (io == io_uring || io == io_direct)
+	  return ring_open_input(in, buffer_size, io == io_direct);
+
+	if (io == io_mmap) {
+	  map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fileno(fd), 0);
+	  if (map != MAP_FAILED) {
+		map_advise(map, in->size);
+		in->map = map;
+		return true;
+	  }
+	}
+  }
+
+  in->buffer_size = buffer_size;
+  in->buffer = (uint8_t*)malloc(buffer_size);
+  return in->buffer != NULL;
+}
+
+/**
+ * Reads the next 'want' bytes of the file. Like fread(), this only comes up
+ * short at the end of the file.
+ *
+ * @param got - Set to the number of bytes read; 0 at the end of the file.
+ * @return Pointer to the bytes read, which stays valid until the next call,
+ *         or NULL on a read error.
+ */
+const uint8_t * input_read(aes_input_t *in, size_t want, size_t *got) {
+  const uint8_t *data;
+  size_t have;
+
+  if (in->map != NULL) {
+	if (want > (size_t)(in->size - in->pos))
+	  want = in->size - in->pos;
+	data = in->map + in->pos;
+	in->pos += want;
+	*got = want;
+	return data;
+  }
+
+  if (in->ring != NULL)
+	return ring_read(in, want, got);
+
+  if (want > in->buffer_size)
+	want = in->buffer_size;
+
+  /* Bytes handed back by input_unread() come first */
+  have = in->unread;
+  if (have > 0)
+	memmove(in->buffer, in->buffer + in->len - have, have);
+  in->len = have;
+  in->unread = 0;
+
+  if (have < want) {
+	in->len += fread(in->buffer + have, sizeof(uint8_t), want - have, in->fd);
+	if (ferror(in->fd) != 0)
+	  return NULL;
+  }
+  else {
+	in->unread = have - want;
+  }
+
+  *got = in->len - in->unread;
+  in->pos += *got;
+  return in->buffer;
+}
+
+/**
+ * Hands back the last 'len' bytes of the last input_read(), so the next read
+ * starts with them again.
+ */
+void input_unread(aes_input_t *in, size_t len) {
+  in->pos -= len;
+  if (in->map == NULL && in->ring == NULL)
+	in->unread += len;
+}
+
+/**
+ * Moves the read position to 'pos' bytes from the start of the file.
+ *
+ * @return false if the file can't be seeked.
+ */
+bool input_seek(aes_input_t *in, long int pos) {
+  if (in->map != NULL || in->ring != NULL) {
+	if (pos > in->size)
+	  return false;
+  }
+  else {
+	if (fseek(in->fd, pos, SEEK_SET) != 0)
+	  return false;
+	in->len = in->unread = 0;
+  }
+  in->pos = pos;
+  return true;
+}
+
+/**
+ * Unmaps the file or frees the buffers. The file itself is left open.
+ */
+void input_close(aes_input_t *in) {
+  if (in->map != NULL)
+	munmap((void*)in->map, in->size);
+  if (in->ring != NULL)
+	uring_destroy(in->ring);
+  if (in->fd_flags >= 0)
+	fcntl(fileno(in->fd), F_SETFL, in->fd_flags);
+  free(in->buffer);
+}
+
+/**
+ * Describes how a file is being read, for -v.
+ */
+const char * input_kind(const aes_input_t *in) {
+  if (in->map != NULL)
+	return "mapped";
+  if (in->ring == NULL)
+	return "buffered";
+  if (!uring_async(in->ring))
+	return "pread";
+  return in->fd_flags >= 0 ? "io_uring, O_DIRECT" : "io_uring";
+}
+
+/*
+  --OUTPUT--
+ */
+
+/**
+ * Checks that an output file is a new, empty regular file, which we can map
+ * or write anywhere in without losing anything already in it.
+ */
+static bool output_fresh(FILE *fd) {
+  struct stat st;
+  int flags;
+
+  flags = fcntl(fileno(fd), F_GETFL);
+  if (flags < 0 || (flags & O_APPEND))
+	return false;
+  return fstat(fileno(fd), &st) == 0 && S_ISREG(st.st_mode)
+	&& st.st_size == 0 && lseek(fileno(fd), 0, SEEK_CUR) == 0;
+}
+
+/**
+ * Sizes the output file and maps it. A shared mapping needs the file to be
+ * open for reading as well as writing.
+ */
+static void map_output(aes_output_t *out, long int size) {
+  void *map;
+
+  if ((fcntl(fileno(out->fd), F_GETFL) & O_ACCMODE) != O_RDWR)
+	return;
+
+  /* If this fails part way, the file may have grown anyway */
+  out->map_size = size;
+  if (posix_fallocate(fileno(out->fd), 0, size) != 0)
+	return;
+
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(out->fd),
+			 0);
+  if (map == MAP_FAILED)
+	return;
+
+  map_advise(map, size);
+  out->map = map;
+}
+
+/**
+ * Waits for the write from a ring buffer, if one is going on.
+ */
+static void ring_wait_write(aes_output_t *out, unsigned slot) {
+  if (uring_wait(out->ring, slot) < 0)
+	out->failed = true;
+}
+
+/**
+ * Starts writing the ring buffer being filled, and moves on to the next.
+ * Under O_DIRECT only whole URING_ALIGN blocks can be written; the rest is
+ * carried over to the start of the next buffer.
+ */
+static void ring_flush(aes_output_t *out) {
+  size_t n, rest;
+  unsigned next;
+
+  n = out->fill;
+  if (out->fd_flags >= 0)
+	n -= n % URING_ALIGN;
+  if (n == 0)
+	return;
+  rest = out->fill - n;
+
+  if (!uring_start(out->ring, out->slot, true, out->file_pos, n))
+	out->failed = true;
+
+  next = (out->slot + 1) % URING_DEPTH;
+  ring_wait_write(out, next);
+  memcpy(uring_buffer(out->ring, next), uring_buffer(out->ring, out->slot) + n,
+		 rest);
+
+  out->file_pos += n;
+  out->slot = next;
+  out->fill = rest;
+}
+
+/**
+ * Finishes writing through the ring. The last write may not be a whole number
+ * of blocks, so O_DIRECT is turned off for it.
+ */
+static void ring_close_output(aes_output_t *out) {
+  unsigned i;
+
+  for (i = 0; i < URING_DEPTH; i++)
+	ring_wait_write(out, i);
+
+  if (out->fill > 0) {
+	if (out->fd_flags >= 0)
+	  fcntl(fileno(out->fd), F_SETFL, out->fd_flags);
+	if (!uring_start(out->ring, out->slot, true, out->file_pos, out->fill))
+	  out->failed = true;
+	ring_wait_write(out, out->slot);
+  }
+  uring_destroy(out->ring);
+}
+
+/**
+ * Gets ready to write a file.
+ *
+ * @param fd - The output file.
+ * @param size - How many bytes will be written at most, or -1 if that isn't
+ *               known. The output is only mapped when it is.
+ * @param buffer_size - The most that will be asked for in one
+ *                      output_reserve().
+ * @param io - How to write the file, if it can be written that way.
+ * @return false if we ran out of memory.
+ */
+bool output_open(aes_output_t *out, FILE *fd, long int size,
+				 size_t buffer_size, aes_io_t io) {
+  size_t window_size;
+
+  memset(out, 0, sizeof(aes_output_t));
+  out->fd = fd;
+  out->fd_flags = -1;
+
+  if (io == io_stdio || fflush(fd) != 0 || !output_fresh(fd))
+	return true;
+
+  if (io == io_mmap) {
+	if (size > 0)
+	  map_output(out, size);
+	return true;
+  }
+
+  if (io == io_direct)
+	out->fd_flags = set_direct(fileno(fd));
+  ring_sizes(buffer_size, &out->stride, &window_size);
+  out->ring = uring_create(fileno(fd), URING_DEPTH, window_size);
+  return out->ring != NULL;
+}
+
+/**
+ * Returns where the next 'len' bytes of output should be put. Nothing is
+ * written until output_commit().
+ *
+ * @return NULL if there is no room (the output was mapped too small), a write
+ *         has failed, or there is no memory.
+ */
+uint8_t * output_reserve(aes_output_t *out, size_t len) {
+  uint8_t *buffer;
+
+  if (out->map != NULL)
+	return len <= (size_t)(out->map_size - out->pos) ? out->map + out->pos
+	  : NULL;
+
+  if (out->ring != NULL) {
+	if (out->fill + len > out->stride + 2 * URING_ALIGN)
+	  ring_flush(out);
+	if (out->failed || out->fill + len > out->stride + 2 * URING_ALIGN)
+	  return NULL;
+	return uring_buffer(out->ring, out->slot) + out->fill;
+  }
+
+  /* Even an empty reservation needs somewhere to point */
+  if (out->buffer == NULL || len > out->buffer_size) {
+	if (len < AES_BLOCK_SIZE)
+	  len = AES_BLOCK_SIZE;
+	buffer = (uint8_t*)realloc(out->buffer, len);
+	if (buffer == NULL)
+	  return NULL;
+	out->buffer = buffer;
+	out->buffer_size = len;
+  }
+  return out->buffer;
+}
+
+/**
+ * Writes the first 'len' bytes of the space from output_reserve().
+ */
+bool output_commit(aes_output_t *out, size_t len) {
+  if (out->ring != NULL) {
+	out->fill += len;
+	if (out->fill >= out->stride)
+	  ring_flush(out);
+  }
+  else if (out->map == NULL
+		   && fwrite(out->buffer, sizeof(uint8_t), len, out->fd) != len) {
+	return false;
+  }
+  out->pos += len;
+  return !out->failed;
+}
+
+/**
+ * Writes 'len' bytes from 'data'.
+ */
+bool output_write(aes_output_t *out, const void *data, size_t len) {
+  uint8_t *p;
+
+  p = output_reserve(out, len);
+  if (p == NULL)
+	return false;
+  memcpy(p, data, len);
+  return output_commit(out, len);
+}
+
+/**
+ * Makes sure the output written so far is on disk, for checkpoints. Writes
+ * gathered in a ring buffer but not yet started are left where they are.
+ *
+ * @return How many bytes, from the start of the output, are on disk, or -1
+ *         if they couldn't be synced.
+ */
+long int output_sync(aes_output_t *out) {
+  unsigned i;
+
+  if (out->map != NULL) {
+	if (out->pos > 0 && msync(out->map, out->pos, MS_SYNC) != 0)
+	  return -1;
+	return out->pos;
+  }
+
+  if (out->ring != NULL) {
+	for (i = 0; i < URING_DEPTH; i++)
+	  ring_wait_write(out, i);
+	if (out->failed || fdatasync(fileno(out->fd)) != 0)
+	  return -1;
+	return out->file_pos;
+  }
+
+  if (fflush(out->fd) != 0 || fdatasync(fileno(out->fd)) != 0)
+	return -1;
+  return out->pos;
+}
+
+/**
+ * Finishes writing: unmaps the file and cuts it down to what was written,
+ * waits for the writes in flight, or flushes the stdio buffer. The file itself
+ * is left open.
+ *
+ * @return false if the last of the output could not be written.
+ */
+bool output_close(aes_output_t *out) {
+  bool ok = true;
+
+  if (out->map != NULL) {
+	munmap(out->map, out->map_size);
+  }
+  else if (out->ring != NULL) {
+	ring_close_output(out);
+	ok = !out->failed;
+  }
+  else {
+	ok = fflush(out->fd) == 0;
+  }
+
+  /* Cut off whatever was reserved but not written */
+  if (ok && out->pos < out->map_size)
+	ok = ftruncate(fileno(out->fd), out->pos) == 0;
+  if (out->fd_flags >= 0)
+	fcntl(fileno(out->fd), F_SETFL, out->fd_flags);
+  free(out->buffer);
+  return ok;
+}
+
+/**
+ * Describes how a file is being written, for -v.
+ */
+const char * output_kind(const aes_output_t *out) {
+  if (out->map != NULL)
+	return "mapped";
+  if (out->ring == NULL)
+	return "buffered";
+  if (!uring_async(out->ring))
+	return "pwrite";
+  return out->fd_flags >= 0 ? "io_uring, O_DIRECT" : "io_uring";
+}
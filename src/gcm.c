@@ -0,0 +1,604 @@
+/**
+ * Galois/Counter Mode (GCM)
+ *
+ * GCM is CTR mode plus an authentication tag. The ciphertext is run through
+ * GHASH, a polynomial hash over GF(2^128) keyed with H = E(K, 0), and the
+ * result is encrypted with the first counter block to give a 16-byte tag.
+ * aes-decrypt computes the same tag over the ciphertext it reads, and rejects
+ * the file if the two don't match, so any change to the cipher file (or to its
+ * header, which is hashed too) is caught instead of decrypting to garbage.
+ *
+ * The counter blocks are laid out as in the standard: the first 12 bytes of
+ * the nonce, followed by a 32-bit block counter that starts at 1 for the tag
+ * and at 2 for the first block of data. That gives the GCM length limit of
+ * 2^32 - 2 blocks (64 GiB) per file.
+ *
+ * GHASH has to see the blocks in order, one multiplication by H after another,
+ * which would make it the slow serial part of the pipeline. Two things keep it
+ * close to CTR speed:
+ *
+ *  - With PCLMULQDQ (carry-less multiply) we hash eight blocks per step. The
+ *    blocks are multiplied by H^8 ... H^1 and the products added up before a
+ *    single reduction, so the multiplications don't wait on each other.
+ *  - Hashing is linear, so each thread can hash its own chunk from zero. The
+ *    chunk hashes are then chained together with one multiplication by H^n
+ *    each, where n is the number of blocks in the chunk.
+ *
+ * Processors without PCLMULQDQ use Shoup's 4-bit table method instead.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "aes.h"
+
+/* Most blocks of data a GCM file can hold */
+#define GCM_MAX_BLOCKS 0xFFFFFFFEULL
+
+/* Bytes ciphered and then hashed in one go */
+#define GCM_PIECE_SIZE (16 * 1024)
+
+/* Blocks hashed per reduction with PCLMULQDQ */
+#define CLMUL_BLOCKS GHASH_POWERS
+
+/* Reads a big-endian 64-bit number */
+static inline uint64_t get_be64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return __builtin_bswap64(v);
+}
+
+/* Writes a big-endian 64-bit number */
+static inline void put_be64(uint8_t *p, uint64_t v) {
+  v = __builtin_bswap64(v);
+  memcpy(p, &v, 8);
+}
+
+/*
+  --GF(2^128) ARITHMETIC--
+
+  GCM numbers its bits backwards: the first bit of the block is the x^0
+  coefficient, so "multiply by x" is a right shift, and the reduction
+  polynomial x^128 + x^7 + x^2 + x + 1 shows up as 0xE1 in the top byte.
+ */
+
+/**
+ * Multiplies x by y one bit at a time. Far too slow for bulk data, but we only
+ * use it to set up the hash key and to chain chunk hashes together.
+ */
+static void gf128_mul(uint8_t *x, const uint8_t *y) {
+  uint64_t zh = 0, zl = 0, vh, vl, xh, xl, carry;
+  int i;
+
+  xh = get_be64(x);
+  xl = get_be64(x + 8);
+  vh = get_be64(y);
+  vl = get_be64(y + 8);
+
+  for (i = 0; i < 128; i++) {
+	if ((i < 64 ? xh >> (63 - i) : xl >> (127 - i)) & 1) {
+	  zh ^= vh;
+	  zl ^= vl;
+	}
+	carry = vl & 1;
+	vl = (vl >> 1) | (vh << 63);
+	vh = (vh >> 1) ^ (carry ? 0xE100000000000000ULL : 0);
+  }
+
+  put_be64(x, zh);
+  put_be64(x + 8, zl);
+}
+
+/**
+ * Raises h to the power n, by repeated squaring.
+ */
+static void gf128_pow(uint8_t *out, const uint8_t *h, uint64_t n) {
+  uint8_t base[16];
+
+  memset(out, 0, 16);
+  out[0] = 0x80; /* The number 1 */
+  memcpy(base, h, 16);
+
+  for (; n > 0; n >>= 1) {
+	if (n & 1)
+	  gf128_mul(out, base);
+	gf128_mul(base, base);
+  }
+}
+
+/*
+  --TABLE-DRIVEN GHASH--
+ */
+
+/* Reduction of the four bits shifted out of the bottom of Z */
+static const uint16_t last4[16] = {
+  0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+  0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+/**
+ * Builds the table of i * H for every 4-bit value i.
+ */
+static void table_init(ghash_key_t *hkey) {
+  uint64_t vh, vl, t;
+  int i, j;
+
+  vh = get_be64(hkey->h);
+  vl = get_be64(hkey->h + 8);
+
+  hkey->hh[0] = 0;
+  hkey->hl[0] = 0;
+  hkey->hh[8] = vh;
+  hkey->hl[8] = vl;
+
+  for (i = 4; i > 0; i >>= 1) {
+	t = (vl & 1) ? 0xE100000000000000ULL : 0;
+	vl = (vh << 63) | (vl >> 1);
+	vh = (vh >> 1) ^ t;
+	hkey->hh[i] = vh;
+	hkey->hl[i] = vl;
+  }
+  for (i = 2; i <= 8; i *= 2) {
+	for (j = 1; j < i; j++) {
+	  hkey->hh[i + j] = hkey->hh[i] ^ hkey->hh[j];
+	  hkey->hl[i + j] = hkey->hl[i] ^ hkey->hl[j];
+	}
+  }
+}
+
+/**
+ * x = x * H, four bits at a time.
+ */
+static void table_mul(const ghash_key_t *hkey, uint8_t *x) {
+  uint64_t zh, zl;
+  uint8_t lo, hi, rem;
+  int i;
+
+  lo = x[15] & 0x0F;
+  zh = hkey->hh[lo];
+  zl = hkey->hl[lo];
+
+  for (i = 15; i >= 0; i--) {
+	lo = x[i] & 0x0F;
+	hi = x[i] >> 4;
+
+	if (i != 15) {
+	  rem = zl & 0x0F;
+	  zl = (zh << 60) | (zl >> 4);
+	  zh = (zh >> 4) ^ ((uint64_t)last4[rem] << 48);
+	  zh ^= hkey->hh[lo];
+	  zl ^= hkey->hl[lo];
+	}
+	rem = zl & 0x0F;
+	zl = (zh << 60) | (zl >> 4);
+	zh = (zh >> 4) ^ ((uint64_t)last4[rem] << 48);
+	zh ^= hkey->hh[hi];
+	zl ^= hkey->hl[hi];
+  }
+
+  put_be64(x, zh);
+  put_be64(x + 8, zl);
+}
+
+/**
+ * Hashes whole blocks into x with the 4-bit tables.
+ */
+static void table_ghash(const ghash_key_t *hkey, uint8_t *x,
+						const uint8_t *in, size_t num_blocks) {
+  int i;
+
+  for (; num_blocks > 0; num_blocks--) {
+	for (i = 0; i < AES_BLOCK_SIZE; i++)
+	  x[i] ^= in[i];
+	table_mul(hkey, x);
+	in += AES_BLOCK_SIZE;
+  }
+}
+
+/*
+  --PCLMULQDQ GHASH--
+
+  The carry-less multiply works on ordinary bit order, so blocks are byte-
+  swapped on the way in and out. The product of two bit-reflected numbers
+  comes out one bit short, which is fixed up with a shift before reducing.
+  (This follows Intel's "Carry-Less Multiplication and Its Usage for Computing
+  the GCM Mode" white paper.)
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+
+#define CLMUL_TARGET __attribute__((target("pclmul,ssse3,sse2")))
+
+/**
+ * Checks CPUID for PCLMULQDQ and the byte shuffle we use with it.
+ */
+static bool cpu_has_pclmul(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+	return false;
+
+  return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3) && (edx & bit_SSE2);
+}
+
+/* Reverses the bytes of a block */
+static inline CLMUL_TARGET __m128i bswap128(__m128i v) {
+  return _mm_shuffle_epi8(v, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+										  8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+/**
+ * Adds the 256-bit product a * b to the lo/mid/hi accumulators.
+ */
+static inline CLMUL_TARGET
+void clmul_acc(__m128i a, __m128i b, __m128i *lo, __m128i *mid, __m128i *hi) {
+  *lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, b, 0x00));
+  *hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, b, 0x11));
+  *mid = _mm_xor_si128(*mid, _mm_clmulepi64_si128(a, b, 0x01));
+  *mid = _mm_xor_si128(*mid, _mm_clmulepi64_si128(a, b, 0x10));
+}
+
+/**
+ * Reduces an accumulated 256-bit product modulo the GCM polynomial.
+ */
+static inline CLMUL_TARGET
+__m128i clmul_reduce(__m128i lo, __m128i mid, __m128i hi) {
+  __m128i t7, t8, t9, t2, t4, t5;
+
+  /* Fold the middle terms into the two halves */
+  lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+  hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+  /* Shift the 256-bit product left by one bit */
+  t7 = _mm_srli_epi32(lo, 31);
+  t8 = _mm_srli_epi32(hi, 31);
+  lo = _mm_slli_epi32(lo, 1);
+  hi = _mm_slli_epi32(hi, 1);
+  t9 = _mm_srli_si128(t7, 12);
+  t8 = _mm_slli_si128(t8, 4);
+  t7 = _mm_slli_si128(t7, 4);
+  lo = _mm_or_si128(lo, t7);
+  hi = _mm_or_si128(hi, t8);
+  hi = _mm_or_si128(hi, t9);
+
+  /* Reduce the low half into the high half */
+  t7 = _mm_slli_epi32(lo, 31);
+  t8 = _mm_slli_epi32(lo, 30);
+  t9 = _mm_slli_epi32(lo, 25);
+  t7 = _mm_xor_si128(t7, _mm_xor_si128(t8, t9));
+  t8 = _mm_srli_si128(t7, 4);
+  t7 = _mm_slli_si128(t7, 12);
+  lo = _mm_xor_si128(lo, t7);
+
+  t2 = _mm_srli_epi32(lo, 1);
+  t4 = _mm_srli_epi32(lo, 2);
+  t5 = _mm_srli_epi32(lo, 7);
+  t2 = _mm_xor_si128(t2, _mm_xor_si128(t4, t5));
+  t2 = _mm_xor_si128(t2, t8);
+  lo = _mm_xor_si128(lo, t2);
+
+  return _mm_xor_si128(hi, lo);
+}
+
+/**
+ * Hashes whole blocks into x with carry-less multiplies.
+ */
+static CLMUL_TARGET
+void clmul_ghash(const ghash_key_t *hkey, uint8_t *x,
+				 const uint8_t *in, size_t num_blocks) {
+  __m128i h[CLMUL_BLOCKS], acc, b, lo, mid, hi;
+  int i;
+
+  for (i = 0; i < CLMUL_BLOCKS; i++)
+	h[i] = _mm_loadu_si128((const __m128i *)hkey->h_pow[i]);
+
+  acc = bswap128(_mm_loadu_si128((const __m128i *)x));
+
+  /* acc = (acc + C1) * H^8 + C2 * H^7 + ... + C8 * H */
+  for (; num_blocks >= CLMUL_BLOCKS; num_blocks -= CLMUL_BLOCKS) {
+	lo = mid = hi = _mm_setzero_si128();
+	for (i = 0; i < CLMUL_BLOCKS; i++) {
+	  b = bswap128(_mm_loadu_si128((const __m128i *)(in + 16 * i)));
+	  if (i == 0)
+		b = _mm_xor_si128(b, acc);
+	  clmul_acc(b, h[CLMUL_BLOCKS - 1 - i], &lo, &mid, &hi);
+	}
+	acc = clmul_reduce(lo, mid, hi);
+	in += 16 * CLMUL_BLOCKS;
+  }
+
+  for (; num_blocks > 0; num_blocks--) {
+	b = bswap128(_mm_loadu_si128((const __m128i *)in));
+	lo = mid = hi = _mm_setzero_si128();
+	clmul_acc(_mm_xor_si128(acc, b), h[0], &lo, &mid, &hi);
+	acc = clmul_reduce(lo, mid, hi);
+	in += AES_BLOCK_SIZE;
+  }
+
+  _mm_storeu_si128((__m128i *)x, bswap128(acc));
+}
+
+#endif /* __x86_64__ || __i386__ */
+
+/*
+  --GHASH--
+ */
+
+/**
+ * Sets up the hash key H and whatever the GHASH implementation needs from it.
+ */
+static void ghash_init(ghash_key_t *hkey, const uint8_t *h) {
+  uint8_t p[16];
+  int i, j;
+
+  memset(hkey, 0, sizeof(ghash_key_t));
+  memcpy(hkey->h, h, 16);
+
+#if defined(__x86_64__) || defined(__i386__)
+  hkey->clmul = cpu_has_pclmul();
+#endif
+  if (!hkey->clmul) {
+	table_init(hkey);
+	return;
+  }
+
+  /* H^1 ... H^8, byte-swapped the way clmul_ghash() uses them */
+  memcpy(p, h, 16);
+  for (i = 0; i < CLMUL_BLOCKS; i++) {
+	if (i > 0)
+	  gf128_mul(p, h);
+	for (j = 0; j < 16; j++)
+	  hkey->h_pow[i][j] = p[15 - j];
+  }
+}
+
+/**
+ * Hashes whole blocks into x.
+ */
+static void ghash(const ghash_key_t *hkey, uint8_t *x,
+				  const uint8_t *in, size_t num_blocks) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (hkey->clmul) {
+	clmul_ghash(hkey, x, in, num_blocks);
+	return;
+  }
+#endif
+  table_ghash(hkey, x, in, num_blocks);
+}
+
+/**
+ * Hashes any number of bytes into x, padding the last block with 0's.
+ */
+static void ghash_bytes(const ghash_key_t *hkey, uint8_t *x,
+						const uint8_t *in, size_t len) {
+  uint8_t last[AES_BLOCK_SIZE];
+  size_t whole;
+
+  whole = len / AES_BLOCK_SIZE;
+  ghash(hkey, x, in, whole);
+
+  if (len % AES_BLOCK_SIZE) {
+	memset(last, 0, sizeof(last));
+	memcpy(last, in + whole * AES_BLOCK_SIZE, len % AES_BLOCK_SIZE);
+	ghash(hkey, x, last, 1);
+  }
+}
+
+/*
+  --GCM--
+ */
+
+/**
+ * Starts a GCM encryption or decryption.
+ *
+ * @param iv - The nonce from the file header. Only the first 12 bytes are used.
+ */
+void gcm_init(gcm_t *gcm, const aes_engine_t *engine, const aes_key_t *key,
+			  const uint8_t *iv) {
+  uint8_t h[AES_BLOCK_SIZE];
+
+  memset(gcm, 0, sizeof(gcm_t));
+  gcm->engine = engine;
+  gcm->key = key;
+
+  /* H is the encryption of the zero block */
+  memset(h, 0, sizeof(h));
+  engine->encrypt(key, h, h, 1);
+  ghash_init(&gcm->hkey, h);
+
+  /* The first counter block, used for the tag */
+  memcpy(gcm->j0, iv, 12);
+  gcm->j0[15] = 1;
+}
+
+/**
+ * Starts another message under the same key. The hash key and its tables are
+ * kept, so this is much cheaper than gcm_init().
+ */
+void gcm_restart(gcm_t *gcm, const uint8_t *iv) {
+  memset(gcm->x, 0, sizeof(gcm->x));
+  gcm->aad_len = 0;
+  gcm->data_len = 0;
+
+  memset(gcm->j0, 0, sizeof(gcm->j0));
+  memcpy(gcm->j0, iv, 12);
+  gcm->j0[15] = 1;
+}
+
+/**
+ * Hashes the additional authenticated data. This must be called at most once,
+ * before any data is ciphered.
+ */
+void gcm_aad(gcm_t *gcm, const uint8_t *aad, size_t len) {
+  ghash_bytes(&gcm->hkey, gcm->x, aad, len);
+  gcm->aad_len = len;
+}
+
+/* One chunk of a buffer being ciphered and hashed by the pool */
+struct gcm_chunk
+{
+  uint8_t x[AES_BLOCK_SIZE]; /* GHASH of the chunk on its own */
+  uint64_t num_blocks; /* Blocks hashed, counting a partial one */
+};
+
+/* One buffer being ciphered and hashed by the pool */
+struct gcm_job
+{
+  gcm_t *gcm;
+  bool decrypt;
+  uint64_t block; /* Index of the first block of the buffer */
+  const uint8_t *in;
+  uint8_t *out;
+  size_t len;
+  struct gcm_chunk *chunks;
+};
+
+/**
+ * Ciphers and hashes chunk i of a job. When encrypting we hash the output,
+ * when decrypting the input, so either way it is the ciphertext. The chunk is
+ * worked through GCM_PIECE_SIZE bytes at a time, so the data is still in the
+ * L1 cache when it is hashed.
+ */
+static void gcm_run_chunk(void *arg, size_t i) {
+  const struct gcm_job *job = arg;
+  struct gcm_chunk *chunk = &job->chunks[i];
+  const ghash_key_t *hkey = &job->gcm->hkey;
+  size_t offset, end, len;
+
+  offset = i * AES_CHUNK_SIZE;
+  end = job->len - offset > AES_CHUNK_SIZE
+	? offset + AES_CHUNK_SIZE : job->len;
+
+  memset(chunk->x, 0, sizeof(chunk->x));
+  chunk->num_blocks = (end - offset + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+
+  for (; offset < end; offset += len) {
+	len = end - offset < GCM_PIECE_SIZE ? end - offset : GCM_PIECE_SIZE;
+
+	if (job->decrypt)
+	  ghash_bytes(hkey, chunk->x, job->in + offset, len);
+
+	/* Data starts at the counter after J0 */
+	ctr_crypt(job->gcm->engine, job->gcm->key, job->gcm->j0,
+			  1 + job->block + offset / AES_BLOCK_SIZE,
+			  job->in + offset, job->out + offset, len);
+
+	if (!job->decrypt)
+	  ghash_bytes(hkey, chunk->x, job->out + offset, len);
+  }
+}
+
+/**
+ * Ciphers a buffer on the pool and adds its ciphertext to the hash. Every
+ * buffer but the last must be a whole number of blocks.
+ */
+static bool gcm_crypt(gcm_t *gcm, pool_t *pool, bool decrypt,
+					  const uint8_t *in, uint8_t *out, size_t len) {
+  struct gcm_job job;
+  size_t num_chunks, i;
+  int j;
+
+  if ((gcm->data_len + len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE
+	  > GCM_MAX_BLOCKS)
+	return false;
+
+  num_chunks = (len + AES_CHUNK_SIZE - 1) / AES_CHUNK_SIZE;
+  job.chunks = (struct gcm_chunk*)malloc(num_chunks * sizeof(struct gcm_chunk));
+  if (job.chunks == NULL)
+	return false;
+
+  job.gcm = gcm;
+  job.decrypt = decrypt;
+  job.block = gcm->data_len / AES_BLOCK_SIZE;
+  job.in = in;
+  job.out = out;
+  job.len = len;
+  pool_run(pool, num_chunks, gcm_run_chunk, &job);
+
+  /* Chain the chunk hashes: x = x * H^n + chunk. All chunks but the last are
+	 the same size, so H^n rarely needs working out again. */
+  for (i = 0; i < num_chunks; i++) {
+	if (job.chunks[i].num_blocks != gcm->pow_blocks) {
+	  gf128_pow(gcm->h_n, gcm->hkey.h, job.chunks[i].num_blocks);
+	  gcm->pow_blocks = job.chunks[i].num_blocks;
+	}
+	gf128_mul(gcm->x, gcm->h_n);
+	for (j = 0; j < AES_BLOCK_SIZE; j++)
+	  gcm->x[j] ^= job.chunks[i].x[j];
+  }
+
+  gcm->data_len += len;
+  free(job.chunks);
+  return true;
+}
+
+/**
+ * Encrypts a buffer. 'in' and 'out' may be the same buffer.
+ *
+ * @return false if the file is too long for GCM, or we ran out of memory.
+ */
+bool gcm_encrypt(gcm_t *gcm, pool_t *pool, const uint8_t *in, uint8_t *out,
+				 size_t len) {
+  return gcm_crypt(gcm, pool, false, in, out, len);
+}
+
+/**
+ * Decrypts a buffer. The plaintext must not be trusted until gcm_tag() has
+ * been checked.
+ */
+bool gcm_decrypt(gcm_t *gcm, pool_t *pool, const uint8_t *in, uint8_t *out,
+				 size_t len) {
+  return gcm_crypt(gcm, pool, true, in, out, len);
+}
+
+/**
+ * Adds ciphertext that was ciphered elsewhere to the hash, for when the
+ * keystream has been made along with other messages' (see ctr_crypt_multi()).
+ * The data starts at the counter after j0. Like gcm_encrypt(), every call but
+ * the last must be a whole number of blocks.
+ *
+ * @return false if the message is too long for GCM.
+ */
+bool gcm_hash(gcm_t *gcm, const uint8_t *cipher, size_t len) {
+  if ((gcm->data_len + len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE
+	  > GCM_MAX_BLOCKS)
+	return false;
+
+  ghash_bytes(&gcm->hkey, gcm->x, cipher, len);
+  gcm->data_len += len;
+  return true;
+}
+
+/**
+ * Finishes the hash and computes the authentication tag.
+ */
+void gcm_tag(gcm_t *gcm, uint8_t *tag) {
+  uint8_t lengths[AES_BLOCK_SIZE];
+
+  /* The last block hashed holds the bit lengths of the AAD and the data */
+  put_be64(lengths, gcm->aad_len * 8);
+  put_be64(lengths + 8, gcm->data_len * 8);
+  ghash(&gcm->hkey, gcm->x, lengths, 1);
+
+  ctr_crypt(gcm->engine, gcm->key, gcm->j0, 0, gcm->x, tag, AES_BLOCK_SIZE);
+}
+
+/**
+ * Compares two tags without stopping at the first difference, so the time
+ * taken doesn't tell an attacker how much of a forged tag was right.
+ */
+bool gcm_tag_equal(const uint8_t *a, const uint8_t *b) {
+  uint8_t diff = 0;
+  int i;
+
+  for (i = 0; i < AES_BLOCK_SIZE; i++)
+	diff |= a[i] ^ b[i];
+  return diff == 0;
+}
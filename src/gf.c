@@ -1,51 +1,186 @@
+/**
+ * Arithmetic in GF(2^8), the field AES works in
+ *
+ * A byte is a polynomial over GF(2) of degree at most 7, and multiplying two
+ * of them is done modulo x^8 + x^4 + x^3 + x + 1 (0x11B). Multiplying by x,
+ * "xtime" in FIPS-197, is a shift left by one, with 0x1B XORed in if a bit
+ * fell off the top. Every other multiplication is a sum of xtimes, so
+ * MixColumns and its inverse only need a few of them:
+ *
+ *   2a = xtime(a)          9a = 8a ^ a
+ *   3a = 2a ^ a           11a = 8a ^ 2a ^ a
+ *                         13a = 8a ^ 4a ^ a
+ *                         14a = 8a ^ 4a ^ 2a
+ *
+ * None of this looks anything up or branches on the bytes it is given, so it
+ * takes the same time whatever the key and data are. The 0x1B is applied with
+ * a mask made from the top bit, not an if.
+ *
+ * Four bytes packed into a word are multiplied at once by keeping each one's
+ * top bit from spilling into the next (xtime32()). gf_mix_column() and
+ * gf_mix_column_inv() work that way on a whole column, and gf_mix_columns()
+ * and gf_mix_columns_inv() on a whole 16-byte state, with SSE2 where there is
+ * one. A column word holds row r of the column in bits 8r to 8r+7, so a
+ * rotation right by 8 lines each row up with the one below it.
+ */
+
 #include <stdint.h>
 
-static const uint8_t exp[256] = {
-  0x01,0x03,0x05,0x0f,0x11,0x33,0x55,0xff,0x1a,0x2e,0x72,0x96,0xa1,0xf8,0x13,0x35,
-  0x5f,0xe1,0x38,0x48,0xd8,0x73,0x95,0xa4,0xf7,0x02,0x06,0x0a,0x1e,0x22,0x66,0xaa, 
-  0xe5,0x34,0x5c,0xe4,0x37,0x59,0xeb,0x26,0x6a,0xbe,0xd9,0x70,0x90,0xab,0xe6,0x31, 
-  0x53,0xf5,0x04,0x0c,0x14,0x3c,0x44,0xcc,0x4f,0xd1,0x68,0xb8,0xd3,0x6e,0xb2,0xcd, 
-  0x4c,0xd4,0x67,0xa9,0xe0,0x3b,0x4d,0xd7,0x62,0xa6,0xf1,0x08,0x18,0x28,0x78,0x88, 
-  0x83,0x9e,0xb9,0xd0,0x6b,0xbd,0xdc,0x7f,0x81,0x98,0xb3,0xce,0x49,0xdb,0x76,0x9a, 
-  0xb5,0xc4,0x57,0xf9,0x10,0x30,0x50,0xf0,0x0b,0x1d,0x27,0x69,0xbb,0xd6,0x61,0xa3, 
-  0xfe,0x19,0x2b,0x7d,0x87,0x92,0xad,0xec,0x2f,0x71,0x93,0xae,0xe9,0x20,0x60,0xa0, 
-  0xfb,0x16,0x3a,0x4e,0xd2,0x6d,0xb7,0xc2,0x5d,0xe7,0x32,0x56,0xfa,0x15,0x3f,0x41, 
-  0xc3,0x5e,0xe2,0x3d,0x47,0xc9,0x40,0xc0,0x5b,0xed,0x2c,0x74,0x9c,0xbf,0xda,0x75, 
-  0x9f,0xba,0xd5,0x64,0xac,0xef,0x2a,0x7e,0x82,0x9d,0xbc,0xdf,0x7a,0x8e,0x89,0x80, 
-  0x9b,0xb6,0xc1,0x58,0xe8,0x23,0x65,0xaf,0xea,0x25,0x6f,0xb1,0xc8,0x43,0xc5,0x54, 
-  0xfc,0x1f,0x21,0x63,0xa5,0xf4,0x07,0x09,0x1b,0x2d,0x77,0x99,0xb0,0xcb,0x46,0xca, 
-  0x45,0xcf,0x4a,0xde,0x79,0x8b,0x86,0x91,0xa8,0xe3,0x3e,0x42,0xc6,0x51,0xf3,0x0e, 
-  0x12,0x36,0x5a,0xee,0x29,0x7b,0x8d,0x8c,0x8f,0x8a,0x85,0x94,0xa7,0xf2,0x0d,0x17, 
-  0x39,0x4b,0xdd,0x7c,0x84,0x97,0xa2,0xfd,0x1c,0x24,0x6c,0xb4,0xc7,0x52,0xf6,0x01
-};
-
-static const uint8_t log[256] = {
-  0x00,0x00,0x19,0x01,0x32,0x02,0x1a,0xc6,0x4b,0xc7,0x1b,0x68,0x33,0xee,0xdf,0x03,
-  0x64,0x04,0xe0,0x0e,0x34,0x8d,0x81,0xef,0x4c,0x71,0x08,0xc8,0xf8,0x69,0x1c,0xc1,
-  0x7d,0xc2,0x1d,0xb5,0xf9,0xb9,0x27,0x6a,0x4d,0xe4,0xa6,0x72,0x9a,0xc9,0x09,0x78,
-  0x65,0x2f,0x8a,0x05,0x21,0x0f,0xe1,0x24,0x12,0xf0,0x82,0x45,0x35,0x93,0xda,0x8e,
-  0x96,0x8f,0xdb,0xbd,0x36,0xd0,0xce,0x94,0x13,0x5c,0xd2,0xf1,0x40,0x46,0x83,0x38,
-  0x66,0xdd,0xfd,0x30,0xbf,0x06,0x8b,0x62,0xb3,0x25,0xe2,0x98,0x22,0x88,0x91,0x10,
-  0x7e,0x6e,0x48,0xc3,0xa3,0xb6,0x1e,0x42,0x3a,0x6b,0x28,0x54,0xfa,0x85,0x3d,0xba,
-  0x2b,0x79,0x0a,0x15,0x9b,0x9f,0x5e,0xca,0x4e,0xd4,0xac,0xe5,0xf3,0x73,0xa7,0x57,
-  0xaf,0x58,0xa8,0x50,0xf4,0xea,0xd6,0x74,0x4f,0xae,0xe9,0xd5,0xe7,0xe6,0xad,0xe8,
-  0x2c,0xd7,0x75,0x7a,0xeb,0x16,0x0b,0xf5,0x59,0xcb,0x5f,0xb0,0x9c,0xa9,0x51,0xa0,
-  0x7f,0x0c,0xf6,0x6f,0x17,0xc4,0x49,0xec,0xd8,0x43,0x1f,0x2d,0xa4,0x76,0x7b,0xb7,
-  0xcc,0xbb,0x3e,0x5a,0xfb,0x60,0xb1,0x86,0x3b,0x52,0xa1,0x6c,0xaa,0x55,0x29,0x9d,
-  0x97,0xb2,0x87,0x90,0x61,0xbe,0xdc,0xfc,0xbc,0x95,0xcf,0xcd,0x37,0x3f,0x5b,0xd1,
-  0x53,0x39,0x84,0x3c,0x41,0xa2,0x6d,0x47,0x14,0x2a,0x9e,0x5d,0x56,0xf2,0xd3,0xab,
-  0x44,0x11,0x92,0xd9,0x23,0x20,0x2e,0x89,0xb4,0x7c,0xb8,0x26,0x77,0x99,0xe3,0xa5,
-  0x67,0x4a,0xed,0xde,0xc5,0x31,0xfe,0x18,0x0d,0x63,0x8c,0x80,0xc0,0xf7,0x70,0x07
-};
+#include "aes.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Rotates a column word right by 'n' bits */
+#define ROR32(w, n) (((w) >> (n)) | ((w) << (32 - (n))))
+
+/**
+ * Multiplies a byte by x (that is, by 2).
+ */
+uint8_t gf_xtime(uint8_t a) {
+  return (uint8_t)((a << 1) ^ (0x1B & -(a >> 7)));
+}
+
+uint8_t gf_mul2(uint8_t a) {
+  return gf_xtime(a);
+}
+
+uint8_t gf_mul3(uint8_t a) {
+  return gf_xtime(a) ^ a;
+}
 
+uint8_t gf_mul9(uint8_t a) {
+  uint8_t a8 = gf_xtime(gf_xtime(gf_xtime(a)));
+  return a8 ^ a;
+}
+
+uint8_t gf_mul11(uint8_t a) {
+  uint8_t a2 = gf_xtime(a), a8 = gf_xtime(gf_xtime(a2));
+  return a8 ^ a2 ^ a;
+}
+
+uint8_t gf_mul13(uint8_t a) {
+  uint8_t a4 = gf_xtime(gf_xtime(a)), a8 = gf_xtime(a4);
+  return a8 ^ a4 ^ a;
+}
+
+uint8_t gf_mul14(uint8_t a) {
+  uint8_t a2 = gf_xtime(a), a4 = gf_xtime(a2), a8 = gf_xtime(a4);
+  return a8 ^ a4 ^ a2;
+}
+
+/**
+ * Multiplies any two bytes, one bit of 'b' at a time. Slower than the kernels
+ * above, but it too runs in the same time for every input.
+ */
 uint8_t ff_multiply(uint8_t a, uint8_t b) {
-  int temp = 0;
+  uint8_t p = 0;
+  int i;
 
-  if ((a == 0) || (b == 0)) return 0;
+  for (i = 0; i < 8; i++) {
+	p ^= a & -(b & 1);
+	a = gf_xtime(a);
+	b >>= 1;
+  }
+  return p;
+}
 
-  temp = ((int)log[a]) + ((int)log[b]);
+/* xtime on each of the four bytes of a word */
+static inline uint32_t xtime32(uint32_t w) {
+  return ((w & 0x7F7F7F7F) << 1) ^ (((w >> 7) & 0x01010101) * 0x1B);
+}
+
+/**
+ * MixColumns on one column: row r becomes
+ * 2a[r] ^ 3a[r+1] ^ a[r+2] ^ a[r+3], or 2(a[r] ^ a[r+1]) ^ a[r+1] ^ a[r+2]
+ * ^ a[r+3].
+ */
+uint32_t gf_mix_column(uint32_t w) {
+  uint32_t r1 = ROR32(w, 8);
 
-  if (temp > 0xff) temp -= 0xff;
-  
-  return exp[temp];
+  return xtime32(w ^ r1) ^ r1 ^ ROR32(w, 16) ^ ROR32(w, 24);
 }
+
+/**
+ * InvMixColumns on one column. The inverse matrix factors into the forward
+ * one times (5 0 4 0) and its rotations, so we add 4(a[r] ^ a[r+2]) to each
+ * row and then mix the column as for encryption.
+ */
+uint32_t gf_mix_column_inv(uint32_t w) {
+  return gf_mix_column(w ^ xtime32(xtime32(w ^ ROR32(w, 16))));
+}
+
+#if defined(__SSE2__)
+
+/* xtime on all sixteen bytes */
+static inline __m128i xtime128(__m128i v) {
+  __m128i hi = _mm_cmpgt_epi8(_mm_setzero_si128(), v);
+  return _mm_xor_si128(_mm_add_epi8(v, v),
+					   _mm_and_si128(hi, _mm_set1_epi8(0x1B)));
+}
+
+/* Rotates each column right by 'n' bits */
+#define ROR128(v, n) \
+  _mm_or_si128(_mm_srli_epi32(v, n), _mm_slli_epi32(v, 32 - (n)))
+
+static inline __m128i mix_columns128(__m128i v) {
+  __m128i r1 = ROR128(v, 8);
+
+  return _mm_xor_si128(_mm_xor_si128(xtime128(_mm_xor_si128(v, r1)), r1),
+					   _mm_xor_si128(ROR128(v, 16), ROR128(v, 24)));
+}
+
+/**
+ * MixColumns on a 16-byte state, column by column.
+ */
+void gf_mix_columns(uint8_t *state) {
+  __m128i v = _mm_loadu_si128((const __m128i *)state);
+  _mm_storeu_si128((__m128i *)state, mix_columns128(v));
+}
+
+/**
+ * InvMixColumns on a 16-byte state, column by column.
+ */
+void gf_mix_columns_inv(uint8_t *state) {
+  __m128i v = _mm_loadu_si128((const __m128i *)state);
+  __m128i u = xtime128(xtime128(_mm_xor_si128(v, ROR128(v, 16))));
+  _mm_storeu_si128((__m128i *)state, mix_columns128(_mm_xor_si128(v, u)));
+}
+
+#else
+
+/* Loads/stores a column word, row 0 in the low byte */
+static inline uint32_t get_column(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16)
+	| ((uint32_t)p[3] << 24);
+}
+
+static inline void put_column(uint8_t *p, uint32_t w) {
+  p[0] = (uint8_t)w;
+  p[1] = (uint8_t)(w >> 8);
+  p[2] = (uint8_t)(w >> 16);
+  p[3] = (uint8_t)(w >> 24);
+}
+
+/**
+ * MixColumns on a 16-byte state, column by column.
+ */
+void gf_mix_columns(uint8_t *state) {
+  int c;
+
+  for (c = 0; c < 4; c++)
+	put_column(state + 4 * c, gf_mix_column(get_column(state + 4 * c)));
+}
+
+/**
+ * InvMixColumns on a 16-byte state, column by column.
+ */
+void gf_mix_columns_inv(uint8_t *state) {
+  int c;
+
+  for (c = 0; c < 4; c++)
+	put_column(state + 4 * c, gf_mix_column_inv(get_column(state + 4 * c)));
+}
+
+#endif
@@ -0,0 +1,335 @@
+/**
+ * Ciphering a file where it lies
+ *
+ * With --in_place, a file is turned into its cipher file (or back) without a
+ * second copy being written next to it. Only the modes whose ciphertext is as
+ * long as the plaintext can do this; the header still has to go in front, so
+ * the data moves up AES_HEADER_SIZE bytes as it is encrypted, and back down
+ * as it is decrypted. The file is worked through a window at a time, read
+ * with pread() and written back with pwrite().
+ *
+ * Overwriting the only copy of the data means a crash part way could lose
+ * some of it, so every window goes through a journal first, a file next to
+ * the one being ciphered:
+ *
+ *  offset  size  field
+ *       0     4  magic, "AESJ"
+ *       4     1  version (3)
+ *       5     1  1 if decrypting, 0 if encrypting
+ *       8    32  the cipher file header
+ *      40    16  key check (see inplace_key_check())
+ *      56     8  bytes of plaintext
+ *      64     8  window size
+ *      72     8  record: plaintext offset of the window in the journal
+ *      80     8  record: its length, 0 if there isn't one yet
+ *      88     8  record: which of the two slots holds it
+ *    4096        slot 0, then slot 1: a window's input, and when encrypting
+ *                the AES_HEADER_SIZE bytes after it, which writing it over
+ *                will destroy
+ *
+ * A window is copied into the free slot and synced, then the record is
+ * pointed at it and synced, and only then is the window ciphered and written
+ * over the file, and the file synced. So whenever the program stops, the
+ * record names a window whose input is safe in the journal, and everything
+ * before it is already ciphered. Running it again redoes that window from the
+ * journal and carries on from there. The journal is removed once the file is
+ * done. All numbers are big-endian.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "aes.h"
+
+#define JOURNAL_MAGIC "AESJ"
+#define JOURNAL_VERSION 3
+
+/* Bytes in the journal before the record */
+#define JOURNAL_RECORD 72
+
+/* Bytes in the record */
+#define JOURNAL_RECORD_SIZE 24
+
+/* Where the first slot starts, and the alignment of the slots */
+#define JOURNAL_DATA 4096
+
+/* Reads a big-endian 64-bit number */
+static uint64_t get_be64(const uint8_t *p) {
+  uint64_t v = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+	v = (v << 8) | p[i];
+  return v;
+}
+
+/* Writes a big-endian 64-bit number */
+static void put_be64(uint8_t *p, uint64_t v) {
+  int i;
+
+  for (i = 7; i >= 0; i--) {
+	p[i] = v & 0xFF;
+	v >>= 8;
+  }
+}
+
+/**
+ * Reads exactly 'len' bytes from 'pos'.
+ */
+static bool read_full(int fd, void *buf, size_t len, uint64_t pos) {
+  ssize_t got;
+
+  while (len > 0) {
+	got = pread(fd, buf, len, pos);
+	if (got < 0 && errno == EINTR)
+	  continue;
+	if (got <= 0)
+	  return false;
+	buf = (uint8_t*)buf + got;
+	len -= got;
+	pos += got;
+  }
+  return true;
+}
+
+/**
+ * Writes exactly 'len' bytes at 'pos'.
+ */
+static bool write_full(int fd, const void *buf, size_t len, uint64_t pos) {
+  ssize_t put;
+
+  while (len > 0) {
+	put = pwrite(fd, buf, len, pos);
+	if (put < 0 && errno == EINTR)
+	  continue;
+	if (put <= 0)
+	  return false;
+	buf = (const uint8_t*)buf + put;
+	len -= put;
+	pos += put;
+  }
+  return true;
+}
+
+/**
+ * Returns the distance between the starts of the two slots.
+ */
+static uint64_t slot_size(const inplace_t *ip) {
+  uint64_t size = ip->window_size + AES_BLOCK_SIZE + AES_HEADER_SIZE;
+  return (size + JOURNAL_DATA - 1) / JOURNAL_DATA * JOURNAL_DATA;
+}
+
+/**
+ * Works out the key check kept in a journal or checkpoint: the first half of
+ * KEY_CHECK_BLOCK encrypted with each key. That is enough to tell whether a
+ * resumed run has the same key, without giving the key away.
+ *
+ * The block must be one the modes never encrypt themselves. The zero block,
+ * used before version 2, is the GCM hash key of chunked files, and half of it
+ * was in the clear. A GCM counter block never ends in four zero bytes, as the
+ * counter starts at 1, so this one can't be a block of a GCM, chunked or
+ * archive key stream either.
+ *
+ * @param key2 - The XTS tweak key, or NULL.
+ * @param check - 16 bytes to fill.
+ */
+void inplace_key_check(const aes_engine_t *engine, const aes_key_t *key,
+					   const aes_key_t *key2, uint8_t *check) {
+  static const uint8_t key_check_block[AES_BLOCK_SIZE] = KEY_CHECK_BLOCK;
+  uint8_t block[AES_BLOCK_SIZE];
+
+  memset(check, 0, 16);
+  engine->encrypt(key, key_check_block, block, 1);
+  memcpy(check, block, 8);
+  if (key2 != NULL) {
+	engine->encrypt(key2, key_check_block, block, 1);
+	memcpy(check + 8, block, 8);
+  }
+}
+
+/**
+ * Writes the start of a new journal, with no window in it yet. Everything but
+ * the record must be filled in.
+ *
+ * @return false if it couldn't be written.
+ */
+bool inplace_start(inplace_t *ip) {
+  uint8_t buf[JOURNAL_RECORD + JOURNAL_RECORD_SIZE];
+
+  ip->pos = 0;
+  ip->len = 0;
+  ip->slot = 0;
+
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, JOURNAL_MAGIC, 4);
+  buf[4] = JOURNAL_VERSION;
+  buf[5] = ip->decrypt;
+  memcpy(buf + 8, ip->header, AES_HEADER_SIZE);
+  memcpy(buf + 40, ip->key_check, sizeof(ip->key_check));
+  put_be64(buf + 56, ip->plain_size);
+  put_be64(buf + 64, ip->window_size);
+
+  return write_full(ip->journal_fd, buf, sizeof(buf), 0)
+	&& fdatasync(ip->journal_fd) == 0;
+}
+
+/**
+ * Reads a journal left by a run that didn't finish, so it can be resumed.
+ * The caller checks that it is for the same job: the direction, the header
+ * and the key.
+ *
+ * @return false if it isn't a journal we understand, with ip->error set if
+ *         it is one from another version.
+ */
+bool inplace_resume(inplace_t *ip) {
+  uint8_t buf[JOURNAL_RECORD + JOURNAL_RECORD_SIZE];
+
+  ip->error = NULL;
+  if (!read_full(ip->journal_fd, buf, sizeof(buf), 0)
+	  || memcmp(buf, JOURNAL_MAGIC, 4) != 0)
+	return false;
+  if (buf[4] != JOURNAL_VERSION) {
+	/* Its data may be the only copy, so say why it can't be used */
+	ip->error = "Journal is from another version of the program; finish the" \
+	  " run with that one";
+	return false;
+  }
+
+  ip->decrypt = buf[5] != 0;
+  memcpy(ip->header, buf + 8, AES_HEADER_SIZE);
+  memcpy(ip->key_check, buf + 40, sizeof(ip->key_check));
+  ip->plain_size = get_be64(buf + 56);
+  ip->window_size = get_be64(buf + 64);
+  ip->pos = get_be64(buf + JOURNAL_RECORD);
+  ip->len = get_be64(buf + JOURNAL_RECORD + 8);
+  ip->slot = get_be64(buf + JOURNAL_RECORD + 16);
+
+  return ip->window_size > 0 && ip->window_size <= (uint64_t)SIZE_MAX / 2
+	&& ip->window_size % AES_BLOCK_SIZE == 0 && ip->slot <= 1
+	&& ip->pos <= ip->plain_size && ip->len <= ip->plain_size - ip->pos
+	&& ip->len <= ip->window_size + AES_BLOCK_SIZE;
+}
+
+/**
+ * Works out how long the window at 'pos' is: a whole window, unless that
+ * would leave less than a block after it, which XTS can't cipher on its own.
+ */
+static size_t window_length(const inplace_t *ip, uint64_t pos) {
+  uint64_t left = ip->plain_size - pos;
+
+  if (left < ip->window_size + AES_BLOCK_SIZE)
+	return left;
+  return ip->window_size;
+}
+
+/**
+ * Ciphers the file a window at a time, through the journal, starting from
+ * where the journal says. When encrypting, the header is written in front of
+ * the data; when decrypting, the file is cut down to the plaintext at the
+ * end.
+ *
+ * @param fn - Ciphers a window in place. Its position in the plaintext says
+ *             where it is in the key stream or which data units it holds.
+ * @param progress - Called with the bytes done so far and the total.
+ * @return false on a read or write error, with ip->error saying which.
+ */
+bool inplace_run(inplace_t *ip, inplace_fn_t fn, void *arg,
+				 void (*progress)(long int, long int)) {
+  uint8_t carry[AES_HEADER_SIZE], record[JOURNAL_RECORD_SIZE];
+  uint8_t *buf;
+  uint64_t pos, in_pos, out_pos;
+  size_t len, extra, carried = 0;
+  bool redo;
+
+  buf = (uint8_t*)malloc(ip->window_size + AES_BLOCK_SIZE + AES_HEADER_SIZE);
+  if (buf == NULL) {
+	ip->error = "Out of memory";
+	return false;
+  }
+
+  /* A window left in the journal is done again first */
+  redo = ip->len > 0;
+  pos = ip->pos;
+  while (pos < ip->plain_size) {
+	len = redo ? ip->len : window_length(ip, pos);
+
+	/* Encrypting writes the window a header's length further on, over the
+	   start of the next one, so that part goes in the journal as well */
+	extra = 0;
+	if (!ip->decrypt)
+	  extra = ip->plain_size - pos - len < AES_HEADER_SIZE
+		? ip->plain_size - pos - len : AES_HEADER_SIZE;
+
+	if (redo) {
+	  if (!read_full(ip->journal_fd, buf, len + extra,
+					 JOURNAL_DATA + ip->slot * slot_size(ip))) {
+		ip->error = "Journal read error";
+		free(buf);
+		return false;
+	  }
+	  redo = false;
+	}
+	else {
+	  /* The start of this window was written over by the last one, and is
+		 held over from that one's journal slot */
+	  memcpy(buf, carry, carried);
+	  in_pos = (ip->decrypt ? pos + AES_HEADER_SIZE : pos) + carried;
+	  if (!read_full(ip->fd, buf + carried, len + extra - carried, in_pos)) {
+		ip->error = "File read error";
+		free(buf);
+		return false;
+	  }
+
+	  ip->slot = !ip->slot;
+	  put_be64(record, pos);
+	  put_be64(record + 8, len);
+	  put_be64(record + 16, ip->slot);
+	  if (!write_full(ip->journal_fd, buf, len + extra,
+					  JOURNAL_DATA + ip->slot * slot_size(ip))
+		  || fdatasync(ip->journal_fd) != 0
+		  || !write_full(ip->journal_fd, record, sizeof(record),
+						 JOURNAL_RECORD)
+		  || fdatasync(ip->journal_fd) != 0) {
+		ip->error = "Journal write error";
+		free(buf);
+		return false;
+	  }
+	}
+
+	memcpy(carry, buf + len, extra);
+	carried = extra;
+	fn(arg, pos, buf, len);
+
+	out_pos = ip->decrypt ? pos : pos + AES_HEADER_SIZE;
+	if ((pos == 0 && !ip->decrypt
+		 && !write_full(ip->fd, ip->header, AES_HEADER_SIZE, 0))
+		|| !write_full(ip->fd, buf, len, out_pos)
+		|| fdatasync(ip->fd) != 0) {
+	  ip->error = "File write error";
+	  free(buf);
+	  return false;
+	}
+
+	pos += len;
+	if (progress != NULL)
+	  progress(pos, ip->plain_size);
+  }
+  free(buf);
+
+  /* An empty file still gets its header */
+  if (!ip->decrypt && ip->plain_size == 0
+	  && !write_full(ip->fd, ip->header, AES_HEADER_SIZE, 0)) {
+	ip->error = "File write error";
+	return false;
+  }
+  if ((ip->decrypt && ftruncate(ip->fd, ip->plain_size) != 0)
+	  || fsync(ip->fd) != 0) {
+	ip->error = "File write error";
+	return false;
+  }
+  return true;
+}
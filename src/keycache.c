@@ -0,0 +1,280 @@
+/**
+ * Key schedule cache
+ *
+ * A program that ciphers messages for many different keys, one after the
+ * other, would otherwise read, decode and expand a key every time it
+ * switches to one. The cache keeps the expanded schedules of the keys used
+ * most recently, so switching to one of those is a hash lookup and a copy.
+ *
+ * A key is found by its ID (the path of its key file, or a name the program
+ * gives it), a version (the file's modification time, so an edited key file
+ * is read again) and the number of keys it holds: two for XTS, which splits
+ * the key into a data and a tweak key, and one otherwise.
+ *
+ * Every entry lives in a single slab allocated when the cache is made, with
+ * each entry on a cache line of its own, so the cache never grows past the
+ * number of keys it was made for. When it is full, the entry used least
+ * recently is wiped and reused. Entries are chained two ways by their index
+ * in the slab: in a hash bucket, and in order of use, most recent first.
+ *
+ * A lock guards the cache, so any number of threads can share one. A lookup
+ * copies the schedules out while it holds it, and the copy is the caller's
+ * own: an entry can be evicted while a context is still using its key.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "aes.h"
+
+/* Alignment of the slab and of each entry in it */
+#define KEY_CACHE_ALIGN 64
+
+/* Marks the end of a chain */
+#define NO_ENTRY UINT32_MAX
+
+typedef struct
+{
+  aes_key_t keys[2]; /* The key, or the XTS data and tweak keys */
+  uint64_t hash;
+  uint64_t version;
+  int count; /* Keys held, 0 if the entry is free */
+  uint32_t bucket_next; /* Next entry in the same hash bucket */
+  uint32_t newer, older; /* Neighbours in order of use */
+  char id[KEY_CACHE_ID_SIZE];
+} __attribute__((aligned(KEY_CACHE_ALIGN))) key_entry_t;
+
+struct aes_key_cache
+{
+  key_entry_t *entries; /* The slab */
+  uint32_t size; /* Number of entries */
+  uint32_t used; /* Entries that have ever been filled */
+  uint32_t *buckets; /* First entry of each hash chain */
+  uint32_t num_buckets; /* A power of two */
+  uint32_t newest, oldest;
+  pthread_mutex_t lock;
+};
+
+/**
+ * Zeroes an entry's keys and ID. The volatile writes can't be left out, even
+ * though nothing reads the entry again until it is filled in.
+ */
+static void wipe_entry(key_entry_t *entry) {
+  volatile uint8_t *p = (volatile uint8_t*)entry->keys;
+  size_t len = sizeof(entry->keys);
+
+  while (len-- > 0)
+	*p++ = 0;
+  p = (volatile uint8_t*)entry->id;
+  for (len = 0; len < sizeof(entry->id); len++)
+	p[len] = 0;
+}
+
+/**
+ * Hashes a lookup with FNV-1a. Not meant to stand up to anyone picking IDs to
+ * collide, which would only make their own lookups slower.
+ */
+static uint64_t hash_key(const char *id, uint64_t version, int count) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+  int i;
+
+  while (*id != '\0') {
+	h ^= (uint8_t)*id++;
+	h *= 0x100000001B3ULL;
+  }
+  for (i = 0; i < 8; i++) {
+	h ^= (version >> (8 * i)) & 0xFF;
+	h *= 0x100000001B3ULL;
+  }
+  return h ^ (uint64_t)count;
+}
+
+/**
+ * Makes a cache of expanded keys.
+ *
+ * @param max_keys - Most keys it holds at once, or 0 for
+ *                   KEY_CACHE_DEFAULT_SIZE.
+ * @return The cache, or NULL if we ran out of memory.
+ */
+aes_key_cache_t * key_cache_create(size_t max_keys) {
+  aes_key_cache_t *cache;
+  void *slab;
+  uint32_t i;
+
+  if (max_keys == 0)
+	max_keys = KEY_CACHE_DEFAULT_SIZE;
+  if (max_keys > KEY_CACHE_MAX_SIZE)
+	return NULL;
+
+  cache = (aes_key_cache_t*)calloc(1, sizeof(aes_key_cache_t));
+  if (cache == NULL)
+	return NULL;
+  cache->size = max_keys;
+  for (cache->num_buckets = 1; cache->num_buckets < 2 * cache->size; )
+	cache->num_buckets *= 2;
+
+  cache->buckets = (uint32_t*)malloc(cache->num_buckets * sizeof(uint32_t));
+  if (cache->buckets == NULL
+	  || posix_memalign(&slab, KEY_CACHE_ALIGN,
+						cache->size * sizeof(key_entry_t)) != 0) {
+	free(cache->buckets);
+	free(cache);
+	return NULL;
+  }
+  cache->entries = (key_entry_t*)slab;
+  memset(cache->entries, 0, cache->size * sizeof(key_entry_t));
+  for (i = 0; i < cache->num_buckets; i++)
+	cache->buckets[i] = NO_ENTRY;
+  cache->newest = cache->oldest = NO_ENTRY;
+  pthread_mutex_init(&cache->lock, NULL);
+  return cache;
+}
+
+/* Takes an entry out of the order of use */
+static void unlink_entry(aes_key_cache_t *cache, uint32_t n) {
+  key_entry_t *entry = &cache->entries[n];
+
+  if (entry->newer != NO_ENTRY)
+	cache->entries[entry->newer].older = entry->older;
+  else
+	cache->newest = entry->older;
+  if (entry->older != NO_ENTRY)
+	cache->entries[entry->older].newer = entry->newer;
+  else
+	cache->oldest = entry->newer;
+}
+
+/* Puts an entry at the front of the order of use */
+static void link_newest(aes_key_cache_t *cache, uint32_t n) {
+  key_entry_t *entry = &cache->entries[n];
+
+  entry->newer = NO_ENTRY;
+  entry->older = cache->newest;
+  if (cache->newest != NO_ENTRY)
+	cache->entries[cache->newest].newer = n;
+  else
+	cache->oldest = n;
+  cache->newest = n;
+}
+
+/* Takes an entry out of its hash bucket */
+static void unlink_bucket(aes_key_cache_t *cache, uint32_t n) {
+  uint32_t *link;
+
+  link = &cache->buckets[cache->entries[n].hash & (cache->num_buckets - 1)];
+  while (*link != n)
+	link = &cache->entries[*link].bucket_next;
+  *link = cache->entries[n].bucket_next;
+}
+
+/* Finds an entry, or returns NO_ENTRY */
+static uint32_t find_entry(const aes_key_cache_t *cache, uint64_t hash,
+						   const char *id, uint64_t version, int count) {
+  const key_entry_t *entry;
+  uint32_t n;
+
+  n = cache->buckets[hash & (cache->num_buckets - 1)];
+  for (; n != NO_ENTRY; n = entry->bucket_next) {
+	entry = &cache->entries[n];
+	if (entry->hash == hash && entry->version == version
+		&& entry->count == count && strcmp(entry->id, id) == 0)
+	  return n;
+  }
+  return NO_ENTRY;
+}
+
+/**
+ * Looks up a key, and copies out its schedules if it is there.
+ *
+ * @param version - Changes whenever the key behind the ID does.
+ * @param count - Number of keys: 2 for XTS, 1 otherwise.
+ * @param keys - Where the 'count' keys go.
+ * @return false if the key isn't in the cache.
+ */
+bool key_cache_find(aes_key_cache_t *cache, const char *id, uint64_t version,
+					int count, aes_key_t *keys) {
+  uint64_t hash;
+  uint32_t n;
+
+  if (strlen(id) >= KEY_CACHE_ID_SIZE)
+	return false;
+  hash = hash_key(id, version, count);
+
+  pthread_mutex_lock(&cache->lock);
+  n = find_entry(cache, hash, id, version, count);
+  if (n != NO_ENTRY) {
+	memcpy(keys, cache->entries[n].keys, count * sizeof(aes_key_t));
+	unlink_entry(cache, n);
+	link_newest(cache, n);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return n != NO_ENTRY;
+}
+
+/**
+ * Adds expanded keys to the cache, in place of the least recently used entry
+ * if it is full. An ID too long to keep isn't cached.
+ *
+ * @param keys - The 'count' keys, already expanded.
+ * @return false if the ID is too long.
+ */
+bool key_cache_add(aes_key_cache_t *cache, const char *id, uint64_t version,
+				   int count, const aes_key_t *keys) {
+  key_entry_t *entry;
+  uint64_t hash;
+  uint32_t n, *bucket;
+
+  if (strlen(id) >= KEY_CACHE_ID_SIZE)
+	return false;
+  hash = hash_key(id, version, count);
+
+  pthread_mutex_lock(&cache->lock);
+  n = find_entry(cache, hash, id, version, count);
+  if (n != NO_ENTRY) {
+	/* Another thread got here first */
+	unlink_entry(cache, n);
+  } else if (cache->used < cache->size) {
+	n = cache->used++;
+  } else {
+	n = cache->oldest;
+	unlink_entry(cache, n);
+	unlink_bucket(cache, n);
+	wipe_entry(&cache->entries[n]);
+	cache->entries[n].count = 0;
+  }
+
+  entry = &cache->entries[n];
+  if (entry->count == 0) {
+	strcpy(entry->id, id);
+	entry->hash = hash;
+	entry->version = version;
+	entry->count = count;
+	bucket = &cache->buckets[hash & (cache->num_buckets - 1)];
+	entry->bucket_next = *bucket;
+	*bucket = n;
+  }
+  memcpy(entry->keys, keys, count * sizeof(aes_key_t));
+  link_newest(cache, n);
+  pthread_mutex_unlock(&cache->lock);
+  return true;
+}
+
+/**
+ * Wipes every key in the cache and frees it.
+ */
+void key_cache_destroy(aes_key_cache_t *cache) {
+  uint32_t n;
+
+  if (cache == NULL)
+	return;
+
+  for (n = 0; n < cache->used; n++)
+	wipe_entry(&cache->entries[n]);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->entries);
+  free(cache->buckets);
+  free(cache);
+}
@@ -9,44 +9,69 @@
 /* External functions */
 extern void bytesub_encrypt(uint8_t *block, size_t count);
 
-/* Rcon lookup table. */
-static const uint32_t rcon_table[15] = 
+/* Round constants. Only the first byte of Rcon[i] is ever non-zero, and
+   Rcon[0] is never used. */
+static const uint8_t rcon_table[11] = 
 {
-  0x01000000, 0x02000000, 0x04000000,
-  0x08000000, 0x10000000, 0x20000000,
-  0x40000000, 0x80000000, 0x1B000000,
-  0x36000000, 0x6C000000, 0xD8000000,
-  0xAB000000, 0x4D000000, 0x9A000000
+  0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36
 };
 
 
 /* Left-rotates the bytes in a word  */
-static uint32_t rot_word(uint32_t word) {
-  uint32_t temp = (word & 0xFF000000) >> 24;
-  word = word << 8;
-  word = word | temp;
-  return word;
+static void rot_word(uint8_t *word) {
+  uint8_t temp = word[0];
+
+  word[0] = word[1];
+  word[1] = word[2];
+  word[2] = word[3];
+  word[3] = temp;
 }
 
 /* Substitutes the bytes in the given word with their AES S-Box value  */
-static uint32_t sub_word(uint32_t word)
+static void sub_word(uint8_t *word)
 {
-  bytesub_encrypt((uint8_t*)&word, 4);
-  return word;
+  bytesub_encrypt(word, 4);
+}
+
+/**
+ * Builds the decryption key block from the expanded key, for the equivalent
+ * inverse cipher (FIPS-197, section 5.3.5). The round keys are stored in the
+ * order decryption uses them, last round first, and every one but the first
+ * and last has InvMixColumns applied to it. Decryption can then run the same
+ * way as encryption: InvSubBytes, InvShiftRows, InvMixColumns, and then the
+ * next round key, with no key schedule work left for each block.
+ */
+static void key_expansion_inv(aes_key_t *key) {
+  int r, num_rounds;
+
+  num_rounds = (key->size / 4) + 6;
+
+  for (r = 0; r <= num_rounds; r++) {
+	memcpy(key->dec_block + 16 * r, key->exp_block + 16 * (num_rounds - r),
+		   AES_BLOCK_SIZE);
+	if (r > 0 && r < num_rounds)
+	  gf_mix_columns_inv(key->dec_block + 16 * r);
+  }
 }
 
 /**
- * Converts an AES encryption key into its expanded form
+ * Converts an AES encryption key into its expanded form, and builds the
+ * decryption key block from that.
+ *
+ * The schedule works on words of four bytes, taken in the order they are
+ * stored, just as FIPS-197 (section 5.2) lays it out, so the round keys are
+ * the same on any machine. Versions before format 2 (see mode.c) read the
+ * words in the machine's byte order instead, which on x86 gave a different
+ * cipher from AES; their files can only be decrypted by those versions.
  * 
  * @param key Encryption key
  * @param key_type Size of encryption key
  */
 void key_expansion(aes_key_t *key)
 {
-  int i, key_word_size, num_rounds;
-  uint32_t temp;
-  uint32_t *w_key = (uint32_t*)key->block;
-  uint32_t *w_exp_key = (uint32_t*)key->exp_block;
+  int i, j, key_word_size, num_rounds;
+  uint8_t temp[4];
+  uint8_t *w = key->exp_block;
   
   /* Determine the key's size in number of words */
   key_word_size = key->size / 4;
@@ -55,20 +80,23 @@ void key_expansion(aes_key_t *key)
   num_rounds = key_word_size + 6;
 
   /* Copy key into the beginning of the expanded key buffer */
-  for (i = 0; i < key_word_size; i++) {
-	w_exp_key[i] = w_key[i];
-  }
+  memcpy(w, key->block, key->size);
 
   /* Perform expansion */
   for (i = key_word_size; i < (AES_BLOCK_SIZE/4)*(num_rounds+1); i++) {
-	temp = w_exp_key[i-1];
+	memcpy(temp, w + 4 * (i - 1), 4);
 	
-	if ((i % key_word_size) == 0)
-	  temp = sub_word(rot_word(temp)) ^ rcon_table[i/key_word_size];
-	  
+	if ((i % key_word_size) == 0) {
+	  rot_word(temp);
+	  sub_word(temp);
+	  temp[0] ^= rcon_table[i/key_word_size];
+	}
 	else if ((key_word_size > 6) && ((i % key_word_size) == 4))
-	  temp = sub_word(temp);
+	  sub_word(temp);
 
-	w_exp_key[i] = w_exp_key[i - key_word_size] ^ temp;
+	for (j = 0; j < 4; j++)
+	  w[4 * i + j] = w[4 * (i - key_word_size) + j] ^ temp[j];
   }
+
+  key_expansion_inv(key);
 }
@@ -0,0 +1,1109 @@
+/**
+ * Library contexts
+ *
+ * A context runs one message through one of the modes, a piece at a time, the
+ * way aes-encrypt and aes-decrypt run a file through it a buffer at a time
+ * (see libaes.h for how it is used). Every mode works in steps: a block, an
+ * XTS data unit, or a chunk and its tag. Some can't take a step until they
+ * know it isn't the last one, which is ciphered differently; they keep back a
+ * few bytes ('hold') until more data or aes_ctx_final() comes:
+ *
+ *  mode     step                      hold when encrypting / decrypting
+ *  ecb      block                     0 / 0
+ *  ctr      block                     0 / 0
+ *  gcm      block                     0 / 16, the tag
+ *  cbc      block                     0 / 16, the padded block
+ *  xts      data unit                 16 / 16, for ciphertext stealing
+ *  chunked  chunk (and tag)           1 / 1, as the last chunk is marked
+ *
+ * The bytes of a piece that don't make a whole step, or are held back, wait
+ * in 'pending'. Whole steps are ciphered straight from the caller's buffer,
+ * and as many as there are go to the engine at once, split over the context's
+ * threads for the modes that can be.
+ *
+ * A context can also encrypt batches of short messages, each one whole and
+ * on its own (aes_encrypt_iov()). One message of a few hundred bytes is far
+ * too little to keep a wide engine busy, so up to BATCH_LANES of them are
+ * ciphered together as the lanes of one call, the way aes-encrypt does a
+ * group of small files (see ctr_crypt_multi() and cbc_encrypt_multi()). The
+ * setup is done once rather than per message: the key schedule and GCM hash
+ * key stay in the context, and the nonces come from one draw of random bytes.
+ *
+ * aes-encrypt and aes-decrypt run files through contexts too, set up with
+ * ctx_new() to cipher with the engine and threads the user picked. They write
+ * or read the header themselves and start the context from it (ctx_start()),
+ * as a file picked up from a checkpoint has its header already, and give it
+ * pieces sized so that what comes out fits the output they have mapped.
+ *
+ * Nothing here is shared between contexts except the T-tables and the choice
+ * of engine, which are made once and only read after that, and the key
+ * caches the program hands to aes_ctx_init_id() and aes_ctx_init_file() (see
+ * keycache.c). A context copies its keys out of the cache, so it doesn't care
+ * what happens to the cache after that.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "aes.h"
+
+struct aes_ctx
+{
+  const aes_engine_t *engine;
+  pool_t *pool;
+  bool shared_pool; /* The pool belongs to the program (see ctx_new()) */
+  aes_mode_t mode;
+  bool decrypt;
+  aes_key_t key;
+  aes_key_t tweak_key; /* XTS only */
+  size_t unit_size; /* XTS data unit or chunk size */
+
+  bool started; /* The header has been written, or read */
+  bool batch; /* Used for batches of messages, not a stream */
+  uint8_t header_buf[AES_HEADER_SIZE];
+  size_t header_len; /* Bytes of the header read so far */
+  aes_header_t header;
+
+  size_t step; /* Bytes of input ciphered at a time */
+  size_t out_step; /* Bytes of output for each step */
+  size_t hold; /* Bytes kept back in case they end the message */
+  uint64_t next; /* Number of the next block, unit or chunk */
+  uint8_t iv[AES_BLOCK_SIZE]; /* CBC: the last ciphertext block */
+  gcm_t gcm;
+  xts_t xts;
+  chunked_t chunked;
+
+  uint8_t *pending; /* step + hold bytes */
+  size_t pending_len;
+
+  gcm_t batch_gcm; /* GCM hash key for batches, set up on first use */
+  bool batch_ready;
+
+  const char *error; /* Why the last call failed; the context is dead */
+};
+
+/* Messages of a batch ciphered together */
+#define BATCH_LANES 64
+
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+
+/* The engine every context uses, picked once: asking the CPU what it
+   supports takes longer than setting up a context from a cached key */
+static const aes_engine_t *lib_engine;
+
+/**
+ * Builds the T-tables and picks the engine, the first time a context is set
+ * up.
+ */
+static void lib_setup(void) {
+  ttable_init();
+  lib_engine = engine_find(NULL);
+}
+
+/**
+ * Clears key material, in a way the compiler can't leave out because the
+ * memory is about to be freed.
+ */
+static void wipe(void *buf, size_t len) {
+  volatile uint8_t *p = buf;
+
+  while (len-- > 0)
+	*p++ = 0;
+}
+
+/**
+ * Records why the context failed. Every later call fails the same way.
+ */
+static bool fail(aes_ctx_t *ctx, const char *error) {
+  ctx->error = error;
+  return false;
+}
+
+/**
+ * Allocates a context for a message, with no key yet.
+ */
+static aes_ctx_t * ctx_create(aes_mode_t mode, bool decrypt) {
+  aes_ctx_t *ctx;
+
+  if ((unsigned)mode > mode_chunked || mode == mode_archive)
+	return NULL;
+
+  ctx = (aes_ctx_t*)calloc(1, sizeof(aes_ctx_t));
+  if (ctx == NULL)
+	return NULL;
+  ctx->pool = pool_create(1);
+  if (ctx->pool == NULL) {
+	free(ctx);
+	return NULL;
+  }
+
+  pthread_once(&setup_once, lib_setup);
+  ctx->engine = lib_engine;
+  ctx->mode = mode;
+  ctx->decrypt = decrypt;
+
+  if (mode == mode_xts)
+	ctx->unit_size = XTS_DEFAULT_UNIT_SIZE;
+  else if (mode == mode_chunked)
+	ctx->unit_size = CHUNKED_DEFAULT_SIZE;
+  return ctx;
+}
+
+/**
+ * Expands the key, or the XTS data and tweak keys, into the context.
+ *
+ * @return false if the key doesn't fit the mode.
+ */
+static bool set_key(aes_ctx_t *ctx, const uint8_t *key, size_t key_size) {
+  size_t size;
+
+  size = ctx->mode == mode_xts ? key_size / 2 : key_size;
+  if ((ctx->mode == mode_xts && key_size % 2 != 0)
+	  || (size != key_16_bytes && size != key_24_bytes && size != key_32_bytes))
+	return false;
+
+  ctx->key.size = size;
+  memcpy(ctx->key.block, key, size);
+  key_expansion(&ctx->key);
+  if (ctx->mode == mode_xts) {
+	ctx->tweak_key.size = size;
+	memcpy(ctx->tweak_key.block, key + size, size);
+	key_expansion(&ctx->tweak_key);
+  }
+  return true;
+}
+
+/**
+ * Takes the context's keys from the cache, if they are there.
+ */
+static bool cached_key(aes_ctx_t *ctx, aes_key_cache_t *cache, const char *id,
+					   uint64_t version) {
+  aes_key_t keys[2];
+  int count = ctx->mode == mode_xts ? 2 : 1;
+
+  if (!key_cache_find(cache, id, version, count, keys))
+	return false;
+  ctx->key = keys[0];
+  if (count == 2)
+	ctx->tweak_key = keys[1];
+  wipe(keys, sizeof(keys));
+  return true;
+}
+
+/**
+ * Puts the context's expanded keys in the cache.
+ */
+static void cache_key(aes_ctx_t *ctx, aes_key_cache_t *cache, const char *id,
+					  uint64_t version) {
+  aes_key_t keys[2];
+  int count = ctx->mode == mode_xts ? 2 : 1;
+
+  keys[0] = ctx->key;
+  keys[1] = ctx->tweak_key;
+  key_cache_add(cache, id, version, count, keys);
+  wipe(keys, sizeof(keys));
+}
+
+/**
+ * Sets up a context for a message.
+ *
+ * @param key - The key: 16, 24 or 32 bytes, or for XTS twice that, the data
+ *              key followed by the tweak key (as aes-encrypt saves them).
+ * @param mode - Any mode but mode_archive.
+ * @param decrypt - Decrypt the message, rather than encrypt it.
+ * @return The context, or NULL if the key doesn't fit the mode or we ran out
+ *         of memory.
+ */
+aes_ctx_t * aes_ctx_init(const uint8_t *key, size_t key_size, aes_mode_t mode,
+						 bool decrypt) {
+  aes_ctx_t *ctx;
+
+  ctx = ctx_create(mode, decrypt);
+  if (ctx != NULL && !set_key(ctx, key, key_size)) {
+	aes_ctx_free(ctx);
+	return NULL;
+  }
+  return ctx;
+}
+
+/**
+ * Sets up a context for a message, with a key named by the program. The
+ * expanded key is taken from the cache if it is there, and put there if not.
+ * An ID stands for the same key for as long as the cache is in use.
+ *
+ * @param id - Names the key, such as a tenant or key number.
+ * @param key - The key, as for aes_ctx_init(). It is only used if the key
+ *              isn't in the cache, and may be NULL to use the cache alone.
+ * @return The context, or NULL if the key isn't cached and none was given,
+ *         doesn't fit the mode, or we ran out of memory.
+ */
+aes_ctx_t * aes_ctx_init_id(aes_key_cache_t *cache, const char *id,
+							const uint8_t *key, size_t key_size,
+							aes_mode_t mode, bool decrypt) {
+  aes_ctx_t *ctx;
+
+  ctx = ctx_create(mode, decrypt);
+  if (ctx == NULL || cached_key(ctx, cache, id, 0))
+	return ctx;
+  if (key == NULL || !set_key(ctx, key, key_size)) {
+	aes_ctx_free(ctx);
+	return NULL;
+  }
+  cache_key(ctx, cache, id, 0);
+  return ctx;
+}
+
+/**
+ * Sets up a context for a message, with the key from a key file as saved by
+ * aes-encrypt. The key is cached under the file's path and modification
+ * time, so the file is only read and the key expanded again once it changes.
+ *
+ * @return The context, or NULL if the file can't be read, doesn't hold a key
+ *         that fits the mode, or we ran out of memory.
+ */
+aes_ctx_t * aes_ctx_init_file(aes_key_cache_t *cache, const char *path,
+							  aes_mode_t mode, bool decrypt) {
+  aes_ctx_t *ctx;
+  struct stat st;
+  uint64_t version;
+  char b64_str[128];
+  uint8_t *data;
+  size_t len;
+  FILE *keyfd;
+  bool ok;
+
+  if (stat(path, &st) != 0)
+	return NULL;
+  version = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+  ctx = ctx_create(mode, decrypt);
+  if (ctx == NULL || cached_key(ctx, cache, path, version))
+	return ctx;
+
+  keyfd = fopen(path, "r");
+  ok = keyfd != NULL && fgets(b64_str, sizeof(b64_str), keyfd) != NULL;
+  if (keyfd != NULL)
+	fclose(keyfd);
+  if (ok) {
+	/* aes-encrypt writes no line break, but an editor might add one */
+	len = strcspn(b64_str, "\r\n");
+	data = len > 0 ? base64_decode(b64_str, len, &len) : NULL;
+  } else
+	data = NULL;
+  ok = data != NULL && set_key(ctx, data, len);
+  wipe(b64_str, sizeof(b64_str));
+  if (data != NULL) {
+	wipe(data, len);
+	free(data);
+  }
+  if (!ok) {
+	aes_ctx_free(ctx);
+	return NULL;
+  }
+  cache_key(ctx, cache, path, version);
+  return ctx;
+}
+
+/**
+ * Sets the XTS data unit size or the chunk size of a message being encrypted,
+ * before any of it has been given. A message being decrypted takes the size
+ * from its header.
+ *
+ * @return false if the mode has no such size, or it isn't one it can use.
+ */
+bool aes_ctx_set_unit_size(aes_ctx_t *ctx, size_t unit_size) {
+  if (ctx->started || ctx->decrypt)
+	return false;
+  if ((ctx->mode == mode_xts && xts_valid_unit_size(unit_size))
+	  || (ctx->mode == mode_chunked && chunked_valid_size(unit_size))) {
+	ctx->unit_size = unit_size;
+	return true;
+  }
+  return false;
+}
+
+/**
+ * Gives the context threads of its own to cipher long pieces with, in the
+ * modes that can be split up. A context starts out with none, and ciphers on
+ * the thread that calls it.
+ *
+ * @param num_threads - Threads to use, counting the caller; 0 for one per
+ *                      processor.
+ * @return false if the threads couldn't be started.
+ */
+bool aes_ctx_set_threads(aes_ctx_t *ctx, int num_threads) {
+  pool_t *pool = pool_create(num_threads);
+
+  if (pool == NULL)
+	return false;
+  if (!ctx->shared_pool)
+	pool_destroy(ctx->pool);
+  ctx->pool = pool;
+  ctx->shared_pool = false;
+  return true;
+}
+
+/**
+ * Works out the most that aes_ctx_update() can write for 'len' bytes of
+ * input, or aes_ctx_final() for a 'len' of 0.
+ */
+size_t aes_ctx_output_size(const aes_ctx_t *ctx, size_t len) {
+  size_t step, out_step;
+
+  /* Plaintext is never longer than the ciphertext it came from */
+  if (ctx->decrypt)
+	return ctx->pending_len + len;
+
+  step = AES_BLOCK_SIZE;
+  out_step = AES_BLOCK_SIZE;
+  if (ctx->mode == mode_xts)
+	step = out_step = ctx->unit_size;
+  else if (ctx->mode == mode_chunked) {
+	step = ctx->unit_size;
+	out_step = step + GCM_TAG_SIZE;
+  }
+  return AES_HEADER_SIZE + ((ctx->pending_len + len) / step + 1) * out_step
+	+ GCM_TAG_SIZE + AES_BLOCK_SIZE;
+}
+
+/**
+ * Works out the steps of the mode, once the header is known, and makes room
+ * for what is kept between pieces.
+ */
+static bool start(aes_ctx_t *ctx) {
+  ctx->step = ctx->out_step = AES_BLOCK_SIZE;
+  ctx->hold = 0;
+
+  switch (ctx->mode) {
+  case mode_gcm:
+	gcm_init(&ctx->gcm, ctx->engine, &ctx->key, ctx->header.iv);
+	gcm_aad(&ctx->gcm, ctx->header_buf, AES_HEADER_SIZE);
+	if (ctx->decrypt)
+	  ctx->hold = GCM_TAG_SIZE;
+	break;
+  case mode_cbc:
+	memcpy(ctx->iv, ctx->header.iv, AES_BLOCK_SIZE);
+	if (ctx->decrypt)
+	  ctx->hold = AES_BLOCK_SIZE;
+	break;
+  case mode_xts:
+	ctx->xts.engine = ctx->engine;
+	ctx->xts.data_key = &ctx->key;
+	ctx->xts.tweak_key = &ctx->tweak_key;
+	ctx->xts.unit_size = ctx->unit_size;
+	ctx->step = ctx->out_step = ctx->unit_size;
+	ctx->hold = AES_BLOCK_SIZE;
+	break;
+  case mode_chunked:
+	chunked_init(&ctx->chunked, ctx->engine, &ctx->key, &ctx->header);
+	ctx->step = ctx->out_step = ctx->unit_size;
+	if (ctx->decrypt)
+	  ctx->step += GCM_TAG_SIZE;
+	else
+	  ctx->out_step += GCM_TAG_SIZE;
+	ctx->hold = 1;
+	break;
+  default:
+	break;
+  }
+
+  ctx->pending = (uint8_t*)malloc(ctx->step + ctx->hold);
+  if (ctx->pending == NULL)
+	return fail(ctx, "Out of memory");
+  ctx->started = true;
+  return true;
+}
+
+/**
+ * Starts a message being encrypted: makes up its header and writes it out.
+ *
+ * @param written - Bytes written to 'out'.
+ */
+static bool start_encrypt(aes_ctx_t *ctx, uint8_t *out, size_t *written) {
+  if (ctx->mode == mode_ecb)
+	return start(ctx);
+
+  /* XTS has no IV; the data unit numbers take its place */
+  if (ctx->mode == mode_xts) {
+	memset(&ctx->header, 0, sizeof(ctx->header));
+	ctx->header.mode = mode_xts;
+  }
+  else if (!header_init(&ctx->header, ctx->mode))
+	return fail(ctx, "Could not generate a nonce");
+  if (ctx->mode == mode_xts || ctx->mode == mode_chunked)
+	ctx->header.param = ctx->unit_size;
+
+  header_encode(&ctx->header, ctx->header_buf);
+  memcpy(out, ctx->header_buf, AES_HEADER_SIZE);
+  *written += AES_HEADER_SIZE;
+  return start(ctx);
+}
+
+/**
+ * Reads as much of the header of a message being decrypted as there is in
+ * the piece, and starts the message once it has all of it.
+ *
+ * @return false if the header isn't one for this mode.
+ */
+static bool read_header(aes_ctx_t *ctx, const uint8_t **in, size_t *len) {
+  size_t take;
+
+  if (ctx->mode == mode_ecb)
+	return start(ctx);
+
+  take = AES_HEADER_SIZE - ctx->header_len;
+  if (take > *len)
+	take = *len;
+  memcpy(ctx->header_buf + ctx->header_len, *in, take);
+  ctx->header_len += take;
+  *in += take;
+  *len -= take;
+  if (ctx->header_len < AES_HEADER_SIZE)
+	return true;
+
+  if (header_is_old(ctx->header_buf, AES_HEADER_SIZE))
+	return fail(ctx, "Cipher message is from an older version, whose cipher"
+				" wasn't standard AES");
+  if (!header_decode(ctx->header_buf, &ctx->header)
+	  || ctx->header.mode != ctx->mode)
+	return fail(ctx, "Not a cipher message for this mode");
+  if (ctx->header.sparse)
+	return fail(ctx, "Sparse cipher files can't be read as a stream");
+  if ((ctx->mode == mode_xts && !xts_valid_unit_size(ctx->header.param))
+	  || (ctx->mode == mode_chunked
+		  && !chunked_valid_size(ctx->header.param)))
+	return fail(ctx, "Cipher message is damaged");
+  if (ctx->mode == mode_xts || ctx->mode == mode_chunked)
+	ctx->unit_size = ctx->header.param;
+  return start(ctx);
+}
+
+/**
+ * Ciphers 'n' whole steps, none of them the last of the message.
+ */
+static bool run_steps(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out,
+					  size_t n) {
+  size_t len = n * ctx->step;
+  uint8_t iv[AES_BLOCK_SIZE];
+  bool ok = true;
+
+  switch (ctx->mode) {
+  case mode_ecb:
+	if (ctx->decrypt)
+	  ctx->engine->decrypt(&ctx->key, in, out, n);
+	else
+	  ctx->engine->encrypt(&ctx->key, in, out, n);
+	break;
+  case mode_ctr:
+	ctr_crypt_parallel(ctx->pool, ctx->engine, &ctx->key, ctx->header.iv,
+					   ctx->next, in, out, len);
+	break;
+  case mode_gcm:
+	ok = ctx->decrypt ? gcm_decrypt(&ctx->gcm, ctx->pool, in, out, len)
+	  : gcm_encrypt(&ctx->gcm, ctx->pool, in, out, len);
+	if (!ok)
+	  return fail(ctx, "Message is too long for GCM mode");
+	break;
+  case mode_cbc:
+	if (ctx->decrypt) {
+	  /* 'in' may be gone once 'out' is written */
+	  memcpy(iv, in + len - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+	  cbc_decrypt_parallel(ctx->pool, ctx->engine, &ctx->key, ctx->iv,
+						   in, out, n);
+	  memcpy(ctx->iv, iv, AES_BLOCK_SIZE);
+	}
+	else
+	  cbc_encrypt(ctx->engine, &ctx->key, ctx->iv, in, out, n);
+	break;
+  case mode_xts:
+	xts_crypt_parallel(ctx->pool, &ctx->xts, ctx->decrypt, ctx->next,
+					   in, out, len);
+	break;
+  case mode_chunked:
+	ok = ctx->decrypt
+	  ? chunked_decrypt(ctx->pool, &ctx->chunked, ctx->next, false,
+						in, out, len)
+	  : chunked_encrypt(ctx->pool, &ctx->chunked, ctx->next, false,
+						in, out, len);
+	if (!ok)
+	  return fail(ctx, ctx->decrypt ? "Authentication failed"
+				  : "Message is too long for chunked mode");
+	break;
+  default:
+	break;
+  }
+
+  ctx->next += n;
+  return true;
+}
+
+/**
+ * Ciphers the next piece of the message. 'in' and 'out' must not overlap.
+ *
+ * @param out - Room for aes_ctx_output_size(len) bytes.
+ * @param out_len - Set to the number of bytes written to 'out'.
+ * @return false if the message can't be ciphered, with aes_ctx_error() saying
+ *         why. The context can't be used again after that.
+ */
+bool aes_ctx_update(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out,
+					size_t len, size_t *out_len) {
+  size_t n, take, written = 0;
+
+  *out_len = 0;
+  if (ctx->error != NULL)
+	return false;
+  if (ctx->batch)
+	return fail(ctx, "Context is used for batches");
+
+  if (!ctx->started) {
+	if (ctx->decrypt ? !read_header(ctx, &in, &len)
+		: !start_encrypt(ctx, out, &written))
+	  return false;
+	if (!ctx->started)
+	  return true;
+  }
+
+  /* The steps we can take, counting what is pending */
+  n = ctx->pending_len + len >= ctx->hold
+	? (ctx->pending_len + len - ctx->hold) / ctx->step : 0;
+
+  /* Finish off the steps that were started in an earlier piece */
+  while (n > 0 && ctx->pending_len > 0) {
+	if (ctx->pending_len < ctx->step) {
+	  take = ctx->step - ctx->pending_len;
+	  memcpy(ctx->pending + ctx->pending_len, in, take);
+	  in += take;
+	  len -= take;
+	  ctx->pending_len = ctx->step;
+	}
+	if (!run_steps(ctx, ctx->pending, out + written, 1))
+	  return false;
+	written += ctx->out_step;
+	n--;
+	ctx->pending_len -= ctx->step;
+	memmove(ctx->pending, ctx->pending + ctx->step, ctx->pending_len);
+  }
+
+  /* The rest come straight from the piece */
+  if (n > 0) {
+	if (!run_steps(ctx, in, out + written, n))
+	  return false;
+	written += n * ctx->out_step;
+	in += n * ctx->step;
+	len -= n * ctx->step;
+  }
+
+  if (len > 0)
+	memcpy(ctx->pending + ctx->pending_len, in, len);
+  ctx->pending_len += len;
+  *out_len = written;
+  return true;
+}
+
+/**
+ * Ciphers the end of the message: whatever is pending, with the padding or
+ * ciphertext stealing the mode ends with. When encrypting in GCM mode the tag
+ * is written after it, and when decrypting the tag or padding is checked.
+ *
+ * @param out - Room for aes_ctx_output_size(0) bytes.
+ * @param out_len - Set to the number of bytes written to 'out'.
+ * @return false if the message is damaged or doesn't authenticate, or can't
+ *         be ciphered, with aes_ctx_error() saying why. A message that fails
+ *         here must not be trusted, even the parts that updates gave back.
+ */
+bool aes_ctx_final(aes_ctx_t *ctx, uint8_t *out, size_t *out_len) {
+  uint8_t block[AES_BLOCK_SIZE], tag[GCM_TAG_SIZE];
+  size_t len, pad_len, written = 0;
+  bool ok;
+
+  *out_len = 0;
+  if (ctx->error != NULL)
+	return false;
+  if (ctx->batch)
+	return fail(ctx, "Context is used for batches");
+  if (!ctx->started) {
+	/* Only an ECB message can be empty, with no header */
+	if (ctx->decrypt && ctx->mode != mode_ecb)
+	  return fail(ctx, "Cipher message is truncated");
+	if (ctx->decrypt ? !start(ctx) : !start_encrypt(ctx, out, &written))
+	  return false;
+  }
+  out += written;
+  len = ctx->pending_len;
+
+  switch (ctx->mode) {
+  case mode_ecb:
+	if (ctx->decrypt && len > 0)
+	  return fail(ctx, "Cipher message is damaged");
+	if (len > 0) {
+	  memset(block, 0, sizeof(block));
+	  memcpy(block, ctx->pending, len);
+	  ctx->engine->encrypt(&ctx->key, block, out, 1);
+	  written += AES_BLOCK_SIZE;
+	}
+	break;
+
+  case mode_ctr:
+	ctr_crypt(ctx->engine, &ctx->key, ctx->header.iv, ctx->next,
+			  ctx->pending, out, len);
+	written += len;
+	break;
+
+  case mode_gcm:
+	if (ctx->decrypt) {
+	  if (len < GCM_TAG_SIZE)
+		return fail(ctx, "Cipher message is truncated");
+	  len -= GCM_TAG_SIZE;
+	}
+	ok = ctx->decrypt
+	  ? gcm_decrypt(&ctx->gcm, ctx->pool, ctx->pending, out, len)
+	  : gcm_encrypt(&ctx->gcm, ctx->pool, ctx->pending, out, len);
+	if (!ok)
+	  return fail(ctx, "Message is too long for GCM mode");
+	written += len;
+	gcm_tag(&ctx->gcm, tag);
+	if (!ctx->decrypt) {
+	  memcpy(out + len, tag, GCM_TAG_SIZE);
+	  written += GCM_TAG_SIZE;
+	}
+	else if (!gcm_tag_equal(tag, ctx->pending + len))
+	  return fail(ctx, "Authentication failed");
+	break;
+
+  case mode_cbc:
+	if (ctx->decrypt) {
+	  if (len != AES_BLOCK_SIZE)
+		return fail(ctx, "Cipher message is damaged");
+	  cbc_decrypt_parallel(ctx->pool, ctx->engine, &ctx->key, ctx->iv,
+						   ctx->pending, block, 1);
+	  if (!cbc_unpad(block, AES_BLOCK_SIZE, &pad_len))
+		return fail(ctx, "Bad padding");
+	  memcpy(out, block, pad_len);
+	  written += pad_len;
+	}
+	else {
+	  memcpy(block, ctx->pending, len);
+	  cbc_pad(block, len);
+	  cbc_encrypt(ctx->engine, &ctx->key, ctx->iv, block, out, 1);
+	  written += AES_BLOCK_SIZE;
+	}
+	break;
+
+  case mode_xts:
+	if (ctx->next == 0 && len < AES_BLOCK_SIZE)
+	  return fail(ctx, ctx->decrypt ? "Cipher message is truncated"
+				  : "XTS mode needs at least a block of data");
+	xts_crypt(&ctx->xts, ctx->decrypt, ctx->next, ctx->pending, out, len);
+	written += len;
+	break;
+
+  case mode_chunked:
+	ok = ctx->decrypt
+	  ? chunked_decrypt(ctx->pool, &ctx->chunked, ctx->next, true,
+						ctx->pending, out, len)
+	  : chunked_encrypt(ctx->pool, &ctx->chunked, ctx->next, true,
+						ctx->pending, out, len);
+	if (!ok)
+	  return fail(ctx, ctx->decrypt ? "Authentication failed"
+				  : "Message is too long for chunked mode");
+	written += ctx->decrypt ? len - GCM_TAG_SIZE
+	  : len + GCM_TAG_SIZE;
+	break;
+
+  default:
+	break;
+  }
+
+  /* Nothing more can be added to the message */
+  ctx->pending_len = 0;
+  ctx->error = "Message is already finished";
+  *out_len = written;
+  return true;
+}
+
+/**
+ * Says why the last call on the context failed, or why no more can be done
+ * with it.
+ */
+const char * aes_ctx_error(const aes_ctx_t *ctx) {
+  return ctx->error != NULL ? ctx->error : "No error";
+}
+
+/**
+ * Stops the context's threads, clears its keys and frees it.
+ */
+void aes_ctx_free(aes_ctx_t *ctx) {
+  if (ctx == NULL)
+	return;
+
+  if (!ctx->shared_pool)
+	pool_destroy(ctx->pool);
+  if (ctx->pending != NULL) {
+	wipe(ctx->pending, ctx->step + ctx->hold);
+	free(ctx->pending);
+  }
+  wipe(ctx, sizeof(aes_ctx_t));
+  free(ctx);
+}
+
+/**
+ * Sets up a context for aes-encrypt or aes-decrypt to run a file through. It
+ * ciphers with the program's engine, on the program's threads, which are left
+ * running when it is freed, and starts from keys already expanded.
+ *
+ * @param tweak_key - The XTS tweak key, or NULL in the other modes.
+ * @return The context, or NULL if we ran out of memory.
+ */
+aes_ctx_t * ctx_new(const aes_engine_t *engine, pool_t *pool, aes_mode_t mode,
+					bool decrypt, const aes_key_t *key,
+					const aes_key_t *tweak_key) {
+  aes_ctx_t *ctx;
+
+  ctx = ctx_create(mode, decrypt);
+  if (ctx == NULL)
+	return NULL;
+  pool_destroy(ctx->pool);
+  ctx->pool = pool;
+  ctx->shared_pool = true;
+  ctx->engine = engine;
+  ctx->key = *key;
+  if (tweak_key != NULL)
+	ctx->tweak_key = *tweak_key;
+  return ctx;
+}
+
+/**
+ * Starts a message whose header the program has written or read itself.
+ * 'pos' bytes of its data (not counting the header) are taken to have been
+ * ciphered already, by a run that is being picked up from a checkpoint; only
+ * the modes that checkpoint_mode() allows can start anywhere but 0, and only
+ * at the start of a step.
+ *
+ * @return false if the header isn't for this mode, or the message can't be
+ *         started at 'pos', with aes_ctx_error() saying why.
+ */
+bool ctx_start(aes_ctx_t *ctx, const aes_header_t *header, uint64_t pos) {
+  if (ctx->started || ctx->batch || header->mode != ctx->mode)
+	return fail(ctx, "Not a cipher message for this mode");
+  if ((ctx->mode == mode_xts && !xts_valid_unit_size(header->param))
+	  || (ctx->mode == mode_chunked && !chunked_valid_size(header->param)))
+	return fail(ctx, "Cipher message is damaged");
+
+  ctx->header = *header;
+  header_encode(header, ctx->header_buf);
+  ctx->header_len = AES_HEADER_SIZE;
+  if (ctx->mode == mode_xts || ctx->mode == mode_chunked)
+	ctx->unit_size = header->param;
+  if (!start(ctx))
+	return false;
+
+  if (pos != 0 && (!checkpoint_mode(ctx->mode) || pos % ctx->step != 0))
+	return fail(ctx, "Message can't be picked up part way there");
+  ctx->next = pos / ctx->step;
+  return true;
+}
+
+/**
+ * Returns the header of a message that has been started.
+ */
+const aes_header_t * ctx_header(const aes_ctx_t *ctx) {
+  return &ctx->header;
+}
+
+/**
+ * Works out how many bytes to give each aes_ctx_update() of a message that
+ * has been started so that it writes no more than 'max': a whole number of
+ * steps, so every update writes the same.
+ */
+size_t ctx_piece_size(const aes_ctx_t *ctx, size_t max) {
+  size_t n = max / (ctx->out_step > ctx->step ? ctx->out_step : ctx->step);
+
+  return (n > 0 ? n : 1) * ctx->step;
+}
+
+/**
+ * Works out exactly how much the next aes_ctx_update() of a message that has
+ * been started writes for 'len' bytes, so a program can have it write straight
+ * into a mapping of the output with no room to spare.
+ */
+size_t ctx_update_size(const aes_ctx_t *ctx, size_t len) {
+  if (ctx->pending_len + len < ctx->hold)
+	return 0;
+  return (ctx->pending_len + len - ctx->hold) / ctx->step * ctx->out_step;
+}
+
+/**
+ * Works out how much aes_ctx_final() writes for a message that has been
+ * started: exactly, but for CBC decryption, where it is the most it writes
+ * before the padding is taken off.
+ */
+size_t ctx_final_size(const aes_ctx_t *ctx) {
+  size_t len = ctx->pending_len;
+
+  switch (ctx->mode) {
+  case mode_ecb:
+	return ctx->decrypt ? 0
+	  : (len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+  case mode_cbc:
+	return ctx->decrypt ? len : AES_BLOCK_SIZE;
+  case mode_gcm:
+  case mode_chunked:
+	if (!ctx->decrypt)
+	  return len + GCM_TAG_SIZE;
+	return len > GCM_TAG_SIZE ? len - GCM_TAG_SIZE : 0;
+  default:
+	return len;
+  }
+}
+
+/* A batch of messages being encrypted by the pool, BATCH_LANES at a time */
+struct batch
+{
+  aes_ctx_t *ctx;
+  const struct iovec *in;
+  struct iovec *out;
+  const aes_header_t *headers;
+  size_t count;
+  bool failed; /* A message was too long for its mode */
+};
+
+/**
+ * Works out how long a message is once encrypted on its own.
+ */
+static size_t message_size(const aes_ctx_t *ctx, size_t len) {
+  switch (ctx->mode) {
+  case mode_ecb:
+	return (len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+  case mode_gcm:
+	return AES_HEADER_SIZE + len + GCM_TAG_SIZE;
+  case mode_cbc:
+	return AES_HEADER_SIZE + (len / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+  case mode_chunked:
+	return chunked_cipher_size(len, ctx->unit_size);
+  default:
+	return AES_HEADER_SIZE + len;
+  }
+}
+
+/**
+ * Encrypts group g of a batch. The messages are laid out just as
+ * aes_ctx_update() and aes_ctx_final() would write them, header first.
+ */
+static void batch_group(void *arg, size_t g) {
+  struct batch *b = arg;
+  aes_ctx_t *ctx = b->ctx;
+  aes_lane_t lanes[BATCH_LANES];
+  uint8_t j0[BATCH_LANES][AES_BLOCK_SIZE], block[AES_BLOCK_SIZE];
+  const aes_header_t *header;
+  chunked_t chunked;
+  gcm_t gcm;
+  uint8_t *out;
+  size_t first, n, i, full;
+
+  first = g * BATCH_LANES;
+  n = b->count - first < BATCH_LANES ? b->count - first : BATCH_LANES;
+  if (n == 0)
+	return; /* Never happens, but lets the compiler see lanes are set */
+
+  for (i = 0; i < n; i++) {
+	header = &b->headers[first + i];
+	out = (uint8_t*)b->out[first + i].iov_base;
+	if (ctx->mode != mode_ecb) {
+	  header_encode(header, out);
+	  out += AES_HEADER_SIZE;
+	}
+	lanes[i].iv = header->iv;
+	lanes[i].in = (const uint8_t*)b->in[first + i].iov_base;
+	lanes[i].out = out;
+	lanes[i].len = b->in[first + i].iov_len;
+  }
+
+  switch (ctx->mode) {
+  case mode_ecb:
+	/* Every block is ciphered the same way, whichever message it is in */
+	for (i = 0; i < n; i++) {
+	  full = lanes[i].len / AES_BLOCK_SIZE;
+	  ctx->engine->encrypt(&ctx->key, lanes[i].in, lanes[i].out, full);
+	  if (lanes[i].len % AES_BLOCK_SIZE != 0) {
+		memset(block, 0, sizeof(block));
+		memcpy(block, lanes[i].in + AES_BLOCK_SIZE * full,
+			   lanes[i].len % AES_BLOCK_SIZE);
+		ctx->engine->encrypt(&ctx->key, block,
+							 lanes[i].out + AES_BLOCK_SIZE * full, 1);
+	  }
+	}
+	break;
+
+  case mode_ctr:
+	ctr_crypt_multi(ctx->engine, &ctx->key, lanes, n, 0);
+	break;
+
+  case mode_gcm:
+	/* The data starts at the counter after each message's j0 */
+	gcm = ctx->batch_gcm;
+	for (i = 0; i < n; i++) {
+	  gcm_restart(&gcm, lanes[i].iv);
+	  memcpy(j0[i], gcm.j0, AES_BLOCK_SIZE);
+	  lanes[i].iv = j0[i];
+	}
+	ctr_crypt_multi(ctx->engine, &ctx->key, lanes, n, 1);
+
+	/* Each message is hashed on its own, with its header as the AAD */
+	for (i = 0; i < n; i++) {
+	  gcm_restart(&gcm, b->headers[first + i].iv);
+	  gcm_aad(&gcm, lanes[i].out - AES_HEADER_SIZE, AES_HEADER_SIZE);
+	  if (!gcm_hash(&gcm, lanes[i].out, lanes[i].len))
+		b->failed = true;
+	  gcm_tag(&gcm, lanes[i].out + lanes[i].len);
+	}
+	break;
+
+  case mode_cbc:
+	/* The padding goes on a copy, as the input may be read-only */
+	for (i = 0; i < n; i++) {
+	  if (lanes[i].len > 0)
+		memcpy(lanes[i].out, lanes[i].in, lanes[i].len);
+	  lanes[i].len = cbc_pad(lanes[i].out, lanes[i].len);
+	  lanes[i].in = lanes[i].out;
+	}
+	for (i = 0; i < n; i += AES_LANES)
+	  cbc_encrypt_multi(ctx->engine, &ctx->key, lanes + i,
+						n - i < AES_LANES ? n - i : AES_LANES);
+	break;
+
+  case mode_chunked:
+	for (i = 0; i < n; i++) {
+	  chunked_init(&chunked, ctx->engine, &ctx->key, &b->headers[first + i]);
+	  if (!chunked_encrypt(ctx->pool, &chunked, 0, true, lanes[i].in,
+						   lanes[i].out, lanes[i].len))
+		b->failed = true;
+	}
+	break;
+
+  default:
+	break;
+  }
+}
+
+/**
+ * Encrypts a batch of messages, each one whole and on its own, with the
+ * context's key and mode. Each comes out just as aes_ctx_update() and
+ * aes_ctx_final() would have written it, with its own nonce. The context must
+ * be one for encrypting, and is only used for batches after this.
+ *
+ * XTS has no nonce: every message would start at data unit 0, so the same
+ * block at the same place in two messages would encrypt the same way, as in
+ * ECB mode. XTS contexts are refused.
+ *
+ * @param in - The messages.
+ * @param out - Where each one goes. Each iov_len says how much room there is
+ *              on the way in, and how much was written on the way out; there
+ *              must be room for aes_ctx_output_size() of the message.
+ * @return false if a message doesn't fit its buffer, or can't be encrypted in
+ *         the context's mode, with aes_ctx_error() saying why.
+ */
+bool aes_encrypt_iov(aes_ctx_t *ctx, const struct iovec *in,
+					 struct iovec *out, size_t count) {
+  struct batch b = { ctx, in, out, NULL, count, false };
+  aes_header_t *headers;
+  size_t i;
+
+  if (ctx->error != NULL)
+	return false;
+  if (ctx->decrypt)
+	return fail(ctx, "Batches can only be encrypted");
+  if (ctx->started && !ctx->batch)
+	return fail(ctx, "Context is in the middle of a message");
+  if (ctx->mode == mode_xts)
+	return fail(ctx, "XTS messages have no nonce, so can't be batched");
+
+  for (i = 0; i < count; i++) {
+	if (out[i].iov_len < message_size(ctx, in[i].iov_len))
+	  return fail(ctx, "Output buffer is too small");
+  }
+
+  ctx->started = true;
+  ctx->batch = true;
+  if (count == 0)
+	return true;
+
+  headers = (aes_header_t*)calloc(count, sizeof(aes_header_t));
+  if (headers == NULL)
+	return fail(ctx, "Out of memory");
+
+  if (ctx->mode != mode_ecb
+	  && !header_init_many(headers, count, ctx->mode)) {
+	free(headers);
+	return fail(ctx, "Could not generate a nonce");
+  }
+  if (ctx->mode == mode_chunked) {
+	for (i = 0; i < count; i++)
+	  headers[i].param = ctx->unit_size;
+  }
+
+  if (ctx->mode == mode_gcm && !ctx->batch_ready) {
+	gcm_init(&ctx->batch_gcm, ctx->engine, &ctx->key, headers[0].iv);
+	ctx->batch_ready = true;
+  }
+
+  b.headers = headers;
+  pool_run(ctx->pool, (count + BATCH_LANES - 1) / BATCH_LANES, batch_group,
+		   &b);
+  free(headers);
+  if (b.failed)
+	return fail(ctx, "Message is too long for the mode");
+
+  for (i = 0; i < count; i++)
+	out[i].iov_len = message_size(ctx, in[i].iov_len);
+  return true;
+}
+
+/**
+ * Encrypts a batch of messages, each with a context of its own, which may
+ * hold different keys. The engines cipher many blocks at once only under the
+ * same key, so each stretch of messages that share a context is encrypted as
+ * a batch of its own (see aes_encrypt_iov()); putting the messages for the
+ * same key next to each other makes the most of that.
+ *
+ * @param ctxs - The context for each message.
+ * @return false if any message couldn't be encrypted, in which case the
+ *         error is in its context.
+ */
+bool aes_encrypt_iov_multi(aes_ctx_t *const *ctxs, const struct iovec *in,
+						   struct iovec *out, size_t count) {
+  size_t i, n;
+  bool ok = true;
+
+  for (i = 0; i < count; i += n) {
+	for (n = 1; i + n < count && ctxs[i + n] == ctxs[i]; n++)
+	  ;
+	if (!aes_encrypt_iov(ctxs[i], in + i, out + i, n))
+	  ok = false;
+  }
+  return ok;
+}
+
+/**
+ * Makes a cache of expanded keys, for aes_ctx_init_id() and
+ * aes_ctx_init_file(), that holds up to 'max_keys' keys (0 for 256). Its
+ * memory is all allocated up front.
+ *
+ * @return The cache, or NULL if we ran out of memory.
+ */
+aes_key_cache_t * aes_key_cache_create(size_t max_keys) {
+  return key_cache_create(max_keys);
+}
+
+/**
+ * Wipes the keys in a cache and frees it. Contexts set up from it keep their
+ * own copies of their keys, and can still be used.
+ */
+void aes_key_cache_free(aes_key_cache_t *cache) {
+  key_cache_destroy(cache);
+}
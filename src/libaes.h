@@ -0,0 +1,99 @@
+/**
+ * libaes: the cipher behind aes-encrypt and aes-decrypt, as a library
+ *
+ * A program that wants to encrypt or decrypt data of its own, rather than
+ * files, sets up a context for each message and streams the data through it:
+ *
+ *   ctx = aes_ctx_init(key, 32, mode_gcm, false);
+ *   for each piece of the message:
+ *     aes_ctx_update(ctx, in, out, len, &out_len);   (writes out_len bytes)
+ *   aes_ctx_final(ctx, out, &out_len);
+ *   aes_ctx_free(ctx);
+ *
+ * The output is laid out just like a cipher file from aes-encrypt, header and
+ * tag included (see mode.c), so the programs can decrypt what the library
+ * encrypts and the other way around. Pieces may be any length; whatever can't
+ * be ciphered yet is held in the context until more comes, so an update may
+ * write more or less than it was given. aes_ctx_output_size() says how much
+ * room to leave.
+ *
+ * Programs that send lots of short messages can encrypt a batch of them in
+ * one call instead, each whole and on its own, in any mode but XTS, which has
+ * no nonce to tell them apart:
+ *
+ *   aes_encrypt_iov(ctx, in, out, count);   (out[i].iov_len is set)
+ *
+ * Every GCM and chunked message, and every archive aes-encrypt makes, takes a
+ * random 96-bit nonce, and chunked messages and archives a key of their own
+ * made from it. Two that share a nonce give away the hash key, so one key
+ * must encrypt no more than 2^32 of them in all (NIST SP 800-38D, 8.3),
+ * counting every context, batch and program that uses it, which keeps the
+ * odds of that below 2^-32. CTR and CBC nonces are 128 bits.
+ *
+ * Programs that switch between many keys can keep the expanded ones in a
+ * cache, and set up each context from a key ID or a key file instead of the
+ * key itself; a key that is in the cache isn't read or expanded again:
+ *
+ *   cache = aes_key_cache_create(1000);
+ *   ctx = aes_ctx_init_file(cache, "tenant-42.key", mode_gcm, false);
+ *
+ * A context holds its own key, mode state and worker threads, and the library
+ * keeps nothing that changes between contexts but the caches it is given,
+ * which lock themselves. So any number of threads can each run their own
+ * contexts at once, with different keys, without waiting on each other. A
+ * single context must only be used by one thread at a time.
+ */
+
+#ifndef _LIBAES_H_
+#define _LIBAES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+/**
+ * Cipher modes. The values are stored in the cipher file header, so they must
+ * not change.
+ */
+typedef enum
+{
+  mode_ecb = 0, /* Each block on its own, no header (the original format) */
+  mode_ctr = 1, /* Counter mode */
+  mode_gcm = 2, /* Galois/Counter mode, with an authentication tag */
+  mode_cbc = 3, /* Cipher block chaining, with PKCS#7 padding */
+  mode_xts = 4, /* XTS, for sector-addressable data; two keys */
+  mode_archive = 5, /* Many files in one, each in GCM mode (see archive.c) */
+  mode_chunked = 6 /* GCM chunks that decrypt on their own (see chunk.c) */
+} aes_mode_t;
+
+/* One message being encrypted or decrypted (see libaes.c) */
+typedef struct aes_ctx aes_ctx_t;
+
+/* Expanded keys, kept for contexts to start from (see keycache.c) */
+typedef struct aes_key_cache aes_key_cache_t;
+
+/* Library contexts. (imported from libaes.c) */
+extern aes_ctx_t * aes_ctx_init(const uint8_t *, size_t, aes_mode_t, bool);
+extern aes_ctx_t * aes_ctx_init_id(aes_key_cache_t *, const char *,
+								   const uint8_t *, size_t, aes_mode_t, bool);
+extern aes_ctx_t * aes_ctx_init_file(aes_key_cache_t *, const char *,
+									 aes_mode_t, bool);
+extern bool aes_ctx_set_unit_size(aes_ctx_t *, size_t);
+extern bool aes_ctx_set_threads(aes_ctx_t *, int);
+extern size_t aes_ctx_output_size(const aes_ctx_t *, size_t);
+extern bool aes_ctx_update(aes_ctx_t *, const uint8_t *, uint8_t *, size_t,
+						   size_t *);
+extern bool aes_ctx_final(aes_ctx_t *, uint8_t *, size_t *);
+
+extern bool aes_encrypt_iov(aes_ctx_t *, const struct iovec *, struct iovec *,
+							size_t);
+extern bool aes_encrypt_iov_multi(aes_ctx_t *const *, const struct iovec *,
+								  struct iovec *, size_t);
+extern const char * aes_ctx_error(const aes_ctx_t *);
+extern void aes_ctx_free(aes_ctx_t *);
+extern aes_key_cache_t * aes_key_cache_create(size_t);
+extern void aes_key_cache_free(aes_key_cache_t *);
+
+
+#endif /* _LIBAES_H_ */
@@ -0,0 +1,277 @@
+/**
+ * Cipher modes and the cipher file header
+ *
+ * The original file format is plain ECB: the file is cut into blocks and every
+ * block is enciphered on its own, with nothing else written to the file. The
+ * other modes need a little more than the key to decrypt (a nonce at least),
+ * so their cipher files start with a small header:
+ *
+ *  offset  size  field
+ *       0     4  magic, "AESC"
+ *       4     1  format version (2)
+ *       5     1  mode (see aes_mode_t)
+ *       6     1  flags: 1 if the file is sparse (see sparse.c)
+ *       7     1  reserved, zero
+ *       8     4  mode parameter, little-endian (XTS: data unit size;
+ *                chunked: chunk size; 0 for the other modes)
+ *      12     4  reserved, zero
+ *      16    16  nonce / initial counter block
+ *
+ * GCM files also end with a 16-byte authentication tag, which covers the
+ * header as well as the ciphertext. Archives hold many files, each encrypted
+ * in GCM mode with a nonce made from the header's (see archive.c). Chunked
+ * files are cut into chunks that each have a tag of their own (see chunk.c).
+ * Sparse CTR and XTS files end with a list of their holes (see sparse.c).
+ *
+ * ECB files keep the old headerless format. aes-decrypt tells the two apart
+ * by the magic number, and refuses a file that has the magic but a header it
+ * can't read.
+ *
+ * Format 1 was written by versions whose key schedule wasn't the one in
+ * FIPS-197 (see keyexpand.c), so the cipher they used wasn't quite AES. Their
+ * files, and their headerless ECB files, only decrypt with those versions;
+ * header_is_old() picks out the ones with a header so they can be refused.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/random.h>
+
+#include "aes.h"
+
+#define HEADER_MAGIC "AESC"
+#define HEADER_VERSION 2
+
+/* Header flag of a sparse file */
+#define HEADER_SPARSE 0x01
+
+/* Mode names, indexed by aes_mode_t */
+static const char *mode_names[] = {
+  "ecb",
+  "ctr",
+  "gcm",
+  "cbc",
+  "xts",
+  "archive",
+  "chunked"
+};
+
+#define NUM_MODES (sizeof(mode_names) / sizeof(mode_names[0]))
+
+/**
+ * Looks up a cipher mode by name.
+ *
+ * @param name - Name of the mode, as given to --mode.
+ * @param mode - Set to the mode if it was found.
+ * @return false if there is no mode with that name.
+ */
+bool mode_find(const char *name, aes_mode_t *mode) {
+  size_t i;
+
+  for (i = 0; i < NUM_MODES; i++) {
+	if (strcmp(name, mode_names[i]) == 0) {
+	  *mode = (aes_mode_t)i;
+	  return true;
+	}
+  }
+  return false;
+}
+
+/**
+ * Returns the name of a cipher mode.
+ */
+const char * mode_name(aes_mode_t mode) {
+  return (size_t)mode < NUM_MODES ? mode_names[mode] : "unknown";
+}
+
+/**
+ * Fills a buffer with random bytes from the kernel. Nonces must never repeat
+ * under the same key, so unlike the key generator this does not use rand().
+ */
+bool random_bytes(uint8_t *buf, size_t len) {
+  ssize_t got;
+
+  while (len > 0) {
+	got = getrandom(buf, len, 0);
+	if (got < 0) {
+	  if (errno == EINTR)
+		continue;
+	  return false;
+	}
+	buf += got;
+	len -= got;
+  }
+  return true;
+}
+
+/* Checks whether 'len' bytes are all zero */
+static bool is_zero(const uint8_t *buf, size_t len) {
+  uint8_t bits = 0;
+
+  while (len-- > 0)
+	bits |= *buf++;
+  return bits == 0;
+}
+
+/* Headers whose nonces are drawn from the kernel at a time */
+#define NONCE_BATCH 64
+
+/**
+ * Sets up headers for several new cipher files, each with a fresh random
+ * nonce. The random bytes for many of them are drawn at once, which saves a
+ * system call per file when there are lots of small ones.
+ *
+ * @return false if no random bytes were available.
+ */
+bool header_init_many(aes_header_t *headers, size_t count, aes_mode_t mode) {
+  uint8_t nonces[NONCE_BATCH * 16];
+  size_t i, j, n;
+
+  for (i = 0; i < count; i += n) {
+	n = count - i < NONCE_BATCH ? count - i : NONCE_BATCH;
+	if (!random_bytes(nonces, n * 16))
+	  return false;
+
+	for (j = 0; j < n; j++) {
+	  memset(&headers[i + j], 0, sizeof(aes_header_t));
+	  headers[i + j].mode = mode;
+	  memcpy(headers[i + j].iv, nonces + 16 * j, 16);
+
+	  /* GCM only takes a 12-byte nonce; the rest is its block counter */
+	  if (mode == mode_gcm || mode == mode_archive || mode == mode_chunked)
+		memset(headers[i + j].iv + 12, 0, 4);
+	  else if (is_zero(headers[i + j].iv + 12, 4))
+		headers[i + j].iv[15] = 1; /* See header_decode() */
+	}
+  }
+  return true;
+}
+
+/**
+ * Sets up a header for a new cipher file with a fresh random nonce.
+ *
+ * @return false if no random bytes were available.
+ */
+bool header_init(aes_header_t *header, aes_mode_t mode) {
+  return header_init_many(header, 1, mode);
+}
+
+/**
+ * Works out the key of a chunked file or an archive, which is its own, from
+ * the key it is made with and the 12-byte nonce in its header. Their chunks
+ * and members then take GCM nonces that only have to differ within the file,
+ * and two files under one key only share a key if their headers share all 96
+ * bits of nonce, the same odds as two GCM files sharing a nonce.
+ *
+ * The file key is the start of the OFB key stream from the nonce and four zero
+ * bytes: E(K, nonce | 0), then that encrypted again if the key is longer than
+ * a block. A GCM counter starts at 1, so the first block is never one of the
+ * key stream of a GCM file under K, and the second is the encryption of a
+ * secret.
+ */
+void header_file_key(const aes_engine_t *engine, const aes_key_t *key,
+					 const aes_header_t *header, aes_key_t *file_key) {
+  uint8_t block[2 * AES_BLOCK_SIZE];
+
+  memset(block, 0, sizeof(block));
+  memcpy(block, header->iv, 12);
+  engine->encrypt(key, block, block, 1);
+  engine->encrypt(key, block, block + AES_BLOCK_SIZE, 1);
+
+  memset(file_key, 0, sizeof(aes_key_t));
+  file_key->size = key->size;
+  memcpy(file_key->block, block, key->size);
+  key_expansion(file_key);
+  memset(block, 0, sizeof(block));
+}
+
+/**
+ * Lays out the header as it is stored in the file.
+ *
+ * @param buf - AES_HEADER_SIZE bytes to fill.
+ */
+void header_encode(const aes_header_t *header, uint8_t *buf) {
+  memset(buf, 0, AES_HEADER_SIZE);
+  memcpy(buf, HEADER_MAGIC, 4);
+  buf[4] = HEADER_VERSION;
+  buf[5] = (uint8_t)header->mode;
+  buf[6] = header->sparse ? HEADER_SPARSE : 0;
+  buf[8] = header->param & 0xFF;
+  buf[9] = (header->param >> 8) & 0xFF;
+  buf[10] = (header->param >> 16) & 0xFF;
+  buf[11] = (header->param >> 24) & 0xFF;
+  memcpy(buf + 16, header->iv, sizeof(header->iv));
+}
+
+/**
+ * Checks whether a file starts with the header magic number. One that does
+ * but whose header doesn't decode is damaged, or from a newer version, and
+ * must not be taken for a headerless ECB file: that would skip the tag check
+ * of a GCM or chunked file whose header has been tampered with.
+ *
+ * @param len - Bytes of the file in 'buf', which may be fewer than 4.
+ */
+bool header_has_magic(const uint8_t *buf, size_t len) {
+  return len >= 4 && memcmp(buf, HEADER_MAGIC, 4) == 0;
+}
+
+/**
+ * Checks whether a file starts with a header written by a version before the
+ * key schedule was fixed, which this one can't decrypt.
+ *
+ * @param len - Bytes of the file in 'buf'.
+ */
+bool header_is_old(const uint8_t *buf, size_t len) {
+  return len > 4 && header_has_magic(buf, len) && buf[4] < HEADER_VERSION;
+}
+
+/**
+ * Reads the header from the start of a cipher file.
+ *
+ * @param buf - The first AES_HEADER_SIZE bytes of the file.
+ * @return false if the file does not start with a header we understand.
+ */
+bool header_decode(const uint8_t *buf, aes_header_t *header) {
+  if (memcmp(buf, HEADER_MAGIC, 4) != 0 || buf[4] != HEADER_VERSION)
+	return false;
+  if (buf[5] == mode_ecb || buf[5] >= NUM_MODES)
+	return false;
+  if (buf[7] || buf[12] || buf[13] || buf[14] || buf[15])
+	return false;
+
+  /* Only the modes that keep the length of the file can be sparse */
+  if (buf[6] != 0 && (buf[6] != HEADER_SPARSE
+					  || (buf[5] != mode_ctr && buf[5] != mode_xts)))
+	return false;
+
+  /* The nonces of the modes with a tag end in four zero bytes, those of CTR
+	 and CBC never do, and XTS has none. So a header with its mode changed,
+	 to get an authenticated file read without its tag check, is refused. */
+  switch (buf[5]) {
+  case mode_gcm:
+  case mode_archive:
+  case mode_chunked:
+	if (!is_zero(buf + 28, 4))
+	  return false;
+	break;
+  case mode_ctr:
+  case mode_cbc:
+	if (is_zero(buf + 28, 4))
+	  return false;
+	break;
+  case mode_xts:
+	if (!is_zero(buf + 16, 16))
+	  return false;
+	break;
+  }
+
+  header->mode = (aes_mode_t)buf[5];
+  header->sparse = buf[6] == HEADER_SPARSE;
+  header->param = (uint32_t)buf[8] | ((uint32_t)buf[9] << 8)
+	| ((uint32_t)buf[10] << 16) | ((uint32_t)buf[11] << 24);
+  memcpy(header->iv, buf + 16, sizeof(header->iv));
+  return true;
+}
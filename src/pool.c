@@ -0,0 +1,211 @@
+/**
+ * Worker thread pool
+ *
+ * The modes that don't chain one block to the next (CTR and friends) can
+ * cipher different parts of a file at the same time. The programs split each
+ * buffer they read into chunks and hand them to this pool, which runs the
+ * chunks on a fixed set of threads and returns once every chunk is done. The
+ * calling thread pitches in as well, so a pool of N threads only starts N-1
+ * of its own.
+ *
+ * A chunk may post a job of its own. That is how a batch of files is run:
+ * each file is a chunk of one job, and each file splits its buffers into
+ * chunks of another. Every job that still has chunks to hand out sits on a
+ * list, and a thread with nothing to do takes the next chunk of the newest
+ * one. So a thread that finishes its small files early helps out with the
+ * chunks of a big one, and files in progress are finished before new ones
+ * are started.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "aes.h"
+
+/* One call to pool_run() */
+typedef struct job
+{
+  pool_fn_t fn;
+  void *arg;
+  size_t count; /* Number of chunks in the job */
+  size_t next; /* Next chunk to hand out */
+  size_t finished; /* Chunks that have returned */
+  struct job *older; /* Next job on the list */
+} job_t;
+
+struct pool
+{
+  int num_threads; /* Threads working on jobs, counting the caller */
+  pthread_t *threads; /* The num_threads - 1 threads we started */
+  pthread_mutex_t lock; /* Guards everything below, and the jobs */
+  pthread_cond_t start; /* Signalled when a new job is posted */
+  pthread_cond_t done; /* Signalled when the last chunk of a job returns */
+  job_t *jobs; /* Jobs with chunks left to hand out, newest first */
+  bool quit;
+};
+
+/**
+ * Takes the next chunk of 'job', and takes the job off the list once its
+ * last chunk has been handed out. Called with the lock held.
+ */
+static size_t take_chunk(pool_t *pool, job_t *job) {
+  job_t **link;
+  size_t i = job->next++;
+
+  if (job->next == job->count) {
+	for (link = &pool->jobs; *link != job; link = &(*link)->older)
+	  ;
+	*link = job->older;
+  }
+  return i;
+}
+
+/**
+ * Runs chunk 'i' of 'job'. Called with the lock held, which is dropped while
+ * the chunk runs.
+ */
+static void run_chunk(pool_t *pool, job_t *job, size_t i) {
+  pthread_mutex_unlock(&pool->lock);
+  job->fn(job->arg, i);
+  pthread_mutex_lock(&pool->lock);
+
+  if (++job->finished == job->count)
+	pthread_cond_broadcast(&pool->done);
+}
+
+/**
+ * Worker thread body. Runs chunks of whatever job is newest, and sleeps when
+ * there are none.
+ */
+static void * worker(void *arg) {
+  pool_t *pool = arg;
+  job_t *job;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+	while (!pool->quit && pool->jobs == NULL)
+	  pthread_cond_wait(&pool->start, &pool->lock);
+	if (pool->quit)
+	  break;
+	job = pool->jobs;
+	run_chunk(pool, job, take_chunk(pool, job));
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/**
+ * Returns the number of processors that are online, or 1 if we can't tell.
+ */
+int pool_default_size(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+/**
+ * Creates a pool.
+ *
+ * @param num_threads - Number of threads to run jobs on, including the
+ *                      thread that calls pool_run(). 0 means one per processor.
+ * @return The pool, or NULL if it could not be created.
+ */
+pool_t * pool_create(int num_threads) {
+  pool_t *pool;
+  int i;
+
+  if (num_threads <= 0)
+	num_threads = pool_default_size();
+
+  pool = (pool_t*)calloc(1, sizeof(pool_t));
+  if (pool == NULL)
+	return NULL;
+
+  pool->threads = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
+  if (pool->threads == NULL) {
+	free(pool);
+	return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  /* Start the workers. If the system won't give us as many as we asked for,
+	 make do with the ones we got. */
+  pool->num_threads = 1;
+  for (i = 1; i < num_threads; i++) {
+	if (pthread_create(&pool->threads[i - 1], NULL, worker, pool) != 0)
+	  break;
+	pool->num_threads++;
+  }
+
+  return pool;
+}
+
+/**
+ * Returns the number of threads that run a job, counting the caller.
+ */
+int pool_size(const pool_t *pool) {
+  return pool->num_threads;
+}
+
+/**
+ * Calls fn(arg, i) for every i from 0 to count - 1, spread over the threads of
+ * the pool, and waits for all of the calls to return. The calls may run in any
+ * order and at the same time, so fn must only touch the data of chunk i. fn
+ * may call pool_run() itself.
+ */
+void pool_run(pool_t *pool, size_t count, pool_fn_t fn, void *arg) {
+  job_t job;
+
+  if (pool->num_threads == 1 || count <= 1) {
+	size_t i;
+	for (i = 0; i < count; i++)
+	  fn(arg, i);
+	return;
+  }
+
+  job.fn = fn;
+  job.arg = arg;
+  job.count = count;
+  job.next = 0;
+  job.finished = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  job.older = pool->jobs;
+  pool->jobs = &job;
+  pthread_cond_broadcast(&pool->start);
+
+  /* Run our own chunks, then wait for the ones other threads took */
+  while (job.next < job.count)
+	run_chunk(pool, &job, take_chunk(pool, &job));
+  while (job.finished < job.count)
+	pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Stops the worker threads and frees the pool.
+ */
+void pool_destroy(pool_t *pool) {
+  int i;
+
+  if (pool == NULL)
+	return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->num_threads - 1; i++)
+	pthread_join(pool->threads[i], NULL);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  free(pool->threads);
+  free(pool);
+}
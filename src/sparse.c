@@ -0,0 +1,373 @@
+/**
+ * Sparse files
+ *
+ * Disk images and the like are mostly holes: ranges that were never written,
+ * take no room on disk, and read as zeros. Encrypting one the usual way reads
+ * and ciphers every one of those zeros, and the cipher file takes up the full
+ * size on disk. With --sparse, aes-encrypt asks the file system where the
+ * holes are (lseek() with SEEK_HOLE and SEEK_DATA), ciphers only the data
+ * between them, and leaves the same holes in the cipher file. Only CTR and
+ * XTS, whose ciphertext lines up with the plaintext, can do this.
+ *
+ * A hole can't be told from ciphertext once the file has been copied by
+ * something that fills holes in, so the header is marked as sparse (see
+ * mode.c), and the holes are listed after the ciphertext:
+ *
+ *  header      AES_HEADER_SIZE bytes
+ *  ciphertext  as long as the plaintext, with a hole wherever it has one
+ *  hole list   for each hole, where it starts in the plaintext and how long
+ *              it is, as two big-endian 64-bit numbers
+ *  trailer     SPARSE_TRAILER_SIZE bytes: the size of the plaintext and the
+ *              number of holes, as two big-endian 64-bit numbers
+ *
+ * aes-decrypt reads the list, deciphers the data between the holes, and
+ * leaves holes in the plaintext file where the list says (or writes zeros, if
+ * it goes to a pipe). Holes are rounded in to whole blocks, or whole data
+ * units in XTS mode, so that everything else is ciphered just as it would be
+ * in a file without holes. XTS also needs the last AES_BLOCK_SIZE bytes of
+ * the file, as a short last unit is stolen into the one before it.
+ *
+ * Like the rest of a CTR or XTS file, the list isn't authenticated, and it
+ * shows where the data is, just as the holes would on a disk.
+ */
+
+/* For SEEK_DATA and SEEK_HOLE */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "aes.h"
+
+/* Bytes in a hole list entry */
+#define SPARSE_ENTRY_SIZE 16
+
+/* Reads a big-endian 64-bit number */
+static uint64_t get_be64(const uint8_t *p) {
+  uint64_t v = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+	v = (v << 8) | p[i];
+  return v;
+}
+
+/* Writes a big-endian 64-bit number */
+static void put_be64(uint8_t *p, uint64_t v) {
+  int i;
+
+  for (i = 7; i >= 0; i--) {
+	p[i] = v & 0xFF;
+	v >>= 8;
+  }
+}
+
+/**
+ * Reads exactly 'len' bytes from 'pos'.
+ */
+static bool read_full(int fd, void *buf, size_t len, uint64_t pos) {
+  ssize_t got;
+
+  while (len > 0) {
+	got = pread(fd, buf, len, pos);
+	if (got < 0 && errno == EINTR)
+	  continue;
+	if (got <= 0)
+	  return false;
+	buf = (uint8_t*)buf + got;
+	len -= got;
+	pos += got;
+  }
+  return true;
+}
+
+/**
+ * Writes all 'len' bytes at the file position, which may be a pipe.
+ */
+static bool write_all(int fd, const void *buf, size_t len) {
+  ssize_t put;
+
+  while (len > 0) {
+	put = write(fd, buf, len);
+	if (put < 0 && errno == EINTR)
+	  continue;
+	if (put <= 0)
+	  return false;
+	buf = (const uint8_t*)buf + put;
+	len -= put;
+  }
+  return true;
+}
+
+/**
+ * Adds a hole to the list.
+ *
+ * @param room - Number of holes the list has room for, grown as needed.
+ */
+static bool add_hole(sparse_t *sp, size_t *room, uint64_t offset,
+					 uint64_t length) {
+  aes_hole_t *grown;
+
+  if (sp->count == *room) {
+	*room = *room == 0 ? 16 : *room * 2;
+	grown = (aes_hole_t*)realloc(sp->holes, *room * sizeof(aes_hole_t));
+	if (grown == NULL)
+	  return false;
+	sp->holes = grown;
+  }
+  sp->holes[sp->count].offset = offset;
+  sp->holes[sp->count].length = length;
+  sp->count++;
+  return true;
+}
+
+/**
+ * Works out where the holes in the plaintext are, from the file system, and
+ * rounds them in to sp->step, keeping them out of the last sp->tail bytes. A
+ * file system that can't tell just has no holes.
+ *
+ * @return false on a read error or if we ran out of memory, with sp->error
+ *         saying which.
+ */
+bool sparse_find(sparse_t *sp) {
+  uint64_t limit, start, end;
+  size_t room = 0;
+  off_t data, hole;
+
+  sp->holes = NULL;
+  sp->count = 0;
+  limit = sp->size > sp->tail ? sp->size - sp->tail : 0;
+
+  for (data = 0; (uint64_t)data < limit; ) {
+	hole = lseek(sp->in_fd, data, SEEK_HOLE);
+	if (hole < 0 && errno == EINVAL)
+	  break;
+	if (hole < 0) {
+	  sp->error = "File read error";
+	  return false;
+	}
+	if ((uint64_t)hole >= limit)
+	  break;
+
+	/* There is no data after a hole at the end of the file */
+	data = lseek(sp->in_fd, hole, SEEK_DATA);
+	if (data < 0 && errno == ENXIO)
+	  data = sp->size;
+	else if (data < 0) {
+	  sp->error = "File read error";
+	  return false;
+	}
+
+	start = ((uint64_t)hole + sp->step - 1) / sp->step * sp->step;
+	end = (uint64_t)data < limit ? (uint64_t)data : limit;
+	end = end / sp->step * sp->step;
+	if (end > start && !add_hole(sp, &room, start, end - start)) {
+	  sp->error = "Out of memory";
+	  return false;
+	}
+  }
+  return true;
+}
+
+/**
+ * Reads the hole list from the end of a sparse cipher file, and the size of
+ * the plaintext, and checks that the holes are in order and lie where
+ * sparse_find() could have put them.
+ *
+ * @param file_size - Length of the whole cipher file.
+ * @return false if the file is damaged or can't be read, with sp->error
+ *         saying which.
+ */
+bool sparse_load(sparse_t *sp, uint64_t file_size) {
+  uint8_t trailer[SPARSE_TRAILER_SIZE], *list;
+  uint64_t count, limit, end, i;
+
+  sp->holes = NULL;
+  sp->count = 0;
+  sp->error = "Cipher file is damaged";
+  if (file_size < AES_HEADER_SIZE + SPARSE_TRAILER_SIZE)
+	return false;
+  if (!read_full(sp->in_fd, trailer, sizeof(trailer),
+				 file_size - SPARSE_TRAILER_SIZE)) {
+	sp->error = "File read error";
+	return false;
+  }
+
+  sp->size = get_be64(trailer);
+  count = get_be64(trailer + 8);
+  file_size -= AES_HEADER_SIZE + SPARSE_TRAILER_SIZE;
+  if (sp->size > file_size
+	  || count != (file_size - sp->size) / SPARSE_ENTRY_SIZE
+	  || (file_size - sp->size) % SPARSE_ENTRY_SIZE != 0)
+	return false;
+  if (count == 0)
+	return true;
+
+  list = (uint8_t*)malloc(count * SPARSE_ENTRY_SIZE);
+  sp->holes = (aes_hole_t*)malloc(count * sizeof(aes_hole_t));
+  if (list == NULL || sp->holes == NULL) {
+	free(list);
+	sparse_free(sp);
+	sp->error = "Out of memory";
+	return false;
+  }
+  if (!read_full(sp->in_fd, list, count * SPARSE_ENTRY_SIZE,
+				 AES_HEADER_SIZE + sp->size)) {
+	free(list);
+	sparse_free(sp);
+	sp->error = "File read error";
+	return false;
+  }
+
+  limit = sp->size > sp->tail ? sp->size - sp->tail : 0;
+  end = 0;
+  for (i = 0; i < count; i++) {
+	sp->holes[i].offset = get_be64(list + i * SPARSE_ENTRY_SIZE);
+	sp->holes[i].length = get_be64(list + i * SPARSE_ENTRY_SIZE + 8);
+	if (sp->holes[i].offset < end || sp->holes[i].offset > limit
+		|| sp->holes[i].length == 0
+		|| sp->holes[i].length > limit - sp->holes[i].offset
+		|| sp->holes[i].offset % sp->step != 0
+		|| sp->holes[i].length % sp->step != 0)
+	  break;
+	end = sp->holes[i].offset + sp->holes[i].length;
+  }
+  free(list);
+  if (i < count) {
+	sparse_free(sp);
+	return false;
+  }
+  sp->count = count;
+  return true;
+}
+
+/**
+ * Frees the hole list.
+ */
+void sparse_free(sparse_t *sp) {
+  free(sp->holes);
+  sp->holes = NULL;
+  sp->count = 0;
+}
+
+/**
+ * Moves the output on past a hole: seeks over it, or writes it out as zeros
+ * if the output is a pipe.
+ *
+ * @param buf - A buffer of sp->window_size bytes to write the zeros from.
+ */
+static bool skip_hole(sparse_t *sp, bool seekable, uint8_t *buf,
+					  uint64_t length) {
+  size_t len;
+
+  if (seekable)
+	return lseek(sp->out_fd, length, SEEK_CUR) >= 0;
+
+  memset(buf, 0, sp->window_size);
+  while (length > 0) {
+	len = length < sp->window_size ? length : sp->window_size;
+	if (!write_all(sp->out_fd, buf, len))
+	  return false;
+	length -= len;
+  }
+  return true;
+}
+
+/**
+ * Writes the hole list and the trailer after the ciphertext.
+ */
+static bool write_list(sparse_t *sp) {
+  uint8_t *list;
+  size_t i, len;
+  bool ok;
+
+  len = sp->count * SPARSE_ENTRY_SIZE + SPARSE_TRAILER_SIZE;
+  list = (uint8_t*)malloc(len);
+  if (list == NULL)
+	return false;
+
+  for (i = 0; i < sp->count; i++) {
+	put_be64(list + i * SPARSE_ENTRY_SIZE, sp->holes[i].offset);
+	put_be64(list + i * SPARSE_ENTRY_SIZE + 8, sp->holes[i].length);
+  }
+  put_be64(list + len - SPARSE_TRAILER_SIZE, sp->size);
+  put_be64(list + len - SPARSE_TRAILER_SIZE + 8, sp->count);
+
+  ok = write_all(sp->out_fd, list, len);
+  free(list);
+  return ok;
+}
+
+/**
+ * Ciphers the data between the holes a window at a time, and writes it out
+ * at the output's file position, skipping the holes. When encrypting, the
+ * header goes in front and the hole list after; when decrypting, the output
+ * is made as long as the plaintext, in case it ends in a hole.
+ *
+ * @param fn - Ciphers a window in place. Its position in the plaintext says
+ *             where it is in the key stream or which data units it holds.
+ * @param progress - Called with the bytes done so far and the total.
+ * @return false on a read or write error, with sp->error saying which.
+ */
+bool sparse_run(sparse_t *sp, inplace_fn_t fn, void *arg,
+				void (*progress)(long int, long int)) {
+  uint64_t pos, end, in_base;
+  off_t out_start;
+  uint8_t *buf;
+  size_t i, len;
+
+  /* Room for a window, and the scrap XTS can't leave for the next one */
+  buf = (uint8_t*)malloc(sp->window_size + AES_BLOCK_SIZE);
+  if (buf == NULL) {
+	sp->error = "Out of memory";
+	return false;
+  }
+  sp->error = "File write error";
+  out_start = lseek(sp->out_fd, 0, SEEK_CUR);
+  in_base = sp->decrypt ? AES_HEADER_SIZE : 0;
+
+  if (!sp->decrypt && !write_all(sp->out_fd, sp->header, AES_HEADER_SIZE)) {
+	free(buf);
+	return false;
+  }
+
+  pos = 0;
+  for (i = 0; i <= sp->count; i++) {
+	/* The data up to the next hole, or the end */
+	end = i < sp->count ? sp->holes[i].offset : sp->size;
+	while (pos < end) {
+	  len = end - pos < sp->window_size + AES_BLOCK_SIZE ? end - pos
+		: sp->window_size;
+	  if (!read_full(sp->in_fd, buf, len, in_base + pos)) {
+		sp->error = "File read error";
+		free(buf);
+		return false;
+	  }
+	  fn(arg, pos, buf, len);
+	  if (!write_all(sp->out_fd, buf, len)) {
+		free(buf);
+		return false;
+	  }
+	  pos += len;
+	  if (progress != NULL)
+		progress(pos, sp->size);
+	}
+
+	if (i < sp->count) {
+	  if (!skip_hole(sp, out_start >= 0, buf, sp->holes[i].length)) {
+		free(buf);
+		return false;
+	  }
+	  pos += sp->holes[i].length;
+	}
+  }
+  free(buf);
+
+  if (!sp->decrypt)
+	return write_list(sp);
+  return out_start < 0 || ftruncate(sp->out_fd, out_start + sp->size) == 0;
+}
@@ -0,0 +1,211 @@
+/**
+ * Table-driven (T-table) AES engine
+ *
+ * The byte-wise reference cipher in cipher.c applies SubBytes,
+ * ShiftRows, MixColumns and AddRoundKey as four separate passes over the
+ * state, and MixColumns is a few shifts and XORs per column (see gf.c).
+ * Here we fold the first three steps into lookups on 32-bit words instead.
+ *
+ * If we treat each column of the state as a big-endian word, one output column
+ * of a full round is:
+ *
+ *   t[c] = T0[s[c] >> 24] ^ T1[s[c+1] >> 16] ^ T2[s[c+2] >> 8] ^ T3[s[c+3]]
+ *          ^ round_key[c]
+ *
+ * where T0[x] holds the column (2*S(x), S(x), S(x), 3*S(x)) and T1, T2, T3 are
+ * the same column rotated one, two and three bytes to the right. The column
+ * offsets (c+1, c+2, c+3) take care of ShiftRows. So a whole round is 16 table
+ * lookups and 16 XORs.
+ *
+ * Decryption works the same way with the InvSubBytes/InvMixColumns tables,
+ * but it needs the round keys in reverse order with InvMixColumns applied to
+ * them (the "equivalent inverse cipher" in FIPS-197, section 5.3.5). That
+ * schedule is built along with the encryption one by key_expansion().
+ *
+ * The tables are built from the S-boxes in bytesub.c by ttable_init(), which
+ * must be called once before either cipher function is used.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+/* Load/store a big-endian word */
+#define GETU32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+				   ((uint32_t)(p)[2] << 8) | ((uint32_t)(p)[3]))
+
+#define PUTU32(p, v) do { (p)[0] = (uint8_t)((v) >> 24); \
+						  (p)[1] = (uint8_t)((v) >> 16); \
+						  (p)[2] = (uint8_t)((v) >> 8);  \
+						  (p)[3] = (uint8_t)(v); } while (0)
+
+/* Rotates a word one byte to the right */
+#define ROR8(w) (((w) >> 8) | ((w) << 24))
+
+static uint32_t te[4][256]; /* Encryption tables */
+static uint32_t td[4][256]; /* Decryption tables */
+static uint8_t  td4[256];   /* Plain inverse S-box for the last round */
+
+/**
+ * Builds the encryption and decryption tables.
+ */
+void ttable_init(void) {
+  int i, t;
+  uint8_t sb, si;
+  uint32_t w;
+
+  for (i = 0; i < 256; i++) {
+	sb = si = (uint8_t)i;
+	bytesub_encrypt(&sb, 1);
+	bytesub_decrypt(&si, 1);
+
+	w = ((uint32_t)gf_mul2(sb) << 24) | ((uint32_t)sb << 16)
+	  | ((uint32_t)sb << 8) | (uint32_t)gf_mul3(sb);
+	for (t = 0; t < 4; t++) {
+	  te[t][i] = w;
+	  w = ROR8(w);
+	}
+
+	w = ((uint32_t)gf_mul14(si) << 24)
+	  | ((uint32_t)gf_mul9(si) << 16)
+	  | ((uint32_t)gf_mul13(si) << 8)
+	  | (uint32_t)gf_mul11(si);
+	for (t = 0; t < 4; t++) {
+	  td[t][i] = w;
+	  w = ROR8(w);
+	}
+
+	td4[i] = si;
+  }
+}
+
+/**
+ * Encrypts one 16-byte block. 'in' and 'out' may point to the same buffer.
+ */
+static void encrypt_block(const aes_key_t *key, const uint8_t *in,
+						  uint8_t *out) {
+  uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+  const uint8_t *rk = key->exp_block;
+  int round, num_rounds;
+
+  num_rounds = (key->size / 4) + 6;
+
+  s0 = GETU32(in)      ^ GETU32(rk);
+  s1 = GETU32(in + 4)  ^ GETU32(rk + 4);
+  s2 = GETU32(in + 8)  ^ GETU32(rk + 8);
+  s3 = GETU32(in + 12) ^ GETU32(rk + 12);
+
+  for (round = 1; round < num_rounds; round++) {
+	rk += 16;
+	t0 = te[0][s0 >> 24] ^ te[1][(s1 >> 16) & 0xff]
+	  ^ te[2][(s2 >> 8) & 0xff] ^ te[3][s3 & 0xff] ^ GETU32(rk);
+	t1 = te[0][s1 >> 24] ^ te[1][(s2 >> 16) & 0xff]
+	  ^ te[2][(s3 >> 8) & 0xff] ^ te[3][s0 & 0xff] ^ GETU32(rk + 4);
+	t2 = te[0][s2 >> 24] ^ te[1][(s3 >> 16) & 0xff]
+	  ^ te[2][(s0 >> 8) & 0xff] ^ te[3][s1 & 0xff] ^ GETU32(rk + 8);
+	t3 = te[0][s3 >> 24] ^ te[1][(s0 >> 16) & 0xff]
+	  ^ te[2][(s1 >> 8) & 0xff] ^ te[3][s2 & 0xff] ^ GETU32(rk + 12);
+	s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+  }
+
+  /*
+   The last round has no MixColumns. Each table still contains the plain
+   S-box value in one of its bytes, so we mask out the one we need.
+   */
+  rk += 16;
+  t0 = (te[2][s0 >> 24] & 0xff000000) ^ (te[3][(s1 >> 16) & 0xff] & 0x00ff0000)
+	^ (te[0][(s2 >> 8) & 0xff] & 0x0000ff00) ^ (te[1][s3 & 0xff] & 0x000000ff)
+	^ GETU32(rk);
+  t1 = (te[2][s1 >> 24] & 0xff000000) ^ (te[3][(s2 >> 16) & 0xff] & 0x00ff0000)
+	^ (te[0][(s3 >> 8) & 0xff] & 0x0000ff00) ^ (te[1][s0 & 0xff] & 0x000000ff)
+	^ GETU32(rk + 4);
+  t2 = (te[2][s2 >> 24] & 0xff000000) ^ (te[3][(s3 >> 16) & 0xff] & 0x00ff0000)
+	^ (te[0][(s0 >> 8) & 0xff] & 0x0000ff00) ^ (te[1][s1 & 0xff] & 0x000000ff)
+	^ GETU32(rk + 8);
+  t3 = (te[2][s3 >> 24] & 0xff000000) ^ (te[3][(s0 >> 16) & 0xff] & 0x00ff0000)
+	^ (te[0][(s1 >> 8) & 0xff] & 0x0000ff00) ^ (te[1][s2 & 0xff] & 0x000000ff)
+	^ GETU32(rk + 12);
+
+  PUTU32(out, t0);
+  PUTU32(out + 4, t1);
+  PUTU32(out + 8, t2);
+  PUTU32(out + 12, t3);
+}
+
+/**
+ * Decrypts one 16-byte block. 'in' and 'out' may point to the same buffer.
+ *
+ * @param dec_block - Decryption key block built by key_expansion().
+ * @param key_size - Size of the key the schedule was built from.
+ */
+static void decrypt_block(const uint8_t *dec_block, key_size_t key_size,
+						  const uint8_t *in, uint8_t *out) {
+  uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+  const uint8_t *rk = dec_block;
+  int round, num_rounds;
+
+  num_rounds = (key_size / 4) + 6;
+
+  s0 = GETU32(in)      ^ GETU32(rk);
+  s1 = GETU32(in + 4)  ^ GETU32(rk + 4);
+  s2 = GETU32(in + 8)  ^ GETU32(rk + 8);
+  s3 = GETU32(in + 12) ^ GETU32(rk + 12);
+
+  /* Inverse ShiftRows pulls bytes from the columns to the left. */
+  for (round = 1; round < num_rounds; round++) {
+	rk += 16;
+	t0 = td[0][s0 >> 24] ^ td[1][(s3 >> 16) & 0xff]
+	  ^ td[2][(s2 >> 8) & 0xff] ^ td[3][s1 & 0xff] ^ GETU32(rk);
+	t1 = td[0][s1 >> 24] ^ td[1][(s0 >> 16) & 0xff]
+	  ^ td[2][(s3 >> 8) & 0xff] ^ td[3][s2 & 0xff] ^ GETU32(rk + 4);
+	t2 = td[0][s2 >> 24] ^ td[1][(s1 >> 16) & 0xff]
+	  ^ td[2][(s0 >> 8) & 0xff] ^ td[3][s3 & 0xff] ^ GETU32(rk + 8);
+	t3 = td[0][s3 >> 24] ^ td[1][(s2 >> 16) & 0xff]
+	  ^ td[2][(s1 >> 8) & 0xff] ^ td[3][s0 & 0xff] ^ GETU32(rk + 12);
+	s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+  }
+
+  rk += 16;
+  t0 = ((uint32_t)td4[s0 >> 24] << 24) ^ ((uint32_t)td4[(s3 >> 16) & 0xff] << 16)
+	^ ((uint32_t)td4[(s2 >> 8) & 0xff] << 8) ^ (uint32_t)td4[s1 & 0xff]
+	^ GETU32(rk);
+  t1 = ((uint32_t)td4[s1 >> 24] << 24) ^ ((uint32_t)td4[(s0 >> 16) & 0xff] << 16)
+	^ ((uint32_t)td4[(s3 >> 8) & 0xff] << 8) ^ (uint32_t)td4[s2 & 0xff]
+	^ GETU32(rk + 4);
+  t2 = ((uint32_t)td4[s2 >> 24] << 24) ^ ((uint32_t)td4[(s1 >> 16) & 0xff] << 16)
+	^ ((uint32_t)td4[(s0 >> 8) & 0xff] << 8) ^ (uint32_t)td4[s3 & 0xff]
+	^ GETU32(rk + 8);
+  t3 = ((uint32_t)td4[s3 >> 24] << 24) ^ ((uint32_t)td4[(s2 >> 16) & 0xff] << 16)
+	^ ((uint32_t)td4[(s1 >> 8) & 0xff] << 8) ^ (uint32_t)td4[s0 & 0xff]
+	^ GETU32(rk + 12);
+
+  PUTU32(out, t0);
+  PUTU32(out + 4, t1);
+  PUTU32(out + 8, t2);
+  PUTU32(out + 12, t3);
+}
+
+/**
+ * Encrypts a run of 16-byte blocks.
+ */
+void ttable_encrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+					size_t num_blocks) {
+  while (num_blocks--) {
+	encrypt_block(key, in, out);
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+  }
+}
+
+/**
+ * Decrypts a run of 16-byte blocks.
+ */
+void ttable_decrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+					size_t num_blocks) {
+  while (num_blocks--) {
+	decrypt_block(key->dec_block, key->size, in, out);
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+  }
+}
@@ -0,0 +1,372 @@
+/**
+ * Asynchronous file I/O with io_uring
+ *
+ * A ring holds a few large buffers, and lets one read or write per buffer be
+ * in flight while the cipher works on another. fileio.c uses it to read ahead
+ * of the cipher and to write behind it, so the disk and the cipher keep busy at
+ * the same time.
+ *
+ * We talk to the kernel with the raw system calls rather than liburing, which
+ * doesn't need much: set up a submission and a completion queue, map them, and
+ * register the buffers so the kernel doesn't have to map them for every
+ * request. The buffers are aligned to ALIGN bytes, so they can be used with
+ * O_DIRECT as well.
+ *
+ * If the kernel doesn't have io_uring (or it has been turned off), the same
+ * calls just do the I/O there and then with pread() and pwrite().
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include "aes.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+/* One buffer and the request using it */
+struct uring_slot
+{
+  bool busy; /* A request is in flight */
+  bool write;
+  uint64_t offset;
+  size_t len;
+  ssize_t result; /* Bytes transferred, or -1 */
+};
+
+struct uring
+{
+  int fd; /* The ring, or -1 to use pread() and pwrite() */
+  int file; /* The file read or written */
+  unsigned depth; /* Number of buffers */
+  size_t buffer_size;
+  uint8_t *buffers;
+  struct uring_slot *slots;
+  bool fixed; /* The buffers are registered with the kernel */
+#ifdef HAVE_IO_URING
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+#endif
+};
+
+/**
+ * Reads or writes a whole buffer with pread() or pwrite(). A read only comes
+ * up short at the end of the file.
+ *
+ * @return Bytes transferred, or -1 on an error.
+ */
+static ssize_t sync_io(int file, bool write, uint8_t *buf, size_t len,
+					   uint64_t offset) {
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len) {
+	if (write)
+	  n = pwrite(file, buf + done, len - done, offset + done);
+	else
+	  n = pread(file, buf + done, len - done, offset + done);
+	if (n < 0) {
+	  if (errno == EINTR)
+		continue;
+	  return -1;
+	}
+	if (n == 0)
+	  break;
+	done += n;
+  }
+  return done;
+}
+
+#ifdef HAVE_IO_URING
+
+/**
+ * Sets up the ring and maps its queues.
+ *
+ * @return false if io_uring can't be used.
+ */
+static bool ring_setup(struct uring *ring) {
+  struct io_uring_params p;
+  struct iovec *iov;
+  uint8_t *sq, *cq;
+  unsigned i;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, ring->depth, &p);
+  if (ring->fd < 0)
+	return false;
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = p.cq_off.cqes
+	+ p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP)
+	  && ring->cq_ring_size > ring->sq_ring_size)
+	ring->sq_ring_size = ring->cq_ring_size;
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+					   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+	goto fail;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	ring->cq_ring = ring->sq_ring;
+	ring->cq_ring_size = 0;
+  }
+  else {
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, ring->fd,
+						 IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+	  goto fail_sq;
+  }
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+	goto fail_cq;
+
+  sq = ring->sq_ring;
+  cq = ring->cq_ring;
+  ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  /* Registering the buffers can fail on a low locked memory limit; the
+	 requests then just name the buffer by address. */
+  iov = (struct iovec*)malloc(ring->depth * sizeof(struct iovec));
+  if (iov != NULL) {
+	for (i = 0; i < ring->depth; i++) {
+	  iov[i].iov_base = ring->buffers + i * ring->buffer_size;
+	  iov[i].iov_len = ring->buffer_size;
+	}
+	ring->fixed = syscall(__NR_io_uring_register, ring->fd,
+						  IORING_REGISTER_BUFFERS, iov, ring->depth) == 0;
+	free(iov);
+  }
+  return true;
+
+ fail_cq:
+  if (ring->cq_ring_size > 0)
+	munmap(ring->cq_ring, ring->cq_ring_size);
+ fail_sq:
+  munmap(ring->sq_ring, ring->sq_ring_size);
+ fail:
+  close(ring->fd);
+  ring->fd = -1;
+  return false;
+}
+
+/**
+ * Queues a request and tells the kernel about it.
+ */
+static bool ring_submit(struct uring *ring, unsigned slot) {
+  struct uring_slot *s = &ring->slots[slot];
+  struct io_uring_sqe *sqe;
+  unsigned tail, index;
+  int ret;
+
+  tail = *ring->sq_tail;
+  index = tail & *ring->sq_mask;
+  sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  if (ring->fixed) {
+	sqe->opcode = s->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	sqe->buf_index = slot;
+  }
+  else {
+	sqe->opcode = s->write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  sqe->fd = ring->file;
+  sqe->off = s->offset;
+  sqe->addr = (uint64_t)(uintptr_t)(ring->buffers + slot * ring->buffer_size);
+  sqe->len = s->len;
+  sqe->user_data = slot;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  do {
+	ret = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret == 1;
+}
+
+/**
+ * Waits for at least one request to finish, and marks every one that has.
+ */
+static bool ring_reap(struct uring *ring) {
+  struct io_uring_cqe *cqe;
+  struct uring_slot *s;
+  unsigned head;
+  int ret;
+
+  head = *ring->cq_head;
+  while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+	ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+				  IORING_ENTER_GETEVENTS, NULL, 0);
+	if (ret < 0 && errno != EINTR)
+	  return false;
+  }
+
+  do {
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	s = &ring->slots[cqe->user_data];
+	s->result = cqe->res < 0 ? -1 : cqe->res;
+	s->busy = false;
+	head++;
+  } while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE));
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+ * Tears down the ring.
+ */
+static void ring_free(struct uring *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring_size > 0)
+	munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+#endif /* HAVE_IO_URING */
+
+/**
+ * Creates a ring for reading or writing a file.
+ *
+ * @param file - The file descriptor.
+ * @param depth - Number of buffers, and so of requests that can be in flight.
+ * @param buffer_size - Size of each buffer; a multiple of ALIGN.
+ * @return NULL if we ran out of memory.
+ */
+uring_t * uring_create(int file, unsigned depth, size_t buffer_size) {
+  struct uring *ring;
+  void *buffers;
+
+  ring = (struct uring*)calloc(1, sizeof(struct uring));
+  if (ring == NULL)
+	return NULL;
+  ring->slots = (struct uring_slot*)calloc(depth, sizeof(struct uring_slot));
+  if (ring->slots == NULL
+	  || posix_memalign(&buffers, URING_ALIGN, depth * buffer_size) != 0) {
+	free(ring->slots);
+	free(ring);
+	return NULL;
+  }
+
+  ring->file = file;
+  ring->depth = depth;
+  ring->buffer_size = buffer_size;
+  ring->buffers = buffers;
+  ring->fd = -1;
+#ifdef HAVE_IO_URING
+  ring_setup(ring);
+#endif
+  return ring;
+}
+
+/**
+ * Tells whether requests really run in the background, or are done with
+ * pread() and pwrite() as they are made.
+ */
+bool uring_async(const uring_t *ring) {
+  return ring->fd >= 0;
+}
+
+/**
+ * Returns buffer 'slot' of the ring.
+ */
+uint8_t * uring_buffer(uring_t *ring, unsigned slot) {
+  return ring->buffers + slot * ring->buffer_size;
+}
+
+/**
+ * Starts reading into or writing from a buffer. The buffer must not be in use
+ * by another request; see uring_wait().
+ *
+ * @param len - Bytes to transfer, at most the buffer size.
+ * @return false if the request could not be made.
+ */
+bool uring_start(uring_t *ring, unsigned slot, bool write, uint64_t offset,
+				 size_t len) {
+  struct uring_slot *s = &ring->slots[slot];
+
+  s->write = write;
+  s->offset = offset;
+  s->len = len;
+
+#ifdef HAVE_IO_URING
+  if (ring->fd >= 0) {
+	s->busy = true;
+	if (ring_submit(ring, slot))
+	  return true;
+	s->busy = false;
+	return false;
+  }
+#endif
+
+  s->result = sync_io(ring->file, write, uring_buffer(ring, slot), len, offset);
+  return true;
+}
+
+/**
+ * Waits for the request on a buffer to finish. Reads may come up short at the
+ * end of the file; a write that came up short is finished with pwrite().
+ *
+ * @return Bytes transferred, or -1 on an error.
+ */
+ssize_t uring_wait(uring_t *ring, unsigned slot) {
+  struct uring_slot *s = &ring->slots[slot];
+  ssize_t n;
+
+#ifdef HAVE_IO_URING
+  while (s->busy) {
+	if (!ring_reap(ring))
+	  return -1;
+  }
+#endif
+
+  if (s->write && s->result >= 0 && (size_t)s->result < s->len) {
+	n = sync_io(ring->file, true, uring_buffer(ring, slot) + s->result,
+				s->len - s->result, s->offset + s->result);
+	s->result = n < 0 ? -1 : s->result + n;
+  }
+  return s->result;
+}
+
+/**
+ * Waits for every request to finish, and frees the ring and its buffers.
+ */
+void uring_destroy(uring_t *ring) {
+  unsigned i;
+
+  for (i = 0; i < ring->depth; i++)
+	uring_wait(ring, i);
+#ifdef HAVE_IO_URING
+  if (ring->fd >= 0)
+	ring_free(ring);
+#endif
+  free(ring->buffers);
+  free(ring->slots);
+  free(ring);
+}
@@ -0,0 +1,189 @@
+/**
+ * VAES cipher engines
+ *
+ * Newer processors (Intel Ice Lake, AMD Zen 3/4 and later) have vector forms of
+ * the AES instructions that run one round on every 128-bit lane of a 256-bit
+ * (YMM) or 512-bit (ZMM) register at once, so one instruction advances two or
+ * four blocks. On top of that we keep eight registers in flight, like the
+ * AES-NI engine does, to cover the instruction latency. That makes 16 blocks
+ * per iteration for the 256-bit engine and 32 for the 512-bit one.
+ *
+ * Whatever is left over at the end of a run is handed to the AES-NI engine,
+ * which every VAES processor also has.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define VAES256_TARGET __attribute__((target("avx2,aes,vaes")))
+#define VAES512_TARGET __attribute__((target("avx512f,aes,vaes")))
+
+/* Registers kept in flight per iteration */
+#define VAES_REGS 8
+
+/* Applies one round instruction to all eight registers. */
+#define ROUND8(op, b, k) do { \
+	b[0] = op(b[0], k); b[1] = op(b[1], k); \
+	b[2] = op(b[2], k); b[3] = op(b[3], k); \
+	b[4] = op(b[4], k); b[5] = op(b[5], k); \
+	b[6] = op(b[6], k); b[7] = op(b[7], k); } while (0)
+
+/*
+  --256-BIT ENGINE--
+ */
+
+/* Blocks in one YMM register */
+#define YMM_BLOCKS 2
+
+/**
+ * Runs whole groups of VAES_REGS * YMM_BLOCKS blocks through the cipher.
+ * Returns the number of blocks processed.
+ */
+static inline VAES256_TARGET
+size_t vaes256_run(const uint8_t *key_block, int num_rounds, bool decrypt,
+				   const uint8_t *in, uint8_t *out, size_t num_blocks) {
+  __m256i rk[15], b[VAES_REGS];
+  size_t done;
+  int r, i;
+
+  /* Copy each round key into both lanes */
+  for (r = 0; r <= num_rounds; r++)
+	rk[r] = _mm256_broadcastsi128_si256(
+	  _mm_loadu_si128((const __m128i *)(key_block + 16 * r)));
+
+  for (done = 0; num_blocks - done >= VAES_REGS * YMM_BLOCKS;
+	   done += VAES_REGS * YMM_BLOCKS) {
+	for (i = 0; i < VAES_REGS; i++)
+	  b[i] = _mm256_loadu_si256((const __m256i *)(in + 32 * i));
+
+	ROUND8(_mm256_xor_si256, b, rk[0]);
+	if (decrypt) {
+	  for (r = 1; r < num_rounds; r++)
+		ROUND8(_mm256_aesdec_epi128, b, rk[r]);
+	  ROUND8(_mm256_aesdeclast_epi128, b, rk[num_rounds]);
+	}
+	else {
+	  for (r = 1; r < num_rounds; r++)
+		ROUND8(_mm256_aesenc_epi128, b, rk[r]);
+	  ROUND8(_mm256_aesenclast_epi128, b, rk[num_rounds]);
+	}
+
+	for (i = 0; i < VAES_REGS; i++)
+	  _mm256_storeu_si256((__m256i *)(out + 32 * i), b[i]);
+
+	in += 32 * VAES_REGS;
+	out += 32 * VAES_REGS;
+  }
+
+  return done;
+}
+
+/**
+ * Encrypts a run of 16-byte blocks with 256-bit VAES.
+ */
+VAES256_TARGET
+void vaes256_encrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+					 size_t num_blocks) {
+  size_t done;
+
+  done = vaes256_run(key->exp_block, (key->size / 4) + 6, false,
+					 in, out, num_blocks);
+  aesni_encrypt(key, in + 16 * done, out + 16 * done, num_blocks - done);
+}
+
+/**
+ * Decrypts a run of 16-byte blocks with 256-bit VAES.
+ */
+VAES256_TARGET
+void vaes256_decrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+					 size_t num_blocks) {
+  size_t done;
+
+  done = vaes256_run(key->dec_block, (key->size / 4) + 6, true,
+					 in, out, num_blocks);
+  aesni_decrypt(key, in + 16 * done, out + 16 * done, num_blocks - done);
+}
+
+/*
+  --512-BIT ENGINE--
+ */
+
+/* Blocks in one ZMM register */
+#define ZMM_BLOCKS 4
+
+/**
+ * Runs whole groups of VAES_REGS * ZMM_BLOCKS blocks through the cipher.
+ * Returns the number of blocks processed.
+ */
+static inline VAES512_TARGET
+size_t vaes512_run(const uint8_t *key_block, int num_rounds, bool decrypt,
+				   const uint8_t *in, uint8_t *out, size_t num_blocks) {
+  __m512i rk[15], b[VAES_REGS];
+  size_t done;
+  int r, i;
+
+  /* Copy each round key into all four lanes */
+  for (r = 0; r <= num_rounds; r++)
+	rk[r] = _mm512_broadcast_i32x4(
+	  _mm_loadu_si128((const __m128i *)(key_block + 16 * r)));
+
+  for (done = 0; num_blocks - done >= VAES_REGS * ZMM_BLOCKS;
+	   done += VAES_REGS * ZMM_BLOCKS) {
+	for (i = 0; i < VAES_REGS; i++)
+	  b[i] = _mm512_loadu_si512((const void *)(in + 64 * i));
+
+	ROUND8(_mm512_xor_si512, b, rk[0]);
+	if (decrypt) {
+	  for (r = 1; r < num_rounds; r++)
+		ROUND8(_mm512_aesdec_epi128, b, rk[r]);
+	  ROUND8(_mm512_aesdeclast_epi128, b, rk[num_rounds]);
+	}
+	else {
+	  for (r = 1; r < num_rounds; r++)
+		ROUND8(_mm512_aesenc_epi128, b, rk[r]);
+	  ROUND8(_mm512_aesenclast_epi128, b, rk[num_rounds]);
+	}
+
+	for (i = 0; i < VAES_REGS; i++)
+	  _mm512_storeu_si512((void *)(out + 64 * i), b[i]);
+
+	in += 64 * VAES_REGS;
+	out += 64 * VAES_REGS;
+  }
+
+  return done;
+}
+
+/**
+ * Encrypts a run of 16-byte blocks with 512-bit VAES.
+ */
+VAES512_TARGET
+void vaes512_encrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+					 size_t num_blocks) {
+  size_t done;
+
+  done = vaes512_run(key->exp_block, (key->size / 4) + 6, false,
+					 in, out, num_blocks);
+  aesni_encrypt(key, in + 16 * done, out + 16 * done, num_blocks - done);
+}
+
+/**
+ * Decrypts a run of 16-byte blocks with 512-bit VAES.
+ */
+VAES512_TARGET
+void vaes512_decrypt(const aes_key_t *key, const uint8_t *in, uint8_t *out,
+					 size_t num_blocks) {
+  size_t done;
+
+  done = vaes512_run(key->dec_block, (key->size / 4) + 6, true,
+					 in, out, num_blocks);
+  aesni_decrypt(key, in + 16 * done, out + 16 * done, num_blocks - done);
+}
+
+#endif /* __x86_64__ || __i386__ */
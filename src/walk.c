@@ -0,0 +1,161 @@
+/**
+ * Directory walking
+ *
+ * With -r, the programs cipher every file under the directories they are
+ * given. This reads one directory: its entries are listed with getdents64 on a
+ * descriptor from openat(), and each one is looked at with fstatat() on the
+ * same descriptor, so the kernel doesn't look the directory's path up again
+ * for every entry.
+ *
+ * The programs walk the tree a directory at a time, with every subdirectory
+ * its own unit of a batch (see batch.c). So subdirectories are read in
+ * parallel, and the files of a directory start being ciphered as soon as it
+ * has been read, while the rest of the tree is still being walked.
+ *
+ * Symbolic links are not followed, so a link back up the tree can't send the
+ * walk round in circles. Nor are devices, pipes or sockets included.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "aes.h"
+
+/* Bytes of directory entries read per system call */
+#define WALK_BUFFER_SIZE (32 * 1024)
+
+/* A directory entry as getdents64 returns it */
+struct dirent64
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/**
+ * Sorts entries by path, so the files of a directory are always done (and
+ * reported) in the same order.
+ */
+static int compare_entries(const void *a, const void *b) {
+  return strcmp(((const aes_entry_t*)a)->path, ((const aes_entry_t*)b)->path);
+}
+
+/**
+ * Adds an entry for 'name' in the directory 'path' to the list.
+ *
+ * @return false if we ran out of memory.
+ */
+static bool add_entry(aes_entry_t **entries, size_t *count, size_t *room,
+					  const char *path, const char *name,
+					  const struct stat *st) {
+  aes_entry_t *grown;
+  size_t len;
+
+  if (*count == *room) {
+	*room = *room == 0 ? 64 : 2 * *room;
+	grown = (aes_entry_t*)realloc(*entries, *room * sizeof(aes_entry_t));
+	if (grown == NULL)
+	  return false;
+	*entries = grown;
+  }
+
+  len = strlen(path);
+  (*entries)[*count].path = (char*)malloc(len + strlen(name) + 2);
+  if ((*entries)[*count].path == NULL)
+	return false;
+  strcpy((*entries)[*count].path, path);
+  if (len == 0 || path[len - 1] != '/')
+	strcat((*entries)[*count].path, "/");
+  strcat((*entries)[*count].path, name);
+
+  (*entries)[*count].dir = S_ISDIR(st->st_mode);
+  (*entries)[*count].size = (long int)st->st_size;
+  (*count)++;
+  return true;
+}
+
+/**
+ * Lists the directories and regular files in a directory, sorted by path.
+ * Each path is 'path' followed by the entry's name.
+ *
+ * @param count - Set to the number of entries.
+ * @return The entries, to be freed with walk_free(), or NULL if the directory
+ *         couldn't be read (errno says why) or we ran out of memory.
+ */
+aes_entry_t * walk_dir(const char *path, size_t *count) {
+  uint8_t buf[WALK_BUFFER_SIZE] __attribute__((aligned(8)));
+  aes_entry_t *entries = NULL;
+  struct dirent64 *d;
+  struct stat st;
+  size_t room = 0;
+  long n, pos;
+  int fd;
+  bool ok = true;
+
+  *count = 0;
+  fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+	return NULL;
+
+  while (ok && (n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+	for (pos = 0; ok && pos < n; pos += d->d_reclen) {
+	  d = (struct dirent64*)(buf + pos);
+	  if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+		continue;
+
+	  /* Whatever can't be looked at, or isn't a file or directory, is
+		 left out */
+	  if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0
+		  || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+		continue;
+	  ok = add_entry(&entries, count, &room, path, d->d_name, &st);
+	}
+  }
+  close(fd);
+
+  if (!ok || n < 0) {
+	walk_free(entries, *count);
+	*count = 0;
+	return NULL;
+  }
+
+  if (entries == NULL)
+	entries = (aes_entry_t*)malloc(sizeof(aes_entry_t));
+  qsort(entries, *count, sizeof(aes_entry_t), compare_entries);
+  return entries;
+}
+
+/**
+ * Returns how much of a directory's path is above the directory itself. What
+ * is left is its name, with which the tree under it starts.
+ */
+int walk_skip(const char *path) {
+  int end = strlen(path);
+
+  while (end > 1 && path[end - 1] == '/')
+	end--;
+  while (end > 0 && path[end - 1] != '/')
+	end--;
+  return end;
+}
+
+/**
+ * Frees a list of entries from walk_dir().
+ */
+void walk_free(aes_entry_t *entries, size_t count) {
+  size_t i;
+
+  if (entries == NULL)
+	return;
+  for (i = 0; i < count; i++)
+	free(entries[i].path);
+  free(entries);
+}
@@ -0,0 +1,270 @@
+/**
+ * XTS mode
+ *
+ * XTS (IEEE 1619) is the mode disk encryption uses. The file is cut into data
+ * units of a fixed size (a "sector", 4 KiB by default), and every unit is
+ * encrypted on its own, with a tweak made from its unit number. Two keys are
+ * used: the tweak key encrypts the unit number, and the data key encrypts the
+ * data. Within a unit, block i is whitened with the tweak times alpha^i:
+ *
+ *   C = E(K1, P ^ T) ^ T,    T = E(K2, unit number) * alpha^i
+ *
+ * The ciphertext is exactly as long as the plaintext. A partial block at the
+ * end of a unit is handled with ciphertext stealing, so any length of 16 bytes
+ * or more works. Since units don't depend on each other, they can be
+ * encrypted in parallel, and any range of the file can be decrypted by reading
+ * just the units that cover it.
+ *
+ * If the file doesn't end on a unit boundary, the last unit is the short piece
+ * left over. That piece must hold at least one whole block, though, so when
+ * fewer than 16 bytes are left over they are added to the end of the unit
+ * before instead.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "aes.h"
+
+/* Blocks whitened and ciphered per engine call */
+#define XTS_BLOCKS 256
+
+/**
+ * Multiplies the tweak by alpha (x) in GF(2^128). XTS stores the tweak little-
+ * endian, so this is a left shift by one bit of a 128-bit number, folding the
+ * bit that falls off the top back in as x^7 + x^2 + x + 1. The tweak is kept
+ * as two words loaded straight from memory, which assumes a little-endian
+ * machine, as the key expansion does.
+ */
+static inline void mul_alpha(uint64_t *t) {
+  uint64_t carry = t[1] >> 63;
+
+  t[1] = (t[1] << 1) | (t[0] >> 63);
+  t[0] = (t[0] << 1) ^ (carry * 0x87);
+}
+
+/**
+ * XORs the tweak sequence into 'num_blocks' blocks, starting from tweak 't'.
+ * 'tweaks' is filled with the tweaks used, and 't' is left at the next one.
+ */
+static inline void whiten(uint8_t *out, const uint8_t *in, uint64_t *t,
+						  uint64_t *tweaks, size_t num_blocks) {
+  uint64_t b[2];
+  size_t i;
+
+  for (i = 0; i < num_blocks; i++) {
+	tweaks[2 * i] = t[0];
+	tweaks[2 * i + 1] = t[1];
+	memcpy(b, in + AES_BLOCK_SIZE * i, AES_BLOCK_SIZE);
+	b[0] ^= t[0];
+	b[1] ^= t[1];
+	memcpy(out + AES_BLOCK_SIZE * i, b, AES_BLOCK_SIZE);
+	mul_alpha(t);
+  }
+}
+
+/**
+ * XORs the tweaks used by whiten() back in, after the cipher.
+ */
+static inline void unwhiten(uint8_t *buf, const uint64_t *tweaks,
+							size_t num_blocks) {
+  uint64_t b[2];
+  size_t i;
+
+  for (i = 0; i < num_blocks; i++) {
+	memcpy(b, buf + AES_BLOCK_SIZE * i, AES_BLOCK_SIZE);
+	b[0] ^= tweaks[2 * i];
+	b[1] ^= tweaks[2 * i + 1];
+	memcpy(buf + AES_BLOCK_SIZE * i, b, AES_BLOCK_SIZE);
+  }
+}
+
+/**
+ * Runs whole blocks through the data cipher with whitening on both sides.
+ */
+static void xts_blocks(const xts_t *xts, bool decrypt, uint64_t *t,
+					   const uint8_t *in, uint8_t *out, size_t num_blocks) {
+  uint64_t tweaks[2 * XTS_BLOCKS];
+  size_t n;
+
+  for (; num_blocks > 0; num_blocks -= n) {
+	n = num_blocks < XTS_BLOCKS ? num_blocks : XTS_BLOCKS;
+
+	whiten(out, in, t, tweaks, n);
+	if (decrypt)
+	  xts->engine->decrypt(xts->data_key, out, out, n);
+	else
+	  xts->engine->encrypt(xts->data_key, out, out, n);
+	unwhiten(out, tweaks, n);
+
+	in += AES_BLOCK_SIZE * n;
+	out += AES_BLOCK_SIZE * n;
+  }
+}
+
+/**
+ * Encrypts or decrypts one data unit of 'len' bytes (at least one block).
+ */
+static void xts_unit(const xts_t *xts, bool decrypt, uint64_t unit,
+					 const uint8_t *in, uint8_t *out, size_t len) {
+  uint8_t tweak[AES_BLOCK_SIZE], last[AES_BLOCK_SIZE], stolen[AES_BLOCK_SIZE];
+  uint64_t t[2], t_next[2];
+  size_t full, r;
+  int i;
+
+  /* The starting tweak is the encrypted unit number, little-endian */
+  memset(tweak, 0, sizeof(tweak));
+  for (i = 0; i < 8; i++)
+	tweak[i] = (unit >> (8 * i)) & 0xFF;
+  xts->engine->encrypt(xts->tweak_key, tweak, tweak, 1);
+  memcpy(t, tweak, sizeof(t));
+
+  full = len / AES_BLOCK_SIZE;
+  r = len % AES_BLOCK_SIZE;
+
+  if (r == 0) {
+	xts_blocks(xts, decrypt, t, in, out, full);
+	return;
+  }
+
+  /* Ciphertext stealing. All but the last full block go as normal. */
+  xts_blocks(xts, decrypt, t, in, out, full - 1);
+  in += AES_BLOCK_SIZE * (full - 1);
+  out += AES_BLOCK_SIZE * (full - 1);
+
+  if (!decrypt) {
+	/* Encrypt the last full block, give the front of it to the partial block,
+	   and encrypt the partial block, filled out with the rest, in its place. */
+	xts_blocks(xts, false, t, in, last, 1);
+	memcpy(stolen, in + AES_BLOCK_SIZE, r);
+	memcpy(stolen + r, last + r, AES_BLOCK_SIZE - r);
+	memcpy(out + AES_BLOCK_SIZE, last, r);
+	xts_blocks(xts, false, t, stolen, out, 1);
+  }
+  else {
+	/* The other way around: the last full block was encrypted with the
+	   following tweak, so skip ahead for it and come back. */
+	t_next[0] = t[0];
+	t_next[1] = t[1];
+	mul_alpha(t_next);
+	xts_blocks(xts, true, t_next, in, last, 1);
+	memcpy(stolen, in + AES_BLOCK_SIZE, r);
+	memcpy(stolen + r, last + r, AES_BLOCK_SIZE - r);
+	memcpy(out + AES_BLOCK_SIZE, last, r);
+	xts_blocks(xts, true, t, stolen, out, 1);
+  }
+}
+
+/**
+ * Returns the length of the data unit starting 'len' bytes before the end of
+ * a buffer: a whole unit, unless that would leave less than a block after it.
+ */
+static inline size_t unit_length(const xts_t *xts, size_t len) {
+  if (len < xts->unit_size + AES_BLOCK_SIZE)
+	return len;
+  return xts->unit_size;
+}
+
+/**
+ * Encrypts or decrypts a run of data units. 'in' and 'out' may be the same
+ * buffer.
+ *
+ * @param unit - Number of the first unit in 'in'.
+ * @param len - Must end on a unit boundary, or at the end of the file.
+ */
+void xts_crypt(const xts_t *xts, bool decrypt, uint64_t unit,
+			   const uint8_t *in, uint8_t *out, size_t len) {
+  size_t n;
+
+  for (; len > 0; len -= n, unit++) {
+	n = unit_length(xts, len);
+	xts_unit(xts, decrypt, unit, in, out, n);
+	in += n;
+	out += n;
+  }
+}
+
+/* One buffer being ciphered by the pool */
+struct xts_job
+{
+  const xts_t *xts;
+  bool decrypt;
+  uint64_t unit;
+  const uint8_t *in;
+  uint8_t *out;
+  size_t len;
+};
+
+/* Ciphers chunk i of a job. The last chunk takes any scrap at the end. */
+static void xts_chunk(void *arg, size_t i) {
+  const struct xts_job *job = arg;
+  size_t offset, len;
+
+  offset = i * AES_CHUNK_SIZE;
+  len = job->len - offset;
+  if (len >= AES_CHUNK_SIZE + AES_BLOCK_SIZE)
+	len = AES_CHUNK_SIZE;
+
+  xts_crypt(job->xts, job->decrypt, job->unit + offset / job->xts->unit_size,
+			job->in + offset, job->out + offset, len);
+}
+
+/**
+ * Same as xts_crypt(), but splits the buffer into AES_CHUNK_SIZE chunks and
+ * ciphers them on the threads of 'pool'. The unit size must divide
+ * AES_CHUNK_SIZE (see xts_valid_unit_size()).
+ */
+void xts_crypt_parallel(pool_t *pool, const xts_t *xts, bool decrypt,
+						uint64_t unit, const uint8_t *in, uint8_t *out,
+						size_t len) {
+  struct xts_job job = { xts, decrypt, unit, in, out, len };
+  size_t num_chunks;
+
+  /* A scrap of less than a block at the end belongs to the chunk before */
+  num_chunks = len / AES_CHUNK_SIZE;
+  if (len % AES_CHUNK_SIZE >= AES_BLOCK_SIZE || num_chunks == 0)
+	num_chunks++;
+
+  pool_run(pool, num_chunks, xts_chunk, &job);
+}
+
+/**
+ * Checks that a data unit size is usable: a power of two, from one block up
+ * to AES_CHUNK_SIZE, so that chunks always hold whole units.
+ */
+bool xts_valid_unit_size(size_t unit_size) {
+  return unit_size >= AES_BLOCK_SIZE && unit_size <= AES_CHUNK_SIZE
+	&& (unit_size & (unit_size - 1)) == 0;
+}
+
+/**
+ * Works out which part of an XTS file has to be read to decrypt a byte range:
+ * the data units that cover it, plus the scrap at the end of the file if the
+ * last of those units is the one that takes it.
+ *
+ * @param data_size - Length of the whole ciphertext.
+ * @param offset - Start of the range.
+ * @param length - Length of the range; must not run past the end.
+ * @param start - Set to the start of the first unit to read.
+ * @param end - Set to the end of the last unit to read.
+ */
+void xts_range(const xts_t *xts, uint64_t data_size, uint64_t offset,
+			   uint64_t length, uint64_t *start, uint64_t *end) {
+  uint64_t last_unit;
+
+  /* Start of the last unit of the file */
+  last_unit = data_size - data_size % xts->unit_size;
+  if (last_unit == data_size || data_size - last_unit < AES_BLOCK_SIZE)
+	last_unit = last_unit >= xts->unit_size ? last_unit - xts->unit_size : 0;
+
+  *start = offset - offset % xts->unit_size;
+  if (*start > last_unit)
+	*start = last_unit;
+
+  *end = offset + length + xts->unit_size - 1;
+  *end -= *end % xts->unit_size;
+  if (*end > last_unit)
+	*end = data_size;
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Packs a small tree into an archive and checks that -l lists every file with
+# its size, that -x takes out each one on its own, that asking for a file the
+# archive doesn't have fails, and that the whole archive unpacks to the tree.
+#
+# Run from the top of the tree, after 'make' (or with 'make check').
+
+set -u
+top=$(pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+cd "$dir"
+mkdir -p src/sub out
+head -c 70000 /dev/urandom > src/a
+: > src/empty
+head -c 5 /dev/urandom > src/sub/b
+head -c 300001 /dev/urandom > src/sub/c
+files="src/a src/empty src/sub/b src/sub/c"
+
+"$top/aes-encrypt" -r -m archive -k key -o archive.aes src > /dev/null \
+  || { echo "archive: encryption failed"; exit 1; }
+
+for f in $files; do
+  echo "$(wc -c < $f | tr -d ' ') $f"
+done | sort > expected
+"$top/aes-decrypt" -l key archive.aes 2> /dev/null \
+  | awk '/^ *[0-9]+  / { print $1, $2 }' | sort > listed
+if ! cmp -s expected listed; then
+  echo "archive: -l lists the wrong files"
+  failed=1
+fi
+
+for f in $files; do
+  rm -f extracted
+  if ! "$top/aes-decrypt" -x $f -o extracted key archive.aes > /dev/null \
+	  || ! cmp -s extracted $f; then
+	echo "archive: -x $f doesn't match"
+	failed=1
+  fi
+done
+
+if "$top/aes-decrypt" -x src/missing -o extracted key archive.aes \
+	 > /dev/null 2>&1; then
+  echo "archive: -x of a file that isn't there didn't fail"
+  failed=1
+fi
+
+if ! "$top/aes-decrypt" -d out/ key archive.aes > /dev/null; then
+  echo "archive: unpacking failed"
+  failed=1
+fi
+for f in $files; do
+  cmp -s out/$f $f || { echo "archive: unpacked $f doesn't match"; failed=1; }
+done
+
+[ $failed -eq 0 ] || exit 1
+echo "archive: listed, extracted and unpacked"
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Encrypts a file with every cipher engine this machine supports, in every
+# mode and with every key size, and decrypts each cipher file with every
+# engine. The engines must all agree with each other; tests/vectors checks
+# that they agree with AES.
+#
+# Run from the top of the tree, after 'make' (or with 'make check').
+
+set -u
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# A whole number of blocks, so that ECB needs no padding, and more than a
+# chunk, so that the pool splits it up
+head -c 100000 /dev/urandom > "$dir/plain"
+
+engines=
+for engine in vaes512 vaes256 aesni bitslice portable reference; do
+  if ./aes-encrypt -e $engine -k "$dir/key" -o "$dir/probe.aes" \
+	   "$dir/plain" > /dev/null 2>&1; then
+	engines="$engines $engine"
+  fi
+done
+
+for size in 16 24 32; do
+  for mode in ecb ctr gcm cbc xts chunked; do
+	for enc in $engines; do
+	  if ! ./aes-encrypt -e $enc -s $size -m $mode -k "$dir/key" \
+		   -o "$dir/cipher.aes" "$dir/plain" > /dev/null; then
+		echo "engines: $enc: $mode, $size-byte key: encryption failed"
+		failed=1
+		continue
+	  fi
+	  for dec in $engines; do
+		rm -f "$dir/out"
+		if ! ./aes-decrypt -e $dec -o "$dir/out" "$dir/key" \
+			 "$dir/cipher.aes" > /dev/null \
+			|| ! cmp -s "$dir/out" "$dir/plain"; then
+		  echo "engines: $mode, $size-byte key: $enc's cipher file doesn't" \
+			"decrypt with $dec"
+		  failed=1
+		fi
+	  done
+	done
+  done
+done
+
+[ $failed -eq 0 ] || exit 1
+echo "engines: all agree:$engines"
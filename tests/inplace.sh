@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Encrypts a file with --in_place, kills the run part way, and checks that
+# running it again finishes the file from its journal, and that the file then
+# decrypts in place, killed part way too, to what it was. The key file of the
+# first run must survive a second run that names it, since the files a run
+# encrypted in place have no other copy.
+#
+# Run from the top of the tree, after 'make' (or with 'make check').
+
+set -u
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+fail() {
+  echo "inplace: $1"
+  exit 1
+}
+
+# Starts a run in the background on the slowest engine, waits for its
+# journal and kills it, and checks the journal was left behind.
+kill_run() {
+  "$@" > /dev/null 2>&1 &
+  pid=$!
+  tries=0
+  while [ -z "$(ls "$dir" | grep '\.journal$')" ] && [ $tries -lt 100 ]; do
+	sleep 0.05
+	tries=$((tries + 1))
+  done
+  sleep 0.2
+  kill -9 $pid 2> /dev/null
+  wait $pid 2> /dev/null
+  [ -n "$(ls "$dir" | grep '\.journal$')" ] \
+	|| fail "$1 finished before it could be killed"
+}
+
+head -c 64M /dev/urandom > "$dir/plain"
+head -c 5000 /dev/urandom > "$dir/plain2"
+
+for mode in ctr xts; do
+  key="$dir/$mode.key"
+  cp "$dir/plain" "$dir/f"
+  cp "$dir/plain2" "$dir/g"
+
+  kill_run ./aes-encrypt -m $mode --in_place -e reference -j 1 -k "$key" \
+	"$dir/f"
+  cp "$key" "$dir/key.first"
+  ./aes-encrypt -m $mode --in_place -k "$key" "$dir/f" > /dev/null \
+	|| fail "$mode: encryption didn't resume"
+  [ -f "$dir/f.aes" ] && [ ! -f "$dir/f" ] && [ ! -f "$dir/f.journal" ] \
+	|| fail "$mode: resumed encryption left the wrong files"
+
+  ./aes-encrypt -m $mode --in_place -k "$key" "$dir/g" > /dev/null \
+	|| fail "$mode: second file didn't encrypt"
+  cmp -s "$key" "$dir/key.first" || fail "$mode: the key file was replaced"
+
+  kill_run ./aes-decrypt --in_place -e reference -j 1 "$key" "$dir/f.aes"
+  ./aes-decrypt --in_place "$key" "$dir/f.aes" > /dev/null \
+	|| fail "$mode: decryption didn't resume"
+  [ -f "$dir/f" ] && [ ! -f "$dir/f.aes" ] && [ ! -f "$dir/f.aes.journal" ] \
+	|| fail "$mode: resumed decryption left the wrong files"
+  cmp -s "$dir/f" "$dir/plain" || fail "$mode: resumed file doesn't match"
+  ./aes-decrypt --in_place "$key" "$dir/g.aes" > /dev/null \
+	&& cmp -s "$dir/g" "$dir/plain2" || fail "$mode: second file doesn't match"
+done
+
+echo "inplace: killed runs resumed"
@@ -0,0 +1,296 @@
+/**
+ * Library tests
+ *
+ * Uses libaes as a program would, through libaes.h alone: streams messages in
+ * every mode through a context in pieces of odd sizes, both ways, and checks
+ * they come back as they were and that a damaged GCM message is caught;
+ * encrypts batches of messages with aes_encrypt_iov() and decrypts each on
+ * its own; and sets up contexts from a key file through a key cache, which
+ * must not read the file again until it changes.
+ *
+ * Built and run by 'make check'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "libaes.h"
+
+/* Bytes 0 to 31 and 32 to 63, as aes-encrypt saves keys */
+#define KEY_A "AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8="
+#define KEY_B "ICEiIyQlJicoKSorLC0uLzAxMjM0NTY3ODk6Ozw9Pj8="
+
+#define BATCH_SIZE 200
+
+static const aes_mode_t modes[] = {
+  mode_ecb, mode_ctr, mode_gcm, mode_cbc, mode_xts, mode_chunked
+};
+static const char *mode_names[] = {
+  "ECB", "CTR", "GCM", "CBC", "XTS", "chunked"
+};
+
+#define NUM_MODES (sizeof(modes) / sizeof(modes[0]))
+
+/* Sizes the pieces of a message are given in, in turn */
+static const size_t encrypt_pieces[] = { 1, 7, 16, 4097, 3, 65537, 15 };
+static const size_t decrypt_pieces[] = { 13, 1, 500, 17, 32768, 2 };
+
+#define NUM_PIECES(p) (sizeof(p) / sizeof(p[0]))
+
+static int failures;
+
+/* Reports a failure */
+static void fail(const char *what, const char *mode, const char *why) {
+  printf("library: %s: %s: %s\n", mode, what, why);
+  failures++;
+}
+
+/* Fills a buffer with bytes that don't repeat in any short pattern */
+static void fill(uint8_t *buf, size_t len, unsigned int seed) {
+  size_t i;
+
+  srand(seed);
+  for (i = 0; i < len; i++)
+	buf[i] = rand();
+}
+
+/**
+ * Streams 'len' bytes through a context, in pieces of the sizes given in
+ * turn, and finishes the message. Frees the context.
+ *
+ * @return The number of bytes written to 'out', or (size_t)-1 if an update
+ *         or the final call failed.
+ */
+static size_t stream(aes_ctx_t *ctx, const uint8_t *in, size_t len,
+					 uint8_t *out, const size_t *pieces, size_t num_pieces) {
+  size_t done = 0, written = 0, piece, out_len, i = 0;
+  bool ok = true;
+
+  while (ok && done < len) {
+	piece = pieces[i++ % num_pieces];
+	if (piece > len - done)
+	  piece = len - done;
+	ok = aes_ctx_update(ctx, in + done, out + written, piece, &out_len);
+	done += piece;
+	written += out_len;
+  }
+  if (ok) {
+	ok = aes_ctx_final(ctx, out + written, &out_len);
+	written += out_len;
+  }
+  aes_ctx_free(ctx);
+  return ok ? written : (size_t)-1;
+}
+
+/**
+ * Checks that a message decrypted to what was encrypted. ECB messages come
+ * back padded with zeros to a whole number of blocks.
+ */
+static bool same(aes_mode_t mode, const uint8_t *plain, size_t len,
+				 const uint8_t *got, size_t got_len) {
+  if (mode == mode_ecb)
+	return got_len == (len + 15) / 16 * 16 && memcmp(got, plain, len) == 0;
+  return got_len == len && memcmp(got, plain, len) == 0;
+}
+
+/* Makes a context with the key of that mode, bytes 0 to 63 */
+static aes_ctx_t * make_ctx(aes_mode_t mode, bool decrypt) {
+  uint8_t key[64];
+  size_t i;
+
+  for (i = 0; i < sizeof(key); i++)
+	key[i] = i;
+  return aes_ctx_init(key, mode == mode_xts ? 64 : 32, mode, decrypt);
+}
+
+static void test_pieces(void) {
+  static const size_t lengths[] = { 1, 15, 16, 17, 4096, 300001 };
+  size_t m, l, len, room, cipher_len, plain_len;
+  uint8_t *plain, *cipher, *out;
+  aes_ctx_t *ctx;
+
+  for (m = 0; m < NUM_MODES; m++) {
+	for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+	  len = lengths[l];
+	  if (modes[m] == mode_xts && len < 16)
+		continue; /* XTS needs a whole block */
+
+	  ctx = make_ctx(modes[m], false);
+	  if (modes[m] == mode_xts)
+		aes_ctx_set_unit_size(ctx, 512);
+	  else if (modes[m] == mode_chunked)
+		aes_ctx_set_unit_size(ctx, 4096);
+	  room = aes_ctx_output_size(ctx, len) + aes_ctx_output_size(ctx, 0);
+	  plain = malloc(len);
+	  cipher = malloc(room);
+	  out = malloc(room);
+	  fill(plain, len, len);
+
+	  cipher_len = stream(ctx, plain, len, cipher, encrypt_pieces,
+						  NUM_PIECES(encrypt_pieces));
+	  plain_len = cipher_len == (size_t)-1 ? cipher_len
+		: stream(make_ctx(modes[m], true), cipher, cipher_len, out,
+				 decrypt_pieces, NUM_PIECES(decrypt_pieces));
+	  if (plain_len == (size_t)-1)
+		fail("pieces", mode_names[m], "a message failed to cipher");
+	  else if (!same(modes[m], plain, len, out, plain_len))
+		fail("pieces", mode_names[m], "a message didn't come back");
+
+	  if (modes[m] == mode_gcm && cipher_len != (size_t)-1) {
+		cipher[cipher_len / 2] ^= 1;
+		if (stream(make_ctx(modes[m], true), cipher, cipher_len, out,
+				   decrypt_pieces, NUM_PIECES(decrypt_pieces)) != (size_t)-1)
+		  fail("pieces", mode_names[m], "a damaged message was let through");
+	  }
+	  free(plain);
+	  free(cipher);
+	  free(out);
+	}
+  }
+}
+
+static void test_iov(void) {
+  struct iovec in[BATCH_SIZE], out[BATCH_SIZE];
+  size_t m, i, len, plain_len;
+  uint8_t *plain;
+  aes_ctx_t *ctx;
+  bool ok;
+
+  for (m = 0; m < NUM_MODES; m++) {
+	ctx = make_ctx(modes[m], false);
+	aes_ctx_set_threads(ctx, 4);
+	if (modes[m] == mode_chunked)
+	  aes_ctx_set_unit_size(ctx, 1024);
+	for (i = 0; i < BATCH_SIZE; i++) {
+	  /* Mostly short messages, with a long one now and then */
+	  len = i % 50 == 0 ? 20000 + i : i * 7 % 1500;
+	  in[i].iov_base = malloc(len);
+	  in[i].iov_len = len;
+	  fill(in[i].iov_base, len, i);
+	  out[i].iov_len = aes_ctx_output_size(ctx, len)
+		+ aes_ctx_output_size(ctx, 0);
+	  out[i].iov_base = malloc(out[i].iov_len);
+	}
+
+	ok = aes_encrypt_iov(ctx, in, out, BATCH_SIZE);
+	if (modes[m] == mode_xts) {
+	  if (ok)
+		fail("batch", mode_names[m], "a batch was let through");
+	} else if (!ok)
+	  fail("batch", mode_names[m], aes_ctx_error(ctx));
+	else {
+	  for (i = 0; i < BATCH_SIZE; i++) {
+		len = in[i].iov_len;
+		plain = malloc(len + 16);
+		plain_len = stream(make_ctx(modes[m], true), out[i].iov_base,
+						   out[i].iov_len, plain, decrypt_pieces,
+						   NUM_PIECES(decrypt_pieces));
+		if (plain_len == (size_t)-1
+			|| !same(modes[m], in[i].iov_base, len, plain, plain_len)) {
+		  fail("batch", mode_names[m], "a message didn't come back");
+		  free(plain);
+		  break;
+		}
+		free(plain);
+	  }
+	}
+	aes_ctx_free(ctx);
+
+	for (i = 0; i < BATCH_SIZE; i++) {
+	  free(in[i].iov_base);
+	  free(out[i].iov_base);
+	}
+  }
+}
+
+/* Writes a key file */
+static bool write_key(const char *path, const char *b64) {
+  FILE *f = fopen(path, "w");
+  bool ok;
+
+  if (f == NULL)
+	return false;
+  ok = fputs(b64, f) != EOF;
+  return fclose(f) == 0 && ok;
+}
+
+/**
+ * Encrypts a short GCM message with a context, and checks which key it was
+ * encrypted with by decrypting it with the key of bytes 'first' onwards.
+ */
+static bool encrypted_with(aes_ctx_t *ctx, uint8_t first) {
+  uint8_t plain[100], cipher[200], out[200], key[32];
+  size_t cipher_len, i;
+
+  if (ctx == NULL)
+	return false;
+  fill(plain, sizeof(plain), 1);
+  cipher_len = stream(ctx, plain, sizeof(plain), cipher, encrypt_pieces,
+					  NUM_PIECES(encrypt_pieces));
+  for (i = 0; i < sizeof(key); i++)
+	key[i] = first + i;
+  return cipher_len != (size_t)-1
+	&& stream(aes_ctx_init(key, sizeof(key), mode_gcm, true), cipher,
+			  cipher_len, out, decrypt_pieces, NUM_PIECES(decrypt_pieces))
+	   == sizeof(plain);
+}
+
+static void test_key_file(void) {
+  char dir[] = "/tmp/libaes-test.XXXXXX", path[64];
+  struct timespec times[2];
+  aes_key_cache_t *cache;
+  struct stat st;
+
+  if (mkdtemp(dir) == NULL) {
+	fail("key file", "GCM", "couldn't make a directory");
+	return;
+  }
+  snprintf(path, sizeof(path), "%s/key", dir);
+  cache = aes_key_cache_create(4);
+
+  if (!write_key(path, KEY_A) || stat(path, &st) != 0)
+	fail("key file", "GCM", "couldn't write the key file");
+  else if (!encrypted_with(aes_ctx_init_file(cache, path, mode_gcm, false), 0))
+	fail("key file", "GCM", "the key wasn't read from the file");
+  else {
+	/* Another key, in a file that looks unchanged, must not be read */
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (!write_key(path, KEY_B) || utimensat(AT_FDCWD, path, times, 0) != 0)
+	  fail("key file", "GCM", "couldn't write the key file");
+	else if (!encrypted_with(aes_ctx_init_file(cache, path, mode_gcm, false),
+							 0))
+	  fail("key file", "GCM", "the key wasn't taken from the cache");
+
+	/* Once the file has changed, its key must be read again */
+	times[1].tv_sec++;
+	if (utimensat(AT_FDCWD, path, times, 0) != 0)
+	  fail("key file", "GCM", "couldn't touch the key file");
+	else if (!encrypted_with(aes_ctx_init_file(cache, path, mode_gcm, false),
+							 32))
+	  fail("key file", "GCM", "a changed key file wasn't read again");
+  }
+
+  unlink(path);
+  if (aes_ctx_init_file(cache, path, mode_gcm, false) != NULL)
+	fail("key file", "GCM", "a missing key file was let through");
+  aes_key_cache_free(cache);
+  rmdir(dir);
+}
+
+int main(void) {
+  test_pieces();
+  test_iov();
+  test_key_file();
+
+  if (failures > 0)
+	return EXIT_FAILURE;
+  printf("library: streams, batches and cached keys all round trip\n");
+  return EXIT_SUCCESS;
+}
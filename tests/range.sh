@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Decrypts ranges of a cipher file with --offset and --length and checks each
+# against the same bytes of the plaintext, for XTS and chunked files: ranges
+# at the start and the end, on and off data unit and chunk boundaries, a
+# single byte, and the scrap of less than a block at the end of a file that
+# isn't a whole number of blocks. A range past the end of the file must be
+# refused.
+#
+# Run from the top of the tree, after 'make' (or with 'make check').
+
+set -u
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+size=1000003
+head -c $size /dev/urandom > "$dir/plain"
+
+# Checks the range 'offset' 'length' of a cipher file made with 'what'
+check_range() {
+  rm -f "$dir/out"
+  if ! ./aes-decrypt --offset $1 --length $2 -o "$dir/out" "$dir/key" \
+	   "$dir/cipher.aes" > /dev/null 2>&1; then
+	echo "range: $what: range $1+$2 doesn't decrypt"
+	failed=1
+  elif ! tail -c +$(($1 + 1)) "$dir/plain" | head -c $2 \
+	  | cmp -s - "$dir/out"; then
+	echo "range: $what: range $1+$2 doesn't match"
+	failed=1
+  fi
+}
+
+# Checks ranges of a cipher file cut into units of 'unit' bytes
+check_ranges() {
+  unit=$1
+  for range in "0 1" "0 $unit" "0 $((unit + 1))" "1 $((unit - 2))" \
+			   "$unit $unit" "$((unit - 1)) 2" "$((3 * unit + 7)) 100000" \
+			   "$((size - 1)) 1" "$((size - 20)) 20" "$((size - unit - 5)) 5" \
+			   "$((size / 2)) $((size - size / 2))" "0 $size"; do
+	check_range $range
+  done
+
+  if ./aes-decrypt --offset $((size - 10)) --length 11 -o "$dir/out" \
+	   "$dir/key" "$dir/cipher.aes" > /dev/null 2>&1; then
+	echo "range: $what: a range past the end wasn't refused"
+	failed=1
+  fi
+}
+
+for unit in 512 4096 65536; do
+  what="xts, $unit-byte units"
+  if ! ./aes-encrypt -m xts -u $unit -k "$dir/key" -o "$dir/cipher.aes" \
+	   "$dir/plain" > /dev/null; then
+	echo "range: $what: encryption failed"
+	exit 1
+  fi
+  check_ranges $unit
+done
+
+for unit in 4096 65536; do
+  what="chunked, $unit-byte chunks"
+  if ! ./aes-encrypt -m chunked -u $unit -k "$dir/key" -o "$dir/cipher.aes" \
+	   "$dir/plain" > /dev/null; then
+	echo "range: $what: encryption failed"
+	exit 1
+  fi
+  check_ranges $unit
+done
+
+[ $failed -eq 0 ] || exit 1
+echo "range: all ranges match"
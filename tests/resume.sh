@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Encrypts a file with --resume, kills the run after its first checkpoint,
+# and checks that running it again picks up from the checkpoint rather than
+# the start; then does the same to the decryption, and checks the plaintext
+# comes back as it was. A checkpoint is only saved every CHECKPOINT_INTERVAL
+# bytes, so the file is a little longer than that; it is all one hole, so it
+# takes no room and no time to read.
+#
+# Run from the top of the tree, after 'make' (or with 'make check').
+
+set -u
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# Starts a run in the background, waits for it to save a checkpoint in
+# 'checkpoint' and kills it. Returns false if it finished first.
+kill_run() {
+  "$@" > /dev/null 2>&1 &
+  pid=$!
+  tries=0
+  while [ -z "$(od -An -tx1 -j64 -N8 "$checkpoint" 2> /dev/null \
+				| tr -d ' 0\n')" ] && [ $tries -lt 400 ]; do
+	sleep 0.05
+	tries=$((tries + 1))
+  done
+  kill -9 $pid 2> /dev/null
+  wait $pid 2> /dev/null
+  [ -f "$checkpoint" ]
+}
+
+# Runs the rest of a killed run, and checks it resumed part way
+resume_run() {
+  if ! "$@" -v > "$dir/log" 2>&1; then
+	echo "resume: $what: the resumed run failed"
+	failed=1
+  elif ! grep -q "Resuming from byte [1-9]" "$dir/log"; then
+	echo "resume: $what: the run started over"
+	failed=1
+  fi
+}
+
+truncate -s 300M "$dir/plain"
+
+for mode in ctr xts chunked; do
+  rm -f "$dir/key" "$dir/cipher.aes" "$dir/out"
+
+  what="$mode encryption"
+  checkpoint="$dir/cipher.aes.checkpoint"
+  if ! kill_run ./aes-encrypt --resume -e portable -j 1 -m $mode \
+	   -k "$dir/key" -o "$dir/cipher.aes" "$dir/plain"; then
+	echo "resume: $what: finished before it could be killed"
+	failed=1
+	continue
+  fi
+  resume_run ./aes-encrypt --resume -m $mode -k "$dir/key" \
+	-o "$dir/cipher.aes" "$dir/plain"
+
+  what="$mode decryption"
+  checkpoint="$dir/out.checkpoint"
+  if ! kill_run ./aes-decrypt --resume -e portable -j 1 -o "$dir/out" \
+	   "$dir/key" "$dir/cipher.aes"; then
+	echo "resume: $what: finished before it could be killed"
+	failed=1
+	continue
+  fi
+  resume_run ./aes-decrypt --resume -o "$dir/out" "$dir/key" \
+	"$dir/cipher.aes"
+
+  if [ -f "$dir/cipher.aes.checkpoint" ] || [ -f "$dir/out.checkpoint" ]; then
+	echo "resume: $mode: a checkpoint was left behind"
+	failed=1
+  fi
+  if ! cmp -s "$dir/out" "$dir/plain"; then
+	echo "resume: $mode: the plaintext doesn't match"
+	failed=1
+  fi
+done
+
+[ $failed -eq 0 ] || exit 1
+echo "resume: killed runs picked up where they stopped"
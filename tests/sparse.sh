@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Encrypts sparse files with --sparse and decrypts them, and checks that they
+# come back as they were, holes and all: the holes must be left out of the
+# cipher file and made again in the plaintext, not written out as zeros. The
+# files have data at the start, in the middle and at the end, or none at all,
+# and some end in a hole or aren't a whole number of blocks.
+#
+# Run from the top of the tree, after 'make' (or with 'make check').
+
+set -u
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# Makes a sparse file of 'size' bytes, with 4096 random bytes at each of the
+# offsets after it
+make_sparse() {
+  name=$1
+  truncate -s $2 "$dir/$name"
+  shift 2
+  for offset in "$@"; do
+	head -c 4096 /dev/urandom \
+	  | dd of="$dir/$name" bs=4096 seek=$((offset / 4096)) conv=notrunc \
+		2> /dev/null
+  done
+}
+
+# Space a file takes on disk, in kilobytes
+disk_kb() {
+  du -k "$1" | cut -f1
+}
+
+make_sparse start 33554432 0
+make_sparse middle 33554432 16777216
+make_sparse end 33554432 33550336
+make_sparse holes 33554432
+make_sparse odd 33554439 0 8388608
+make_sparse scattered 50000000 0 4096000 20480000 40960000
+
+# Without holes in the file system, only the round trip can be checked
+holes=true
+[ $(disk_kb "$dir/holes") -lt 1024 ] || holes=false
+
+for mode in ctr xts; do
+  for f in start middle end holes odd scattered; do
+	what="$mode, $f"
+	rm -f "$dir/cipher.aes" "$dir/out"
+	if ! ./aes-encrypt --sparse -m $mode -k "$dir/key" -o "$dir/cipher.aes" \
+		 "$dir/$f" > /dev/null \
+		|| ! ./aes-decrypt -o "$dir/out" "$dir/key" "$dir/cipher.aes" \
+		   > /dev/null; then
+	  echo "sparse: $what: failed"
+	  failed=1
+	  continue
+	fi
+	if ! cmp -s "$dir/out" "$dir/$f"; then
+	  echo "sparse: $what: the plaintext doesn't match"
+	  failed=1
+	fi
+	if $holes && [ $(disk_kb "$dir/cipher.aes") -gt 1024 ]; then
+	  echo "sparse: $what: the holes were written to the cipher file"
+	  failed=1
+	fi
+	if $holes && [ $(disk_kb "$dir/out") -gt 1024 ]; then
+	  echo "sparse: $what: the holes weren't made again"
+	  failed=1
+	fi
+  done
+done
+
+[ $failed -eq 0 ] || exit 1
+echo "sparse: holes kept"
@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# Flips every bit of the header of a GCM and a chunked cipher file, one at a
+# time, and then a bit of every block of the rest, and checks that
+# aes-decrypt refuses each one. A damaged header must
+# never be read as a headerless ECB file, which has no tag to check, nor as
+# the header of a mode without a tag. A file without the magic number is an
+# old ECB file as far as anyone can tell, so a change to the magic is only
+# caught when the mode is given with -m.
+#
+# Run from the top of the tree, after 'make' (or with 'make check').
+
+set -u
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+head -c 5000 /dev/urandom > "$dir/plain"
+
+for mode in gcm chunked; do
+  ./aes-encrypt -m $mode -k "$dir/key" -o "$dir/$mode.aes" "$dir/plain" \
+	> /dev/null || { echo "tamper: $mode: encryption failed"; exit 1; }
+  if ! ./aes-decrypt -o "$dir/out" "$dir/key" "$dir/$mode.aes" > /dev/null \
+	  || ! cmp -s "$dir/out" "$dir/plain"; then
+	echo "tamper: $mode: untouched file doesn't decrypt"
+	exit 1
+  fi
+
+  byte=0
+  while [ $byte -lt 32 ]; do
+	bit=0
+	while [ $bit -lt 8 ]; do
+	  cp "$dir/$mode.aes" "$dir/bad.aes"
+	  orig=$(od -An -tu1 -j $byte -N1 "$dir/bad.aes" | tr -d ' ')
+	  printf "$(printf '\\%03o' $((orig ^ (1 << bit))))" \
+		| dd of="$dir/bad.aes" bs=1 seek=$byte conv=notrunc 2> /dev/null
+	  rm -f "$dir/out"
+	  opts=
+	  [ $byte -lt 4 ] && opts="-m $mode"
+	  if ./aes-decrypt $opts -o "$dir/out" "$dir/key" "$dir/bad.aes" \
+		  > /dev/null 2>&1; then
+		echo "tamper: $mode: bit $bit of header byte $byte not detected"
+		failed=1
+	  fi
+	  bit=$((bit + 1))
+	done
+	byte=$((byte + 1))
+  done
+
+  # One bit of each block after the header, tags included, and a file cut
+  # short. The plaintext written before the tag check must be removed.
+  size=$(wc -c < "$dir/$mode.aes")
+  byte=32
+  while [ $byte -le $size ]; do
+	cp "$dir/$mode.aes" "$dir/bad.aes"
+	if [ $byte -eq $size ]; then
+	  what="the file cut short"
+	  truncate -s $((size - 1)) "$dir/bad.aes"
+	else
+	  what="byte $byte"
+	  orig=$(od -An -tu1 -j $byte -N1 "$dir/bad.aes" | tr -d ' ')
+	  printf "$(printf '\\%03o' $((orig ^ 0x80)))" \
+		| dd of="$dir/bad.aes" bs=1 seek=$byte conv=notrunc 2> /dev/null
+	fi
+	rm -f "$dir/out"
+	if ./aes-decrypt -o "$dir/out" "$dir/key" "$dir/bad.aes" \
+		> /dev/null 2>&1; then
+	  echo "tamper: $mode: change to $what not detected"
+	  failed=1
+	elif [ -e "$dir/out" ]; then
+	  echo "tamper: $mode: plaintext left behind after $what"
+	  failed=1
+	fi
+	if [ $byte -lt $((size - 16)) ]; then
+	  byte=$((byte + 16))
+	else
+	  byte=$((byte + 1))
+	fi
+  done
+done
+
+[ $failed -eq 0 ] && echo "tamper: all changes detected"
+exit $failed
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Encrypts a directory tree with -r and decrypts the cipher tree with -r, and
+# checks that the tree comes back as it was: every file in its place, the
+# empty ones and the empty directories too, and a symbolic link that loops
+# back up the tree not followed. It is run on one thread and on several,
+# which walk the tree in parallel.
+#
+# Run from the top of the tree, after 'make' (or with 'make check').
+
+set -u
+top=$(pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+cd "$dir"
+mkdir -p src/top/a/b/c src/top/d src/top/empty
+for d in src/top src/top/a src/top/a/b src/top/a/b/c src/top/d; do
+  for size in 0 1 16 4000 100000; do
+	head -c $size /dev/urandom > $d/f$size
+  done
+done
+ln -s .. src/top/a/loop
+
+for mode in ctr gcm chunked; do
+  for jobs in 1 4; do
+	what="$mode, $jobs thread(s)"
+	rm -rf enc dec
+	mkdir enc dec
+	if ! (cd src && "$top/aes-encrypt" -r -j $jobs -m $mode -k ../key \
+			-d ../enc/ top > /dev/null) \
+		|| ! "$top/aes-decrypt" -r -j $jobs -d dec/ key enc/top > /dev/null
+	then
+	  echo "tree: $what: failed"
+	  failed=1
+	  continue
+	fi
+
+	(cd src && find top -type f | sort) > expected
+	(cd dec && find top -type f | sort) > got
+	cmp -s expected got || { echo "tree: $what: wrong files"; failed=1; }
+	while read f; do
+	  if ! cmp -s src/$f dec/$f; then
+		echo "tree: $what: $f doesn't match"
+		failed=1
+	  fi
+	done < expected
+	if [ ! -d dec/top/empty ]; then
+	  echo "tree: $what: empty directory lost"
+	  failed=1
+	fi
+	if [ -e dec/top/a/loop ]; then
+	  echo "tree: $what: link followed"
+	  failed=1
+	fi
+  done
+done
+
+[ $failed -eq 0 ] || exit 1
+echo "tree: trees mirrored ($(wc -l < expected) files each)"
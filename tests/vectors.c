@@ -0,0 +1,273 @@
+/**
+ * Known-answer tests
+ *
+ * Runs every cipher engine this machine supports against published test
+ * vectors: the cipher examples of FIPS-197 (appendix C), ECB, CBC and CTR from
+ * NIST SP 800-38A (appendix F), test cases 2 to 4 of the GCM specification,
+ * and vectors 1 and 2 of IEEE 1619 for XTS. Each is run both ways.
+ *
+ * Built and run by 'make check'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "aes.h"
+
+static const char *engine_names[] = {
+  "vaes512", "vaes256", "aesni", "bitslice", "portable", "reference"
+};
+
+#define NUM_ENGINE_NAMES (sizeof(engine_names) / sizeof(engine_names[0]))
+
+/* FIPS-197, appendix C */
+static const char *fips197_keys[] = {
+  "000102030405060708090a0b0c0d0e0f",
+  "000102030405060708090a0b0c0d0e0f1011121314151617",
+  "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+};
+static const char *fips197_plain = "00112233445566778899aabbccddeeff";
+static const char *fips197_cipher[] = {
+  "69c4e0d86a7b0430d8cdb78070b4c55a",
+  "dda97ca4864cdfe06eaf70a0ec0d7191",
+  "8ea2b7ca516745bfeafc49904b496089"
+};
+
+/* SP 800-38A, appendix F: AES-128 and AES-256 */
+static const char *sp800_38a_keys[] = {
+  "2b7e151628aed2a6abf7158809cf4f3c",
+  "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4"
+};
+static const char *sp800_38a_plain =
+  "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+  "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+static const char *sp800_38a_ecb[] = {
+  "3ad77bb40d7a3660a89ecaf32466ef97f5d3d58503b9699de785895a96fdbaaf"
+  "43b1cd7f598ece23881b00e3ed0306887b0c785e27e8ad3f8223207104725dd4",
+  "f3eed1bdb5d2a03c064b5a7e3db181f8591ccb10d410ed26dc5ba74a31362870"
+  "b6ed21b99ca6f4f9f153e7b1beafed1d23304b7a39f9f3ff067d8d8f9e24ecc7"
+};
+static const char *sp800_38a_cbc_iv = "000102030405060708090a0b0c0d0e0f";
+static const char *sp800_38a_cbc[] = {
+  "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+  "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7",
+  "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d"
+  "39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b"
+};
+static const char *sp800_38a_ctr_iv = "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+static const char *sp800_38a_ctr[] = {
+  "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+  "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee",
+  "601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c5"
+  "2b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6"
+};
+
+/* The GCM specification (McGrew and Viega), test cases 2 to 4 */
+static const struct
+{
+  const char *key, *iv, *aad, *plain, *cipher, *tag;
+} gcm_vectors[] = {
+  { "00000000000000000000000000000000", "000000000000000000000000", "",
+	"00000000000000000000000000000000", "0388dace60b6a392f328c2b971b2fe78",
+	"ab6e47d42cec13bdf53a67b21257bddf" },
+  { "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "",
+	"d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+	"1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+	"42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+	"21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+	"4d5c2af327cd64a62cf35abd2ba6fab4" },
+  { "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888",
+	"feedfacedeadbeeffeedfacedeadbeefabaddad2",
+	"d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+	"1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+	"42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+	"21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+	"5bc94fbc3221a5db94fae95ae7121a47" }
+};
+
+/* IEEE 1619, vectors 1 and 2 */
+static const struct
+{
+  const char *data_key, *tweak_key;
+  uint64_t unit;
+  const char *plain, *cipher;
+} xts_vectors[] = {
+  { "00000000000000000000000000000000", "00000000000000000000000000000000",
+	0, "0000000000000000000000000000000000000000000000000000000000000000",
+	"917cf69ebd68b2ec9b9fe9a3eadda692cd43d2f59598ed858c02c2652fbf922e" },
+  { "11111111111111111111111111111111", "22222222222222222222222222222222",
+	0x3333333333ULL,
+	"4444444444444444444444444444444444444444444444444444444444444444",
+	"c454185e6a16936e39334038acef838bfb186fff7480adc4289382ecd6d394f0" }
+};
+
+static int failures;
+
+/* Decodes a hex string into 'out', and returns its length in bytes */
+static size_t from_hex(const char *hex, uint8_t *out) {
+  size_t i, len = strlen(hex) / 2;
+  unsigned int byte;
+
+  for (i = 0; i < len; i++) {
+	sscanf(hex + 2 * i, "%2x", &byte);
+	out[i] = byte;
+  }
+  return len;
+}
+
+/* Sets up a key from hex */
+static void hex_key(const char *hex, aes_key_t *key) {
+  key->size = from_hex(hex, key->block);
+  key_expansion(key);
+}
+
+/* Compares a result with the expected one, and reports it if they differ */
+static void expect(const char *engine, const char *what, const uint8_t *got,
+				   const char *hex) {
+  uint8_t want[64];
+  size_t len = from_hex(hex, want);
+
+  if (memcmp(got, want, len) != 0) {
+	printf("vectors: %s: %s is wrong\n", engine, what);
+	failures++;
+  }
+}
+
+static void test_fips197(const aes_engine_t *engine) {
+  uint8_t plain[16], out[16];
+  aes_key_t key;
+  size_t i;
+
+  from_hex(fips197_plain, plain);
+  for (i = 0; i < 3; i++) {
+	hex_key(fips197_keys[i], &key);
+	engine->encrypt(&key, plain, out, 1);
+	expect(engine->name, "FIPS-197 encryption", out, fips197_cipher[i]);
+	engine->decrypt(&key, out, out, 1);
+	expect(engine->name, "FIPS-197 decryption", out, fips197_plain);
+  }
+}
+
+static void test_sp800_38a(const aes_engine_t *engine, pool_t *pool) {
+  uint8_t plain[64], cipher[64], out[64], iv[16];
+  aes_key_t key;
+  size_t i;
+
+  from_hex(sp800_38a_plain, plain);
+  for (i = 0; i < 2; i++) {
+	hex_key(sp800_38a_keys[i], &key);
+
+	engine->encrypt(&key, plain, out, 4);
+	expect(engine->name, "SP 800-38A ECB encryption", out, sp800_38a_ecb[i]);
+	engine->decrypt(&key, out, out, 4);
+	expect(engine->name, "SP 800-38A ECB decryption", out, sp800_38a_plain);
+
+	from_hex(sp800_38a_cbc_iv, iv);
+	cbc_encrypt(engine, &key, iv, plain, out, 4);
+	expect(engine->name, "SP 800-38A CBC encryption", out, sp800_38a_cbc[i]);
+	from_hex(sp800_38a_cbc_iv, iv);
+	from_hex(sp800_38a_cbc[i], cipher);
+	cbc_decrypt_parallel(pool, engine, &key, iv, cipher, out, 4);
+	expect(engine->name, "SP 800-38A CBC decryption", out, sp800_38a_plain);
+
+	from_hex(sp800_38a_ctr_iv, iv);
+	ctr_crypt(engine, &key, iv, 0, plain, out, 64);
+	expect(engine->name, "SP 800-38A CTR encryption", out, sp800_38a_ctr[i]);
+	ctr_crypt(engine, &key, iv, 0, out, out, 64);
+	expect(engine->name, "SP 800-38A CTR decryption", out, sp800_38a_plain);
+  }
+}
+
+static void test_gcm(const aes_engine_t *engine, pool_t *pool) {
+  uint8_t iv[16], aad[64], plain[64], cipher[64], out[64], tag[16];
+  size_t i, aad_len, len;
+  aes_key_t key;
+  gcm_t gcm;
+
+  for (i = 0; i < sizeof(gcm_vectors) / sizeof(gcm_vectors[0]); i++) {
+	hex_key(gcm_vectors[i].key, &key);
+	memset(iv, 0, sizeof(iv));
+	from_hex(gcm_vectors[i].iv, iv);
+	aad_len = from_hex(gcm_vectors[i].aad, aad);
+	len = from_hex(gcm_vectors[i].plain, plain);
+	from_hex(gcm_vectors[i].cipher, cipher);
+
+	gcm_init(&gcm, engine, &key, iv);
+	gcm_aad(&gcm, aad, aad_len);
+	if (!gcm_encrypt(&gcm, pool, plain, out, len)) {
+	  printf("vectors: %s: GCM encryption failed\n", engine->name);
+	  failures++;
+	  continue;
+	}
+	gcm_tag(&gcm, tag);
+	expect(engine->name, "GCM encryption", out, gcm_vectors[i].cipher);
+	expect(engine->name, "GCM tag", tag, gcm_vectors[i].tag);
+
+	gcm_init(&gcm, engine, &key, iv);
+	gcm_aad(&gcm, aad, aad_len);
+	if (!gcm_decrypt(&gcm, pool, cipher, out, len)) {
+	  printf("vectors: %s: GCM decryption failed\n", engine->name);
+	  failures++;
+	  continue;
+	}
+	gcm_tag(&gcm, tag);
+	expect(engine->name, "GCM decryption", out, gcm_vectors[i].plain);
+	expect(engine->name, "GCM tag on decryption", tag, gcm_vectors[i].tag);
+  }
+}
+
+static void test_xts(const aes_engine_t *engine) {
+  uint8_t buf[64];
+  aes_key_t keys[2];
+  xts_t xts;
+  size_t i, len;
+
+  for (i = 0; i < sizeof(xts_vectors) / sizeof(xts_vectors[0]); i++) {
+	hex_key(xts_vectors[i].data_key, &keys[0]);
+	hex_key(xts_vectors[i].tweak_key, &keys[1]);
+	len = from_hex(xts_vectors[i].plain, buf);
+	xts.engine = engine;
+	xts.data_key = &keys[0];
+	xts.tweak_key = &keys[1];
+	xts.unit_size = len;
+
+	xts_crypt(&xts, false, xts_vectors[i].unit, buf, buf, len);
+	expect(engine->name, "XTS encryption", buf, xts_vectors[i].cipher);
+	xts_crypt(&xts, true, xts_vectors[i].unit, buf, buf, len);
+	expect(engine->name, "XTS decryption", buf, xts_vectors[i].plain);
+  }
+}
+
+int main(void) {
+  const aes_engine_t *engine;
+  pool_t *pool;
+  size_t i;
+  int tested = 0;
+
+  ttable_init();
+  pool = pool_create(2);
+  if (pool == NULL) {
+	printf("vectors: could not start worker threads\n");
+	return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < NUM_ENGINE_NAMES; i++) {
+	engine = engine_find(engine_names[i]);
+	if (engine == NULL || !engine_supported(engine))
+	  continue;
+	test_fips197(engine);
+	test_sp800_38a(engine, pool);
+	test_gcm(engine, pool);
+	test_xts(engine);
+	tested++;
+  }
+  pool_destroy(pool);
+
+  if (failures > 0)
+	return EXIT_FAILURE;
+  printf("vectors: all known answers match, on %d engines\n", tested);
+  return EXIT_SUCCESS;
+}